@@ -0,0 +1,245 @@
+#include "bench.h"
+
+#include <getopt.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define BENCH_DEFAULT_RUNS 11
+#define BENCH_DEFAULT_MIN_TIME_MS 50
+#define BENCH_MAX_RUNS 1000
+
+typedef enum { FORMAT_TABLE, FORMAT_CSV, FORMAT_JSON } bench_format_t;
+
+static struct {
+  const char *suite;
+  const char *filter;
+  bench_format_t format;
+  int runs;
+  uint64_t min_time_ns;
+  int cases_run;
+} config = {0};
+
+static volatile uint8_t consume_sink;
+
+void bench_consume(const void *ptr, size_t len) {
+  const uint8_t *bytes = ptr;
+  if (bytes && len > 0) {
+    consume_sink ^= bytes[0] ^ bytes[len - 1];
+  }
+}
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void print_usage(const char *program_name) {
+  printf("Usage: %s [OPTIONS]\n\n", program_name);
+  printf("Options:\n");
+  printf("  -r, --runs <n>           Measured runs per case (default %d)\n",
+         BENCH_DEFAULT_RUNS);
+  printf("  -t, --min-time-ms <ms>   Minimum duration of one run (default "
+         "%d)\n",
+         BENCH_DEFAULT_MIN_TIME_MS);
+  printf("  -f, --filter <substr>    Only run cases whose name contains "
+         "substr\n");
+  printf("  -o, --format <fmt>       table, csv or json (default table)\n");
+  printf("  -h, --help               Show this help message\n");
+}
+
+int bench_init(int argc, char **argv, const char *suite) {
+  config.suite = suite;
+  config.format = FORMAT_TABLE;
+  config.runs = BENCH_DEFAULT_RUNS;
+  config.min_time_ns = BENCH_DEFAULT_MIN_TIME_MS * 1000000ULL;
+
+  static struct option long_options[] = {
+      {"runs", required_argument, 0, 'r'},
+      {"min-time-ms", required_argument, 0, 't'},
+      {"filter", required_argument, 0, 'f'},
+      {"format", required_argument, 0, 'o'},
+      {"help", no_argument, 0, 'h'},
+      {0, 0, 0, 0}};
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "r:t:f:o:h", long_options, NULL)) !=
+         -1) {
+    switch (opt) {
+    case 'r':
+      config.runs = atoi(optarg);
+      if (config.runs < 3 || config.runs > BENCH_MAX_RUNS) {
+        fprintf(stderr, "--runs must be between 3 and %d\n", BENCH_MAX_RUNS);
+        return -1;
+      }
+      break;
+    case 't':
+      config.min_time_ns = strtoull(optarg, NULL, 10) * 1000000ULL;
+      break;
+    case 'f':
+      config.filter = optarg;
+      break;
+    case 'o':
+      if (strcmp(optarg, "csv") == 0) {
+        config.format = FORMAT_CSV;
+      } else if (strcmp(optarg, "json") == 0) {
+        config.format = FORMAT_JSON;
+      } else if (strcmp(optarg, "table") == 0) {
+        config.format = FORMAT_TABLE;
+      } else {
+        fprintf(stderr, "Unknown format: %s\n", optarg);
+        return -1;
+      }
+      break;
+    case 'h':
+      print_usage(argv[0]);
+      exit(EXIT_SUCCESS);
+    default:
+      print_usage(argv[0]);
+      return -1;
+    }
+  }
+
+  switch (config.format) {
+  case FORMAT_CSV:
+    printf("suite,benchmark,param,runs,iterations,ns_op_median,ns_op_mean,"
+           "ns_op_stddev,ns_op_min,ns_op_max,bytes_per_sec\n");
+    break;
+  case FORMAT_TABLE:
+    printf("%-8s %-24s %10s %10s %14s %12s %8s %14s\n", "suite", "benchmark",
+           "param", "iters", "ns/op median", "ns/op min", "cv%", "MB/s");
+    break;
+  case FORMAT_JSON:
+    break;
+  }
+
+  fflush(stdout);
+  return 0;
+}
+
+bool bench_enabled(const char *name) {
+  return !config.filter || strstr(name, config.filter) != NULL;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+  double x = *(const double *)a;
+  double y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+// Grow the iteration count until one run takes at least min_time_ns
+static uint64_t calibrate(const bench_case_t *bench_case, bench_fn_t fn,
+                          void *ctx) {
+  uint64_t iterations = 1;
+
+  for (;;) {
+    uint64_t start = now_ns();
+    fn(ctx, iterations);
+    uint64_t elapsed = now_ns() - start;
+
+    if (elapsed >= config.min_time_ns) {
+      break;
+    }
+    if (bench_case->max_iterations &&
+        iterations >= bench_case->max_iterations) {
+      break;
+    }
+
+    // Aim slightly past the target, bounded to avoid overshooting wildly
+    uint64_t next = elapsed > 0 ? iterations * config.min_time_ns * 6 /
+                                      (elapsed * 5)
+                                : iterations * 100;
+    if (next <= iterations) {
+      next = iterations + 1;
+    }
+    if (next > iterations * 100) {
+      next = iterations * 100;
+    }
+    if (bench_case->max_iterations && next > bench_case->max_iterations) {
+      next = bench_case->max_iterations;
+    }
+    iterations = next;
+  }
+
+  return iterations;
+}
+
+void bench_run(const bench_case_t *bench_case, bench_fn_t fn, void *ctx) {
+  if (!bench_enabled(bench_case->name)) {
+    return;
+  }
+
+  uint64_t iterations = calibrate(bench_case, fn, ctx);
+
+  double samples[BENCH_MAX_RUNS];
+  for (int run = 0; run < config.runs; run++) {
+    uint64_t start = now_ns();
+    fn(ctx, iterations);
+    uint64_t elapsed = now_ns() - start;
+    samples[run] = (double)elapsed / (double)iterations;
+  }
+
+  double sum = 0.0;
+  for (int run = 0; run < config.runs; run++) {
+    sum += samples[run];
+  }
+  double mean = sum / config.runs;
+
+  double variance = 0.0;
+  for (int run = 0; run < config.runs; run++) {
+    variance += (samples[run] - mean) * (samples[run] - mean);
+  }
+  double stddev = sqrt(variance / (config.runs - 1));
+
+  qsort(samples, config.runs, sizeof(double), compare_doubles);
+  double median = config.runs % 2
+                      ? samples[config.runs / 2]
+                      : (samples[config.runs / 2 - 1] +
+                         samples[config.runs / 2]) /
+                            2.0;
+  double min = samples[0];
+  double max = samples[config.runs - 1];
+
+  double bytes_per_sec =
+      bench_case->bytes_per_op > 0 && median > 0.0
+          ? (double)bench_case->bytes_per_op * 1e9 / median
+          : 0.0;
+
+  switch (config.format) {
+  case FORMAT_CSV:
+    printf("%s,%s,%zu,%d,%llu,%.1f,%.1f,%.1f,%.1f,%.1f,%.0f\n", config.suite,
+           bench_case->name, bench_case->param, config.runs,
+           (unsigned long long)iterations, median, mean, stddev, min, max,
+           bytes_per_sec);
+    break;
+  case FORMAT_JSON:
+    printf("{\"suite\":\"%s\",\"benchmark\":\"%s\",\"param\":%zu,"
+           "\"runs\":%d,\"iterations\":%llu,\"ns_op_median\":%.1f,"
+           "\"ns_op_mean\":%.1f,\"ns_op_stddev\":%.1f,\"ns_op_min\":%.1f,"
+           "\"ns_op_max\":%.1f,\"bytes_per_sec\":%.0f}\n",
+           config.suite, bench_case->name, bench_case->param, config.runs,
+           (unsigned long long)iterations, median, mean, stddev, min, max,
+           bytes_per_sec);
+    break;
+  case FORMAT_TABLE:
+    printf("%-8s %-24s %10zu %10llu %14.1f %12.1f %8.2f %14.2f\n",
+           config.suite, bench_case->name, bench_case->param,
+           (unsigned long long)iterations, median, min,
+           mean > 0.0 ? stddev * 100.0 / mean : 0.0, bytes_per_sec / 1e6);
+    break;
+  }
+
+  fflush(stdout);
+  config.cases_run++;
+}
+
+int bench_finish(void) {
+  if (config.cases_run == 0) {
+    fprintf(stderr, "No benchmark matched the filter\n");
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
\ No newline at end of file
@@ -0,0 +1,34 @@
+#ifndef CCHAT_BENCH_H
+#define CCHAT_BENCH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Microbenchmark harness shared by bench_client and bench_server.
+//
+// Every case is calibrated so that a single run lasts at least
+// --min-time-ms, then repeated --runs times after one warmup run. Results are
+// reported per operation (median, mean, stddev, min, max) so that outliers
+// caused by scheduling noise do not dominate, and are emitted as CSV or JSON
+// lines for comparison between commits with bench/compare.sh.
+
+// Operation body: perform `iterations` operations on `ctx`
+typedef void (*bench_fn_t)(void *ctx, uint64_t iterations);
+
+typedef struct {
+  const char *name;    // e.g. "seal", "frame_encode"
+  size_t param;        // message size, Argon2 memlimit, ... (0 if unused)
+  size_t bytes_per_op; // payload bytes processed per op for bytes/s (0 = n/a)
+  uint64_t max_iterations; // calibration ceiling for slow cases (0 = none)
+} bench_case_t;
+
+int bench_init(int argc, char **argv, const char *suite);
+bool bench_enabled(const char *name);
+void bench_run(const bench_case_t *bench_case, bench_fn_t fn, void *ctx);
+int bench_finish(void);
+
+// Prevent the optimizer from discarding benchmarked results
+void bench_consume(const void *ptr, size_t len);
+
+#endif // CCHAT_BENCH_H
\ No newline at end of file
@@ -0,0 +1,232 @@
+#include "c-chat.h"
+
+#include "bench.h"
+
+// Client-side primitives: sealed-box and session encryption, Argon2id key
+// derivation and the hand-written frame codec in src/network.c
+
+static const size_t message_sizes[] = {16, 64, 256, MAX_MESSAGE_LEN};
+
+typedef struct {
+  unsigned char public_key[PUBLIC_KEY_SIZE];
+  unsigned char private_key[PRIVATE_KEY_SIZE];
+  char message[MAX_MESSAGE_LEN + 1];
+  unsigned char encrypted[ENCRYPTED_MSG_SIZE];
+  size_t encrypted_len;
+} seal_ctx_t;
+
+static void bench_seal(void *arg, uint64_t iterations) {
+  seal_ctx_t *ctx = arg;
+  for (uint64_t i = 0; i < iterations; i++) {
+    encrypt_message(ctx->message, ctx->public_key, ctx->encrypted,
+                    &ctx->encrypted_len);
+  }
+  bench_consume(ctx->encrypted, ctx->encrypted_len);
+}
+
+static void bench_open(void *arg, uint64_t iterations) {
+  seal_ctx_t *ctx = arg;
+  char plaintext[MAX_MESSAGE_LEN + 1];
+  size_t plaintext_len = 0;
+  for (uint64_t i = 0; i < iterations; i++) {
+    decrypt_message(ctx->encrypted, ctx->encrypted_len, ctx->private_key,
+                    plaintext, &plaintext_len);
+  }
+  bench_consume(plaintext, plaintext_len);
+}
+
+static void bench_open_cached(void *arg, uint64_t iterations) {
+  seal_ctx_t *ctx = arg;
+  char plaintext[MAX_MESSAGE_LEN + 1];
+  size_t plaintext_len = 0;
+  for (uint64_t i = 0; i < iterations; i++) {
+    decrypt_sealed_message(ctx->encrypted, ctx->encrypted_len, ctx->public_key,
+                           ctx->private_key, plaintext, &plaintext_len);
+  }
+  bench_consume(plaintext, plaintext_len);
+}
+
+typedef struct {
+  secure_session_keys_t keys;
+  char message[MAX_MESSAGE_LEN + 1];
+  unsigned char encrypted[ENCRYPTED_MSG_SIZE];
+  size_t encrypted_len;
+} session_ctx_t;
+
+static void bench_session_derive(void *arg, uint64_t iterations) {
+  session_ctx_t *ctx = arg;
+  for (uint64_t i = 0; i < iterations; i++) {
+    derive_session_key(&ctx->keys);
+  }
+  bench_consume(ctx->keys.session_key, sizeof(ctx->keys.session_key));
+}
+
+static void bench_session_seal(void *arg, uint64_t iterations) {
+  session_ctx_t *ctx = arg;
+  for (uint64_t i = 0; i < iterations; i++) {
+    encrypt_message_session(ctx->message, &ctx->keys, ctx->encrypted,
+                            &ctx->encrypted_len);
+  }
+  bench_consume(ctx->encrypted, ctx->encrypted_len);
+}
+
+static void bench_session_open(void *arg, uint64_t iterations) {
+  session_ctx_t *ctx = arg;
+  char plaintext[MAX_MESSAGE_LEN + 1];
+  size_t plaintext_len = 0;
+  for (uint64_t i = 0; i < iterations; i++) {
+    decrypt_message_session(ctx->encrypted, ctx->encrypted_len, &ctx->keys,
+                            plaintext, &plaintext_len);
+  }
+  bench_consume(plaintext, plaintext_len);
+}
+
+typedef struct {
+  unsigned long long opslimit;
+  size_t memlimit;
+  unsigned char salt[KEY_DERIVATION_SALT_SIZE];
+  unsigned char derived_key[DERIVED_KEY_SIZE];
+} kdf_ctx_t;
+
+static void bench_kdf(void *arg, uint64_t iterations) {
+  kdf_ctx_t *ctx = arg;
+  for (uint64_t i = 0; i < iterations; i++) {
+    derive_key_from_password_with_limits("correct horse battery staple",
+                                         ctx->salt, ctx->opslimit,
+                                         ctx->memlimit, ctx->derived_key);
+  }
+  bench_consume(ctx->derived_key, sizeof(ctx->derived_key));
+}
+
+typedef struct {
+  uint8_t header[FRAME_HEADER_SIZE];
+  uint8_t payload[1 + MAX_USERNAME_LEN + 2 + ENCRYPTED_MSG_SIZE];
+  unsigned char encrypted[ENCRYPTED_MSG_SIZE];
+  size_t encrypted_len;
+} codec_ctx_t;
+
+static void bench_frame_encode(void *arg, uint64_t iterations) {
+  codec_ctx_t *ctx = arg;
+  size_t payload_len = 0;
+  for (uint64_t i = 0; i < iterations; i++) {
+    payload_len = encode_send_message_payload(ctx->payload, "bob",
+                                              ctx->encrypted,
+                                              ctx->encrypted_len);
+    encode_frame_header(ctx->header, 0x04, (uint32_t)payload_len);
+  }
+  bench_consume(ctx->payload, payload_len);
+  bench_consume(ctx->header, sizeof(ctx->header));
+}
+
+static void bench_frame_decode(void *arg, uint64_t iterations) {
+  codec_ctx_t *ctx = arg;
+  uint8_t msg_type = 0;
+  uint32_t payload_len = 0;
+  for (uint64_t i = 0; i < iterations; i++) {
+    decode_frame_header(ctx->header, &msg_type, &payload_len);
+    ctx->header[3] ^= (uint8_t)i & 1;
+  }
+  bench_consume(&payload_len, sizeof(payload_len));
+  bench_consume(&msg_type, sizeof(msg_type));
+}
+
+int main(int argc, char *argv[]) {
+  if (bench_init(argc, argv, "client") < 0) {
+    return EXIT_FAILURE;
+  }
+
+  if (init_crypto_library() != CCHAT_SUCCESS) {
+    return EXIT_FAILURE;
+  }
+
+  static seal_ctx_t seal_ctx;
+  crypto_box_keypair(seal_ctx.public_key, seal_ctx.private_key);
+
+  for (size_t i = 0; i < sizeof(message_sizes) / sizeof(message_sizes[0]);
+       i++) {
+    size_t size = message_sizes[i];
+    memset(seal_ctx.message, 'a', size);
+    seal_ctx.message[size] = '\0';
+
+    bench_case_t seal_case = {"seal", size, size, 0};
+    bench_run(&seal_case, bench_seal, &seal_ctx);
+
+    encrypt_message(seal_ctx.message, seal_ctx.public_key, seal_ctx.encrypted,
+                    &seal_ctx.encrypted_len);
+    bench_case_t open_case = {"open", size, size, 0};
+    bench_run(&open_case, bench_open, &seal_ctx);
+
+    bench_case_t open_cached_case = {"open_cached", size, size, 0};
+    bench_run(&open_cached_case, bench_open_cached, &seal_ctx);
+  }
+
+  // Session mode: one crypto_box_beforenm per chat, then symmetric per message
+  static session_ctx_t session_ctx;
+  unsigned char partner_private_key[PRIVATE_KEY_SIZE];
+  crypto_box_keypair(session_ctx.keys.public_key, session_ctx.keys.private_key);
+  crypto_box_keypair(session_ctx.keys.partner_public_key, partner_private_key);
+  secure_zero_memory(partner_private_key, sizeof(partner_private_key));
+  session_ctx.keys.keys_loaded = true;
+
+  bench_case_t derive_case = {"session_derive", 0, 0, 0};
+  bench_run(&derive_case, bench_session_derive, &session_ctx);
+
+  for (size_t i = 0; i < sizeof(message_sizes) / sizeof(message_sizes[0]);
+       i++) {
+    size_t size = message_sizes[i];
+    memset(session_ctx.message, 'a', size);
+    session_ctx.message[size] = '\0';
+
+    bench_case_t seal_case = {"session_seal", size, size, 0};
+    bench_run(&seal_case, bench_session_seal, &session_ctx);
+
+    encrypt_message_session(session_ctx.message, &session_ctx.keys,
+                            session_ctx.encrypted, &session_ctx.encrypted_len);
+    bench_case_t open_case = {"session_open", size, size, 0};
+    bench_run(&open_case, bench_session_open, &session_ctx);
+  }
+
+  // Argon2id limits: libsodium's minimum-cost tier, the INTERACTIVE limits
+  // used for key files today, and MODERATE for comparison. param is the
+  // memory limit in KiB; each run is capped to a handful of derivations.
+  static const struct {
+    unsigned long long opslimit;
+    size_t memlimit;
+  } kdf_limits[] = {
+      {1, 8 * 1024 * 1024},
+      {2, 32 * 1024 * 1024},
+      {crypto_pwhash_OPSLIMIT_INTERACTIVE, crypto_pwhash_MEMLIMIT_INTERACTIVE},
+      {crypto_pwhash_OPSLIMIT_MODERATE, crypto_pwhash_MEMLIMIT_MODERATE},
+  };
+
+  static kdf_ctx_t kdf_ctx;
+  randombytes_buf(kdf_ctx.salt, sizeof(kdf_ctx.salt));
+  for (size_t i = 0; i < sizeof(kdf_limits) / sizeof(kdf_limits[0]); i++) {
+    kdf_ctx.opslimit = kdf_limits[i].opslimit;
+    kdf_ctx.memlimit = kdf_limits[i].memlimit;
+
+    char name[32];
+    snprintf(name, sizeof(name), "kdf_ops%llu", kdf_ctx.opslimit);
+    bench_case_t kdf_case = {name, kdf_ctx.memlimit / 1024, 0, 4};
+    bench_run(&kdf_case, bench_kdf, &kdf_ctx);
+  }
+
+  static codec_ctx_t codec_ctx;
+  for (size_t i = 0; i < sizeof(message_sizes) / sizeof(message_sizes[0]);
+       i++) {
+    size_t size = message_sizes[i];
+    codec_ctx.encrypted_len = size + crypto_box_SEALBYTES;
+    randombytes_buf(codec_ctx.encrypted, codec_ctx.encrypted_len);
+
+    bench_case_t encode_case = {"frame_encode", size, codec_ctx.encrypted_len,
+                                0};
+    bench_run(&encode_case, bench_frame_encode, &codec_ctx);
+  }
+
+  bench_case_t decode_case = {"frame_decode", 0, FRAME_HEADER_SIZE, 0};
+  bench_run(&decode_case, bench_frame_decode, &codec_ctx);
+
+  secure_zero_memory(&seal_ctx, sizeof(seal_ctx));
+  secure_zero_memory(&session_ctx, sizeof(session_ctx));
+  return bench_finish();
+}
\ No newline at end of file
@@ -0,0 +1,295 @@
+#include "../server/include/c-chat-server.h"
+
+#include "bench.h"
+
+// Server-side frame codec in server/src/protocol.c: header encode/decode,
+// SEND_MESSAGE parsing and INCOMING_MESSAGE encoding on the relay path, plus
+// the full relay (receive, dispatch, route, deliver, ack) over the memory
+// transport so handler cost is measured without the kernel TCP stack.
+// key_lookup_* resolve MAX_KEY_BATCH keys from a roster of ROSTER_USERS,
+// either one GET_PUBLIC_KEY frame per name or a single GET_PUBLIC_KEYS.
+// find_user_threads runs lookups on N threads at once; with lock-free reads
+// the time per operation should stay flat as N grows (given N cores).
+
+#define ROSTER_USERS 500
+#define MAX_LOOKUP_THREADS 8
+
+static const size_t message_sizes[] = {16, 64, 256, MAX_MESSAGE_LEN};
+
+typedef struct {
+  uint8_t header[MESSAGE_HEADER_SIZE];
+  uint8_t send_payload[1 + MAX_USERNAME_LEN + 2 + MAX_MESSAGE_LEN + 100];
+  uint32_t send_payload_len;
+  uint8_t incoming[4 + 1 + MAX_USERNAME_LEN + 4 + 2 + MAX_MESSAGE_LEN + 100];
+  unsigned char encrypted[MAX_MESSAGE_LEN + 100];
+  uint16_t encrypted_len;
+} codec_ctx_t;
+
+static void bench_header_roundtrip(void *arg, uint64_t iterations) {
+  codec_ctx_t *ctx = arg;
+  network_message_t msg = {0};
+  for (uint64_t i = 0; i < iterations; i++) {
+    encode_message_header(ctx->header, MSG_INCOMING_MESSAGE, (uint32_t)i);
+    decode_message_header(ctx->header, &msg);
+  }
+  bench_consume(&msg.length, sizeof(msg.length));
+}
+
+static void bench_parse_send(void *arg, uint64_t iterations) {
+  codec_ctx_t *ctx = arg;
+  char recipient[MAX_USERNAME_LEN];
+  const unsigned char *data = NULL;
+  uint16_t data_len = 0;
+  for (uint64_t i = 0; i < iterations; i++) {
+    parse_send_message(ctx->send_payload, ctx->send_payload_len, recipient,
+                       &data, &data_len);
+  }
+  bench_consume(&data_len, sizeof(data_len));
+  bench_consume(recipient, sizeof(recipient));
+}
+
+static void bench_encode_incoming(void *arg, uint64_t iterations) {
+  codec_ctx_t *ctx = arg;
+  size_t len = 0;
+  for (uint64_t i = 0; i < iterations; i++) {
+    len = encode_incoming_message(ctx->incoming, (uint32_t)i, "alice",
+                                  (uint32_t)i, ctx->encrypted,
+                                  ctx->encrypted_len);
+  }
+  bench_consume(ctx->incoming, len);
+}
+
+typedef struct {
+  client_connection_t *sender;
+  uint8_t frame[MESSAGE_HEADER_SIZE + 1 + MAX_USERNAME_LEN + 2 +
+                MAX_MESSAGE_LEN + 100];
+  size_t frame_len;
+} relay_ctx_t;
+
+static client_connection_t *open_relay_client(const char *username) {
+  unsigned char public_key[PUBLIC_KEY_SIZE];
+  randombytes_buf(public_key, sizeof(public_key));
+  if (add_user(username, public_key) < 0) {
+    return NULL;
+  }
+
+  // Both ends discard output: only the server side of the relay is timed
+  int fd = memory_transport_open(true);
+  struct sockaddr_in address = {0};
+  client_connection_t *client = fd >= 0 ? accept_client(fd, &address) : NULL;
+  if (client) {
+    client->authenticated = true;
+    strncpy(client->username, username, MAX_USERNAME_LEN - 1);
+  }
+  return client;
+}
+
+static void bench_relay(void *arg, uint64_t iterations) {
+  relay_ctx_t *ctx = arg;
+  for (uint64_t i = 0; i < iterations; i++) {
+    memory_transport_write(ctx->sender->socket_fd, ctx->frame, ctx->frame_len);
+    serve_client_message(ctx->sender);
+  }
+}
+
+typedef struct {
+  client_connection_t *client;
+  uint8_t single[MAX_KEY_BATCH][MESSAGE_HEADER_SIZE + 1 + MAX_USERNAME_LEN];
+  size_t single_len[MAX_KEY_BATCH];
+  uint8_t batch[MESSAGE_HEADER_SIZE + 1 +
+                MAX_KEY_BATCH * (1 + MAX_USERNAME_LEN + 4)];
+  size_t batch_len;
+} key_lookup_ctx_t;
+
+static void build_key_lookups(key_lookup_ctx_t *ctx) {
+  uint8_t *batch = ctx->batch + MESSAGE_HEADER_SIZE;
+  size_t batch_len = 1;
+  batch[0] = MAX_KEY_BATCH;
+
+  // Names spread across the roster, so single lookups scan varying distances
+  for (int i = 0; i < MAX_KEY_BATCH; i++) {
+    char username[MAX_USERNAME_LEN];
+    int username_len = snprintf(username, sizeof(username), "user%d",
+                                i * (ROSTER_USERS / MAX_KEY_BATCH));
+
+    uint8_t *single = ctx->single[i] + MESSAGE_HEADER_SIZE;
+    single[0] = (uint8_t)username_len;
+    memcpy(&single[1], username, username_len);
+    encode_message_header(ctx->single[i], MSG_GET_PUBLIC_KEY,
+                          1 + username_len);
+    ctx->single_len[i] = MESSAGE_HEADER_SIZE + 1 + username_len;
+
+    batch[batch_len] = (uint8_t)username_len;
+    memcpy(&batch[batch_len + 1], username, username_len);
+    memset(&batch[batch_len + 1 + username_len], 0, 4);
+    batch_len += 1 + username_len + 4;
+  }
+
+  encode_message_header(ctx->batch, MSG_GET_PUBLIC_KEYS, batch_len);
+  ctx->batch_len = MESSAGE_HEADER_SIZE + batch_len;
+}
+
+static void bench_key_lookup_single(void *arg, uint64_t iterations) {
+  key_lookup_ctx_t *ctx = arg;
+  for (uint64_t i = 0; i < iterations; i++) {
+    for (int k = 0; k < MAX_KEY_BATCH; k++) {
+      memory_transport_write(ctx->client->socket_fd, ctx->single[k],
+                             ctx->single_len[k]);
+      serve_client_message(ctx->client);
+    }
+  }
+}
+
+static void bench_key_lookup_batch(void *arg, uint64_t iterations) {
+  key_lookup_ctx_t *ctx = arg;
+  for (uint64_t i = 0; i < iterations; i++) {
+    memory_transport_write(ctx->client->socket_fd, ctx->batch, ctx->batch_len);
+    serve_client_message(ctx->client);
+  }
+}
+
+typedef struct {
+  client_connection_t *client;
+  uint8_t frame[MESSAGE_HEADER_SIZE + 2 + MAX_USERNAME_LEN];
+  size_t frame_len;
+} directory_ctx_t;
+
+// One request per iteration: a prefix search, or the full LIST_USERS dump
+// that autocomplete used before search existed
+static void bench_directory_request(void *arg, uint64_t iterations) {
+  directory_ctx_t *ctx = arg;
+  for (uint64_t i = 0; i < iterations; i++) {
+    memory_transport_write(ctx->client->socket_fd, ctx->frame, ctx->frame_len);
+    serve_client_message(ctx->client);
+  }
+}
+
+typedef struct {
+  int threads;
+  uint64_t iterations;
+} parallel_lookup_ctx_t;
+
+static void *find_user_worker(void *arg) {
+  const parallel_lookup_ctx_t *ctx = arg;
+  uint32_t seed = (uint32_t)(uintptr_t)pthread_self();
+  for (uint64_t i = 0; i < ctx->iterations; i++) {
+    char username[MAX_USERNAME_LEN];
+    seed = seed * 1103515245u + 12345u;
+    snprintf(username, sizeof(username), "user%u", seed % ROSTER_USERS);
+    user_record_t *user = find_user(username);
+    bench_consume(&user, sizeof(user));
+  }
+  return NULL;
+}
+
+// One operation is one lookup on every thread
+static void bench_find_user_threads(void *arg, uint64_t iterations) {
+  parallel_lookup_ctx_t *ctx = arg;
+  pthread_t threads[MAX_LOOKUP_THREADS];
+  ctx->iterations = iterations;
+  for (int t = 0; t < ctx->threads; t++) {
+    pthread_create(&threads[t], NULL, find_user_worker, ctx);
+  }
+  for (int t = 0; t < ctx->threads; t++) {
+    pthread_join(threads[t], NULL);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  if (bench_init(argc, argv, "server") < 0) {
+    return EXIT_FAILURE;
+  }
+
+  log_set_verbose(false);
+  set_transport(&memory_transport);
+  // Request loops run far past any per-address budget
+  admission_set_enabled(false);
+  if (init_server_state() < 0) {
+    return EXIT_FAILURE;
+  }
+
+  static codec_ctx_t ctx;
+  static relay_ctx_t relay;
+  relay.sender = open_relay_client("alice");
+  if (!relay.sender || !open_relay_client("bob")) {
+    return EXIT_FAILURE;
+  }
+
+  bench_case_t header_case = {"header_roundtrip", 0, MESSAGE_HEADER_SIZE, 0};
+  bench_run(&header_case, bench_header_roundtrip, &ctx);
+
+  for (size_t i = 0; i < sizeof(message_sizes) / sizeof(message_sizes[0]);
+       i++) {
+    size_t size = message_sizes[i];
+    ctx.encrypted_len = (uint16_t)(size + crypto_box_SEALBYTES);
+    randombytes_buf(ctx.encrypted, ctx.encrypted_len);
+
+    ctx.send_payload[0] = 3;
+    memcpy(&ctx.send_payload[1], "bob", 3);
+    ctx.send_payload[4] = (ctx.encrypted_len >> 8) & 0xFF;
+    ctx.send_payload[5] = ctx.encrypted_len & 0xFF;
+    memcpy(&ctx.send_payload[6], ctx.encrypted, ctx.encrypted_len);
+    ctx.send_payload_len = 6 + ctx.encrypted_len;
+
+    bench_case_t parse_case = {"parse_send_message", size,
+                               ctx.send_payload_len, 0};
+    bench_run(&parse_case, bench_parse_send, &ctx);
+
+    bench_case_t encode_case = {"encode_incoming", size, ctx.encrypted_len, 0};
+    bench_run(&encode_case, bench_encode_incoming, &ctx);
+
+    encode_message_header(relay.frame, MSG_SEND_MESSAGE, ctx.send_payload_len);
+    memcpy(relay.frame + MESSAGE_HEADER_SIZE, ctx.send_payload,
+           ctx.send_payload_len);
+    relay.frame_len = MESSAGE_HEADER_SIZE + ctx.send_payload_len;
+
+    bench_case_t relay_case = {"relay", size, ctx.encrypted_len, 0};
+    bench_run(&relay_case, bench_relay, &relay);
+  }
+
+  static key_lookup_ctx_t lookup;
+  lookup.client = relay.sender;
+  for (int i = 0; i < ROSTER_USERS; i++) {
+    char username[MAX_USERNAME_LEN];
+    unsigned char public_key[PUBLIC_KEY_SIZE];
+    snprintf(username, sizeof(username), "user%d", i);
+    randombytes_buf(public_key, sizeof(public_key));
+    add_user(username, public_key);
+  }
+  build_key_lookups(&lookup);
+
+  bench_case_t single_case = {"key_lookup_single", MAX_KEY_BATCH, 0, 0};
+  bench_run(&single_case, bench_key_lookup_single, &lookup);
+
+  bench_case_t batch_case = {"key_lookup_batch", MAX_KEY_BATCH, 0, 0};
+  bench_run(&batch_case, bench_key_lookup_batch, &lookup);
+
+  for (int threads = 1; threads <= MAX_LOOKUP_THREADS; threads *= 2) {
+    static parallel_lookup_ctx_t parallel;
+    parallel.threads = threads;
+    bench_case_t parallel_case = {"find_user_threads", (size_t)threads, 0, 0};
+    bench_run(&parallel_case, bench_find_user_threads, &parallel);
+  }
+
+  static directory_ctx_t search;
+  search.client = relay.sender;
+  uint8_t *search_payload = search.frame + MESSAGE_HEADER_SIZE;
+  search_payload[0] = 5;
+  memcpy(&search_payload[1], "user4", 5);
+  search_payload[6] = SEARCH_MAX_RESULTS;
+  encode_message_header(search.frame, MSG_SEARCH_USERS, 7);
+  search.frame_len = MESSAGE_HEADER_SIZE + 7;
+
+  bench_case_t search_case = {"user_search", ROSTER_USERS, 0, 0};
+  bench_run(&search_case, bench_directory_request, &search);
+
+  static directory_ctx_t listing;
+  listing.client = relay.sender;
+  encode_message_header(listing.frame, MSG_LIST_USERS, 0);
+  listing.frame_len = MESSAGE_HEADER_SIZE;
+
+  bench_case_t list_case = {"user_list_full", ROSTER_USERS, 0, 0};
+  bench_run(&list_case, bench_directory_request, &listing);
+
+  return bench_finish();
+}
\ No newline at end of file
@@ -0,0 +1,40 @@
+#!/bin/bash
+
+# Compare two benchmark CSV files produced with --format=csv and flag cases
+# whose median ns/op regressed by more than THRESHOLD percent.
+#
+# Usage: bench/compare.sh <baseline.csv> <candidate.csv> [threshold_percent]
+# Exits 1 if any case regressed past the threshold.
+
+set -e
+
+if [ $# -lt 2 ]; then
+    echo "Usage: $0 <baseline.csv> <candidate.csv> [threshold_percent]"
+    exit 2
+fi
+
+BASELINE="$1"
+CANDIDATE="$2"
+THRESHOLD="${3:-10}"
+
+awk -F, -v threshold="$THRESHOLD" '
+BEGIN { printf "%-48s %14s %14s %9s\n", "case", "base ns/op", "new ns/op", "delta" }
+FNR == 1 { next }
+FNR == NR { base[$1 "," $2 "," $3] = $6; next }
+{
+    key = $1 "," $2 "," $3
+    if (!(key in base)) {
+        printf "%-48s %14s %14.1f %9s\n", key, "-", $6, "new"
+        next
+    }
+    delta = base[key] > 0 ? ($6 - base[key]) * 100.0 / base[key] : 0
+    flag = delta > threshold ? "REGRESSED" : (delta < -threshold ? "improved" : "")
+    if (delta > threshold) regressions++
+    printf "%-48s %14.1f %14.1f %+8.1f%% %s\n", key, base[key], $6, delta, flag
+}
+END {
+    if (regressions > 0) {
+        printf "\n%d case(s) regressed by more than %s%%\n", regressions, threshold
+        exit 1
+    }
+}' "$BASELINE" "$CANDIDATE"
@@ -6,6 +6,7 @@
 #include <limits.h>
 #include <sodium.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -21,6 +22,12 @@
 #define MAX_PASSWORD_LEN 256
 #define SERVER_HOST "localhost"
 #define SERVER_PORT 8080
+// Cluster nodes send REGISTER_USER to the node that owns the name; never
+// follow more redirects than this for one request
+#define MAX_SERVER_REDIRECTS 2
+
+// Wire framing: [4 bytes: payload length][1 byte: message type]
+#define FRAME_HEADER_SIZE 5
 
 // Use system PATH_MAX or fallback for path construction safety
 #ifndef PATH_MAX
@@ -35,10 +42,70 @@
 #define KEY_DERIVATION_SALT_SIZE crypto_pwhash_SALTBYTES
 #define DERIVED_KEY_SIZE crypto_secretbox_KEYBYTES
 
+// Session envelope: [version][nonce][crypto_box_easy_afternm ciphertext]
+// Nonce is a random per-session prefix followed by a 64-bit message counter
+#define SESSION_KEY_SIZE crypto_box_BEFORENMBYTES
+#define SESSION_ENVELOPE_VERSION 0x01
+#define SESSION_NONCE_PREFIX_SIZE (crypto_box_NONCEBYTES - 8)
+#define SESSION_OVERHEAD (1 + crypto_box_NONCEBYTES + crypto_box_MACBYTES)
+
+// Group envelope: [version][random nonce][crypto_secretbox_easy ciphertext]
+// under a key the group's members share; the server relays it unopened. The
+// key reaches each member sealed to their public key.
+#define GROUP_KEY_SIZE crypto_secretbox_KEYBYTES
+#define GROUP_ENVELOPE_VERSION 0x02
+#define GROUP_OVERHEAD                                                         \
+  (1 + crypto_secretbox_NONCEBYTES + crypto_secretbox_MACBYTES)
+#define WRAPPED_GROUP_KEY_SIZE (crypto_box_SEALBYTES + GROUP_KEY_SIZE)
+
+// File transfer: the file is encrypted with crypto_secretstream in chunks of
+// FILE_CHUNK_SIZE ciphertext bytes (the last one shorter), one per
+// FILE_CHUNK frame. The stream key and header travel sealed to the
+// recipient in the offer's envelope.
+#define FILE_CHUNK_SIZE (64 * 1024)
+#define FILE_PLAIN_CHUNK_SIZE                                                  \
+  (FILE_CHUNK_SIZE - crypto_secretstream_xchacha20poly1305_ABYTES)
+#define FILE_KEY_SIZE crypto_secretstream_xchacha20poly1305_KEYBYTES
+#define FILE_HEADER_SIZE crypto_secretstream_xchacha20poly1305_HEADERBYTES
+#define FILE_ENVELOPE_SIZE                                                     \
+  (crypto_box_SEALBYTES + FILE_KEY_SIZE + FILE_HEADER_SIZE)
+
 // File paths
 #define KEYS_DIR ".c-chat"
 #define PRIVATE_KEY_FILE "private_key"
 #define PUBLIC_KEY_FILE "public_key"
+#define AGENT_SOCKET_FILE "agent.sock"
+#define KDF_CONFIG_FILE "kdf.conf"
+#define KNOWN_KEYS_FILE "known_keys"
+
+// Pinned partner keys are rechecked with the server at most this often
+#define KEY_CACHE_REVALIDATE_SECS (24 * 60 * 60)
+#define MAX_KEY_BATCH 32
+#define USER_PAGE_MAX_ENTRIES 48
+#define SEARCH_MAX_RESULTS 32
+#define KEY_FINGERPRINT_BYTES 16
+#define KEY_FINGERPRINT_LEN (KEY_FINGERPRINT_BYTES * 3)
+
+// Key file: [header][salt][nonce][public_key][encrypted_private_key]
+// Header: "CCHK" magic, 1 byte version, 1 byte pwhash algorithm, 2 reserved
+// bytes, 4 byte opslimit and 4 byte memlimit in KiB (big-endian). Files
+// without a header are the original format, sealed with INTERACTIVE limits.
+#define KEY_FILE_MAGIC "CCHK"
+#define KEY_FILE_VERSION 0x01
+#define KEY_FILE_HEADER_SIZE 16
+#define KEY_FILE_BODY_SIZE                                                     \
+  (KEY_DERIVATION_SALT_SIZE + crypto_secretbox_NONCEBYTES + PUBLIC_KEY_SIZE +  \
+   PRIVATE_KEY_SIZE + crypto_secretbox_MACBYTES)
+
+// Argon2id calibration bounds (see kdf.c)
+#define KDF_DEFAULT_TARGET_MS 300
+#define KDF_DEFAULT_MEMORY_BUDGET (1024UL * 1024 * 1024)
+#define KDF_MIN_MEMLIMIT (8UL * 1024 * 1024)
+#define KDF_MAX_MEMLIMIT (4UL * 1024 * 1024 * 1024 - 1024)
+#define KDF_MAX_OPSLIMIT 64ULL
+
+// Key agent defaults
+#define AGENT_DEFAULT_IDLE_TIMEOUT 900
 
 // Error codes
 typedef enum {
@@ -83,16 +150,27 @@ void print_version(void);
 cchat_error_t register_user(const char *username);
 cchat_error_t login_user(const char *username);
 cchat_error_t list_users(void);
+cchat_error_t list_users_since(uint32_t *registry_version);
+cchat_error_t find_users(const char *prefix);
 
 // Secure key management structure - keys are cleared after each session
 typedef struct {
   unsigned char private_key[PRIVATE_KEY_SIZE];
+  unsigned char public_key[PUBLIC_KEY_SIZE];
   unsigned char partner_public_key[PUBLIC_KEY_SIZE];
   bool keys_loaded;
+  bool agent_backed; // private key held by the key agent, not in memory here
+
+  // Shared key precomputed once per chat (see derive_session_key)
+  unsigned char session_key[SESSION_KEY_SIZE];
+  unsigned char nonce_prefix[SESSION_NONCE_PREFIX_SIZE];
+  uint64_t nonce_counter;
+  bool session_ready;
 } secure_session_keys_t;
 
 // Chat functionality
 cchat_error_t start_chat(const char *username);
+cchat_error_t sync_known_keys(const char **usernames, size_t count);
 cchat_error_t send_message(const char *message);
 cchat_error_t receive_messages(void);
 
@@ -111,6 +189,76 @@ cchat_error_t decrypt_message(const unsigned char *encrypted,
                               size_t encrypted_len,
                               const unsigned char *private_key, char *message,
                               size_t *message_len);
+cchat_error_t decrypt_sealed_message(const unsigned char *encrypted,
+                                     size_t encrypted_len,
+                                     const unsigned char *public_key,
+                                     const unsigned char *private_key,
+                                     char *message, size_t *message_len);
+
+// Session encryption: one X25519 exchange per chat, then XSalsa20-Poly1305
+cchat_error_t derive_session_key(secure_session_keys_t *keys);
+void init_session_nonce(secure_session_keys_t *keys);
+cchat_error_t encrypt_message_session(const char *message,
+                                      secure_session_keys_t *keys,
+                                      unsigned char *encrypted,
+                                      size_t *encrypted_len);
+cchat_error_t decrypt_message_session(const unsigned char *encrypted,
+                                      size_t encrypted_len,
+                                      const secure_session_keys_t *keys,
+                                      char *message, size_t *message_len);
+
+// Group encryption: one ciphertext for every member
+void generate_group_key(unsigned char *group_key);
+cchat_error_t wrap_group_key(const unsigned char *group_key,
+                             const unsigned char *member_public_key,
+                             unsigned char *wrapped);
+cchat_error_t unwrap_group_key(const unsigned char *wrapped,
+                               size_t wrapped_len,
+                               const unsigned char *public_key,
+                               const unsigned char *private_key,
+                               unsigned char *group_key);
+cchat_error_t encrypt_group_message(const char *message,
+                                    const unsigned char *group_key,
+                                    unsigned char *encrypted,
+                                    size_t *encrypted_len);
+cchat_error_t decrypt_group_message(const unsigned char *encrypted,
+                                    size_t encrypted_len,
+                                    const unsigned char *group_key,
+                                    char *message, size_t *message_len);
+
+// File encryption: crypto_secretstream key and header, sealed to the
+// recipient
+cchat_error_t seal_file_envelope(
+    const unsigned char *key, const unsigned char *header,
+    const unsigned char *recipient_public_key, unsigned char *envelope);
+cchat_error_t open_file_envelope(const unsigned char *envelope,
+                                 size_t envelope_len,
+                                 const unsigned char *public_key,
+                                 const unsigned char *private_key,
+                                 unsigned char *key, unsigned char *header);
+
+// One direction of a file's secretstream. Every chunk but the last holds
+// FILE_PLAIN_CHUNK_SIZE bytes and only the last carries TAG_FINAL, so a
+// stream cut short at any point fails to decrypt.
+typedef struct {
+  crypto_secretstream_xchacha20poly1305_state state;
+  bool finished; // TAG_FINAL written or read
+} file_stream_t;
+
+cchat_error_t file_stream_init_push(file_stream_t *stream,
+                                    const unsigned char *key,
+                                    unsigned char *header);
+cchat_error_t file_stream_push(file_stream_t *stream,
+                               const unsigned char *plain, size_t plain_len,
+                               bool last, unsigned char *chunk,
+                               size_t *chunk_len);
+cchat_error_t file_stream_init_pull(file_stream_t *stream,
+                                    const unsigned char *key,
+                                    const unsigned char *header);
+cchat_error_t file_stream_pull(file_stream_t *stream,
+                               const unsigned char *chunk, size_t chunk_len,
+                               unsigned char *plain, size_t *plain_len);
+cchat_error_t file_stream_end(const file_stream_t *stream);
 
 // Key management
 cchat_error_t save_keys_to_file(const char *username,
@@ -123,12 +271,83 @@ cchat_error_t load_keys_from_file(const char *username,
                                   const char *password);
 cchat_error_t create_keys_directory(void);
 
+// One page of the user directory (paged LIST_USERS)
+typedef struct {
+  char username[MAX_USERNAME_LEN];
+  uint8_t status; // 0=offline, 1=online, 2=away
+  uint32_t changed_version;
+} user_entry_t;
+
+typedef struct {
+  uint32_t registry_version; // directory version when the page was read
+  uint32_t next_cursor;      // 0 when this was the last page
+  size_t count;
+  user_entry_t entries[USER_PAGE_MAX_ENTRIES];
+} user_page_t;
+
+// Per-name result of a public key lookup (PUBLIC_KEY_RESPONSE status byte)
+typedef enum {
+  KEY_LOOKUP_NOT_FOUND = 0,
+  KEY_LOOKUP_FOUND = 1,
+  KEY_LOOKUP_UNCHANGED = 2
+} key_lookup_status_t;
+
+// Known partner keys (trust on first use, see keycache.c)
+typedef struct {
+  char username[MAX_USERNAME_LEN];
+  unsigned char public_key[PUBLIC_KEY_SIZE];
+  uint32_t key_version; // server key version, 0 if unknown
+  uint64_t verified_at; // last time the server confirmed this key
+} known_key_t;
+
+cchat_error_t keycache_lookup(const char *username, known_key_t *entry);
+cchat_error_t keycache_store(const known_key_t *entry);
+cchat_error_t keycache_forget(const char *username);
+void format_key_fingerprint(const unsigned char *public_key, char *out,
+                            size_t out_size);
+
+// Key agent (ssh-agent style cache of unlocked keys)
+cchat_error_t run_key_agent(unsigned int idle_timeout);
+cchat_error_t agent_add_key(const char *username,
+                            const unsigned char *public_key,
+                            const unsigned char *private_key);
+cchat_error_t agent_get_public_key(const char *username,
+                                   unsigned char *public_key);
+cchat_error_t agent_session_key(const char *username,
+                                const unsigned char *partner_public_key,
+                                unsigned char *session_key);
+cchat_error_t agent_open_message(const char *username,
+                                 const unsigned char *encrypted,
+                                 size_t encrypted_len, char *message,
+                                 size_t *message_len);
+cchat_error_t agent_lock(void);
+
 // Password utilities
 cchat_error_t derive_key_from_password(const char *password,
                                        const unsigned char *salt,
                                        unsigned char *derived_key);
+cchat_error_t derive_key_from_password_with_limits(const char *password,
+                                                   const unsigned char *salt,
+                                                   unsigned long long opslimit,
+                                                   size_t memlimit,
+                                                   unsigned char *derived_key);
 void secure_zero_memory(void *ptr, size_t size);
 
+// Argon2id parameters for key files
+typedef struct {
+  unsigned long long opslimit;
+  size_t memlimit;
+} kdf_params_t;
+
+void kdf_default_params(kdf_params_t *params);
+bool kdf_params_valid(const kdf_params_t *params);
+cchat_error_t load_kdf_params(kdf_params_t *params);
+cchat_error_t save_kdf_params(const kdf_params_t *params);
+cchat_error_t calibrate_kdf(unsigned int target_ms, size_t memory_budget,
+                            kdf_params_t *params);
+cchat_error_t run_kdf_calibration(unsigned int target_ms,
+                                  size_t memory_budget);
+
 // Network
 cchat_error_t connect_to_server(void);
 cchat_error_t disconnect_from_server(void);
@@ -136,10 +355,30 @@ cchat_error_t register_user_with_server(const char *username,
                                         const unsigned char *public_key);
 cchat_error_t get_user_public_key(const char *username,
                                   unsigned char *public_key);
+cchat_error_t fetch_user_public_key(const char *username,
+                                    uint32_t known_version,
+                                    unsigned char *public_key,
+                                    uint32_t *key_version, bool *unchanged);
+cchat_error_t fetch_user_page(uint32_t cursor, uint32_t since,
+                              user_page_t *page);
+cchat_error_t fetch_user_matches(const char *prefix, user_entry_t *entries,
+                                 size_t *count);
+cchat_error_t fetch_user_public_keys(known_key_t *keys,
+                                     key_lookup_status_t *statuses,
+                                     size_t count);
 cchat_error_t send_message_to_server(const char *recipient,
                                      const unsigned char *encrypted_message,
                                      size_t message_len);
 
+// Frame codec (exposed for benchmarking)
+void encode_frame_header(uint8_t *header, uint8_t msg_type,
+                         uint32_t payload_len);
+void decode_frame_header(const uint8_t *header, uint8_t *msg_type,
+                         uint32_t *payload_len);
+size_t encode_send_message_payload(uint8_t *payload, const char *recipient,
+                                   const unsigned char *encrypted_message,
+                                   size_t message_len);
+
 // Main chat loop
 void run_chat_interface(void);
 
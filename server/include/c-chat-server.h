@@ -7,6 +7,7 @@
 #include <pthread.h>
 #include <signal.h>
 #include <sodium.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -24,12 +25,140 @@
 #define MESSAGE_QUEUE_SIZE 100
 #define RATE_LIMIT_WINDOW 60
 #define RATE_LIMIT_MAX_REQUESTS 100
+#define MESSAGE_HEADER_SIZE 5
+
+#define CAPTURE_MAGIC "CCAP"
+#define CAPTURE_VERSION 1
+#define CAPTURE_HEADER_SIZE 16
+#define CAPTURE_RECORD_HEADER_SIZE 18
+#define CAPTURE_BUFFER_SIZE (1 << 20)
+
+// Memory transport descriptors live far above any real socket fd
+#define MEMORY_TRANSPORT_FD_BASE (1 << 24)
+#define MEMORY_TRANSPORT_MAX_CHANNELS MAX_CLIENTS
 
 #define PUBLIC_KEY_SIZE crypto_box_PUBLICKEYBYTES
 #define PRIVATE_KEY_SIZE crypto_box_SECRETKEYBYTES
 #define SIGNATURE_SIZE crypto_sign_BYTES
 #define CHALLENGE_SIZE 32
 
+// PUBLIC_KEY_RESPONSE status byte
+#define KEY_LOOKUP_NOT_FOUND 0
+#define KEY_LOOKUP_FOUND 1
+#define KEY_LOOKUP_UNCHANGED 2
+
+// Most usernames one GET_PUBLIC_KEYS request may carry
+#define MAX_KEY_BATCH 32
+
+// USER_PAGE_RESPONSE entries per page; a full page stays well under the
+// client's MAX_MESSAGE_LEN * 2 frame limit
+#define USER_PAGE_MAX_ENTRIES 48
+
+// Most matches one SEARCH_USERS request may return
+#define SEARCH_MAX_RESULTS 32
+
+// Longest a GET_MESSAGES long poll or SYNC_MESSAGES may park its connection
+#define LONG_POLL_MAX_MS 30000
+
+// Default and ceiling for the byte budget of one SYNC_MESSAGES batch
+#define SYNC_DEFAULT_MAX_BYTES (64 * 1024)
+#define SYNC_MAX_BYTES (1024 * 1024)
+
+// Inbox overflow spool (see spool.c)
+#define INBOX_SPOOL_DIR "spool"
+#define INBOX_SPOOL_MAX_BYTES (64 * 1024 * 1024)
+#define INBOX_SPOOL_TOTAL_MAX_BYTES (1024ULL * 1024 * 1024)
+
+// Message retention (see retention.c). The period is split into
+// RETENTION_BUCKETS buckets; a message expires with its whole bucket.
+#define MESSAGE_RETENTION_HOURS 24
+#define RETENTION_BUCKETS 24
+#define RETENTION_TRACKED_BUCKETS (RETENTION_BUCKETS + 2)
+
+// Idle connections (see timers.c). Times are in seconds; every delay must be
+// shorter than the wheel.
+#define CONNECTION_TIMEOUT 300
+#define KEEPALIVE_INTERVAL 60
+#define TIMER_WHEEL_SLOTS 512
+
+// Admission budgets (see admission.c): a burst, then one more every
+// interval. Connects and logins are counted per address, frames and sends
+// per connection.
+#define ADMIT_CONNECT_BURST 50
+#define ADMIT_CONNECT_INTERVAL_MS 200
+#define ADMIT_REQUEST_BURST RATE_LIMIT_MAX_REQUESTS
+#define ADMIT_REQUEST_INTERVAL_MS                                              \
+  (RATE_LIMIT_WINDOW * 1000 / RATE_LIMIT_MAX_REQUESTS)
+#define ADMIT_LOGIN_BURST 30
+#define ADMIT_LOGIN_INTERVAL_MS 500
+#define ADMIT_SEND_BURST 60
+#define ADMIT_SEND_INTERVAL_MS 250
+
+// Overload control (see overload.c): low-priority frames are refused once
+// the least wait seen in an interval is above the target
+#define OVERLOAD_TARGET_MS 20
+#define OVERLOAD_INTERVAL_MS 100
+
+// Outbound lanes (see outbound.c): bytes one connection may have queued
+// behind its writer, on all lanes together and on the bulk lane alone
+#define OUTBOUND_MAX_BYTES (1024 * 1024)
+#define OUTBOUND_BULK_MAX_BYTES (256 * 1024)
+
+// Zerocopy sends (see transport.c): frames whose payload is at least this
+// large are sent with MSG_ZEROCOPY (0 = never; -z sets it), on sockets whose
+// descriptor is below the limit
+#define ZEROCOPY_THRESHOLD_BYTES (16 * 1024)
+#define ZEROCOPY_MAX_FD 4096
+
+// Cluster mode (see cluster.c): nodes in one cluster, ring points per node,
+// records a link may hold for an unreachable peer, records per batch frame,
+// and how long a link waits before reconnecting and for each ACK
+#define CLUSTER_MAX_NODES 16
+#define CLUSTER_VNODES 64
+#define CLUSTER_QUEUE_MAX_BYTES (16 * 1024 * 1024)
+#define CLUSTER_BATCH_MAX_BYTES (256 * 1024)
+#define CLUSTER_RETRY_MS 1000
+#define CLUSTER_ACK_TIMEOUT_SEC 10
+
+// Group conversations (see groups.c)
+#define MAX_GROUPS 1024
+#define MAX_GROUP_MEMBERS 256
+#define MAX_GROUP_NAME_LEN 64
+
+// GROUP_INFO members per response; like USER_PAGE_MAX_ENTRIES, a full page
+// stays under the client's frame limit
+#define GROUP_PAGE_MAX_ENTRIES 48
+
+// UPDATE_GROUP operations
+#define GROUP_ADD_MEMBER 1
+#define GROUP_REMOVE_MEMBER 2
+
+// SEND_MULTI: recipients per frame, and the frame size it may use instead
+// of the usual inbound limit (each copy still fits a SEND_MESSAGE frame)
+#define MAX_MULTI_RECIPIENTS 32
+#define SEND_MULTI_MAX_PAYLOAD (MAX_MULTI_RECIPIENTS * MAX_MESSAGE_LEN * 2 + 1)
+
+// File transfers (see file_transfer.c). Sizes are of the ciphertext stream;
+// FILE_CHUNK and FILE_DATA frames carry at most FILE_CHUNK_MAX_BYTES of it.
+#define MAX_FILE_TRANSFERS 256
+#define FILE_MAX_BYTES (1024LL * 1024 * 1024)
+#define FILE_SPOOL_MAX_BYTES (4LL * 1024 * 1024 * 1024)
+#define FILE_CHUNK_MAX_BYTES (64 * 1024)
+#define FILE_FETCH_MAX_BYTES (4 * 1024 * 1024)
+#define FILE_ENVELOPE_MAX_LEN 256
+#define FILE_TRANSFER_IDLE_HOURS 24
+#define FILE_TRANSFER_SWEEP_SECONDS 3600
+
+// FILE_RESPONSE statuses
+#define FILE_STATUS_REFUSED 0
+#define FILE_STATUS_OK 1
+#define FILE_STATUS_FULL 2
+#define FILE_STATUS_COMPLETE 3
+
+// MULTI_ACK statuses beyond MESSAGE_ACK's 0 failed, 1 delivered, 2 queued
+#define MULTI_STATUS_NOT_FOUND 3
+#define MULTI_STATUS_RATE_LIMITED 4
+
 typedef enum {
   MSG_REGISTER_USER = 0x01,
   MSG_LOGIN_USER = 0x02,
@@ -39,6 +168,19 @@ typedef enum {
   MSG_SET_STATUS = 0x06,
   MSG_LIST_USERS = 0x07,
   MSG_LOGOUT = 0x08,
+  MSG_GET_PUBLIC_KEYS = 0x09,
+  MSG_SEARCH_USERS = 0x0A,
+  MSG_SYNC_MESSAGES = 0x0B,
+  MSG_ACK_MESSAGES = 0x0C,
+  MSG_PONG = 0x0D,
+  MSG_CREATE_GROUP = 0x0E,
+  MSG_UPDATE_GROUP = 0x0F,
+  MSG_SEND_GROUP_MESSAGE = 0x10,
+  MSG_GET_GROUP = 0x11,
+  MSG_SEND_MULTI = 0x12,
+  MSG_FILE_OFFER = 0x13,
+  MSG_FILE_CHUNK = 0x14,
+  MSG_FILE_FETCH = 0x15,
 
   MSG_REGISTER_RESPONSE = 0x81,
   MSG_LOGIN_RESPONSE = 0x82,
@@ -47,7 +189,22 @@ typedef enum {
   MSG_INCOMING_MESSAGE = 0x85,
   MSG_USER_LIST_RESPONSE = 0x86,
   MSG_STATUS_UPDATE = 0x87,
-  MSG_ERROR = 0x88
+  MSG_ERROR = 0x88,
+  MSG_PUBLIC_KEYS_RESPONSE = 0x89,
+  MSG_USER_PAGE_RESPONSE = 0x8A,
+  MSG_SEARCH_RESPONSE = 0x8B,
+  MSG_POLL_RESPONSE = 0x8C,
+  MSG_SYNC_MESSAGE = 0x8D,
+  MSG_SYNC_RESPONSE = 0x8E,
+  MSG_PING = 0x8F,
+  MSG_GROUP_RESPONSE = 0x90,
+  MSG_GROUP_INFO = 0x91,
+  MSG_GROUP_MESSAGE = 0x92,
+  MSG_GROUP_SYNC_MESSAGE = 0x93,
+  MSG_MULTI_ACK = 0x94,
+  MSG_FILE_RESPONSE = 0x95,
+  MSG_FILE_AVAILABLE = 0x96,
+  MSG_FILE_DATA = 0x97
 } message_type_t;
 
 typedef enum {
@@ -64,7 +221,8 @@ typedef enum {
   ERR_INVALID_FORMAT = 0x05,
   ERR_RATE_LIMIT = 0x06,
   ERR_SERVER_ERROR = 0x07,
-  ERR_CONNECTION_TERMINATED = 0x08
+  ERR_CONNECTION_TERMINATED = 0x08,
+  ERR_WRONG_NODE = 0x09
 } error_code_t;
 
 typedef struct {
@@ -73,46 +231,194 @@ typedef struct {
   uint8_t *payload;
 } network_message_t;
 
+// Ciphertext of a stored message. A group send stores one body and every
+// member's inbox holds a reference to it.
+typedef struct {
+  _Atomic uint32_t refs;
+  size_t len;
+  unsigned char data[];
+} message_body_t;
+
+// Payload of an outgoing frame, shared by reference: a lane queues it
+// without copying, a group send shares one among the members, and a
+// zerocopy send keeps it until the kernel is done with it
+typedef struct {
+  _Atomic uint32_t refs;
+  uint32_t len;
+  uint8_t data[];
+} frame_buffer_t;
+
+typedef struct {
+  uint32_t message_id;
+  uint32_t seq;      // per-recipient sequence number, from 1
+  uint32_t group_id; // 0 for a direct message
+  char sender[MAX_USERNAME_LEN];
+  time_t timestamp;
+  size_t encrypted_len;
+  unsigned char *encrypted_data; // body->data once stored
+  message_body_t *body;
+} stored_message_t;
+
+// A spool record reserved but not yet written (see spool.c)
+typedef struct spool_write spool_write_t;
+
+// Messages an inbox holds from one retention bucket
+typedef struct {
+  int64_t bucket;  // timestamp / retention_bucket_width()
+  uint32_t count;  // still stored, in the ring or the spool
+  off_t spool_end; // spool offset just past its last spooled message
+} retention_bucket_t;
+
+// Per-recipient mailbox. Messages are numbered per user and kept until the
+// recipient acknowledges them, across connections, so a client can resume
+// from the last sequence number it holds.
+typedef struct {
+  stored_message_t messages[MESSAGE_QUEUE_SIZE]; // ring from head
+  int head;
+  int count;
+  uint32_t next_seq;    // seq of the next message stored
+  uint32_t acked_seq;   // everything up to here has been received
+  int waiters;          // connections parked in a long poll or sync
+  pthread_cond_t ready; // signalled by queue_message()
+  pthread_mutex_t mutex;
+
+  // Overflow beyond the ring, all newer than it (see spool.c). The file is
+  // used under spool_mutex, everything else under mutex.
+  pthread_mutex_t spool_mutex;
+  int spool_fd;          // -1 until the first record is written
+  uint32_t spool_count;  // not yet read back, written or still pending
+  off_t spool_read_offset;
+  off_t spool_written;   // records before this are in the file
+  off_t spool_bytes;     // end of the reserved records, pending included
+  off_t spool_punched;   // space before this has been given back
+  uint32_t spool_generation; // changes when the read offset jumps
+  spool_write_t *spool_pending; // reserved, not yet written, oldest first
+  spool_write_t *spool_pending_tail;
+
+  // Stored messages by age, oldest bucket first (see retention.c)
+  retention_bucket_t buckets[RETENTION_TRACKED_BUCKETS];
+  int bucket_head;
+  int bucket_count;
+} user_inbox_t;
+
 typedef struct {
   char username[MAX_USERNAME_LEN];
   unsigned char public_key[PUBLIC_KEY_SIZE];
-  user_status_t status;
+  uint32_t key_version; // changes whenever public_key does
+  // Written under mutex, read without it (see directory.c)
+  _Atomic uint32_t changed_version; // registry version of the last change
+  _Atomic user_status_t status;
   time_t last_seen;
   bool is_registered;
+  uint8_t node; // cluster node that owns the user (see cluster.c)
   pthread_mutex_t mutex;
+  user_inbox_t inbox;
 } user_record_t;
 
+// Immutable name-ordered view of the registered users, replaced by add_user()
+// and read without locks through directory_acquire()
+typedef struct user_directory {
+  int count; // users[0..count) are registered
+  // Writer-side bookkeeping once the snapshot has been replaced
+  uint64_t retired_epoch;
+  struct user_directory *next_retired;
+  uint16_t by_name[]; // users[] indices in username order
+} user_directory_t;
+
+typedef enum {
+  CAPTURE_CONNECT = 1,
+  CAPTURE_FRAME = 2,
+  CAPTURE_DISCONNECT = 3
+} capture_kind_t;
+
+// Byte transport used by send_network_message()/receive_network_message()
 typedef struct {
-  uint32_t message_id;
-  char sender[MAX_USERNAME_LEN];
-  char recipient[MAX_USERNAME_LEN];
-  time_t timestamp;
-  size_t encrypted_len;
-  unsigned char *encrypted_data;
-  bool delivered;
-} stored_message_t;
+  const char *name;
+  // Write one frame (header + payload) in full; 0 on success, -1 on error.
+  // When owner is not NULL it holds payload, and the transport may keep a
+  // reference to it after returning.
+  int (*send_frame)(int fd, const uint8_t *header, size_t header_len,
+                    const uint8_t *payload, size_t payload_len,
+                    frame_buffer_t *owner);
+  // Write one frame only if it all fits without waiting; on -1 part of it
+  // may have gone out, so the caller must give up on the stream
+  int (*try_send_frame)(int fd, const uint8_t *header, size_t header_len,
+                        const uint8_t *payload, size_t payload_len);
+  // recv(MSG_WAITALL) semantics: short count only on close, 0 on EOF
+  ssize_t (*recv_exact)(int fd, void *buffer, size_t len);
+  // Fail pending and later I/O on fd from another thread; fd stays open
+  void (*shutdown)(int fd);
+  // CLOCK_REALTIME ns at which the data last returned by recv_exact() on
+  // this thread reached the host, or 0 if the transport cannot tell
+  int64_t (*arrival_ns)(int fd);
+  void (*close)(int fd);
+  // Write one frame whose payload ends with len bytes of file_fd from
+  // offset; header holds the frame header and the rest of the payload
+  int (*send_file)(int fd, const uint8_t *header, size_t header_len,
+                   int file_fd, off_t offset, size_t len);
+} transport_ops_t;
 
+typedef enum {
+  ADMIT_CONNECT, // per address
+  ADMIT_REQUEST, // every frame, per connection
+  ADMIT_LOGIN,   // REGISTER_USER and LOGIN_USER, per address
+  ADMIT_SEND,    // SEND_MESSAGE, per connection
+  ADMIT_KINDS
+} admit_kind_t;
+
+// Outcome of one SYNC_MESSAGES batch (see sync_messages())
 typedef struct {
-  time_t window_start;
-  int request_count;
-} rate_limit_t;
+  uint16_t count;      // messages sent in this batch
+  uint32_t last_seq;   // seq of the last message sent, or the request's
+  uint32_t newest_seq; // newest seq stored for the user
+  uint32_t acked_seq;  // everything up to here was trimmed
+} sync_result_t;
+
+// Totals since startup, see retention_get_stats()
+typedef struct {
+  uint64_t expired_messages;
+  uint64_t reclaimed_memory_bytes; // message bodies freed from inboxes
+  uint64_t reclaimed_spool_bytes;  // spool records discarded
+} retention_stats_t;
+
+// Outbound frame priority (see outbound.c)
+typedef enum { LANE_CONTROL, LANE_BULK, OUTBOUND_LANES } outbound_lane_t;
+
+typedef struct outbound_frame outbound_frame_t;
 
 typedef struct {
   int socket_fd;
+  uint32_t connection_id;
   struct sockaddr_in address;
   char username[MAX_USERNAME_LEN];
+  int user_index; // users[] index once authenticated
   bool authenticated;
   bool connected;
+  bool in_use; // slot owned until disconnect_client() finishes
   user_status_t status;
   unsigned char challenge[CHALLENGE_SIZE];
   time_t connected_time;
-  rate_limit_t rate_limit;
+  bool sync_mode; // has sent SYNC_MESSAGES: deliver through the inbox only
+  int64_t ready_ns; // handler last went back to reading (see overload.c)
+
+  // Per-connection admission buckets, used by its handler thread only (see
+  // admission.c)
+  uint32_t admit_full_at[ADMIT_KINDS];
+
+  // Idle tracking (see timers.c)
+  _Atomic uint32_t last_activity; // timer tick of the last inbound frame
+  uint32_t pinged_activity;       // last_activity a PING was sent for
+  int timer_slot;                 // wheel slot, -1 when not scheduled
+  int timer_prev, timer_next;     // clients[] indices in that slot, or -1
 
-  stored_message_t message_queue[MESSAGE_QUEUE_SIZE];
-  int queue_head;
-  int queue_tail;
-  int queue_count;
-  pthread_mutex_t queue_mutex;
+  // Frames queued behind the thread writing to the socket (see outbound.c)
+  pthread_mutex_t send_mutex;
+  pthread_cond_t send_idle; // signalled when sending drops to false
+  outbound_frame_t *lane_head[OUTBOUND_LANES];
+  outbound_frame_t *lane_tail[OUTBOUND_LANES];
+  size_t lane_bytes[OUTBOUND_LANES]; // payload bytes queued per lane
+  bool sending;          // a thread is writing to the socket
+  bool send_closed;      // disconnected or broken: refuse new frames
 
   pthread_t thread_id;
   pthread_mutex_t mutex;
@@ -121,7 +427,8 @@ typedef struct {
 typedef struct {
   user_record_t users[MAX_CLIENTS];
   int user_count;
-  pthread_mutex_t users_mutex;
+  _Atomic(user_directory_t *) directory; // current snapshot of users[]
+  pthread_mutex_t users_mutex;           // serializes writers only
 
   client_connection_t clients[MAX_CLIENTS];
   int client_count;
@@ -130,6 +437,13 @@ typedef struct {
   uint32_t next_message_id;
   pthread_mutex_t message_id_mutex;
 
+  uint32_t next_connection_id;
+  uint32_t next_key_version; // guarded by users_mutex
+
+  // Bumped on every registration and status change (see touch_user_record)
+  uint32_t registry_version;
+  pthread_mutex_t registry_version_mutex;
+
   int server_socket;
   bool running;
   pthread_mutex_t running_mutex;
@@ -138,23 +452,63 @@ typedef struct {
 extern server_state_t server;
 
 int init_server(void);
+int init_server_state(void);
+int open_listen_socket(void);
 void cleanup_server(void);
+void configure_client_socket(int socket_fd);
+client_connection_t *accept_client(int socket_fd,
+                                   const struct sockaddr_in *address);
 void *client_handler(void *arg);
+int serve_client_message(client_connection_t *client);
+void disconnect_client(client_connection_t *client);
 void signal_handler(int sig);
 
 int send_network_message(int socket_fd, message_type_t type,
-                         const uint8_t *payload, uint32_t payload_len);
+                         const uint8_t *payload, uint32_t payload_len,
+                         frame_buffer_t *owner);
 int receive_network_message(int socket_fd, network_message_t *msg);
+int receive_message_header(int socket_fd, network_message_t *msg);
+int receive_message_payload(int socket_fd, network_message_t *msg);
+int discard_message_payload(int socket_fd, const network_message_t *msg);
 void free_network_message(network_message_t *msg);
-int send_error(int socket_fd, error_code_t error_code,
+void encode_message_header(uint8_t *header, message_type_t type,
+                           uint32_t payload_len);
+void decode_message_header(const uint8_t *header, network_message_t *msg);
+size_t incoming_message_size(size_t sender_len, size_t encrypted_len);
+size_t encode_incoming_message(uint8_t *payload, uint32_t message_id,
+                               const char *sender, uint32_t timestamp,
+                               const unsigned char *encrypted_data,
+                               uint16_t encrypted_len);
+int parse_send_message(const uint8_t *payload, uint32_t payload_len,
+                       char *recipient, const unsigned char **encrypted_data,
+                       uint16_t *encrypted_len);
+int send_error(client_connection_t *client, error_code_t error_code,
                const char *error_message);
 
+int send_client_message(client_connection_t *client, message_type_t type,
+                        const uint8_t *payload, uint32_t payload_len);
+int send_client_buffer(client_connection_t *client, message_type_t type,
+                       frame_buffer_t *buffer);
+int send_client_message_nowait(client_connection_t *client,
+                               message_type_t type, const uint8_t *payload,
+                               uint32_t payload_len);
+int send_client_file(client_connection_t *client, message_type_t type,
+                     const uint8_t *prefix, uint32_t prefix_len, int file_fd,
+                     off_t offset, uint32_t len);
+void outbound_open(client_connection_t *client);
+void outbound_close(client_connection_t *client, user_record_t *user);
+frame_buffer_t *frame_buffer_create(const uint8_t *data, uint32_t len);
+frame_buffer_t *frame_buffer_hold(frame_buffer_t *buffer);
+void frame_buffer_release(frame_buffer_t *buffer);
+
 int handle_register_user(client_connection_t *client, const uint8_t *payload,
                          uint32_t payload_len);
 int handle_login_user(client_connection_t *client, const uint8_t *payload,
                       uint32_t payload_len);
 int handle_get_public_key(client_connection_t *client, const uint8_t *payload,
                           uint32_t payload_len);
+int handle_get_public_keys(client_connection_t *client, const uint8_t *payload,
+                           uint32_t payload_len);
 int handle_send_message(client_connection_t *client, const uint8_t *payload,
                         uint32_t payload_len);
 int handle_get_messages(client_connection_t *client, const uint8_t *payload,
@@ -163,25 +517,180 @@ int handle_set_status(client_connection_t *client, const uint8_t *payload,
                       uint32_t payload_len);
 int handle_list_users(client_connection_t *client, const uint8_t *payload,
                       uint32_t payload_len);
+int handle_search_users(client_connection_t *client, const uint8_t *payload,
+                        uint32_t payload_len);
+int handle_sync_messages(client_connection_t *client, const uint8_t *payload,
+                         uint32_t payload_len);
+int handle_ack_messages(client_connection_t *client, const uint8_t *payload,
+                        uint32_t payload_len);
 int handle_logout(client_connection_t *client, const uint8_t *payload,
                   uint32_t payload_len);
+int handle_create_group(client_connection_t *client, const uint8_t *payload,
+                        uint32_t payload_len);
+int handle_update_group(client_connection_t *client, const uint8_t *payload,
+                        uint32_t payload_len);
+int handle_get_group(client_connection_t *client, const uint8_t *payload,
+                     uint32_t payload_len);
+int handle_send_group_message(client_connection_t *client,
+                              const uint8_t *payload, uint32_t payload_len);
+int handle_send_multi(client_connection_t *client, const uint8_t *payload,
+                      uint32_t payload_len);
+int handle_file_offer(client_connection_t *client, const uint8_t *payload,
+                      uint32_t payload_len);
+int handle_file_chunk(client_connection_t *client, const uint8_t *payload,
+                      uint32_t payload_len);
+int handle_file_fetch(client_connection_t *client, const uint8_t *payload,
+                      uint32_t payload_len);
+int store_forwarded_message(const char *sender, user_record_t *recipient_user,
+                            uint32_t message_id,
+                            const unsigned char *encrypted_message,
+                            uint16_t message_len);
+void push_stored_messages(user_record_t *user);
 
 user_record_t *find_user(const char *username);
+void find_users(const char *const *usernames, int count,
+                user_record_t **users);
 client_connection_t *find_client_by_username(const char *username);
+void find_member_clients(const uint16_t *members, int count,
+                         client_connection_t **routes);
 int add_user(const char *username, const unsigned char *public_key);
+void touch_user_record(user_record_t *user);
+int search_users(const char *prefix, int max_results,
+                 user_record_t **matches);
 int authenticate_user(client_connection_t *client, const char *username,
                       const unsigned char *signature);
+void auth_set_replay_seed(const char *seed);
+void auth_new_challenge(unsigned char *challenge);
 
-int queue_message(const char *recipient, const char *sender,
+int directory_init(void);
+void directory_cleanup(void);
+const user_directory_t *directory_acquire(void);
+void directory_release(void);
+int directory_lower_bound(const user_directory_t *directory,
+                          const char *username);
+user_record_t *directory_find(const user_directory_t *directory,
+                              const char *username);
+int directory_insert(int position, int user_index);
+
+int queue_message(user_record_t *recipient_user, const char *sender,
                   const unsigned char *encrypted_data, size_t encrypted_len);
+int queue_forwarded_message(user_record_t *recipient_user, const char *sender,
+                            uint32_t message_id,
+                            const unsigned char *encrypted_data,
+                            size_t encrypted_len);
+int queue_group_message(user_record_t *member, const char *sender,
+                        uint32_t group_id, uint32_t message_id,
+                        message_body_t *body);
+int requeue_pushed_message(user_record_t *user, message_type_t type,
+                           const uint8_t *frame, uint32_t frame_len);
+message_body_t *message_body_create(const unsigned char *data, size_t len);
+void message_body_release(message_body_t *body);
 int deliver_queued_messages(client_connection_t *client);
+int wait_for_messages(client_connection_t *client, uint32_t timeout_ms,
+                      uint32_t last_seen_id, uint32_t *last_id);
+int sync_messages(client_connection_t *client, uint32_t after_seq,
+                  uint32_t max_bytes, uint32_t timeout_ms,
+                  sync_result_t *result);
+int ack_messages(user_record_t *user, uint32_t seq);
+bool inbox_has_waiters(user_record_t *user);
+int init_inbox(user_inbox_t *inbox);
+void destroy_inbox(user_inbox_t *inbox);
+
+int spool_set_directory(const char *dir);
+int spool_open(const char *file_name);
+int spool_reserve(user_inbox_t *inbox, const stored_message_t *msg);
+int spool_flush(user_inbox_t *inbox, const char *username);
+int spool_refill(user_inbox_t *inbox);
+void spool_close(user_inbox_t *inbox);
+off_t spool_discard(user_inbox_t *inbox, uint32_t count, off_t end_offset);
+
+int create_group(const char *name, int owner, const int *members, int count,
+                 uint32_t *group_id);
+int update_group(uint32_t group_id, int actor, int op, int user);
+int get_group_members(uint32_t group_id, int member, uint16_t *members,
+                      char *name);
+
+int file_transfer_create(int sender, int recipient, uint64_t size,
+                         const uint8_t *envelope, uint16_t envelope_len,
+                         uint32_t *transfer_id);
+int file_transfer_resume(uint32_t transfer_id, int sender, uint64_t *stored);
+int file_transfer_write(uint32_t transfer_id, int sender, uint64_t offset,
+                        const uint8_t *data, uint32_t len, uint64_t *stored);
+int file_transfer_fetch(client_connection_t *client, uint32_t transfer_id,
+                        uint64_t offset, uint32_t max_bytes, uint64_t *next);
+void file_transfers_announce(client_connection_t *client);
+int expire_file_transfers(time_t now);
+void file_transfers_cleanup(void);
+
+int cluster_configure(const char *list, int self);
+bool cluster_enabled(void);
+int cluster_owner(const char *username);
+bool cluster_owns(const char *username);
+bool cluster_is_local(const user_record_t *user);
+const char *cluster_owner_address(const char *username);
+uint16_t cluster_client_port(void);
+int cluster_start(void);
+void cluster_stop(void);
+void cluster_announce_user(user_record_t *user);
+void cluster_announce_status(const char *username, user_status_t status);
+int cluster_forward_message(const char *sender, const user_record_t *recipient,
+                            uint32_t message_id,
+                            const unsigned char *encrypted_message,
+                            uint16_t message_len);
 
-bool check_rate_limit(client_connection_t *client);
-void update_rate_limit(client_connection_t *client);
+void retention_set_period(time_t seconds);
+time_t retention_bucket_width(void);
+void retention_track_locked(user_record_t *user, time_t timestamp,
+                            bool spooled);
+void retention_untrack_locked(user_inbox_t *inbox, uint32_t count);
+int64_t expire_inbox(user_record_t *user, int64_t cutoff,
+                     retention_stats_t *stats);
+int expire_messages(time_t now);
+void retention_get_stats(retention_stats_t *stats);
+int retention_start(void);
+void retention_stop(void);
+
+uint32_t timer_now(void);
+void connection_timer_start(client_connection_t *client);
+void connection_timer_touch(client_connection_t *client);
+void connection_timer_stop(client_connection_t *client);
+int timer_wheel_advance(uint32_t now);
+int timer_wheel_start(void);
+void timer_wheel_stop(void);
+
+bool admit(uint32_t address, admit_kind_t kind);
+bool admit_connection(client_connection_t *client, admit_kind_t kind);
+bool admit_frame(client_connection_t *client, uint8_t type);
+void admission_set_enabled(bool enabled);
+
+bool overload_shed(uint8_t type, int64_t arrival_ns, int64_t ready_ns);
+int64_t overload_clock(void);
+void overload_record(int64_t sojourn_ns);
+bool overload_active(void);
+uint64_t overload_shed_count(void);
 
 int validate_username_server(const char *username);
 void broadcast_status_update(const char *username, user_status_t status);
 
+int capture_open(const char *path);
+void capture_close(void);
+bool capture_active(void);
+void capture_record(capture_kind_t kind, uint32_t connection_id, uint8_t type,
+                    const uint8_t *payload, uint32_t payload_len);
+
+extern const transport_ops_t socket_transport;
+extern const transport_ops_t memory_transport;
+void set_transport(const transport_ops_t *ops);
+const transport_ops_t *get_transport(void);
+void transport_set_zerocopy_threshold(size_t bytes);
+size_t transport_zerocopy_threshold(void);
+int memory_transport_open(bool discard_output);
+int memory_transport_write(int fd, const void *data, size_t len);
+size_t memory_transport_read(int fd, void *buffer, size_t len);
+uint64_t memory_transport_output_bytes(int fd);
+
+// verbose=false silences INFO and ERROR output (used by c-chat-sim)
+void log_set_verbose(bool verbose);
 void log_info(const char *format, ...);
 void log_error(const char *format, ...);
 void log_debug(const char *format, ...);
@@ -0,0 +1,217 @@
+#include "../include/c-chat-server.h"
+
+// Admission control
+//
+// Work that opens sessions is budgeted per source IPv4 address: opening
+// connections and login/registration attempts. Those budgets belong to the
+// address, so reconnecting does not refill them, and they are sized for
+// several users sharing one address behind a NAT. Everything else a
+// session does (frames of any kind, message sends) is budgeted per
+// connection, so one busy client cannot use up its neighbours' allowance.
+//
+// Connects are checked in the accept loop before a slot or thread is taken,
+// and frames right after their header is read, before the payload is
+// allocated, so a flood costs the server as little as possible. A frame
+// over budget is skipped and answered with ERR_RATE_LIMIT; the connection
+// stays open.
+//
+// Each bucket is kept as a single timestamp (GCRA): the time at which it
+// would be full again. A request is admitted while that time is less than
+// one burst ahead of now, and pushes it one interval further. Refill is
+// exact, with no fractional tokens and no per-bucket timer.
+//
+// Per-address buckets live in a sharded, set-associative table: an address
+// hashes to ADMISSION_PROBE consecutive entries of one shard and is looked
+// up only there. A bucket that has filled up again is the same as no entry
+// at all, so such entries are simply reused; only when every candidate is
+// still draining is the one closest to full evicted.
+
+#define ADMISSION_SHARDS 16
+#define ADMISSION_SHARD_ENTRIES 1024
+#define ADMISSION_PROBE 8
+
+typedef struct {
+  uint32_t address;
+  uint32_t full_at[ADMIT_KINDS]; // admission clock, ms
+} admission_entry_t;
+
+typedef struct {
+  _Alignas(64) pthread_mutex_t mutex;
+  admission_entry_t entries[ADMISSION_SHARD_ENTRIES];
+} admission_shard_t;
+
+typedef struct {
+  uint32_t burst;
+  uint32_t interval_ms;
+} admission_budget_t;
+
+static const admission_budget_t budgets[ADMIT_KINDS] = {
+    [ADMIT_CONNECT] = {ADMIT_CONNECT_BURST, ADMIT_CONNECT_INTERVAL_MS},
+    [ADMIT_REQUEST] = {ADMIT_REQUEST_BURST, ADMIT_REQUEST_INTERVAL_MS},
+    [ADMIT_LOGIN] = {ADMIT_LOGIN_BURST, ADMIT_LOGIN_INTERVAL_MS},
+    [ADMIT_SEND] = {ADMIT_SEND_BURST, ADMIT_SEND_INTERVAL_MS},
+};
+
+static admission_shard_t shards[ADMISSION_SHARDS];
+static pthread_once_t shards_once = PTHREAD_ONCE_INIT;
+
+static atomic_bool admission_enabled = true;
+
+// Load generators drive every session from one address
+void admission_set_enabled(bool enabled) {
+  atomic_store(&admission_enabled, enabled);
+}
+
+// Milliseconds on a clock that never goes back; wraps every ~49 days, which
+// the signed comparisons below tolerate
+static uint32_t admission_clock(void) {
+  struct timespec now;
+#ifdef CLOCK_MONOTONIC_COARSE
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+#else
+  clock_gettime(CLOCK_MONOTONIC, &now);
+#endif
+  return (uint32_t)now.tv_sec * 1000u + (uint32_t)(now.tv_nsec / 1000000);
+}
+
+static void init_shards(void) {
+  for (int i = 0; i < ADMISSION_SHARDS; i++) {
+    pthread_mutex_init(&shards[i].mutex, NULL);
+  }
+}
+
+static uint32_t hash_address(uint32_t address) {
+  // Fibonacci hashing spreads sequential addresses across shards
+  return address * 2654435761u;
+}
+
+// Milliseconds until the entry's fullest-draining bucket refills, 0 if all
+// are full
+static uint32_t drain_remaining(const admission_entry_t *entry, uint32_t now) {
+  uint32_t remaining = 0;
+  for (int kind = 0; kind < ADMIT_KINDS; kind++) {
+    int32_t ahead = (int32_t)(entry->full_at[kind] - now);
+    if (ahead > (int32_t)remaining) {
+      remaining = (uint32_t)ahead;
+    }
+  }
+  return remaining;
+}
+
+static admission_entry_t *find_entry_locked(admission_shard_t *shard,
+                                            uint32_t hash, uint32_t address,
+                                            uint32_t now) {
+  admission_entry_t *reusable = NULL;
+  admission_entry_t *closest_to_full = NULL;
+  uint32_t closest_remaining = UINT32_MAX;
+
+  for (int probe = 0; probe < ADMISSION_PROBE; probe++) {
+    admission_entry_t *entry =
+        &shard->entries[(hash + probe) % ADMISSION_SHARD_ENTRIES];
+    uint32_t remaining = drain_remaining(entry, now);
+    if (entry->address == address) {
+      return entry;
+    }
+    if (remaining == 0) {
+      if (!reusable) {
+        reusable = entry;
+      }
+    } else if (remaining < closest_remaining) {
+      closest_remaining = remaining;
+      closest_to_full = entry;
+    }
+  }
+
+  admission_entry_t *entry = reusable ? reusable : closest_to_full;
+  entry->address = address;
+  for (int kind = 0; kind < ADMIT_KINDS; kind++) {
+    entry->full_at[kind] = now;
+  }
+  return entry;
+}
+
+// Take one token from the bucket that is full again at *full_at
+static bool take_token(uint32_t *full_at, admit_kind_t kind, uint32_t now) {
+  const admission_budget_t *budget = &budgets[kind];
+  uint32_t full = *full_at;
+  int32_t ahead = (int32_t)(full - now);
+  int32_t capacity = (int32_t)(budget->burst * budget->interval_ms);
+  if (ahead < 0 || ahead > capacity) {
+    // Full, or left over from before the clock wrapped
+    full = now;
+    ahead = 0;
+  }
+
+  bool admitted = ahead + (int32_t)budget->interval_ms <= capacity;
+  if (admitted) {
+    *full_at = full + budget->interval_ms;
+  }
+  return admitted;
+}
+
+// Take one token of kind for address (network byte order). false means the
+// caller should shed the work.
+bool admit(uint32_t address, admit_kind_t kind) {
+  if (!atomic_load_explicit(&admission_enabled, memory_order_relaxed)) {
+    return true;
+  }
+
+  pthread_once(&shards_once, init_shards);
+
+  uint32_t now = admission_clock();
+  uint32_t hash = hash_address(address);
+  admission_shard_t *shard = &shards[hash >> 28];
+
+  pthread_mutex_lock(&shard->mutex);
+  admission_entry_t *entry = find_entry_locked(shard, hash, address, now);
+  bool admitted = take_token(&entry->full_at[kind], kind, now);
+  pthread_mutex_unlock(&shard->mutex);
+
+  return admitted;
+}
+
+// Take one token of kind from the connection's own bucket; called by its
+// handler thread only. A new connection starts with full buckets
+// (admit_full_at zeroed by accept_client()).
+bool admit_connection(client_connection_t *client, admit_kind_t kind) {
+  if (!atomic_load_explicit(&admission_enabled, memory_order_relaxed)) {
+    return true;
+  }
+  return take_token(&client->admit_full_at[kind], kind, admission_clock());
+}
+
+// Budgets charged for one inbound frame of the given type
+bool admit_frame(client_connection_t *client, uint8_t type) {
+  switch (type) {
+  case MSG_FILE_CHUNK:
+    // A chunk only fills space its FILE_OFFER was already admitted for
+    if (client->authenticated) {
+      return true;
+    }
+    break;
+  case MSG_ACK_MESSAGES:
+  case MSG_PONG:
+    // Answers to work the server started; a client draining a backlog
+    // sends one per batch
+    return true;
+  default:
+    break;
+  }
+
+  if (!admit_connection(client, ADMIT_REQUEST)) {
+    return false;
+  }
+
+  switch (type) {
+  case MSG_REGISTER_USER:
+  case MSG_LOGIN_USER:
+    return admit(client->address.sin_addr.s_addr, ADMIT_LOGIN);
+  case MSG_SEND_MESSAGE:
+  case MSG_SEND_GROUP_MESSAGE:
+  case MSG_SEND_MULTI:
+  case MSG_FILE_OFFER:
+    return admit_connection(client, ADMIT_SEND);
+  default:
+    return true;
+  }
+}
\ No newline at end of file
@@ -0,0 +1,126 @@
+#include "../include/c-chat-server.h"
+#include <fcntl.h>
+#include <sys/stat.h>
+
+// Wire-traffic capture for offline replay (see tools/replay.c)
+//
+// File layout, all integers big-endian:
+//   header: [4 bytes: "CCAP"][2 bytes: version][2 bytes: reserved]
+//           [8 bytes: capture start, ns since the Unix epoch]
+//   record: [1 byte: kind][4 bytes: connection id]
+//           [8 bytes: ns since capture start][1 byte: message type]
+//           [4 bytes: payload length][N bytes: payload]
+//
+// CONNECT and DISCONNECT records carry type 0 and no payload.
+
+static FILE *capture_file = NULL;
+static pthread_mutex_t capture_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct timespec capture_start;
+
+static void put_u16(uint8_t *out, uint16_t value) {
+  out[0] = (value >> 8) & 0xFF;
+  out[1] = value & 0xFF;
+}
+
+static void put_u32(uint8_t *out, uint32_t value) {
+  out[0] = (value >> 24) & 0xFF;
+  out[1] = (value >> 16) & 0xFF;
+  out[2] = (value >> 8) & 0xFF;
+  out[3] = value & 0xFF;
+}
+
+static void put_u64(uint8_t *out, uint64_t value) {
+  put_u32(out, (uint32_t)(value >> 32));
+  put_u32(out + 4, (uint32_t)value);
+}
+
+int capture_open(const char *path) {
+  if (!path) {
+    return -1;
+  }
+
+  // Captures contain usernames, public keys and ciphertexts: owner-only
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+  if (fd < 0) {
+    log_error("Failed to open capture file %s: %s", path, strerror(errno));
+    return -1;
+  }
+
+  FILE *file = fdopen(fd, "wb");
+  if (!file) {
+    log_error("Failed to open capture stream: %s", strerror(errno));
+    close(fd);
+    return -1;
+  }
+  setvbuf(file, NULL, _IOFBF, CAPTURE_BUFFER_SIZE);
+
+  struct timespec wall;
+  clock_gettime(CLOCK_REALTIME, &wall);
+  clock_gettime(CLOCK_MONOTONIC, &capture_start);
+
+  uint8_t header[CAPTURE_HEADER_SIZE];
+  memcpy(header, CAPTURE_MAGIC, 4);
+  put_u16(&header[4], CAPTURE_VERSION);
+  put_u16(&header[6], 0);
+  put_u64(&header[8], (uint64_t)wall.tv_sec * 1000000000ULL +
+                          (uint64_t)wall.tv_nsec);
+
+  if (fwrite(header, 1, sizeof(header), file) != sizeof(header)) {
+    log_error("Failed to write capture header: %s", strerror(errno));
+    fclose(file);
+    return -1;
+  }
+
+  pthread_mutex_lock(&capture_mutex);
+  capture_file = file;
+  pthread_mutex_unlock(&capture_mutex);
+
+  log_info("Capturing inbound traffic to %s", path);
+  return 0;
+}
+
+void capture_close(void) {
+  pthread_mutex_lock(&capture_mutex);
+  if (capture_file) {
+    fclose(capture_file);
+    capture_file = NULL;
+    log_info("Traffic capture closed");
+  }
+  pthread_mutex_unlock(&capture_mutex);
+}
+
+bool capture_active(void) { return capture_file != NULL; }
+
+void capture_record(capture_kind_t kind, uint32_t connection_id, uint8_t type,
+                    const uint8_t *payload, uint32_t payload_len) {
+  if (!capture_file) {
+    return;
+  }
+
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  uint64_t offset_ns =
+      (uint64_t)(now.tv_sec - capture_start.tv_sec) * 1000000000ULL +
+      (uint64_t)(now.tv_nsec - capture_start.tv_nsec);
+
+  uint8_t record[CAPTURE_RECORD_HEADER_SIZE];
+  record[0] = (uint8_t)kind;
+  put_u32(&record[1], connection_id);
+  put_u64(&record[5], offset_ns);
+  record[13] = type;
+  put_u32(&record[14], payload ? payload_len : 0);
+
+  pthread_mutex_lock(&capture_mutex);
+  if (capture_file) {
+    // Timestamps are taken outside the lock, so records from concurrent
+    // connections may be written slightly out of order; replay sorts them
+    if (fwrite(record, 1, sizeof(record), capture_file) != sizeof(record) ||
+        (payload && payload_len > 0 &&
+         fwrite(payload, 1, payload_len, capture_file) != payload_len)) {
+      log_error("Failed to write capture record, disabling capture");
+      fclose(capture_file);
+      capture_file = NULL;
+    }
+  }
+  pthread_mutex_unlock(&capture_mutex);
+}
\ No newline at end of file
@@ -1,123 +1,285 @@
 #include "../include/c-chat-server.h"
 
-void *client_handler(void *arg) {
-  client_connection_t *client = (client_connection_t *)arg;
+// Drop a frame refused before dispatch. A capture still records it, so
+// that replay offers the server the same load that was refused here.
+static int refuse_frame(client_connection_t *client, network_message_t *msg,
+                        error_code_t error_code, const char *error_message) {
+  if (capture_active()) {
+    if (receive_message_payload(client->socket_fd, msg) < 0) {
+      return -1;
+    }
+    capture_record(CAPTURE_FRAME, client->connection_id, msg->type,
+                   msg->payload, msg->length);
+    free_network_message(msg);
+  } else if (discard_message_payload(client->socket_fd, msg) < 0) {
+    return -1;
+  }
+
+  send_error(client, error_code, error_message);
+  connection_timer_touch(client);
+  return 0;
+}
+
+// Receive one frame from the client and dispatch it. Returns 0 to keep
+// serving, -2 when the peer closed the connection and -1 on a fatal error.
+int serve_client_message(client_connection_t *client) {
   network_message_t msg;
+  memset(&msg, 0, sizeof(msg));
 
   char client_ip[INET_ADDRSTRLEN];
   inet_ntop(AF_INET, &client->address.sin_addr, client_ip, INET_ADDRSTRLEN);
 
-  log_info("Client handler started for %s:%d", client_ip,
-           ntohs(client->address.sin_port));
+  // Frames that arrive from here on wait on the server, not on this
+  // connection's previous request
+  client->ready_ns = overload_clock();
+  int result = receive_message_header(client->socket_fd, &msg);
+  if (result == -2) {
+    log_info("Client %s disconnected", client_ip);
+    return -2;
+  } else if (result < 0) {
+    log_error("Failed to receive message from client %s", client_ip);
+    return -1;
+  }
 
-  while (client->connected && server.running) {
-    memset(&msg, 0, sizeof(msg));
+  // Shed before the payload is allocated, but keep the connection
+  if (!admit_frame(client, msg.type)) {
+    log_error("Rate limit exceeded for client %s", client_ip);
+    return refuse_frame(client, &msg, ERR_RATE_LIMIT, "Rate limit exceeded");
+  }
 
-    int result = receive_network_message(client->socket_fd, &msg);
-    if (result == -2) {
-      log_info("Client %s disconnected", client_ip);
+  // Under overload, refuse optional work but keep the connection
+  if (overload_shed(msg.type, get_transport()->arrival_ns(client->socket_fd),
+                    client->ready_ns)) {
+    return refuse_frame(client, &msg, ERR_RATE_LIMIT,
+                        "Server busy, retry later");
+  }
+
+  if (receive_message_payload(client->socket_fd, &msg) < 0) {
+    log_error("Failed to receive message from client %s", client_ip);
+    return -1;
+  }
+
+  capture_record(CAPTURE_FRAME, client->connection_id, msg.type, msg.payload,
+                 msg.length);
+  connection_timer_touch(client);
+
+  switch (msg.type) {
+  case MSG_REGISTER_USER:
+    if (handle_register_user(client, msg.payload, msg.length) < 0) {
+      log_error("Failed to handle register user from %s", client_ip);
+    }
+    break;
+
+  case MSG_LOGIN_USER:
+    if (handle_login_user(client, msg.payload, msg.length) < 0) {
+      log_error("Failed to handle login user from %s", client_ip);
+    }
+    break;
+
+  case MSG_GET_PUBLIC_KEY:
+    if (!client->authenticated) {
+      send_error(client, ERR_AUTH_FAILED, "Not authenticated");
       break;
-    } else if (result < 0) {
-      log_error("Failed to receive message from client %s", client_ip);
+    }
+    if (handle_get_public_key(client, msg.payload, msg.length) < 0) {
+      log_error("Failed to handle get public key from %s", client_ip);
+    }
+    break;
+
+  case MSG_GET_PUBLIC_KEYS:
+    if (!client->authenticated) {
+      send_error(client, ERR_AUTH_FAILED, "Not authenticated");
       break;
     }
+    if (handle_get_public_keys(client, msg.payload, msg.length) < 0) {
+      log_error("Failed to handle get public keys from %s", client_ip);
+    }
+    break;
 
-    if (!check_rate_limit(client)) {
-      log_error("Rate limit exceeded for client %s", client_ip);
-      send_error(client->socket_fd, ERR_RATE_LIMIT, "Rate limit exceeded");
-      free_network_message(&msg);
+  case MSG_SEND_MESSAGE:
+    if (!client->authenticated) {
+      send_error(client, ERR_AUTH_FAILED, "Not authenticated");
       break;
     }
+    if (handle_send_message(client, msg.payload, msg.length) < 0) {
+      log_error("Failed to handle send message from %s", client_ip);
+    }
+    break;
 
-    update_rate_limit(client);
+  case MSG_GET_MESSAGES:
+    if (!client->authenticated) {
+      send_error(client, ERR_AUTH_FAILED, "Not authenticated");
+      break;
+    }
+    if (handle_get_messages(client, msg.payload, msg.length) < 0) {
+      log_error("Failed to handle get messages from %s", client_ip);
+    }
+    break;
 
-    switch (msg.type) {
-    case MSG_REGISTER_USER:
-      if (handle_register_user(client, msg.payload, msg.length) < 0) {
-        log_error("Failed to handle register user from %s", client_ip);
-      }
+  case MSG_SET_STATUS:
+    if (!client->authenticated) {
+      send_error(client, ERR_AUTH_FAILED, "Not authenticated");
       break;
+    }
+    if (handle_set_status(client, msg.payload, msg.length) < 0) {
+      log_error("Failed to handle set status from %s", client_ip);
+    }
+    break;
 
-    case MSG_LOGIN_USER:
-      if (handle_login_user(client, msg.payload, msg.length) < 0) {
-        log_error("Failed to handle login user from %s", client_ip);
-      }
+  case MSG_LIST_USERS:
+    if (!client->authenticated) {
+      send_error(client, ERR_AUTH_FAILED, "Not authenticated");
       break;
+    }
+    if (handle_list_users(client, msg.payload, msg.length) < 0) {
+      log_error("Failed to handle list users from %s", client_ip);
+    }
+    break;
 
-    case MSG_GET_PUBLIC_KEY:
-      if (!client->authenticated) {
-        send_error(client->socket_fd, ERR_AUTH_FAILED, "Not authenticated");
-        break;
-      }
-      if (handle_get_public_key(client, msg.payload, msg.length) < 0) {
-        log_error("Failed to handle get public key from %s", client_ip);
-      }
+  case MSG_SEARCH_USERS:
+    if (!client->authenticated) {
+      send_error(client, ERR_AUTH_FAILED, "Not authenticated");
       break;
+    }
+    if (handle_search_users(client, msg.payload, msg.length) < 0) {
+      log_error("Failed to handle search users from %s", client_ip);
+    }
+    break;
 
-    case MSG_SEND_MESSAGE:
-      if (!client->authenticated) {
-        send_error(client->socket_fd, ERR_AUTH_FAILED, "Not authenticated");
-        break;
-      }
-      if (handle_send_message(client, msg.payload, msg.length) < 0) {
-        log_error("Failed to handle send message from %s", client_ip);
-      }
+  case MSG_SYNC_MESSAGES:
+    if (!client->authenticated) {
+      send_error(client, ERR_AUTH_FAILED, "Not authenticated");
       break;
+    }
+    if (handle_sync_messages(client, msg.payload, msg.length) < 0) {
+      log_error("Failed to handle sync messages from %s", client_ip);
+    }
+    break;
 
-    case MSG_GET_MESSAGES:
-      if (!client->authenticated) {
-        send_error(client->socket_fd, ERR_AUTH_FAILED, "Not authenticated");
-        break;
-      }
-      if (handle_get_messages(client, msg.payload, msg.length) < 0) {
-        log_error("Failed to handle get messages from %s", client_ip);
-      }
+  case MSG_ACK_MESSAGES:
+    if (!client->authenticated) {
+      send_error(client, ERR_AUTH_FAILED, "Not authenticated");
       break;
+    }
+    if (handle_ack_messages(client, msg.payload, msg.length) < 0) {
+      log_error("Failed to handle ack messages from %s", client_ip);
+    }
+    break;
 
-    case MSG_SET_STATUS:
-      if (!client->authenticated) {
-        send_error(client->socket_fd, ERR_AUTH_FAILED, "Not authenticated");
-        break;
-      }
-      if (handle_set_status(client, msg.payload, msg.length) < 0) {
-        log_error("Failed to handle set status from %s", client_ip);
-      }
+  case MSG_CREATE_GROUP:
+    if (!client->authenticated) {
+      send_error(client, ERR_AUTH_FAILED, "Not authenticated");
       break;
+    }
+    if (handle_create_group(client, msg.payload, msg.length) < 0) {
+      log_error("Failed to handle create group from %s", client_ip);
+    }
+    break;
 
-    case MSG_LIST_USERS:
-      if (!client->authenticated) {
-        send_error(client->socket_fd, ERR_AUTH_FAILED, "Not authenticated");
-        break;
-      }
-      if (handle_list_users(client, msg.payload, msg.length) < 0) {
-        log_error("Failed to handle list users from %s", client_ip);
-      }
+  case MSG_UPDATE_GROUP:
+    if (!client->authenticated) {
+      send_error(client, ERR_AUTH_FAILED, "Not authenticated");
       break;
+    }
+    if (handle_update_group(client, msg.payload, msg.length) < 0) {
+      log_error("Failed to handle update group from %s", client_ip);
+    }
+    break;
 
-    case MSG_LOGOUT:
-      if (handle_logout(client, msg.payload, msg.length) < 0) {
-        log_error("Failed to handle logout from %s", client_ip);
-      }
+  case MSG_GET_GROUP:
+    if (!client->authenticated) {
+      send_error(client, ERR_AUTH_FAILED, "Not authenticated");
       break;
+    }
+    if (handle_get_group(client, msg.payload, msg.length) < 0) {
+      log_error("Failed to handle get group from %s", client_ip);
+    }
+    break;
+
+  case MSG_SEND_GROUP_MESSAGE:
+    if (!client->authenticated) {
+      send_error(client, ERR_AUTH_FAILED, "Not authenticated");
+      break;
+    }
+    if (handle_send_group_message(client, msg.payload, msg.length) < 0) {
+      log_error("Failed to handle send group message from %s", client_ip);
+    }
+    break;
 
-    default:
-      log_error("Unknown message type 0x%02X from client %s", msg.type,
-                client_ip);
-      send_error(client->socket_fd, ERR_INVALID_FORMAT, "Unknown message type");
+  case MSG_SEND_MULTI:
+    if (!client->authenticated) {
+      send_error(client, ERR_AUTH_FAILED, "Not authenticated");
       break;
     }
+    if (handle_send_multi(client, msg.payload, msg.length) < 0) {
+      log_error("Failed to handle multi-send from %s", client_ip);
+    }
+    break;
+
+  case MSG_FILE_OFFER:
+    if (!client->authenticated) {
+      send_error(client, ERR_AUTH_FAILED, "Not authenticated");
+      break;
+    }
+    if (handle_file_offer(client, msg.payload, msg.length) < 0) {
+      log_error("Failed to handle file offer from %s", client_ip);
+    }
+    break;
 
-    free_network_message(&msg);
+  case MSG_FILE_CHUNK:
+    if (!client->authenticated) {
+      send_error(client, ERR_AUTH_FAILED, "Not authenticated");
+      break;
+    }
+    if (handle_file_chunk(client, msg.payload, msg.length) < 0) {
+      log_error("Failed to handle file chunk from %s", client_ip);
+    }
+    break;
+
+  case MSG_FILE_FETCH:
+    if (!client->authenticated) {
+      send_error(client, ERR_AUTH_FAILED, "Not authenticated");
+      break;
+    }
+    if (handle_file_fetch(client, msg.payload, msg.length) < 0) {
+      log_error("Failed to handle file fetch from %s", client_ip);
+    }
+    break;
+
+  case MSG_PONG:
+    // Answer to a keepalive PING; receiving it was the point
+    break;
+
+  case MSG_LOGOUT:
+    if (handle_logout(client, msg.payload, msg.length) < 0) {
+      log_error("Failed to handle logout from %s", client_ip);
+    }
+    break;
+
+  default:
+    log_error("Unknown message type 0x%02X from client %s", msg.type,
+              client_ip);
+    send_error(client, ERR_INVALID_FORMAT, "Unknown message type");
+    break;
   }
 
+  free_network_message(&msg);
+  return 0;
+}
+
+void disconnect_client(client_connection_t *client) {
+  connection_timer_stop(client);
+
   pthread_mutex_lock(&client->mutex);
 
+  user_record_t *user = NULL;
   if (client->authenticated && strlen(client->username) > 0) {
-    user_record_t *user = find_user(client->username);
+    user = find_user(client->username);
     if (user) {
       pthread_mutex_lock(&user->mutex);
       user->status = STATUS_OFFLINE;
       user->last_seen = time(NULL);
+      touch_user_record(user);
       pthread_mutex_unlock(&user->mutex);
 
       broadcast_status_update(client->username, STATUS_OFFLINE);
@@ -126,7 +288,8 @@ void *client_handler(void *arg) {
   }
 
   if (client->socket_fd >= 0) {
-    close(client->socket_fd);
+    outbound_close(client, user);
+    get_transport()->close(client->socket_fd);
     client->socket_fd = -1;
   }
 
@@ -134,20 +297,35 @@ void *client_handler(void *arg) {
   client->authenticated = false;
   memset(client->username, 0, sizeof(client->username));
 
-  pthread_mutex_lock(&client->queue_mutex);
-  for (int i = 0; i < client->queue_count; i++) {
-    if (client->message_queue[i].encrypted_data) {
-      sodium_memzero(client->message_queue[i].encrypted_data,
-                     client->message_queue[i].encrypted_len);
-      free(client->message_queue[i].encrypted_data);
+  // Stored messages stay in the user's inbox for the next connection
+
+  pthread_mutex_unlock(&client->mutex);
+
+  // Only now may accept_client() hand the slot to a new connection
+  pthread_mutex_lock(&server.clients_mutex);
+  client->in_use = false;
+  pthread_mutex_unlock(&server.clients_mutex);
+}
+
+void *client_handler(void *arg) {
+  client_connection_t *client = (client_connection_t *)arg;
+
+  char client_ip[INET_ADDRSTRLEN];
+  inet_ntop(AF_INET, &client->address.sin_addr, client_ip, INET_ADDRSTRLEN);
+
+  log_info("Client handler started for %s:%d", client_ip,
+           ntohs(client->address.sin_port));
+
+  capture_record(CAPTURE_CONNECT, client->connection_id, 0, NULL, 0);
+
+  while (client->connected && server.running) {
+    if (serve_client_message(client) < 0) {
+      break;
     }
   }
-  client->queue_count = 0;
-  client->queue_head = 0;
-  client->queue_tail = 0;
-  pthread_mutex_unlock(&client->queue_mutex);
 
-  pthread_mutex_unlock(&client->mutex);
+  capture_record(CAPTURE_DISCONNECT, client->connection_id, 0, NULL, 0);
+  disconnect_client(client);
 
   log_info("Client handler terminated for %s:%d", client_ip,
            ntohs(client->address.sin_port));
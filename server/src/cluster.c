@@ -0,0 +1,1198 @@
+#include "../include/c-chat-server.h"
+#include <netinet/tcp.h>
+
+// Cluster mode
+//
+// Several servers can share one user base. Every username belongs to one
+// node, chosen by consistent hashing: each node puts CLUSTER_VNODES points
+// on a 64-bit ring, hashed from its client address, and a name belongs to
+// the first point at or after its own hash. The owner is the only node that
+// registers the name and the only one its user may log in to; the others
+// answer with ERR_WRONG_NODE and the owner's address. So a name is unique
+// across the cluster without any coordination, and the user's inbox,
+// sessions, groups and file transfers all live on one node.
+//
+// Every node keeps a copy of the whole directory, so public keys, listings
+// and searches are answered locally. The owner propagates what it decides:
+// a registration or a status change becomes a record on the link to every
+// other node, and a SEND_MESSAGE for a user owned elsewhere becomes a record
+// on the link to its owner, which stores it in the user's inbox. Link
+// readers never write to clients: pushes to an online recipient and the
+// presence updates shown to local clients are left to a delivery thread, so
+// a slow client cannot stall a link or its ACKs.
+//
+// A link carries one node's records to one peer over a persistent TCP
+// connection. The sending node keeps records queued, up to
+// CLUSTER_QUEUE_MAX_BYTES, until the peer acknowledges them, and sends
+// them in batches: while one batch waits for its ACK, new records gather
+// for the next, so a busy link sends few large frames. Records are numbered
+// per sender run (an incarnation), and the receiver remembers the last one
+// it applied, so after a reconnect the sender skips what already arrived
+// and resends the rest.
+//
+// Each (re)connect starts with a SYNC of every user the sender knows, ahead
+// of anything queued. It brings a peer that started late, or missed records
+// while the queue was full, up to date, and gives a restarted owner back the
+// registrations it lost before any message for those users arrives. Status
+// is taken only from a user's owner. When a peer's link drops, its users are
+// shown offline until it returns.
+//
+// Membership is fixed at startup and every node must be given the same
+// list (checked when a link opens). Links are not authenticated: the
+// cluster port belongs on a private network.
+
+// Link frames, [4 bytes: length][1 byte: type][payload] like the client
+// protocol but on the cluster port
+#define LINK_HELLO 0x01     // [1 node][8 incarnation][8 membership hash]
+#define LINK_HELLO_ACK 0x02 // [8 last applied seq]
+#define LINK_BATCH 0x03     // [8 first seq][2 count][records]
+#define LINK_ACK 0x04       // [8 last applied seq]
+#define LINK_SYNC 0x05      // [2 count][records], not numbered
+
+// Batch records: [1 byte: kind][2 bytes: length][body]
+#define RECORD_USER 1     // [1 len][name][public key][1 status]
+#define RECORD_PRESENCE 2 // [1 len][name][1 status]
+#define RECORD_MESSAGE 3  // [4 id][1 len][sender][1 len][recipient]
+                          // [2 len][ciphertext]
+
+#define RECORD_HEADER_SIZE 3
+#define LINK_HELLO_SIZE 17
+#define LINK_FRAME_MAX_BYTES (10 + CLUSTER_BATCH_MAX_BYTES)
+
+typedef struct cluster_record {
+  struct cluster_record *next;
+  uint64_t seq;
+  uint32_t len;
+  uint8_t data[]; // header and body
+} cluster_record_t;
+
+typedef struct {
+  char address[INET_ADDRSTRLEN + 6]; // host:client_port, for redirects
+  struct sockaddr_in cluster_address;
+  uint16_t client_port;
+
+  // Outbound link (not used for the local node)
+  pthread_t thread;
+  bool thread_started;
+  pthread_mutex_t mutex;
+  pthread_cond_t wake;
+  cluster_record_t *head, *tail; // unacknowledged, oldest first
+  size_t queued_bytes;
+  uint64_t next_seq;
+  int fd; // -1 while disconnected
+
+  // Inbound link from this node
+  pthread_mutex_t inbound_mutex;
+  uint64_t inbound_incarnation;
+  uint64_t applied_seq;
+  int inbound_fd; // current connection, -1 if none
+} cluster_node_t;
+
+typedef struct {
+  uint64_t hash;
+  int node;
+} ring_point_t;
+
+static cluster_node_t nodes[CLUSTER_MAX_NODES];
+static int node_count;
+static int self_node;
+static bool enabled;
+static uint64_t membership_hash;
+static uint64_t incarnation;
+
+static ring_point_t ring[CLUSTER_MAX_NODES * CLUSTER_VNODES];
+static int ring_size;
+
+static atomic_bool running;
+static int listen_fd = -1;
+static pthread_t listener_thread;
+static bool listener_started;
+
+// Inbound link threads still running; cluster_stop() waits for them
+static int readers;
+static pthread_mutex_t readers_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t readers_done = PTHREAD_COND_INITIALIZER;
+
+// What link readers leave to the delivery thread, so that a slow client
+// never holds up a link: pushing stored messages to a user's connection, or
+// telling local clients of a user's new status
+typedef struct delivery_job {
+  struct delivery_job *next;
+  user_record_t *user;
+  bool presence;
+  user_status_t status;
+} delivery_job_t;
+
+static pthread_t delivery_thread;
+static bool delivery_started;
+static pthread_mutex_t delivery_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t delivery_wake = PTHREAD_COND_INITIALIZER;
+static delivery_job_t *delivery_head, *delivery_tail;
+
+// FNV-1a with a final mix, so nearby names and vnode keys spread over the
+// whole ring; every node must compute the same value
+static uint64_t hash_bytes(const void *data, size_t len) {
+  const uint8_t *bytes = data;
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= bytes[i];
+    hash *= 1099511628211ULL;
+  }
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+static int compare_points(const void *a, const void *b) {
+  const ring_point_t *left = a, *right = b;
+  if (left->hash != right->hash) {
+    return left->hash < right->hash ? -1 : 1;
+  }
+  return left->node - right->node;
+}
+
+static void put_u16(uint8_t *out, uint16_t value) {
+  out[0] = (uint8_t)(value >> 8);
+  out[1] = (uint8_t)value;
+}
+
+static uint16_t get_u16(const uint8_t *in) {
+  return (uint16_t)((in[0] << 8) | in[1]);
+}
+
+static void put_u32(uint8_t *out, uint32_t value) {
+  out[0] = (value >> 24) & 0xFF;
+  out[1] = (value >> 16) & 0xFF;
+  out[2] = (value >> 8) & 0xFF;
+  out[3] = value & 0xFF;
+}
+
+static uint32_t get_u32(const uint8_t *in) {
+  return ((uint32_t)in[0] << 24) | ((uint32_t)in[1] << 16) |
+         ((uint32_t)in[2] << 8) | in[3];
+}
+
+static void put_u64(uint8_t *out, uint64_t value) {
+  put_u32(out, (uint32_t)(value >> 32));
+  put_u32(out + 4, (uint32_t)value);
+}
+
+static uint64_t get_u64(const uint8_t *in) {
+  return ((uint64_t)get_u32(in) << 32) | get_u32(in + 4);
+}
+
+// list is "host:client_port:cluster_port,..." in the same order on every
+// node; self is this node's position in it
+int cluster_configure(const char *list, int self) {
+  char copy[CLUSTER_MAX_NODES * 64];
+  if (!list || strlen(list) >= sizeof(copy)) {
+    return -1;
+  }
+  strcpy(copy, list);
+
+  node_count = 0;
+  membership_hash = 0;
+  char *save = NULL;
+  for (char *entry = strtok_r(copy, ",", &save); entry;
+       entry = strtok_r(NULL, ",", &save)) {
+    if (node_count == CLUSTER_MAX_NODES) {
+      return -1;
+    }
+
+    char host[INET_ADDRSTRLEN];
+    unsigned client_port, cluster_port;
+    char extra;
+    if (sscanf(entry, "%15[0-9.]:%u:%u%c", host, &client_port, &cluster_port,
+               &extra) != 3 ||
+        client_port == 0 || client_port > 65535 || cluster_port == 0 ||
+        cluster_port > 65535) {
+      return -1;
+    }
+
+    membership_hash = hash_bytes(entry, strlen(entry)) ^ (membership_hash * 31);
+
+    cluster_node_t *node = &nodes[node_count];
+    memset(&node->cluster_address, 0, sizeof(node->cluster_address));
+    node->cluster_address.sin_family = AF_INET;
+    node->cluster_address.sin_port = htons((uint16_t)cluster_port);
+    if (inet_pton(AF_INET, host, &node->cluster_address.sin_addr) != 1) {
+      return -1;
+    }
+    node->client_port = (uint16_t)client_port;
+    snprintf(node->address, sizeof(node->address), "%s:%u", host,
+             client_port);
+    node_count++;
+  }
+
+  if (node_count == 0 || self < 0 || self >= node_count) {
+    return -1;
+  }
+  self_node = self;
+
+  // A node's points depend only on its own address, so adding or removing
+  // one node moves only the names next to its points
+  ring_size = 0;
+  for (int i = 0; i < node_count; i++) {
+    char key[sizeof(nodes[i].address) + 8];
+    for (int vnode = 0; vnode < CLUSTER_VNODES; vnode++) {
+      int len = snprintf(key, sizeof(key), "%s#%d", nodes[i].address, vnode);
+      ring[ring_size].hash = hash_bytes(key, (size_t)len);
+      ring[ring_size].node = i;
+      ring_size++;
+    }
+  }
+  qsort(ring, (size_t)ring_size, sizeof(ring[0]), compare_points);
+
+  enabled = true;
+  return 0;
+}
+
+bool cluster_enabled(void) { return enabled; }
+
+// Node that owns username; 0 outside cluster mode
+int cluster_owner(const char *username) {
+  if (!enabled) {
+    return 0;
+  }
+
+  uint64_t hash = hash_bytes(username, strlen(username));
+  int low = 0, high = ring_size;
+  while (low < high) {
+    int mid = low + (high - low) / 2;
+    if (ring[mid].hash < hash) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  return ring[low == ring_size ? 0 : low].node;
+}
+
+bool cluster_owns(const char *username) {
+  return !enabled || cluster_owner(username) == self_node;
+}
+
+bool cluster_is_local(const user_record_t *user) {
+  return !enabled || user->node == self_node;
+}
+
+// host:port clients should connect to for username
+const char *cluster_owner_address(const char *username) {
+  return nodes[cluster_owner(username)].address;
+}
+
+uint16_t cluster_client_port(void) {
+  return enabled ? nodes[self_node].client_port : SERVER_PORT;
+}
+
+// ---------------------------------------------------------------------------
+// Link I/O
+// ---------------------------------------------------------------------------
+
+// owner, if not NULL, holds payload (see transport_ops_t.send_frame)
+static int link_send(int fd, uint8_t type, const uint8_t *payload,
+                     uint32_t payload_len, frame_buffer_t *owner) {
+  uint8_t header[MESSAGE_HEADER_SIZE];
+  encode_message_header(header, (message_type_t)type, payload_len);
+  return socket_transport.send_frame(fd, header, sizeof(header), payload,
+                                     payload_len, owner);
+}
+
+// Read one frame of at most max_len payload bytes into a new buffer
+static int link_receive(int fd, uint8_t *type, uint8_t **payload,
+                        uint32_t *payload_len, uint32_t max_len) {
+  uint8_t header[MESSAGE_HEADER_SIZE];
+  if (socket_transport.recv_exact(fd, header, sizeof(header)) !=
+      (ssize_t)sizeof(header)) {
+    return -1;
+  }
+
+  uint32_t len = get_u32(header);
+  if (len > max_len) {
+    log_error("Cluster link frame of %u bytes exceeds limit", len);
+    return -1;
+  }
+
+  uint8_t *data = malloc(len > 0 ? len : 1);
+  if (!data) {
+    return -1;
+  }
+  if (len > 0 && socket_transport.recv_exact(fd, data, len) != (ssize_t)len) {
+    free(data);
+    return -1;
+  }
+
+  *type = header[4];
+  *payload = data;
+  *payload_len = len;
+  return 0;
+}
+
+static void configure_link_socket(int fd) {
+  int enable = 1;
+  setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, &enable, sizeof(enable));
+  // Batches are written whole and answered at once
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+
+  // Also bounds connect(), the HELLO and the wait for each ACK
+  struct timeval timeout = {CLUSTER_ACK_TIMEOUT_SEC, 0};
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+#ifdef SO_ZEROCOPY
+  // Full batches are large enough to send without copying (see transport.c)
+  if (transport_zerocopy_threshold() > 0) {
+    setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &enable, sizeof(enable));
+  }
+#endif
+}
+
+// ---------------------------------------------------------------------------
+// Sending records
+// ---------------------------------------------------------------------------
+
+// Queue one record for node; fails while the queue is over its budget
+static int enqueue_record(cluster_node_t *node, uint8_t kind,
+                          const uint8_t *body, uint16_t body_len) {
+  cluster_record_t *record =
+      malloc(sizeof(*record) + RECORD_HEADER_SIZE + body_len);
+  if (!record) {
+    return -1;
+  }
+  record->next = NULL;
+  record->len = RECORD_HEADER_SIZE + body_len;
+  record->data[0] = kind;
+  put_u16(&record->data[1], body_len);
+  memcpy(&record->data[RECORD_HEADER_SIZE], body, body_len);
+
+  pthread_mutex_lock(&node->mutex);
+  if (node->queued_bytes + record->len > CLUSTER_QUEUE_MAX_BYTES) {
+    pthread_mutex_unlock(&node->mutex);
+    free(record);
+    log_error("Cluster link to %s is full, dropping record", node->address);
+    return -1;
+  }
+
+  record->seq = node->next_seq++;
+  if (node->tail) {
+    node->tail->next = record;
+  } else {
+    node->head = record;
+  }
+  node->tail = record;
+  node->queued_bytes += record->len;
+  pthread_cond_signal(&node->wake);
+  pthread_mutex_unlock(&node->mutex);
+  return 0;
+}
+
+static void broadcast_record(uint8_t kind, const uint8_t *body,
+                             uint16_t body_len) {
+  for (int i = 0; i < node_count; i++) {
+    if (i != self_node) {
+      enqueue_record(&nodes[i], kind, body, body_len);
+    }
+  }
+}
+
+static uint16_t encode_user(uint8_t *body, const char *username,
+                            const unsigned char *public_key,
+                            user_status_t status) {
+  size_t name_len = strlen(username);
+  body[0] = (uint8_t)name_len;
+  memcpy(&body[1], username, name_len);
+  memcpy(&body[1 + name_len], public_key, PUBLIC_KEY_SIZE);
+  body[1 + name_len + PUBLIC_KEY_SIZE] = (uint8_t)status;
+  return (uint16_t)(2 + name_len + PUBLIC_KEY_SIZE);
+}
+
+// A user this node just registered
+void cluster_announce_user(user_record_t *user) {
+  if (!enabled || !user) {
+    return;
+  }
+
+  uint8_t body[2 + MAX_USERNAME_LEN + PUBLIC_KEY_SIZE];
+  pthread_mutex_lock(&user->mutex);
+  uint16_t body_len =
+      encode_user(body, user->username, user->public_key, user->status);
+  pthread_mutex_unlock(&user->mutex);
+  broadcast_record(RECORD_USER, body, body_len);
+}
+
+// A status change of a user this node owns
+void cluster_announce_status(const char *username, user_status_t status) {
+  if (!enabled || !cluster_owns(username)) {
+    return;
+  }
+
+  uint8_t body[2 + MAX_USERNAME_LEN];
+  size_t name_len = strlen(username);
+  body[0] = (uint8_t)name_len;
+  memcpy(&body[1], username, name_len);
+  body[1 + name_len] = (uint8_t)status;
+  broadcast_record(RECORD_PRESENCE, body, (uint16_t)(2 + name_len));
+}
+
+// Hand a message for a user owned by another node to that node's link
+int cluster_forward_message(const char *sender, const user_record_t *recipient,
+                            uint32_t message_id,
+                            const unsigned char *encrypted_message,
+                            uint16_t message_len) {
+  if (!enabled || recipient->node == self_node ||
+      recipient->node >= node_count) {
+    return -1;
+  }
+
+  size_t sender_len = strlen(sender);
+  size_t recipient_len = strlen(recipient->username);
+  size_t body_len = 4 + 1 + sender_len + 1 + recipient_len + 2 + message_len;
+  uint8_t *body = malloc(body_len);
+  if (!body) {
+    return -1;
+  }
+
+  uint8_t *out = body;
+  put_u32(out, message_id);
+  out += 4;
+  *out++ = (uint8_t)sender_len;
+  memcpy(out, sender, sender_len);
+  out += sender_len;
+  *out++ = (uint8_t)recipient_len;
+  memcpy(out, recipient->username, recipient_len);
+  out += recipient_len;
+  put_u16(out, message_len);
+  memcpy(out + 2, encrypted_message, message_len);
+
+  int result = enqueue_record(&nodes[recipient->node], RECORD_MESSAGE, body,
+                              (uint16_t)body_len);
+  sodium_memzero(body, body_len);
+  free(body);
+  return result;
+}
+
+// Free records the peer has applied; caller holds node->mutex
+static void trim_acknowledged_locked(cluster_node_t *node, uint64_t seq) {
+  while (node->head && node->head->seq <= seq) {
+    cluster_record_t *record = node->head;
+    node->head = record->next;
+    node->queued_bytes -= record->len;
+    sodium_memzero(record->data, record->len);
+    free(record);
+  }
+  if (!node->head) {
+    node->tail = NULL;
+  }
+}
+
+static int read_ack(int fd, uint8_t expected, uint64_t *seq) {
+  uint8_t type;
+  uint8_t *payload;
+  uint32_t payload_len;
+  if (link_receive(fd, &type, &payload, &payload_len, 8) < 0) {
+    return -1;
+  }
+  int result = -1;
+  if (type == expected && payload_len == 8) {
+    *seq = get_u64(payload);
+    result = 0;
+  }
+  free(payload);
+  return result;
+}
+
+// Send every registered user, with the status this node has for it, as
+// USER records in one SYNC frame. A status change after the snapshot is
+// queued behind it and so arrives after it.
+static int send_sync(cluster_node_t *node, int fd, uint8_t *frame) {
+  pthread_mutex_lock(&server.users_mutex);
+  int user_count = server.user_count;
+  pthread_mutex_unlock(&server.users_mutex);
+
+  size_t len = 2;
+  uint16_t count = 0;
+  for (int i = 0; i < user_count; i++) {
+    user_record_t *user = &server.users[i];
+    if (len + RECORD_HEADER_SIZE + 2 + MAX_USERNAME_LEN + PUBLIC_KEY_SIZE >
+        LINK_FRAME_MAX_BYTES) {
+      log_error("Cluster sync to %s truncated at %d users", node->address, i);
+      break;
+    }
+
+    pthread_mutex_lock(&user->mutex);
+    uint16_t body_len = encode_user(&frame[len + RECORD_HEADER_SIZE],
+                                    user->username, user->public_key,
+                                    user->status);
+    pthread_mutex_unlock(&user->mutex);
+    frame[len] = RECORD_USER;
+    put_u16(&frame[len + 1], body_len);
+    len += RECORD_HEADER_SIZE + body_len;
+    count++;
+  }
+  put_u16(frame, count);
+
+  uint64_t acked;
+  if (link_send(fd, LINK_SYNC, frame, (uint32_t)len, NULL) < 0 ||
+      read_ack(fd, LINK_ACK, &acked) < 0) {
+    return -1;
+  }
+  log_debug("Sent %u users to cluster node %s", count, node->address);
+  return 0;
+}
+
+// Send batches until the connection fails or the cluster stops
+static void run_link(cluster_node_t *node, int fd) {
+  uint8_t hello[LINK_HELLO_SIZE];
+  hello[0] = (uint8_t)self_node;
+  put_u64(&hello[1], incarnation);
+  put_u64(&hello[9], membership_hash);
+
+  uint64_t applied;
+  if (link_send(fd, LINK_HELLO, hello, sizeof(hello), NULL) < 0 ||
+      read_ack(fd, LINK_HELLO_ACK, &applied) < 0) {
+    return;
+  }
+
+  pthread_mutex_lock(&node->mutex);
+  trim_acknowledged_locked(node, applied);
+  pthread_mutex_unlock(&node->mutex);
+
+  uint8_t *frame = malloc(LINK_FRAME_MAX_BYTES);
+  if (!frame) {
+    return;
+  }
+  int synced = send_sync(node, fd, frame);
+  sodium_memzero(frame, LINK_FRAME_MAX_BYTES);
+  free(frame);
+  if (synced < 0) {
+    return;
+  }
+  log_info("Cluster link to %s up", node->address);
+
+  for (;;) {
+    pthread_mutex_lock(&node->mutex);
+    while (!node->head && atomic_load(&running)) {
+      pthread_cond_wait(&node->wake, &node->mutex);
+    }
+    if (!atomic_load(&running)) {
+      pthread_mutex_unlock(&node->mutex);
+      break;
+    }
+
+    // A fresh buffer per batch: a zerocopy send of the last one may still
+    // hold it (see transport.c)
+    frame_buffer_t *buffer = frame_buffer_create(NULL, LINK_FRAME_MAX_BYTES);
+    if (!buffer) {
+      pthread_mutex_unlock(&node->mutex);
+      break;
+    }
+    uint8_t *batch = buffer->data;
+
+    // Everything queued is unacknowledged, and nothing is in flight
+    uint64_t first_seq = node->head->seq;
+    uint16_t count = 0;
+    size_t len = 10;
+    for (cluster_record_t *record = node->head;
+         record && count < UINT16_MAX &&
+         len + record->len <= LINK_FRAME_MAX_BYTES;
+         record = record->next) {
+      memcpy(batch + len, record->data, record->len);
+      len += record->len;
+      count++;
+    }
+    pthread_mutex_unlock(&node->mutex);
+
+    put_u64(batch, first_seq);
+    put_u16(batch + 8, count);
+
+    uint64_t acked;
+    int sent = link_send(fd, LINK_BATCH, batch, (uint32_t)len, buffer);
+    frame_buffer_release(buffer);
+    if (sent < 0 || read_ack(fd, LINK_ACK, &acked) < 0) {
+      break;
+    }
+
+    pthread_mutex_lock(&node->mutex);
+    trim_acknowledged_locked(node, acked);
+    pthread_mutex_unlock(&node->mutex);
+  }
+}
+
+static void *link_sender(void *arg) {
+  cluster_node_t *node = arg;
+
+  while (atomic_load(&running)) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd >= 0) {
+      configure_link_socket(fd);
+      pthread_mutex_lock(&node->mutex);
+      node->fd = fd; // for cluster_stop()
+      pthread_mutex_unlock(&node->mutex);
+      if (connect(fd, (struct sockaddr *)&node->cluster_address,
+                  sizeof(node->cluster_address)) == 0) {
+        run_link(node, fd);
+        log_info("Cluster link to %s down", node->address);
+      }
+
+      pthread_mutex_lock(&node->mutex);
+      node->fd = -1;
+      pthread_mutex_unlock(&node->mutex);
+      socket_transport.close(fd);
+    }
+
+    // Retry, keeping queued records, until the peer is back
+    pthread_mutex_lock(&node->mutex);
+    if (atomic_load(&running)) {
+      struct timespec deadline;
+      clock_gettime(CLOCK_MONOTONIC, &deadline);
+      deadline.tv_sec += CLUSTER_RETRY_MS / 1000;
+      deadline.tv_nsec += (long)(CLUSTER_RETRY_MS % 1000) * 1000000;
+      if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+      }
+      pthread_cond_timedwait(&node->wake, &node->mutex, &deadline);
+    }
+    pthread_mutex_unlock(&node->mutex);
+  }
+
+  return NULL;
+}
+
+// ---------------------------------------------------------------------------
+// Delivery
+// ---------------------------------------------------------------------------
+
+static void queue_delivery(user_record_t *user, bool presence,
+                           user_status_t status) {
+  delivery_job_t *job = malloc(sizeof(*job));
+  if (!job) {
+    // A pushed message stays in the inbox for the next login or fetch
+    log_error("Failed to queue cluster delivery for %s", user->username);
+    return;
+  }
+  job->next = NULL;
+  job->user = user;
+  job->presence = presence;
+  job->status = status;
+
+  pthread_mutex_lock(&delivery_mutex);
+  if (delivery_tail) {
+    delivery_tail->next = job;
+  } else {
+    delivery_head = job;
+  }
+  delivery_tail = job;
+  pthread_cond_signal(&delivery_wake);
+  pthread_mutex_unlock(&delivery_mutex);
+}
+
+static void *delivery_worker(void *arg) {
+  (void)arg;
+
+  pthread_mutex_lock(&delivery_mutex);
+  for (;;) {
+    while (!delivery_head && atomic_load(&running)) {
+      pthread_cond_wait(&delivery_wake, &delivery_mutex);
+    }
+    if (!atomic_load(&running)) {
+      break;
+    }
+    delivery_job_t *job = delivery_head;
+    delivery_head = job->next;
+    if (!delivery_head) {
+      delivery_tail = NULL;
+    }
+    pthread_mutex_unlock(&delivery_mutex);
+
+    if (job->presence) {
+      broadcast_status_update(job->user->username, job->status);
+    } else {
+      push_stored_messages(job->user);
+    }
+    free(job);
+
+    pthread_mutex_lock(&delivery_mutex);
+  }
+  pthread_mutex_unlock(&delivery_mutex);
+
+  return NULL;
+}
+
+// ---------------------------------------------------------------------------
+// Receiving records
+// ---------------------------------------------------------------------------
+
+static void set_remote_status(user_record_t *user, user_status_t status) {
+  pthread_mutex_lock(&user->mutex);
+  bool changed = user->status != status;
+  if (changed) {
+    user->status = status;
+    user->last_seen = time(NULL);
+    touch_user_record(user);
+  }
+  pthread_mutex_unlock(&user->mutex);
+
+  if (changed) {
+    queue_delivery(user, true, status);
+  }
+}
+
+// [1 byte: length][name] at *in, for a name owned by node; NULL if not
+static const char *read_name(const uint8_t **in, const uint8_t *end,
+                             char *name, int owner) {
+  if (*in >= end) {
+    return NULL;
+  }
+  uint8_t len = **in;
+  if (len == 0 || len >= MAX_USERNAME_LEN || end - *in < 1 + len) {
+    return NULL;
+  }
+  memcpy(name, *in + 1, len);
+  name[len] = '\0';
+  *in += 1 + len;
+
+  if (validate_username_server(name) < 0 ||
+      (owner >= 0 && cluster_owner(name) != owner)) {
+    return NULL;
+  }
+  return name;
+}
+
+static int apply_record(int from, uint8_t kind, const uint8_t *body,
+                        uint16_t body_len) {
+  const uint8_t *in = body;
+  const uint8_t *end = body + body_len;
+  char name[MAX_USERNAME_LEN];
+
+  switch (kind) {
+  case RECORD_USER:
+  case RECORD_PRESENCE: {
+    // Any node may restore a registration (see send_sync()), but only the
+    // owner speaks for a user's status
+    if (!read_name(&in, end, name, kind == RECORD_USER ? -1 : from)) {
+      return -1;
+    }
+    const uint8_t *public_key = in;
+    if (kind == RECORD_USER) {
+      if (end - in < PUBLIC_KEY_SIZE) {
+        return -1;
+      }
+      in += PUBLIC_KEY_SIZE;
+    }
+    if (in >= end || *in > STATUS_AWAY) {
+      return -1;
+    }
+    user_status_t status = (user_status_t)*in;
+
+    user_record_t *user = find_user(name);
+    if (!user && kind == RECORD_USER) {
+      int result = add_user(name, public_key);
+      if (result == -1) {
+        log_error("Cannot add cluster user %s", name);
+        return 0;
+      }
+      user = find_user(name);
+    }
+    if (user && kind == RECORD_USER &&
+        memcmp(user->public_key, public_key, PUBLIC_KEY_SIZE) != 0) {
+      // Registered again while its owner was down; keys never change once
+      // published, so the nodes disagree until they restart
+      log_error("Cluster user %s has a different key on %s", name,
+                nodes[from].address);
+    }
+    if (user && user->node == from) {
+      set_remote_status(user, status);
+    }
+    return 0;
+  }
+
+  case RECORD_MESSAGE: {
+    if (end - in < 4) {
+      return -1;
+    }
+    uint32_t message_id = get_u32(in);
+    in += 4;
+
+    char sender[MAX_USERNAME_LEN];
+    if (!read_name(&in, end, sender, from) ||
+        !read_name(&in, end, name, self_node) || end - in < 2) {
+      return -1;
+    }
+    uint16_t message_len = get_u16(in);
+    in += 2;
+    if (message_len == 0 || message_len > MAX_MESSAGE_LEN * 2 ||
+        end - in < message_len) {
+      return -1;
+    }
+
+    user_record_t *recipient = find_user(name);
+    if (!recipient) {
+      log_error("Dropping forwarded message %u for unknown user %s",
+                message_id, name);
+      return 0;
+    }
+    // Stored before the batch is acknowledged; pushed by the delivery
+    // thread
+    if (store_forwarded_message(sender, recipient, message_id, in,
+                                message_len) == 0) {
+      queue_delivery(recipient, false, STATUS_OFFLINE);
+    }
+    return 0;
+  }
+
+  default:
+    // From a newer node; the length lets us skip it
+    return 0;
+  }
+}
+
+// Apply the records of a BATCH that were not applied before, or all of a
+// SYNC; *applied receives the last seq applied. -1 if the frame is
+// malformed.
+static int apply_frame(int from, uint8_t type, const uint8_t *payload,
+                       uint32_t payload_len, uint64_t *applied) {
+  cluster_node_t *node = &nodes[from];
+  size_t header_len = type == LINK_BATCH ? 10 : 2;
+  if ((type != LINK_BATCH && type != LINK_SYNC) || payload_len < header_len) {
+    return -1;
+  }
+
+  uint64_t seq = type == LINK_BATCH ? get_u64(payload) : 0;
+  uint16_t count = get_u16(payload + header_len - 2);
+  const uint8_t *in = payload + header_len;
+  const uint8_t *end = payload + payload_len;
+
+  pthread_mutex_lock(&node->inbound_mutex);
+  int result = 0;
+  for (uint16_t i = 0; i < count; i++, seq++) {
+    if (end - in < RECORD_HEADER_SIZE ||
+        end - in - RECORD_HEADER_SIZE < get_u16(in + 1)) {
+      result = -1;
+      break;
+    }
+    uint8_t kind = in[0];
+    uint16_t body_len = get_u16(in + 1);
+    const uint8_t *body = in + RECORD_HEADER_SIZE;
+    in = body + body_len;
+
+    if (type == LINK_BATCH && seq <= node->applied_seq) {
+      continue; // resent after a lost ACK
+    }
+    if (apply_record(from, kind, body, body_len) < 0) {
+      log_error("Malformed cluster record from %s", node->address);
+    }
+    if (type == LINK_BATCH) {
+      node->applied_seq = seq;
+    }
+  }
+  *applied = node->applied_seq;
+  pthread_mutex_unlock(&node->inbound_mutex);
+  return result;
+}
+
+// Show a node's users offline once its link is gone
+static void mark_node_offline(int from) {
+  pthread_mutex_lock(&server.users_mutex);
+  int user_count = server.user_count;
+  pthread_mutex_unlock(&server.users_mutex);
+
+  for (int i = 0; i < user_count; i++) {
+    if (server.users[i].node == from &&
+        server.users[i].status != STATUS_OFFLINE) {
+      set_remote_status(&server.users[i], STATUS_OFFLINE);
+    }
+  }
+}
+
+// Check a HELLO and register fd as the current link from its node; returns
+// the node, or -1 to refuse the connection
+static int accept_hello(int fd, const uint8_t *hello, uint32_t hello_len,
+                        uint64_t *applied) {
+  if (hello_len != LINK_HELLO_SIZE || hello[0] >= node_count ||
+      hello[0] == self_node || get_u64(&hello[9]) != membership_hash) {
+    log_error("Refused cluster link: unknown node or different membership");
+    return -1;
+  }
+
+  int from = hello[0];
+  cluster_node_t *node = &nodes[from];
+  pthread_mutex_lock(&node->inbound_mutex);
+  uint64_t peer_incarnation = get_u64(&hello[1]);
+  if (peer_incarnation != node->inbound_incarnation) {
+    // The peer restarted and numbers its records from 1 again
+    node->inbound_incarnation = peer_incarnation;
+    node->applied_seq = 0;
+  }
+  if (node->inbound_fd >= 0) {
+    // Replaced by this connection; the old one is dead or dying
+    shutdown(node->inbound_fd, SHUT_RDWR);
+  }
+  node->inbound_fd = fd;
+  *applied = node->applied_seq;
+  pthread_mutex_unlock(&node->inbound_mutex);
+  return from;
+}
+
+static void serve_link(int from, int fd, uint64_t applied) {
+  cluster_node_t *node = &nodes[from];
+  uint8_t ack[8];
+  put_u64(ack, applied);
+  if (link_send(fd, LINK_HELLO_ACK, ack, sizeof(ack), NULL) < 0) {
+    return;
+  }
+
+  // An idle link is fine once established; keepalive finds dead peers
+  struct timeval no_timeout = {0, 0};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &no_timeout, sizeof(no_timeout));
+
+  log_info("Cluster link from %s up", node->address);
+  uint8_t type;
+  uint8_t *payload;
+  uint32_t payload_len;
+  while (atomic_load(&running) &&
+         link_receive(fd, &type, &payload, &payload_len,
+                      LINK_FRAME_MAX_BYTES) == 0) {
+    int result = apply_frame(from, type, payload, payload_len, &applied);
+    sodium_memzero(payload, payload_len);
+    free(payload);
+    if (result < 0) {
+      log_error("Malformed cluster frame from %s", node->address);
+      return;
+    }
+    put_u64(ack, applied);
+    if (link_send(fd, LINK_ACK, ack, sizeof(ack), NULL) < 0) {
+      return;
+    }
+  }
+}
+
+static void *link_reader(void *arg) {
+  int fd = (int)(intptr_t)arg;
+
+  uint8_t type;
+  uint8_t *hello;
+  uint32_t hello_len;
+  int from = -1;
+  uint64_t applied = 0;
+  if (link_receive(fd, &type, &hello, &hello_len, LINK_HELLO_SIZE) == 0) {
+    if (type == LINK_HELLO) {
+      from = accept_hello(fd, hello, hello_len, &applied);
+    }
+    free(hello);
+  }
+
+  if (from >= 0) {
+    serve_link(from, fd, applied);
+
+    cluster_node_t *node = &nodes[from];
+    pthread_mutex_lock(&node->inbound_mutex);
+    bool current = node->inbound_fd == fd;
+    if (current) {
+      node->inbound_fd = -1;
+    }
+    pthread_mutex_unlock(&node->inbound_mutex);
+    if (current) {
+      log_info("Cluster link from %s down", node->address);
+      mark_node_offline(from);
+    }
+  }
+
+  close(fd);
+
+  pthread_mutex_lock(&readers_mutex);
+  readers--;
+  pthread_cond_broadcast(&readers_done);
+  pthread_mutex_unlock(&readers_mutex);
+  return NULL;
+}
+
+static void *link_listener(void *arg) {
+  (void)arg;
+
+  while (atomic_load(&running)) {
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      break; // shut down by cluster_stop()
+    }
+    if (!atomic_load(&running)) {
+      close(fd);
+      break;
+    }
+    configure_link_socket(fd);
+
+    pthread_mutex_lock(&readers_mutex);
+    readers++;
+    pthread_mutex_unlock(&readers_mutex);
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, link_reader, (void *)(intptr_t)fd) !=
+        0) {
+      log_error("Failed to start cluster link thread: %s", strerror(errno));
+      close(fd);
+      pthread_mutex_lock(&readers_mutex);
+      readers--;
+      pthread_mutex_unlock(&readers_mutex);
+      continue;
+    }
+    pthread_detach(thread);
+  }
+
+  return NULL;
+}
+
+// ---------------------------------------------------------------------------
+// Lifecycle
+// ---------------------------------------------------------------------------
+
+int cluster_start(void) {
+  if (!enabled) {
+    return 0;
+  }
+
+  randombytes_buf(&incarnation, sizeof(incarnation));
+  atomic_store(&running, true);
+
+  pthread_condattr_t wake_attr;
+  pthread_condattr_init(&wake_attr);
+  pthread_condattr_setclock(&wake_attr, CLOCK_MONOTONIC);
+  for (int i = 0; i < node_count; i++) {
+    cluster_node_t *node = &nodes[i];
+    pthread_mutex_init(&node->mutex, NULL);
+    pthread_cond_init(&node->wake, &wake_attr);
+    pthread_mutex_init(&node->inbound_mutex, NULL);
+    node->head = node->tail = NULL;
+    node->queued_bytes = 0;
+    node->next_seq = 1;
+    node->fd = -1;
+    node->inbound_incarnation = 0;
+    node->applied_seq = 0;
+    node->inbound_fd = -1;
+    node->thread_started = false;
+  }
+  pthread_condattr_destroy(&wake_attr);
+
+  if (pthread_create(&delivery_thread, NULL, delivery_worker, NULL) != 0) {
+    log_error("Failed to start cluster delivery: %s", strerror(errno));
+    cluster_stop();
+    return -1;
+  }
+  delivery_started = true;
+
+  // Bound to the configured address, not every interface
+  listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+  int opt = 1;
+  if (listen_fd < 0 ||
+      setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0 ||
+      bind(listen_fd, (struct sockaddr *)&nodes[self_node].cluster_address,
+           sizeof(nodes[self_node].cluster_address)) < 0 ||
+      listen(listen_fd, CLUSTER_MAX_NODES) < 0) {
+    log_error("Failed to open cluster port: %s", strerror(errno));
+    cluster_stop();
+    return -1;
+  }
+
+  if (pthread_create(&listener_thread, NULL, link_listener, NULL) != 0) {
+    log_error("Failed to start cluster listener: %s", strerror(errno));
+    cluster_stop();
+    return -1;
+  }
+  listener_started = true;
+
+  for (int i = 0; i < node_count; i++) {
+    if (i == self_node) {
+      continue;
+    }
+    if (pthread_create(&nodes[i].thread, NULL, link_sender, &nodes[i]) != 0) {
+      log_error("Failed to start cluster link thread: %s", strerror(errno));
+      cluster_stop();
+      return -1;
+    }
+    nodes[i].thread_started = true;
+  }
+
+  log_info("Cluster node %d of %d (%s), cluster port %u", self_node,
+           node_count, nodes[self_node].address,
+           ntohs(nodes[self_node].cluster_address.sin_port));
+  return 0;
+}
+
+void cluster_stop(void) {
+  if (!enabled || !atomic_exchange(&running, false)) {
+    return;
+  }
+
+  if (listen_fd >= 0) {
+    shutdown(listen_fd, SHUT_RDWR);
+  }
+  if (listener_started) {
+    pthread_join(listener_thread, NULL);
+    listener_started = false;
+  }
+  if (listen_fd >= 0) {
+    close(listen_fd);
+    listen_fd = -1;
+  }
+
+  for (int i = 0; i < node_count; i++) {
+    cluster_node_t *node = &nodes[i];
+    pthread_mutex_lock(&node->mutex);
+    if (node->fd >= 0) {
+      shutdown(node->fd, SHUT_RDWR);
+    }
+    pthread_cond_broadcast(&node->wake);
+    pthread_mutex_unlock(&node->mutex);
+
+    pthread_mutex_lock(&node->inbound_mutex);
+    if (node->inbound_fd >= 0) {
+      shutdown(node->inbound_fd, SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&node->inbound_mutex);
+  }
+
+  for (int i = 0; i < node_count; i++) {
+    if (nodes[i].thread_started) {
+      pthread_join(nodes[i].thread, NULL);
+      nodes[i].thread_started = false;
+    }
+  }
+
+  // Readers that never finished a HELLO hold no inbound_fd; they end on
+  // their own when the peer gives up
+  pthread_mutex_lock(&readers_mutex);
+  while (readers > 0) {
+    pthread_cond_wait(&readers_done, &readers_mutex);
+  }
+  pthread_mutex_unlock(&readers_mutex);
+
+  // Messages left unpushed are still in their inboxes
+  pthread_mutex_lock(&delivery_mutex);
+  pthread_cond_broadcast(&delivery_wake);
+  pthread_mutex_unlock(&delivery_mutex);
+  if (delivery_started) {
+    pthread_join(delivery_thread, NULL);
+    delivery_started = false;
+  }
+  while (delivery_head) {
+    delivery_job_t *job = delivery_head;
+    delivery_head = job->next;
+    free(job);
+  }
+  delivery_tail = NULL;
+
+  for (int i = 0; i < node_count; i++) {
+    cluster_node_t *node = &nodes[i];
+    pthread_mutex_lock(&node->mutex);
+    size_t dropped = node->queued_bytes;
+    trim_acknowledged_locked(node, UINT64_MAX);
+    pthread_mutex_unlock(&node->mutex);
+    if (dropped > 0) {
+      log_error("Dropped %zu unsent bytes for cluster node %s", dropped,
+                node->address);
+    }
+  }
+}
\ No newline at end of file
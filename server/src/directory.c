@@ -0,0 +1,215 @@
+#include "../include/c-chat-server.h"
+#include <stdint.h>
+
+// Read-mostly user directory
+//
+// Lookups far outnumber registrations, so readers never lock. add_user()
+// copies the current user_directory_t with the new name inserted and
+// publishes it through server.directory; readers bracket their use with
+// directory_acquire()/directory_release() and see either the old snapshot or
+// the new one, never a partial insert.
+//
+// Every insert copies the whole index. users[] holds at most MAX_CLIENTS
+// records, so one copy is at most 2 KB, and registering all of them at once,
+// as a cluster node does when it restores its peers' users, copies about
+// 1 MB. Batching inserts behind a pending list would also leave new names out
+// of the ordered walks that LIST_USERS and FIND_USERS make over a snapshot.
+//
+// Old snapshots are reclaimed by epoch. A reader announces the global epoch
+// in its own slot before loading server.directory and clears the slot when
+// done. A replaced snapshot is stamped with the epoch it was retired in and
+// freed by a later writer once every announced epoch is newer, i.e. once no
+// reader can still hold it. Reclamation runs under users_mutex, so retired
+// snapshots are freed in batches on the write path only.
+//
+// Records in server.users[] are never removed and everything but status and
+// changed_version is immutable once published, so pointers found through a
+// snapshot stay valid after directory_release().
+
+// Client handler threads plus the accept and maintenance threads
+#define DIRECTORY_READER_SLOTS (MAX_CLIENTS + 16)
+
+typedef struct {
+  // Epoch announced by the reader on this slot, 0 while it is not reading.
+  // One cache line per slot so readers on different cores do not contend.
+  _Alignas(64) _Atomic uint64_t epoch;
+  atomic_bool taken;
+} reader_slot_t;
+
+static reader_slot_t reader_slots[DIRECTORY_READER_SLOTS];
+static _Atomic uint64_t global_epoch = 1;
+
+static pthread_once_t reader_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t reader_key;
+
+static _Thread_local int reader_slot = -1;
+static _Thread_local int read_depth;
+static _Thread_local bool read_locked;
+
+// Retired snapshots waiting for readers to move on; guarded by users_mutex
+static user_directory_t *retired_head;
+
+static void release_reader_slot(void *value) {
+  int slot = (int)(intptr_t)value - 1;
+  atomic_store(&reader_slots[slot].epoch, 0);
+  atomic_store(&reader_slots[slot].taken, false);
+}
+
+static void create_reader_key(void) {
+  pthread_key_create(&reader_key, release_reader_slot);
+}
+
+static int claim_reader_slot(void) {
+  pthread_once(&reader_key_once, create_reader_key);
+
+  for (int i = 0; i < DIRECTORY_READER_SLOTS; i++) {
+    bool expected = false;
+    if (atomic_compare_exchange_strong(&reader_slots[i].taken, &expected,
+                                       true)) {
+      // Slot is handed back by the key destructor when the thread exits
+      pthread_setspecific(reader_key, (void *)(intptr_t)(i + 1));
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+const user_directory_t *directory_acquire(void) {
+  if (read_depth++ > 0) {
+    return atomic_load(&server.directory);
+  }
+
+  if (reader_slot < 0) {
+    reader_slot = claim_reader_slot();
+  }
+
+  if (reader_slot < 0) {
+    // Every slot is in use: read under the writers' lock instead, which also
+    // keeps reclamation out until directory_release()
+    pthread_mutex_lock(&server.users_mutex);
+    read_locked = true;
+    return atomic_load(&server.directory);
+  }
+
+  // The announcement must be visible before the snapshot is loaded; both are
+  // sequentially consistent so a writer that missed it also published first
+  atomic_store(&reader_slots[reader_slot].epoch, atomic_load(&global_epoch));
+  return atomic_load(&server.directory);
+}
+
+void directory_release(void) {
+  if (--read_depth > 0) {
+    return;
+  }
+
+  if (read_locked) {
+    read_locked = false;
+    pthread_mutex_unlock(&server.users_mutex);
+    return;
+  }
+
+  atomic_store_explicit(&reader_slots[reader_slot].epoch, 0,
+                        memory_order_release);
+}
+
+// Position of the first name >= username in snapshot order
+int directory_lower_bound(const user_directory_t *directory,
+                          const char *username) {
+  int low = 0, high = directory->count;
+  while (low < high) {
+    int mid = (low + high) / 2;
+    if (strcmp(server.users[directory->by_name[mid]].username, username) < 0) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  return low;
+}
+
+user_record_t *directory_find(const user_directory_t *directory,
+                              const char *username) {
+  int position = directory_lower_bound(directory, username);
+  if (position < directory->count) {
+    user_record_t *user = &server.users[directory->by_name[position]];
+    if (strcmp(user->username, username) == 0) {
+      return user;
+    }
+  }
+  return NULL;
+}
+
+static user_directory_t *allocate_directory(int count) {
+  user_directory_t *directory =
+      calloc(1, sizeof(*directory) + (size_t)count * sizeof(uint16_t));
+  if (directory) {
+    directory->count = count;
+  }
+  return directory;
+}
+
+static void reclaim_retired(void) {
+  uint64_t oldest = UINT64_MAX;
+  for (int i = 0; i < DIRECTORY_READER_SLOTS; i++) {
+    uint64_t epoch = atomic_load(&reader_slots[i].epoch);
+    if (epoch != 0 && epoch < oldest) {
+      oldest = epoch;
+    }
+  }
+
+  user_directory_t **link = &retired_head;
+  while (*link) {
+    user_directory_t *directory = *link;
+    if (directory->retired_epoch < oldest) {
+      *link = directory->next_retired;
+      free(directory);
+    } else {
+      link = &directory->next_retired;
+    }
+  }
+}
+
+int directory_init(void) {
+  user_directory_t *empty = allocate_directory(0);
+  if (!empty) {
+    return -1;
+  }
+  atomic_store(&server.directory, empty);
+  return 0;
+}
+
+// Publish a snapshot with users[user_index] inserted at position. Called by
+// add_user() with users_mutex held, after the record is filled in.
+int directory_insert(int position, int user_index) {
+  user_directory_t *current = atomic_load(&server.directory);
+  user_directory_t *next = allocate_directory(current->count + 1);
+  if (!next) {
+    return -1;
+  }
+
+  memcpy(next->by_name, current->by_name, (size_t)position * sizeof(uint16_t));
+  next->by_name[position] = (uint16_t)user_index;
+  memcpy(&next->by_name[position + 1], &current->by_name[position],
+         (size_t)(current->count - position) * sizeof(uint16_t));
+
+  atomic_store(&server.directory, next);
+
+  // Readers announcing this epoch or earlier may still hold current
+  current->retired_epoch = atomic_fetch_add(&global_epoch, 1);
+  current->next_retired = retired_head;
+  retired_head = current;
+
+  reclaim_retired();
+  return 0;
+}
+
+// Only at shutdown, once no reader threads remain
+void directory_cleanup(void) {
+  while (retired_head) {
+    user_directory_t *directory = retired_head;
+    retired_head = directory->next_retired;
+    free(directory);
+  }
+  free(atomic_exchange(&server.directory, NULL));
+}
\ No newline at end of file
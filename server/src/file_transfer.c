@@ -0,0 +1,395 @@
+#include "../include/c-chat-server.h"
+
+// File transfers
+//
+// A file is too large for a message, so it travels as a stream: the sender
+// encrypts it with crypto_secretstream (the server never sees the key, which
+// travels sealed to the recipient in the offer's envelope) and uploads the
+// ciphertext in FILE_CHUNK frames; the recipient pulls it back with
+// FILE_FETCH whenever it is online, while the upload is still running or
+// long after.
+//
+// The server keeps each transfer's ciphertext in an unlinked file in the
+// spool directory, never in memory: chunks are written as they arrive and
+// fetches are served from the file with the transport's send_file, which is
+// sendfile() on a real socket. Both sides resume from a byte offset, so a
+// dropped connection costs at most the chunks in flight. Every chunk is
+// acknowledged with the bytes stored so far, and a fetch returns at most the
+// number of bytes the recipient asked for, which bounds what either side
+// has in flight.
+//
+// A transfer ends when the recipient fetches at the end of the file, or
+// after FILE_TRANSFER_IDLE_HOURS without an upload or a fetch (checked
+// hourly by the retention sweeper, which runs even with retention off). All
+// transfers together may hold FILE_SPOOL_MAX_BYTES of disk.
+
+typedef struct {
+  uint32_t id;                // 0 when the slot is free
+  uint16_t sender, recipient; // users[] indices
+  uint64_t size;              // ciphertext bytes the sender announced
+  uint64_t stored;            // bytes written so far, always a prefix
+  uint32_t writing;           // bytes of the chunk being written after it
+  int fd;
+  time_t last_activity;
+  uint16_t envelope_len;
+  uint8_t envelope[FILE_ENVELOPE_MAX_LEN];
+} file_transfer_t;
+
+// FILE_AVAILABLE payload: [4 bytes: transfer id][1 byte: sender length]
+// [sender][8 bytes: size][8 bytes: stored][2 bytes: envelope length]
+// [envelope]
+#define FILE_AVAILABLE_MAX_LEN                                                 \
+  (4 + 1 + MAX_USERNAME_LEN + 8 + 8 + 2 + FILE_ENVELOPE_MAX_LEN)
+
+static file_transfer_t transfers[MAX_FILE_TRANSFERS];
+static uint32_t transfer_generation;
+static uint64_t spooled_bytes; // stored and writing bytes of live transfers
+static pthread_mutex_t transfers_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void put_u32(uint8_t *out, uint32_t value) {
+  out[0] = (value >> 24) & 0xFF;
+  out[1] = (value >> 16) & 0xFF;
+  out[2] = (value >> 8) & 0xFF;
+  out[3] = value & 0xFF;
+}
+
+static void put_u64(uint8_t *out, uint64_t value) {
+  put_u32(out, (uint32_t)(value >> 32));
+  put_u32(out + 4, (uint32_t)value);
+}
+
+static file_transfer_t *find_transfer_locked(uint32_t transfer_id) {
+  if (transfer_id == 0) {
+    return NULL;
+  }
+  file_transfer_t *transfer =
+      &transfers[(transfer_id - 1) % MAX_FILE_TRANSFERS];
+  return transfer->id == transfer_id ? transfer : NULL;
+}
+
+static void release_transfer_locked(file_transfer_t *transfer) {
+  close(transfer->fd);
+  spooled_bytes -= transfer->stored + transfer->writing;
+  transfer->id = 0;
+  transfer->fd = -1;
+}
+
+static uint32_t encode_available_locked(const file_transfer_t *transfer,
+                                        uint8_t *out) {
+  const char *sender = server.users[transfer->sender].username;
+  size_t sender_len = strlen(sender);
+
+  uint32_t offset = 0;
+  put_u32(&out[offset], transfer->id);
+  offset += 4;
+  out[offset++] = (uint8_t)sender_len;
+  memcpy(&out[offset], sender, sender_len);
+  offset += (uint32_t)sender_len;
+  put_u64(&out[offset], transfer->size);
+  offset += 8;
+  put_u64(&out[offset], transfer->stored);
+  offset += 8;
+  out[offset++] = (transfer->envelope_len >> 8) & 0xFF;
+  out[offset++] = transfer->envelope_len & 0xFF;
+  memcpy(&out[offset], transfer->envelope, transfer->envelope_len);
+  return offset + transfer->envelope_len;
+}
+
+// Tell the recipient, if online, that the transfer has data waiting
+static void announce(const uint8_t *payload, uint32_t payload_len,
+                     uint16_t recipient) {
+  client_connection_t *route;
+  find_member_clients(&recipient, 1, &route);
+  if (route) {
+    send_client_message(route, MSG_FILE_AVAILABLE, payload, payload_len);
+  }
+}
+
+// Start a transfer of size bytes from sender to recipient. Returns a
+// FILE_STATUS_* and sets *transfer_id on success.
+int file_transfer_create(int sender, int recipient, uint64_t size,
+                         const uint8_t *envelope, uint16_t envelope_len,
+                         uint32_t *transfer_id) {
+  if (size == 0 || size > FILE_MAX_BYTES ||
+      envelope_len > FILE_ENVELOPE_MAX_LEN) {
+    return FILE_STATUS_REFUSED;
+  }
+
+  pthread_mutex_lock(&transfers_mutex);
+
+  file_transfer_t *transfer = NULL;
+  for (int i = 0; i < MAX_FILE_TRANSFERS; i++) {
+    if (transfers[i].id == 0) {
+      transfer = &transfers[i];
+      break;
+    }
+  }
+  if (!transfer) {
+    pthread_mutex_unlock(&transfers_mutex);
+    log_error("Cannot start file transfer: transfer table full");
+    return FILE_STATUS_FULL;
+  }
+
+  uint32_t id;
+  // (id - 1) % MAX_FILE_TRANSFERS is the slot for every generation
+  do {
+    id = (uint32_t)(transfer - transfers) + 1 +
+         MAX_FILE_TRANSFERS * transfer_generation++;
+  } while (id == 0);
+
+  char file_name[32];
+  snprintf(file_name, sizeof(file_name), "transfer-%u.file", id);
+  int fd = spool_open(file_name);
+  if (fd < 0) {
+    pthread_mutex_unlock(&transfers_mutex);
+    return FILE_STATUS_REFUSED;
+  }
+
+  transfer->id = id;
+  transfer->sender = (uint16_t)sender;
+  transfer->recipient = (uint16_t)recipient;
+  transfer->size = size;
+  transfer->stored = 0;
+  transfer->writing = 0;
+  transfer->fd = fd;
+  transfer->last_activity = time(NULL);
+  transfer->envelope_len = envelope_len;
+  memcpy(transfer->envelope, envelope, envelope_len);
+
+  uint8_t available[FILE_AVAILABLE_MAX_LEN];
+  uint32_t available_len = encode_available_locked(transfer, available);
+  pthread_mutex_unlock(&transfers_mutex);
+
+  *transfer_id = id;
+  announce(available, available_len, (uint16_t)recipient);
+  return FILE_STATUS_OK;
+}
+
+// Where the sender of a transfer should continue its upload
+int file_transfer_resume(uint32_t transfer_id, int sender, uint64_t *stored) {
+  pthread_mutex_lock(&transfers_mutex);
+  file_transfer_t *transfer = find_transfer_locked(transfer_id);
+  if (!transfer || transfer->sender != sender) {
+    pthread_mutex_unlock(&transfers_mutex);
+    return FILE_STATUS_REFUSED;
+  }
+  *stored = transfer->stored;
+  pthread_mutex_unlock(&transfers_mutex);
+  return FILE_STATUS_OK;
+}
+
+// Append len bytes at offset, which must be where the upload stands.
+// Returns a FILE_STATUS_* and the bytes stored afterwards in *stored. The
+// chunk's place and spool space are reserved under the lock and written
+// without it, so uploads do not wait on each other's disk writes.
+int file_transfer_write(uint32_t transfer_id, int sender, uint64_t offset,
+                        const uint8_t *data, uint32_t len, uint64_t *stored) {
+  *stored = 0;
+
+  pthread_mutex_lock(&transfers_mutex);
+  file_transfer_t *transfer = find_transfer_locked(transfer_id);
+  if (!transfer || transfer->sender != sender) {
+    pthread_mutex_unlock(&transfers_mutex);
+    return FILE_STATUS_REFUSED;
+  }
+
+  *stored = transfer->stored;
+  if (offset != transfer->stored || transfer->writing > 0 ||
+      len > transfer->size - transfer->stored) {
+    // A chunk after a lost one, racing one in progress, or past the
+    // announced size
+    pthread_mutex_unlock(&transfers_mutex);
+    return FILE_STATUS_REFUSED;
+  }
+  if (spooled_bytes + len > FILE_SPOOL_MAX_BYTES) {
+    pthread_mutex_unlock(&transfers_mutex);
+    return FILE_STATUS_FULL;
+  }
+
+  // The transfer may end while this copy is being written to (see
+  // file_transfer_fetch())
+  int fd = dup(transfer->fd);
+  if (fd < 0) {
+    pthread_mutex_unlock(&transfers_mutex);
+    log_error("Failed to open file transfer %u: %s", transfer_id,
+              strerror(errno));
+    return FILE_STATUS_REFUSED;
+  }
+  transfer->writing = len;
+  spooled_bytes += len;
+  pthread_mutex_unlock(&transfers_mutex);
+
+  size_t written = 0;
+  int status = FILE_STATUS_OK;
+  while (written < len) {
+    ssize_t result = pwrite(fd, data + written, len - written,
+                            (off_t)(offset + written));
+    if (result < 0 && errno == EINTR) {
+      continue;
+    }
+    if (result <= 0) {
+      log_error("Failed to spool file transfer %u: %s", transfer_id,
+                result < 0 ? strerror(errno) : "short write");
+      status = FILE_STATUS_FULL;
+      break;
+    }
+    written += (size_t)result;
+  }
+  close(fd);
+
+  pthread_mutex_lock(&transfers_mutex);
+  // Released meanwhile (expired or shut down), reservation and all
+  transfer = find_transfer_locked(transfer_id);
+  if (!transfer) {
+    pthread_mutex_unlock(&transfers_mutex);
+    return FILE_STATUS_REFUSED;
+  }
+
+  transfer->writing = 0;
+  if (status != FILE_STATUS_OK) {
+    spooled_bytes -= len;
+    *stored = transfer->stored;
+    pthread_mutex_unlock(&transfers_mutex);
+    return status;
+  }
+
+  transfer->stored += len;
+  transfer->last_activity = time(NULL);
+  *stored = transfer->stored;
+
+  uint8_t available[FILE_AVAILABLE_MAX_LEN];
+  uint32_t available_len = 0;
+  if (transfer->stored == transfer->size) {
+    available_len = encode_available_locked(transfer, available);
+  }
+  uint16_t recipient = transfer->recipient;
+  pthread_mutex_unlock(&transfers_mutex);
+
+  if (available_len > 0) {
+    announce(available, available_len, recipient);
+  }
+  return FILE_STATUS_OK;
+}
+
+// Send the recipient up to max_bytes of the file from offset as FILE_DATA
+// frames straight from the spool. Fetching at the end of a finished upload
+// ends the transfer (FILE_STATUS_COMPLETE). *next receives the offset to
+// fetch from next time.
+int file_transfer_fetch(client_connection_t *client, uint32_t transfer_id,
+                        uint64_t offset, uint32_t max_bytes, uint64_t *next) {
+  *next = 0;
+
+  pthread_mutex_lock(&transfers_mutex);
+  file_transfer_t *transfer = find_transfer_locked(transfer_id);
+  if (!transfer || transfer->recipient != client->user_index) {
+    pthread_mutex_unlock(&transfers_mutex);
+    return FILE_STATUS_REFUSED;
+  }
+
+  *next = offset;
+  if (offset > transfer->stored) {
+    *next = transfer->stored;
+    pthread_mutex_unlock(&transfers_mutex);
+    return FILE_STATUS_REFUSED;
+  }
+  if (offset == transfer->size) {
+    log_info("File transfer %u from %s to %s complete (%llu bytes)",
+             transfer_id, server.users[transfer->sender].username,
+             client->username, (unsigned long long)transfer->size);
+    release_transfer_locked(transfer);
+    pthread_mutex_unlock(&transfers_mutex);
+    return FILE_STATUS_COMPLETE;
+  }
+
+  uint64_t available = transfer->stored - offset;
+  if (max_bytes == 0 || max_bytes > FILE_FETCH_MAX_BYTES) {
+    max_bytes = FILE_FETCH_MAX_BYTES;
+  }
+  if (available > max_bytes) {
+    available = max_bytes;
+  }
+
+  // The transfer may end while this copy is still being sent from; the
+  // unlinked file lives until both descriptors are closed
+  int fd = dup(transfer->fd);
+  transfer->last_activity = time(NULL);
+  pthread_mutex_unlock(&transfers_mutex);
+
+  if (fd < 0) {
+    log_error("Failed to open file transfer %u: %s", transfer_id,
+              strerror(errno));
+    return FILE_STATUS_REFUSED;
+  }
+
+  // [4 bytes: transfer id][8 bytes: offset][data]
+  uint8_t prefix[12];
+  put_u32(prefix, transfer_id);
+  uint64_t end = offset + available;
+  while (*next < end) {
+    uint32_t len = end - *next > FILE_CHUNK_MAX_BYTES
+                       ? FILE_CHUNK_MAX_BYTES
+                       : (uint32_t)(end - *next);
+    put_u64(prefix + 4, *next);
+    if (send_client_file(client, MSG_FILE_DATA, prefix, sizeof(prefix), fd,
+                         (off_t)*next, len) < 0) {
+      break;
+    }
+    *next += len;
+  }
+
+  close(fd);
+  return FILE_STATUS_OK;
+}
+
+// Send FILE_AVAILABLE for every transfer waiting for a user who just logged
+// in
+void file_transfers_announce(client_connection_t *client) {
+  for (int i = 0; i < MAX_FILE_TRANSFERS; i++) {
+    uint8_t available[FILE_AVAILABLE_MAX_LEN];
+    uint32_t available_len = 0;
+
+    pthread_mutex_lock(&transfers_mutex);
+    if (transfers[i].id != 0 &&
+        transfers[i].recipient == client->user_index) {
+      available_len = encode_available_locked(&transfers[i], available);
+    }
+    pthread_mutex_unlock(&transfers_mutex);
+
+    if (available_len > 0) {
+      send_client_message(client, MSG_FILE_AVAILABLE, available,
+                          available_len);
+    }
+  }
+}
+
+// Drop transfers nobody has uploaded to or fetched from for
+// FILE_TRANSFER_IDLE_HOURS. Returns the number dropped.
+int expire_file_transfers(time_t now) {
+  int expired = 0;
+
+  pthread_mutex_lock(&transfers_mutex);
+  for (int i = 0; i < MAX_FILE_TRANSFERS; i++) {
+    if (transfers[i].id != 0 &&
+        now - transfers[i].last_activity >=
+            (time_t)FILE_TRANSFER_IDLE_HOURS * 3600) {
+      release_transfer_locked(&transfers[i]);
+      expired++;
+    }
+  }
+  pthread_mutex_unlock(&transfers_mutex);
+
+  if (expired > 0) {
+    log_info("Expired %d idle file transfers", expired);
+  }
+  return expired;
+}
+
+void file_transfers_cleanup(void) {
+  pthread_mutex_lock(&transfers_mutex);
+  for (int i = 0; i < MAX_FILE_TRANSFERS; i++) {
+    if (transfers[i].id != 0) {
+      release_transfer_locked(&transfers[i]);
+    }
+  }
+  pthread_mutex_unlock(&transfers_mutex);
+}
\ No newline at end of file
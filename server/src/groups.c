@@ -0,0 +1,155 @@
+#include "../include/c-chat-server.h"
+
+// Group conversations
+//
+// A group is a name and up to MAX_GROUP_MEMBERS registered users, the first
+// of whom owns it. Members share a group key among themselves (the server
+// never sees it), so a send to the group is one upload that the server fans
+// out: the INCOMING frame is encoded once for every online member, and
+// offline or syncing members' inboxes all reference one stored body (see
+// handle_send_group_message()).
+//
+// Groups live in a fixed table under one mutex; the owner adds members, and
+// any member may remove itself. A group whose last member leaves is freed.
+// IDs carry a generation above the slot index, so a stale ID never reaches
+// a later group in the same slot.
+
+typedef struct {
+  uint32_t id; // 0 when the slot is free
+  char name[MAX_GROUP_NAME_LEN];
+  int member_count;
+  uint16_t members[MAX_GROUP_MEMBERS]; // users[] indices, owner first
+} group_t;
+
+static group_t groups[MAX_GROUPS];
+static uint32_t group_generation;
+static pthread_mutex_t groups_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static group_t *find_group_locked(uint32_t group_id) {
+  if (group_id == 0) {
+    return NULL;
+  }
+  group_t *group = &groups[(group_id - 1) % MAX_GROUPS];
+  return group->id == group_id ? group : NULL;
+}
+
+static int member_position(const group_t *group, int user) {
+  for (int i = 0; i < group->member_count; i++) {
+    if (group->members[i] == user) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// members may repeat the owner or each other; duplicates are dropped
+int create_group(const char *name, int owner, const int *members, int count,
+                 uint32_t *group_id) {
+  if (!name || !group_id || count < 0) {
+    return -1;
+  }
+
+  pthread_mutex_lock(&groups_mutex);
+
+  group_t *group = NULL;
+  for (int i = 0; i < MAX_GROUPS; i++) {
+    if (groups[i].id == 0) {
+      group = &groups[i];
+      break;
+    }
+  }
+  if (!group) {
+    pthread_mutex_unlock(&groups_mutex);
+    log_error("Cannot create group %s: group table full", name);
+    return -1;
+  }
+
+  group->member_count = 0;
+  group->members[group->member_count++] = (uint16_t)owner;
+  for (int i = 0; i < count; i++) {
+    if (member_position(group, members[i]) >= 0) {
+      continue;
+    }
+    if (group->member_count == MAX_GROUP_MEMBERS) {
+      pthread_mutex_unlock(&groups_mutex);
+      return -1;
+    }
+    group->members[group->member_count++] = (uint16_t)members[i];
+  }
+
+  strncpy(group->name, name, MAX_GROUP_NAME_LEN - 1);
+  group->name[MAX_GROUP_NAME_LEN - 1] = '\0';
+  // (id - 1) % MAX_GROUPS is the slot for every generation; 0 stays free
+  do {
+    group->id =
+        (uint32_t)(group - groups) + 1 + MAX_GROUPS * group_generation++;
+  } while (group->id == 0);
+  *group_id = group->id;
+
+  pthread_mutex_unlock(&groups_mutex);
+  return 0;
+}
+
+// Add (owner only) or remove (owner, or a member removing itself) one user
+int update_group(uint32_t group_id, int actor, int op, int user) {
+  pthread_mutex_lock(&groups_mutex);
+
+  group_t *group = find_group_locked(group_id);
+  if (!group || member_position(group, actor) < 0) {
+    pthread_mutex_unlock(&groups_mutex);
+    return -1;
+  }
+
+  bool is_owner = group->members[0] == actor;
+  int position = member_position(group, user);
+  int result = 0;
+
+  if (op == GROUP_ADD_MEMBER) {
+    if (!is_owner || group->member_count == MAX_GROUP_MEMBERS) {
+      result = -1;
+    } else if (position < 0) {
+      group->members[group->member_count++] = (uint16_t)user;
+    }
+  } else if (op == GROUP_REMOVE_MEMBER) {
+    if (position < 0 || (!is_owner && user != actor)) {
+      result = -1;
+    } else {
+      // Keep the order so the next member in line inherits ownership
+      memmove(&group->members[position], &group->members[position + 1],
+              (size_t)(group->member_count - position - 1) *
+                  sizeof(group->members[0]));
+      group->member_count--;
+      if (group->member_count == 0) {
+        group->id = 0;
+      }
+    }
+  } else {
+    result = -1;
+  }
+
+  pthread_mutex_unlock(&groups_mutex);
+  return result;
+}
+
+// Copy the member list, owner first, if member belongs to the group.
+// Returns the member count, or -1 for an unknown group or a non-member.
+// name, if given, receives the group name.
+int get_group_members(uint32_t group_id, int member, uint16_t *members,
+                      char *name) {
+  pthread_mutex_lock(&groups_mutex);
+
+  group_t *group = find_group_locked(group_id);
+  if (!group || member_position(group, member) < 0) {
+    pthread_mutex_unlock(&groups_mutex);
+    return -1;
+  }
+
+  int count = group->member_count;
+  memcpy(members, group->members, (size_t)count * sizeof(members[0]));
+  if (name) {
+    memcpy(name, group->name, MAX_GROUP_NAME_LEN);
+  }
+
+  pthread_mutex_unlock(&groups_mutex);
+  return count;
+}
\ No newline at end of file
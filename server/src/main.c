@@ -0,0 +1,168 @@
+#include "../include/c-chat-server.h"
+#include <getopt.h>
+
+static void print_usage(const char *program_name) {
+  printf("C-Chat Server\n\n");
+  printf("Usage: %s [OPTIONS]\n\n", program_name);
+  printf("Options:\n");
+  printf("  -w, --capture <file>    Record inbound frames for replay\n");
+  printf("  -s, --spool-dir <dir>   Spill full inboxes here (default: %s)\n",
+         INBOX_SPOOL_DIR);
+  printf("  -r, --retention <hours> Expire stored messages (default: %d, 0 = "
+         "never)\n",
+         MESSAGE_RETENTION_HOURS);
+  printf("  -A, --no-admission      Disable per-address rate limits (load "
+         "tests)\n");
+  printf("  -R, --replay-auth <seed> Derive login challenges from seed so "
+         "captured logins replay (testing only)\n");
+  printf("  -z, --zerocopy <bytes>  Send frames this large without copying "
+         "(default: %d, 0 = never)\n",
+         ZEROCOPY_THRESHOLD_BYTES);
+  printf("  -c, --cluster <nodes>   Run as one node of a cluster; nodes is "
+         "host:port:cluster_port,...\n");
+  printf("  -n, --node <index>      This node's position in --cluster "
+         "(default: 0)\n");
+  printf("  -h, --help              Show this help message\n");
+}
+
+int main(int argc, char *argv[]) {
+  const char *capture_path = NULL;
+  const char *cluster_nodes = NULL;
+  long cluster_node = 0;
+
+  static struct option long_options[] = {
+      {"capture", required_argument, 0, 'w'},
+      {"spool-dir", required_argument, 0, 's'},
+      {"retention", required_argument, 0, 'r'},
+      {"no-admission", no_argument, 0, 'A'},
+      {"replay-auth", required_argument, 0, 'R'},
+      {"zerocopy", required_argument, 0, 'z'},
+      {"cluster", required_argument, 0, 'c'},
+      {"node", required_argument, 0, 'n'},
+      {"help", no_argument, 0, 'h'},
+      {0, 0, 0, 0}};
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "w:s:r:AR:z:c:n:h", long_options,
+                            NULL)) != -1) {
+    switch (opt) {
+    case 'w':
+      capture_path = optarg;
+      break;
+    case 's':
+      if (spool_set_directory(optarg) < 0) {
+        fprintf(stderr, "Spool directory path too long\n");
+        return EXIT_FAILURE;
+      }
+      break;
+    case 'r': {
+      char *end;
+      long hours = strtol(optarg, &end, 10);
+      if (*end != '\0' || hours < 0 || hours > 24 * 365) {
+        fprintf(stderr, "Invalid retention period: %s\n", optarg);
+        return EXIT_FAILURE;
+      }
+      retention_set_period((time_t)hours * 3600);
+      break;
+    }
+    case 'A':
+      admission_set_enabled(false);
+      break;
+    case 'R':
+      auth_set_replay_seed(optarg);
+      break;
+    case 'z': {
+      char *end;
+      long bytes = strtol(optarg, &end, 10);
+      if (*end != '\0' || bytes < 0) {
+        fprintf(stderr, "Invalid zerocopy threshold: %s\n", optarg);
+        return EXIT_FAILURE;
+      }
+      transport_set_zerocopy_threshold((size_t)bytes);
+      break;
+    }
+    case 'c':
+      cluster_nodes = optarg;
+      break;
+    case 'n': {
+      char *end;
+      cluster_node = strtol(optarg, &end, 10);
+      if (*end != '\0' || cluster_node < 0) {
+        fprintf(stderr, "Invalid node index: %s\n", optarg);
+        return EXIT_FAILURE;
+      }
+      break;
+    }
+    case 'h':
+      print_usage(argv[0]);
+      return EXIT_SUCCESS;
+    default:
+      print_usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (cluster_nodes &&
+      cluster_configure(cluster_nodes, (int)cluster_node) < 0) {
+    fprintf(stderr, "Invalid cluster: %s (node %ld)\n", cluster_nodes,
+            cluster_node);
+    return EXIT_FAILURE;
+  }
+
+  log_info("Starting C-Chat Server v1.0.0");
+
+  if (init_server() < 0) {
+    log_error("Failed to initialize server");
+    return EXIT_FAILURE;
+  }
+
+  if (capture_path && capture_open(capture_path) < 0) {
+    cleanup_server();
+    return EXIT_FAILURE;
+  }
+
+  log_info("Server listening on port %d", cluster_client_port());
+
+  while (server.running) {
+    struct sockaddr_in client_addr;
+    socklen_t client_len = sizeof(client_addr);
+
+    int client_socket = accept(server.server_socket,
+                               (struct sockaddr *)&client_addr, &client_len);
+    if (client_socket < 0) {
+      if (errno == EINTR && !server.running) {
+        break;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        log_error("Failed to accept client connection: %s", strerror(errno));
+      }
+      continue;
+    }
+
+    // Cheapest place to shed a connect flood: no slot, thread or read yet
+    if (!admit(client_addr.sin_addr.s_addr, ADMIT_CONNECT)) {
+      close(client_socket);
+      continue;
+    }
+
+    configure_client_socket(client_socket);
+    client_connection_t *client = accept_client(client_socket, &client_addr);
+    if (!client) {
+      log_error("Maximum client connections reached, rejecting client");
+      close(client_socket);
+      continue;
+    }
+
+    if (pthread_create(&client->thread_id, NULL, client_handler, client) !=
+        0) {
+      log_error("Failed to create client thread: %s", strerror(errno));
+      close(client_socket);
+      client->connected = false;
+      client->in_use = false;
+    }
+  }
+
+  log_info("Server shutting down");
+  cleanup_server();
+  return EXIT_SUCCESS;
+}
\ No newline at end of file
@@ -1,18 +1,27 @@
 #include "../include/c-chat-server.h"
 
+// In cluster mode only the node that owns a name registers it and logs its
+// user in; any other node answers with the owner's address
+static bool redirect_to_owner(client_connection_t *client,
+                              const char *username) {
+  if (cluster_owns(username)) {
+    return false;
+  }
+  send_error(client, ERR_WRONG_NODE, cluster_owner_address(username));
+  return true;
+}
+
 int handle_register_user(client_connection_t *client, const uint8_t *payload,
                          uint32_t payload_len) {
   if (!payload || payload_len < 1 + PUBLIC_KEY_SIZE) {
-    send_error(client->socket_fd, ERR_INVALID_FORMAT,
-               "Invalid registration data");
+    send_error(client, ERR_INVALID_FORMAT, "Invalid registration data");
     return -1;
   }
 
   uint8_t username_len = payload[0];
   if (username_len == 0 || username_len >= MAX_USERNAME_LEN ||
       payload_len < 1 + username_len + PUBLIC_KEY_SIZE) {
-    send_error(client->socket_fd, ERR_INVALID_FORMAT,
-               "Invalid username length");
+    send_error(client, ERR_INVALID_FORMAT, "Invalid username length");
     return -1;
   }
 
@@ -21,11 +30,14 @@ int handle_register_user(client_connection_t *client, const uint8_t *payload,
   username[username_len] = '\0';
 
   if (validate_username_server(username) < 0) {
-    send_error(client->socket_fd, ERR_INVALID_USERNAME,
-               "Invalid username format");
+    send_error(client, ERR_INVALID_USERNAME, "Invalid username format");
     return -1;
   }
 
+  if (redirect_to_owner(client, username)) {
+    return 0;
+  }
+
   const unsigned char *public_key = &payload[1 + username_len];
 
   int result = add_user(username, public_key);
@@ -35,6 +47,7 @@ int handle_register_user(client_connection_t *client, const uint8_t *payload,
     response[0] = 1;
     response[1] = 0;
     log_info("User %s registered successfully", username);
+    cluster_announce_user(find_user(username));
   } else if (result == -2) {
     response[0] = 0;
     response[1] = ERR_USER_EXISTS;
@@ -45,22 +58,21 @@ int handle_register_user(client_connection_t *client, const uint8_t *payload,
     log_error("Registration failed for %s: server error", username);
   }
 
-  return send_network_message(client->socket_fd, MSG_REGISTER_RESPONSE,
-                              response, sizeof(response));
+  return send_client_message(client, MSG_REGISTER_RESPONSE, response,
+                             sizeof(response));
 }
 
 int handle_login_user(client_connection_t *client, const uint8_t *payload,
                       uint32_t payload_len) {
   if (!payload || payload_len < 1 + SIGNATURE_SIZE) {
-    send_error(client->socket_fd, ERR_INVALID_FORMAT, "Invalid login data");
+    send_error(client, ERR_INVALID_FORMAT, "Invalid login data");
     return -1;
   }
 
   uint8_t username_len = payload[0];
   if (username_len == 0 || username_len >= MAX_USERNAME_LEN ||
       payload_len < 1 + username_len + SIGNATURE_SIZE) {
-    send_error(client->socket_fd, ERR_INVALID_FORMAT,
-               "Invalid username length");
+    send_error(client, ERR_INVALID_FORMAT, "Invalid username length");
     return -1;
   }
 
@@ -68,6 +80,10 @@ int handle_login_user(client_connection_t *client, const uint8_t *payload,
   memcpy(username, &payload[1], username_len);
   username[username_len] = '\0';
 
+  if (redirect_to_owner(client, username)) {
+    return 0;
+  }
+
   const unsigned char *signature = &payload[1 + username_len];
 
   int result = authenticate_user(client, username, signature);
@@ -78,31 +94,29 @@ int handle_login_user(client_connection_t *client, const uint8_t *payload,
     memcpy(&response[1], client->challenge, CHALLENGE_SIZE);
 
     deliver_queued_messages(client);
+    file_transfers_announce(client);
 
     log_info("User %s logged in successfully", username);
-    return send_network_message(client->socket_fd, MSG_LOGIN_RESPONSE, response,
-                                sizeof(response));
+    return send_client_message(client, MSG_LOGIN_RESPONSE, response,
+                               sizeof(response));
   } else {
     response[0] = 0;
     log_info("Login failed for %s", username);
-    return send_network_message(client->socket_fd, MSG_LOGIN_RESPONSE, response,
-                                1);
+    return send_client_message(client, MSG_LOGIN_RESPONSE, response, 1);
   }
 }
 
 int handle_get_public_key(client_connection_t *client, const uint8_t *payload,
                           uint32_t payload_len) {
   if (!payload || payload_len < 1) {
-    send_error(client->socket_fd, ERR_INVALID_FORMAT,
-               "Invalid public key request");
+    send_error(client, ERR_INVALID_FORMAT, "Invalid public key request");
     return -1;
   }
 
   uint8_t username_len = payload[0];
   if (username_len == 0 || username_len >= MAX_USERNAME_LEN ||
       payload_len < 1 + username_len) {
-    send_error(client->socket_fd, ERR_INVALID_FORMAT,
-               "Invalid username length");
+    send_error(client, ERR_INVALID_FORMAT, "Invalid username length");
     return -1;
   }
 
@@ -110,67 +124,309 @@ int handle_get_public_key(client_connection_t *client, const uint8_t *payload,
   memcpy(username, &payload[1], username_len);
   username[username_len] = '\0';
 
-  user_record_t *user = find_user(username);
+  // Clients with a cached key append its version to revalidate it cheaply
+  bool has_known_version = payload_len >= 1 + username_len + 4u;
+  uint32_t known_version = 0;
+  if (has_known_version) {
+    const uint8_t *version = &payload[1 + username_len];
+    known_version = ((uint32_t)version[0] << 24) |
+                    ((uint32_t)version[1] << 16) |
+                    ((uint32_t)version[2] << 8) | (uint32_t)version[3];
+  }
 
-  uint8_t response[1 + PUBLIC_KEY_SIZE];
-  if (user) {
-    response[0] = 1;
-    pthread_mutex_lock(&user->mutex);
-    memcpy(&response[1], user->public_key, PUBLIC_KEY_SIZE);
-    pthread_mutex_unlock(&user->mutex);
+  user_record_t *user = find_user(username);
 
-    log_debug("Sent public key for user %s to %s", username, client->username);
-    return send_network_message(client->socket_fd, MSG_PUBLIC_KEY_RESPONSE,
-                                response, sizeof(response));
-  } else {
-    response[0] = 0;
+  uint8_t response[1 + PUBLIC_KEY_SIZE + 4];
+  if (!user) {
+    response[0] = KEY_LOOKUP_NOT_FOUND;
     log_debug("Public key not found for user %s (requested by %s)", username,
               client->username);
-    return send_network_message(client->socket_fd, MSG_PUBLIC_KEY_RESPONSE,
-                                response, 1);
+    return send_client_message(client, MSG_PUBLIC_KEY_RESPONSE, response, 1);
+  }
+
+  // Key and version never change once the record is published
+  uint32_t key_version = user->key_version;
+  memcpy(&response[1], user->public_key, PUBLIC_KEY_SIZE);
+
+  if (has_known_version && known_version == key_version) {
+    response[0] = KEY_LOOKUP_UNCHANGED;
+    response[1] = (uint8_t)(key_version >> 24);
+    response[2] = (uint8_t)(key_version >> 16);
+    response[3] = (uint8_t)(key_version >> 8);
+    response[4] = (uint8_t)key_version;
+
+    log_debug("Public key for user %s unchanged for %s", username,
+              client->username);
+    return send_client_message(client, MSG_PUBLIC_KEY_RESPONSE, response, 5);
   }
+
+  response[0] = KEY_LOOKUP_FOUND;
+  uint8_t *version = &response[1 + PUBLIC_KEY_SIZE];
+  version[0] = (uint8_t)(key_version >> 24);
+  version[1] = (uint8_t)(key_version >> 16);
+  version[2] = (uint8_t)(key_version >> 8);
+  version[3] = (uint8_t)key_version;
+
+  log_debug("Sent public key for user %s to %s", username, client->username);
+  return send_client_message(client, MSG_PUBLIC_KEY_RESPONSE, response,
+                             sizeof(response));
 }
 
-int handle_send_message(client_connection_t *client, const uint8_t *payload,
-                        uint32_t payload_len) {
-  if (!payload || payload_len < 3) {
-    send_error(client->socket_fd, ERR_INVALID_FORMAT, "Invalid message data");
+typedef struct {
+  char username[MAX_USERNAME_LEN];
+  uint8_t username_len;
+  uint32_t known_version;
+  bool found;
+  uint32_t key_version;
+  unsigned char public_key[PUBLIC_KEY_SIZE];
+} key_request_t;
+
+int handle_get_public_keys(client_connection_t *client, const uint8_t *payload,
+                           uint32_t payload_len) {
+  if (!payload || payload_len < 1 || payload[0] == 0 ||
+      payload[0] > MAX_KEY_BATCH) {
+    send_error(client, ERR_INVALID_FORMAT, "Invalid public keys request");
     return -1;
   }
 
-  uint8_t recipient_len = payload[0];
-  if (recipient_len == 0 || recipient_len >= MAX_USERNAME_LEN ||
-      payload_len < 1 + recipient_len + 2) {
-    send_error(client->socket_fd, ERR_INVALID_FORMAT,
-               "Invalid recipient length");
-    return -1;
+  uint8_t count = payload[0];
+  key_request_t requests[MAX_KEY_BATCH];
+
+  // [1 byte: count] then per name [1 byte: length][name][4 bytes: version]
+  size_t offset = 1;
+  for (uint8_t i = 0; i < count; i++) {
+    key_request_t *request = &requests[i];
+    uint8_t username_len = offset < payload_len ? payload[offset] : 0;
+    if (username_len == 0 || username_len >= MAX_USERNAME_LEN ||
+        offset + 1 + username_len + 4 > payload_len) {
+      send_error(client, ERR_INVALID_FORMAT, "Invalid username length");
+      return -1;
+    }
+
+    memcpy(request->username, &payload[offset + 1], username_len);
+    request->username[username_len] = '\0';
+    request->username_len = username_len;
+
+    const uint8_t *version = &payload[offset + 1 + username_len];
+    request->known_version =
+        ((uint32_t)version[0] << 24) | ((uint32_t)version[1] << 16) |
+        ((uint32_t)version[2] << 8) | (uint32_t)version[3];
+    request->found = false;
+
+    offset += 1 + username_len + 4;
   }
 
-  char recipient[MAX_USERNAME_LEN];
-  memcpy(recipient, &payload[1], recipient_len);
-  recipient[recipient_len] = '\0';
+  // Resolve every name against one directory snapshot: a binary search per
+  // name, without locks, and consistent across the whole batch
+  const user_directory_t *directory = directory_acquire();
+  for (uint8_t i = 0; i < count; i++) {
+    key_request_t *request = &requests[i];
+    user_record_t *user = directory_find(directory, request->username);
+    if (user) {
+      request->found = true;
+      request->key_version = user->key_version;
+      memcpy(request->public_key, user->public_key, PUBLIC_KEY_SIZE);
+    }
+  }
+  directory_release();
+
+  // [1 byte: count] then per name, in request order:
+  // [1 byte: status][1 byte: length][name] followed by
+  // [32 bytes: key][4 bytes: version] if found, [4 bytes: version] if
+  // unchanged
+  uint8_t response[1 + MAX_KEY_BATCH * (2 + MAX_USERNAME_LEN +
+                                        PUBLIC_KEY_SIZE + 4)];
+  size_t response_len = 1;
+  uint8_t found_count = 0;
+  response[0] = count;
+
+  for (uint8_t i = 0; i < count; i++) {
+    const key_request_t *request = &requests[i];
+    uint8_t *entry = &response[response_len];
+
+    entry[1] = request->username_len;
+    memcpy(&entry[2], request->username, request->username_len);
+    uint8_t *data = &entry[2 + request->username_len];
+    response_len += 2 + request->username_len;
+
+    if (!request->found) {
+      entry[0] = KEY_LOOKUP_NOT_FOUND;
+      continue;
+    }
 
-  uint16_t message_len = ((uint16_t)payload[1 + recipient_len] << 8) |
-                         payload[1 + recipient_len + 1];
+    found_count++;
+    if (request->known_version != 0 &&
+        request->known_version == request->key_version) {
+      entry[0] = KEY_LOOKUP_UNCHANGED;
+    } else {
+      entry[0] = KEY_LOOKUP_FOUND;
+      memcpy(data, request->public_key, PUBLIC_KEY_SIZE);
+      data += PUBLIC_KEY_SIZE;
+      response_len += PUBLIC_KEY_SIZE;
+    }
 
-  if (message_len == 0 || payload_len < 1 + recipient_len + 2 + message_len) {
-    send_error(client->socket_fd, ERR_INVALID_FORMAT, "Invalid message length");
-    return -1;
+    data[0] = (uint8_t)(request->key_version >> 24);
+    data[1] = (uint8_t)(request->key_version >> 16);
+    data[2] = (uint8_t)(request->key_version >> 8);
+    data[3] = (uint8_t)request->key_version;
+    response_len += 4;
   }
 
-  const unsigned char *encrypted_message = &payload[1 + recipient_len + 2];
+  log_debug("Resolved %u of %u public keys for %s", found_count, count,
+            client->username);
+  return send_client_message(client, MSG_PUBLIC_KEYS_RESPONSE, response,
+                             (uint32_t)response_len);
+}
 
-  user_record_t *recipient_user = find_user(recipient);
-  if (!recipient_user) {
-    send_error(client->socket_fd, ERR_USER_NOT_FOUND, "Recipient not found");
+// Sync clients read only from their inbox, and a parked long poll returns
+// as soon as the inbox gains a message, so neither gets a direct push
+static bool delivers_via_inbox(client_connection_t *recipient_client,
+                               user_record_t *recipient_user) {
+  pthread_mutex_lock(&recipient_client->mutex);
+  bool via_inbox = recipient_client->sync_mode;
+  pthread_mutex_unlock(&recipient_client->mutex);
+  return via_inbox || inbox_has_waiters(recipient_user);
+}
+
+// Hand one message to a resolved recipient: pushed as INCOMING_MESSAGE when
+// it is online and reading pushes, stored in its inbox otherwise, or passed
+// to the cluster node that owns it. Returns the MESSAGE_ACK status.
+static uint8_t relay_message(const char *sender,
+                             user_record_t *recipient_user,
+                             client_connection_t *recipient_client,
+                             uint32_t message_id,
+                             const unsigned char *encrypted_message,
+                             uint16_t message_len) {
+  const char *recipient = recipient_user->username;
+
+  if (!cluster_is_local(recipient_user)) {
+    // The owner delivers it; queued is all this node can promise
+    if (cluster_forward_message(sender, recipient_user, message_id,
+                                encrypted_message, message_len) == 0) {
+      log_info("Message %u forwarded from %s to %s", message_id, sender,
+               recipient);
+      return 2;
+    }
+    return 0;
+  }
+
+  bool via_inbox =
+      recipient_client && delivers_via_inbox(recipient_client, recipient_user);
+
+  if (via_inbox) {
+    if (queue_message(recipient_user, sender, encrypted_message,
+                      message_len) == 0) {
+      log_info("Message %u queued from %s to %s (inbox delivery)", message_id,
+               sender, recipient);
+      return 2;
+    }
+    return 0;
+  }
+
+  if (!recipient_client) {
+    if (queue_message(recipient_user, sender, encrypted_message,
+                      message_len) == 0) {
+      log_info("Message %u queued from %s to %s (recipient offline)",
+               message_id, sender, recipient);
+      return 2;
+    }
+    return 0;
+  }
+
+  size_t sender_len = strlen(sender);
+  size_t incoming_len = incoming_message_size(sender_len, message_len);
+
+  frame_buffer_t *buffer = frame_buffer_create(NULL, (uint32_t)incoming_len);
+  if (!buffer) {
+    return 0;
+  }
+
+  encode_incoming_message(buffer->data, message_id, sender,
+                          (uint32_t)time(NULL), encrypted_message,
+                          message_len);
+
+  uint8_t status;
+  int sent = send_client_buffer(recipient_client, MSG_INCOMING_MESSAGE,
+                                buffer);
+  if (sent == 0) {
+    status = 1;
+    log_info("Message %u delivered from %s to %s", message_id,
+             sender, recipient);
+  } else if (sent > 0) {
+    // Behind the recipient's writer; back to its inbox if never written
+    status = 2;
+    log_info("Message %u queued from %s to %s (behind writer)", message_id,
+             sender, recipient);
+  } else {
+    status = 2;
+    queue_message(recipient_user, sender, encrypted_message,
+                  message_len);
+    log_info("Message %u queued from %s to %s (delivery failed)", message_id,
+             sender, recipient);
+  }
+
+  frame_buffer_release(buffer);
+  return status;
+}
+
+// A message another cluster node accepted for a user this node owns. It
+// goes to the inbox either way: the caller is a link reader, which must not
+// wait on a client socket, so an online recipient gets it from
+// push_stored_messages() afterwards.
+int store_forwarded_message(const char *sender, user_record_t *recipient_user,
+                            uint32_t message_id,
+                            const unsigned char *encrypted_message,
+                            uint16_t message_len) {
+  if (queue_forwarded_message(recipient_user, sender, message_id,
+                              encrypted_message, message_len) < 0) {
     return -1;
   }
+  log_info("Message %u queued from %s to %s (forwarded)", message_id, sender,
+           recipient_user->username);
+  return 0;
+}
 
-  uint32_t message_id;
+// Push a user's stored messages to its connection, if it has one that reads
+// pushes; sync and long-poll clients fetch them from the inbox themselves
+void push_stored_messages(user_record_t *user) {
+  client_connection_t *client = find_client_by_username(user->username);
+  if (client && !delivers_via_inbox(client, user)) {
+    deliver_queued_messages(client);
+  }
+}
+
+// First of count consecutive message IDs
+static uint32_t reserve_message_ids(uint32_t count) {
   pthread_mutex_lock(&server.message_id_mutex);
-  message_id = server.next_message_id++;
+  uint32_t first = server.next_message_id;
+  server.next_message_id += count;
   pthread_mutex_unlock(&server.message_id_mutex);
+  return first;
+}
 
+int handle_send_message(client_connection_t *client, const uint8_t *payload,
+                        uint32_t payload_len) {
+  char recipient[MAX_USERNAME_LEN];
+  const unsigned char *encrypted_message;
+  uint16_t message_len;
+
+  int parse_result = parse_send_message(payload, payload_len, recipient,
+                                        &encrypted_message, &message_len);
+  if (parse_result == -1) {
+    send_error(client, ERR_INVALID_FORMAT, "Invalid recipient length");
+    return -1;
+  } else if (parse_result < 0) {
+    send_error(client, ERR_INVALID_FORMAT, "Invalid message length");
+    return -1;
+  }
+
+  user_record_t *recipient_user = find_user(recipient);
+  if (!recipient_user) {
+    send_error(client, ERR_USER_NOT_FOUND, "Recipient not found");
+    return -1;
+  }
+
+  uint32_t message_id = reserve_message_ids(1);
   client_connection_t *recipient_client = find_client_by_username(recipient);
 
   uint8_t ack_response[5];
@@ -178,84 +434,231 @@ int handle_send_message(client_connection_t *client, const uint8_t *payload,
   ack_response[1] = (message_id >> 16) & 0xFF;
   ack_response[2] = (message_id >> 8) & 0xFF;
   ack_response[3] = message_id & 0xFF;
+  ack_response[4] = relay_message(client->username, recipient_user,
+                                  recipient_client, message_id,
+                                  encrypted_message, message_len);
 
-  if (recipient_client) {
-    size_t sender_len = strlen(client->username);
-    time_t timestamp = time(NULL);
+  return send_client_message(client, MSG_MESSAGE_ACK, ack_response,
+                             sizeof(ack_response));
+}
+
+// [1 byte: count] then per recipient, as in SEND_MESSAGE,
+// [1 byte: recipient length][recipient][2 bytes: length][ciphertext]
+// The same text sent to several people, each copy encrypted for its
+// recipient, in one frame: recipients are resolved with one pass over the
+// directory and one over the connections, and a single MULTI_ACK reports
+// every recipient's outcome in request order. Each recipient beyond the
+// first costs a send token of its own.
+int handle_send_multi(client_connection_t *client, const uint8_t *payload,
+                      uint32_t payload_len) {
+  if (!payload || payload_len < 1 || payload[0] == 0 ||
+      payload[0] > MAX_MULTI_RECIPIENTS) {
+    send_error(client, ERR_INVALID_FORMAT, "Invalid multi-send request");
+    return -1;
+  }
 
-    uint8_t *message_payload = malloc(4 + 1 + sender_len + 4 + 2 + message_len);
-    if (!message_payload) {
-      ack_response[4] = 0;
-      send_network_message(client->socket_fd, MSG_MESSAGE_ACK, ack_response,
-                           sizeof(ack_response));
+  int count = payload[0];
+  char recipients[MAX_MULTI_RECIPIENTS][MAX_USERNAME_LEN];
+  const char *names[MAX_MULTI_RECIPIENTS];
+  const unsigned char *messages[MAX_MULTI_RECIPIENTS];
+  uint16_t message_lens[MAX_MULTI_RECIPIENTS];
+
+  uint32_t offset = 1;
+  for (int i = 0; i < count; i++) {
+    int parse_result = parse_send_message(
+        &payload[offset], payload_len - offset, recipients[i], &messages[i],
+        &message_lens[i]);
+    if (parse_result < 0) {
+      send_error(client, ERR_INVALID_FORMAT,
+                 parse_result == -1 ? "Invalid recipient length"
+                                    : "Invalid message length");
       return -1;
     }
+    names[i] = recipients[i];
+    // Every copy must fit the frame a single SEND_MESSAGE would use
+    uint32_t entry_len =
+        1u + (uint32_t)strlen(recipients[i]) + 2u + message_lens[i];
+    if (entry_len > MAX_MESSAGE_LEN * 2) {
+      send_error(client, ERR_INVALID_FORMAT, "Invalid message length");
+      return -1;
+    }
+    offset += entry_len;
+  }
 
-    message_payload[0] = (message_id >> 24) & 0xFF;
-    message_payload[1] = (message_id >> 16) & 0xFF;
-    message_payload[2] = (message_id >> 8) & 0xFF;
-    message_payload[3] = message_id & 0xFF;
+  user_record_t *users[MAX_MULTI_RECIPIENTS];
+  find_users(names, count, users);
 
-    message_payload[4] = (uint8_t)sender_len;
-    memcpy(&message_payload[5], client->username, sender_len);
+  uint16_t user_indices[MAX_MULTI_RECIPIENTS];
+  int found = 0;
+  for (int i = 0; i < count; i++) {
+    if (users[i]) {
+      user_indices[found++] = (uint16_t)(users[i] - server.users);
+    }
+  }
+  client_connection_t *routes[MAX_MULTI_RECIPIENTS];
+  find_member_clients(user_indices, found, routes);
+
+  uint32_t first_id = reserve_message_ids((uint32_t)count);
+
+  // [1 byte: count][count x ([4 bytes: message id][1 byte: status])]
+  uint8_t response[1 + MAX_MULTI_RECIPIENTS * 5];
+  response[0] = (uint8_t)count;
+  int route = 0;
+  for (int i = 0; i < count; i++) {
+    uint32_t message_id = first_id + (uint32_t)i;
+    uint8_t status;
+    if (!users[i]) {
+      status = MULTI_STATUS_NOT_FOUND;
+      message_id = 0;
+    } else if (i > 0 && !admit_connection(client, ADMIT_SEND)) {
+      status = MULTI_STATUS_RATE_LIMITED;
+      message_id = 0;
+      route++;
+    } else {
+      status = relay_message(client->username, users[i], routes[route++],
+                             message_id, messages[i], message_lens[i]);
+    }
 
-    uint32_t ts = (uint32_t)timestamp;
-    message_payload[5 + sender_len] = (ts >> 24) & 0xFF;
-    message_payload[5 + sender_len + 1] = (ts >> 16) & 0xFF;
-    message_payload[5 + sender_len + 2] = (ts >> 8) & 0xFF;
-    message_payload[5 + sender_len + 3] = ts & 0xFF;
+    uint8_t *entry = &response[1 + i * 5];
+    entry[0] = (message_id >> 24) & 0xFF;
+    entry[1] = (message_id >> 16) & 0xFF;
+    entry[2] = (message_id >> 8) & 0xFF;
+    entry[3] = message_id & 0xFF;
+    entry[4] = status;
+  }
 
-    message_payload[5 + sender_len + 4] = (message_len >> 8) & 0xFF;
-    message_payload[5 + sender_len + 5] = message_len & 0xFF;
+  log_debug("Multi-send from %s to %d recipients", client->username, count);
+  return send_client_message(client, MSG_MULTI_ACK, response,
+                             1 + (uint32_t)count * 5);
+}
 
-    memcpy(&message_payload[5 + sender_len + 6], encrypted_message,
-           message_len);
+int handle_get_messages(client_connection_t *client, const uint8_t *payload,
+                        uint32_t payload_len) {
+  if (!payload || payload_len == 0) {
+    return deliver_queued_messages(client);
+  }
 
-    if (send_network_message(recipient_client->socket_fd, MSG_INCOMING_MESSAGE,
-                             message_payload,
-                             4 + 1 + sender_len + 4 + 2 + message_len) == 0) {
-      ack_response[4] = 1;
-      log_info("Message %u delivered from %s to %s", message_id,
-               client->username, recipient);
-    } else {
-      ack_response[4] = 2;
-      queue_message(recipient, client->username, encrypted_message,
-                    message_len);
-      log_info("Message %u queued from %s to %s (delivery failed)", message_id,
-               client->username, recipient);
-    }
+  // Long poll: [4 bytes: timeout ms][4 bytes: last seen message ID]
+  if (payload_len < 8) {
+    send_error(client, ERR_INVALID_FORMAT, "Invalid poll request");
+    return -1;
+  }
 
-    sodium_memzero(message_payload, 4 + 1 + sender_len + 4 + 2 + message_len);
-    free(message_payload);
-  } else {
-    queue_message(recipient, client->username, encrypted_message, message_len);
-    ack_response[4] = 2;
-    log_info("Message %u queued from %s to %s (recipient offline)", message_id,
-             client->username, recipient);
+  uint32_t timeout_ms = ((uint32_t)payload[0] << 24) |
+                        ((uint32_t)payload[1] << 16) |
+                        ((uint32_t)payload[2] << 8) | (uint32_t)payload[3];
+  uint32_t last_seen_id = ((uint32_t)payload[4] << 24) |
+                          ((uint32_t)payload[5] << 16) |
+                          ((uint32_t)payload[6] << 8) | (uint32_t)payload[7];
+
+  uint32_t last_id;
+  int delivered = wait_for_messages(client, timeout_ms, last_seen_id, &last_id);
+  if (delivered < 0) {
+    send_error(client, ERR_SERVER_ERROR, "Poll failed");
+    return -1;
   }
 
-  return send_network_message(client->socket_fd, MSG_MESSAGE_ACK, ack_response,
-                              sizeof(ack_response));
+  // Ends the poll: [2 bytes: messages delivered][4 bytes: last message ID]
+  uint8_t response[6];
+  response[0] = (uint8_t)(delivered >> 8);
+  response[1] = (uint8_t)delivered;
+  response[2] = (uint8_t)(last_id >> 24);
+  response[3] = (uint8_t)(last_id >> 16);
+  response[4] = (uint8_t)(last_id >> 8);
+  response[5] = (uint8_t)last_id;
+
+  return send_client_message(client, MSG_POLL_RESPONSE, response,
+                             sizeof(response));
 }
 
-int handle_get_messages(client_connection_t *client, const uint8_t *payload,
+// Incremental sync from the user's inbox:
+// [4 bytes: after seq][4 bytes: max bytes, 0 for the default]
+// [4 bytes: timeout ms] (optional, 0 answers at once)
+int handle_sync_messages(client_connection_t *client, const uint8_t *payload,
+                         uint32_t payload_len) {
+  if (!payload || payload_len < 8) {
+    send_error(client, ERR_INVALID_FORMAT, "Invalid sync request");
+    return -1;
+  }
+
+  uint32_t after_seq = ((uint32_t)payload[0] << 24) |
+                       ((uint32_t)payload[1] << 16) |
+                       ((uint32_t)payload[2] << 8) | (uint32_t)payload[3];
+  uint32_t max_bytes = ((uint32_t)payload[4] << 24) |
+                       ((uint32_t)payload[5] << 16) |
+                       ((uint32_t)payload[6] << 8) | (uint32_t)payload[7];
+  uint32_t timeout_ms = 0;
+  if (payload_len >= 12) {
+    timeout_ms = ((uint32_t)payload[8] << 24) | ((uint32_t)payload[9] << 16) |
+                 ((uint32_t)payload[10] << 8) | (uint32_t)payload[11];
+  }
+
+  if (max_bytes == 0) {
+    max_bytes = SYNC_DEFAULT_MAX_BYTES;
+  } else if (max_bytes > SYNC_MAX_BYTES) {
+    max_bytes = SYNC_MAX_BYTES;
+  }
+
+  // From now on this connection is fed from the inbox only
+  pthread_mutex_lock(&client->mutex);
+  client->sync_mode = true;
+  pthread_mutex_unlock(&client->mutex);
+
+  sync_result_t result;
+  if (sync_messages(client, after_seq, max_bytes, timeout_ms, &result) < 0) {
+    send_error(client, ERR_SERVER_ERROR, "Sync failed");
+    return -1;
+  }
+
+  // Ends the batch: [2 bytes: count][4 bytes: last seq sent]
+  // [4 bytes: newest seq stored][4 bytes: acknowledged seq]
+  uint8_t response[14];
+  response[0] = (uint8_t)(result.count >> 8);
+  response[1] = (uint8_t)result.count;
+  const uint32_t values[3] = {result.last_seq, result.newest_seq,
+                              result.acked_seq};
+  for (int i = 0; i < 3; i++) {
+    response[2 + i * 4] = (uint8_t)(values[i] >> 24);
+    response[3 + i * 4] = (uint8_t)(values[i] >> 16);
+    response[4 + i * 4] = (uint8_t)(values[i] >> 8);
+    response[5 + i * 4] = (uint8_t)values[i];
+  }
+
+  return send_client_message(client, MSG_SYNC_RESPONSE, response,
+                             sizeof(response));
+}
+
+// Cumulative acknowledgement: [4 bytes: seq]. No response.
+int handle_ack_messages(client_connection_t *client, const uint8_t *payload,
                         uint32_t payload_len) {
-  (void)payload;
-  (void)payload_len;
+  if (!payload || payload_len < 4) {
+    send_error(client, ERR_INVALID_FORMAT, "Invalid acknowledgement");
+    return -1;
+  }
+
+  uint32_t seq = ((uint32_t)payload[0] << 24) | ((uint32_t)payload[1] << 16) |
+                 ((uint32_t)payload[2] << 8) | (uint32_t)payload[3];
 
-  return deliver_queued_messages(client);
+  if (ack_messages(find_user(client->username), seq) < 0) {
+    send_error(client, ERR_INVALID_FORMAT,
+               "Acknowledgement beyond stored messages");
+    return -1;
+  }
+
+  log_debug("%s acknowledged messages up to seq %u", client->username, seq);
+  return 0;
 }
 
 int handle_set_status(client_connection_t *client, const uint8_t *payload,
                       uint32_t payload_len) {
   if (!payload || payload_len < 1) {
-    send_error(client->socket_fd, ERR_INVALID_FORMAT, "Invalid status data");
+    send_error(client, ERR_INVALID_FORMAT, "Invalid status data");
     return -1;
   }
 
   user_status_t new_status = (user_status_t)payload[0];
   if (new_status > STATUS_AWAY) {
-    send_error(client->socket_fd, ERR_INVALID_FORMAT, "Invalid status value");
+    send_error(client, ERR_INVALID_FORMAT, "Invalid status value");
     return -1;
   }
 
@@ -264,6 +667,7 @@ int handle_set_status(client_connection_t *client, const uint8_t *payload,
     pthread_mutex_lock(&user->mutex);
     user->status = new_status;
     user->last_seen = time(NULL);
+    touch_user_record(user);
     pthread_mutex_unlock(&user->mutex);
 
     pthread_mutex_lock(&client->mutex);
@@ -278,53 +682,134 @@ int handle_set_status(client_connection_t *client, const uint8_t *payload,
   return 0;
 }
 
+// Paged form of LIST_USERS, used when the request has a payload:
+// [4 bytes: cursor][4 bytes: since version][1 byte: max entries]
+// Only records changed after `since` are returned (0 lists everyone), in
+// registration order starting at `cursor`. Users are never removed from the
+// table, so a cursor stays valid across registrations.
+static int handle_list_users_page(client_connection_t *client,
+                                  const uint8_t *payload,
+                                  uint32_t payload_len) {
+  if (payload_len < 9) {
+    send_error(client, ERR_INVALID_FORMAT, "Invalid user list request");
+    return -1;
+  }
+
+  uint32_t cursor = ((uint32_t)payload[0] << 24) |
+                    ((uint32_t)payload[1] << 16) |
+                    ((uint32_t)payload[2] << 8) | (uint32_t)payload[3];
+  uint32_t since = ((uint32_t)payload[4] << 24) |
+                   ((uint32_t)payload[5] << 16) |
+                   ((uint32_t)payload[6] << 8) | (uint32_t)payload[7];
+  uint8_t max_entries = payload[8];
+  if (max_entries == 0 || max_entries > USER_PAGE_MAX_ENTRIES) {
+    max_entries = USER_PAGE_MAX_ENTRIES;
+  }
+
+  // [4 bytes: registry version][4 bytes: next cursor, 0 when done]
+  // [1 byte: count] then per user
+  // [1 byte: length][name][1 byte: status][4 bytes: changed version]
+  uint8_t response[9 + USER_PAGE_MAX_ENTRIES * (1 + MAX_USERNAME_LEN + 5)];
+  size_t offset = 9;
+  uint8_t count = 0;
+
+  // The version is read before the scan: anything that changes while the
+  // pages are fetched is newer and shows up in the client's next delta
+  pthread_mutex_lock(&server.registry_version_mutex);
+  uint32_t registry_version = server.registry_version;
+  pthread_mutex_unlock(&server.registry_version_mutex);
+
+  const user_directory_t *directory = directory_acquire();
+
+  uint32_t index = cursor;
+  for (; index < (uint32_t)directory->count && count < max_entries; index++) {
+    user_record_t *user = &server.users[index];
+
+    // Version first: touch_user_record() stores it after the status, so a
+    // new version always comes with the status it was stamped for
+    uint32_t changed_version = user->changed_version;
+    uint8_t status = (uint8_t)user->status;
+
+    if (changed_version <= since) {
+      continue;
+    }
+
+    size_t username_len = strlen(user->username);
+    response[offset] = (uint8_t)username_len;
+    memcpy(&response[offset + 1], user->username, username_len);
+    uint8_t *entry = &response[offset + 1 + username_len];
+    entry[0] = status;
+    entry[1] = (uint8_t)(changed_version >> 24);
+    entry[2] = (uint8_t)(changed_version >> 16);
+    entry[3] = (uint8_t)(changed_version >> 8);
+    entry[4] = (uint8_t)changed_version;
+
+    offset += 1 + username_len + 5;
+    count++;
+  }
+
+  uint32_t next_cursor = index < (uint32_t)directory->count ? index : 0;
+
+  directory_release();
+
+  response[0] = (uint8_t)(registry_version >> 24);
+  response[1] = (uint8_t)(registry_version >> 16);
+  response[2] = (uint8_t)(registry_version >> 8);
+  response[3] = (uint8_t)registry_version;
+  response[4] = (uint8_t)(next_cursor >> 24);
+  response[5] = (uint8_t)(next_cursor >> 16);
+  response[6] = (uint8_t)(next_cursor >> 8);
+  response[7] = (uint8_t)next_cursor;
+  response[8] = count;
+
+  log_debug("Sent user page to %s (%u users, since %u, next cursor %u)",
+            client->username, count, since, next_cursor);
+  return send_client_message(client, MSG_USER_PAGE_RESPONSE, response,
+                             (uint32_t)offset);
+}
+
 int handle_list_users(client_connection_t *client, const uint8_t *payload,
                       uint32_t payload_len) {
-  (void)payload;
-  (void)payload_len;
+  if (payload && payload_len > 0) {
+    return handle_list_users_page(client, payload, payload_len);
+  }
 
-  pthread_mutex_lock(&server.users_mutex);
+  // Empty payload: the original full listing, kept for older clients
+  const user_directory_t *directory = directory_acquire();
 
   size_t total_size = 2;
-  for (int i = 0; i < server.user_count; i++) {
-    if (server.users[i].is_registered) {
-      total_size += 1 + strlen(server.users[i].username) + 1;
-    }
+  for (int i = 0; i < directory->count; i++) {
+    total_size += 1 + strlen(server.users[i].username) + 1;
   }
 
   uint8_t *response = malloc(total_size);
   if (!response) {
-    pthread_mutex_unlock(&server.users_mutex);
-    send_error(client->socket_fd, ERR_SERVER_ERROR, "Memory allocation failed");
+    directory_release();
+    send_error(client, ERR_SERVER_ERROR, "Memory allocation failed");
     return -1;
   }
 
   uint16_t user_count = 0;
   size_t offset = 2;
 
-  for (int i = 0; i < server.user_count; i++) {
-    if (server.users[i].is_registered) {
-      size_t username_len = strlen(server.users[i].username);
+  for (int i = 0; i < directory->count; i++) {
+    size_t username_len = strlen(server.users[i].username);
 
-      response[offset] = (uint8_t)username_len;
-      memcpy(&response[offset + 1], server.users[i].username, username_len);
+    response[offset] = (uint8_t)username_len;
+    memcpy(&response[offset + 1], server.users[i].username, username_len);
+    response[offset + 1 + username_len] = (uint8_t)server.users[i].status;
 
-      pthread_mutex_lock(&server.users[i].mutex);
-      response[offset + 1 + username_len] = (uint8_t)server.users[i].status;
-      pthread_mutex_unlock(&server.users[i].mutex);
-
-      offset += 1 + username_len + 1;
-      user_count++;
-    }
+    offset += 1 + username_len + 1;
+    user_count++;
   }
 
   response[0] = (user_count >> 8) & 0xFF;
   response[1] = user_count & 0xFF;
 
-  pthread_mutex_unlock(&server.users_mutex);
+  directory_release();
 
-  int result = send_network_message(client->socket_fd, MSG_USER_LIST_RESPONSE,
-                                    response, offset);
+  int result = send_client_message(client, MSG_USER_LIST_RESPONSE, response,
+                                   offset);
 
   sodium_memzero(response, total_size);
   free(response);
@@ -333,6 +818,60 @@ int handle_list_users(client_connection_t *client, const uint8_t *payload,
   return result;
 }
 
+// Prefix search over registered usernames, for client autocomplete:
+// [1 byte: prefix length][prefix][1 byte: max results]
+// Answered from the sorted name index in O(log N + K) rather than a scan.
+int handle_search_users(client_connection_t *client, const uint8_t *payload,
+                        uint32_t payload_len) {
+  if (!payload || payload_len < 2) {
+    send_error(client, ERR_INVALID_FORMAT, "Invalid search request");
+    return -1;
+  }
+
+  uint8_t prefix_len = payload[0];
+  if (prefix_len >= MAX_USERNAME_LEN || payload_len < 2u + prefix_len) {
+    send_error(client, ERR_INVALID_FORMAT, "Invalid search prefix length");
+    return -1;
+  }
+
+  char prefix[MAX_USERNAME_LEN];
+  memcpy(prefix, &payload[1], prefix_len);
+  prefix[prefix_len] = '\0';
+  if (strlen(prefix) != prefix_len) {
+    send_error(client, ERR_INVALID_FORMAT, "Invalid search prefix");
+    return -1;
+  }
+
+  int max_results = payload[1 + prefix_len];
+  if (max_results == 0 || max_results > SEARCH_MAX_RESULTS) {
+    max_results = SEARCH_MAX_RESULTS;
+  }
+
+  user_record_t *matches[SEARCH_MAX_RESULTS];
+  int count = search_users(prefix, max_results, matches);
+
+  // [1 byte: count] then per match [1 byte: length][name][1 byte: status]
+  uint8_t response[1 + SEARCH_MAX_RESULTS * (1 + MAX_USERNAME_LEN + 1)];
+  size_t offset = 1;
+  for (int i = 0; i < count; i++) {
+    user_record_t *user = matches[i];
+    size_t username_len = strlen(user->username);
+
+    response[offset] = (uint8_t)username_len;
+    memcpy(&response[offset + 1], user->username, username_len);
+
+    response[offset + 1 + username_len] = (uint8_t)user->status;
+
+    offset += 1 + username_len + 1;
+  }
+  response[0] = (uint8_t)count;
+
+  log_debug("Search for '%s' from %s matched %d users", prefix,
+            client->username, count);
+  return send_client_message(client, MSG_SEARCH_RESPONSE, response,
+                             (uint32_t)offset);
+}
+
 int handle_logout(client_connection_t *client, const uint8_t *payload,
                   uint32_t payload_len) {
   (void)payload;
@@ -345,4 +884,397 @@ int handle_logout(client_connection_t *client, const uint8_t *payload,
   pthread_mutex_unlock(&client->mutex);
 
   return 0;
+}
+
+static uint32_t get_u32(const uint8_t *in) {
+  return ((uint32_t)in[0] << 24) | ((uint32_t)in[1] << 16) |
+         ((uint32_t)in[2] << 8) | (uint32_t)in[3];
+}
+
+static void put_u32(uint8_t *out, uint32_t value) {
+  out[0] = (value >> 24) & 0xFF;
+  out[1] = (value >> 16) & 0xFF;
+  out[2] = (value >> 8) & 0xFF;
+  out[3] = value & 0xFF;
+}
+
+// [1 byte: length][username] at *offset, for a registered user; the offset
+// moves past it. NULL if malformed or unknown, with the error already sent.
+static user_record_t *parse_group_member(client_connection_t *client,
+                                         const uint8_t *payload,
+                                         uint32_t payload_len,
+                                         uint32_t *offset) {
+  uint8_t username_len = *offset < payload_len ? payload[*offset] : 0;
+  if (username_len == 0 || username_len >= MAX_USERNAME_LEN ||
+      *offset + 1 + username_len > payload_len) {
+    send_error(client, ERR_INVALID_FORMAT, "Invalid username length");
+    return NULL;
+  }
+
+  char username[MAX_USERNAME_LEN];
+  memcpy(username, &payload[*offset + 1], username_len);
+  username[username_len] = '\0';
+  *offset += 1 + username_len;
+
+  // Groups live on one node, so members must belong to it too
+  user_record_t *user = find_user(username);
+  if (!user || !cluster_is_local(user)) {
+    send_error(client, ERR_USER_NOT_FOUND, "Group member not found");
+    return NULL;
+  }
+  return user;
+}
+
+// [1 byte: name length][name][1 byte: count]
+// [count x ([1 byte: length][username])]
+// The creator owns the group and is always a member.
+int handle_create_group(client_connection_t *client, const uint8_t *payload,
+                        uint32_t payload_len) {
+  if (!payload || payload_len < 2) {
+    send_error(client, ERR_INVALID_FORMAT, "Invalid group request");
+    return -1;
+  }
+
+  uint8_t name_len = payload[0];
+  if (name_len == 0 || name_len >= MAX_GROUP_NAME_LEN ||
+      payload_len < 2u + name_len) {
+    send_error(client, ERR_INVALID_FORMAT, "Invalid group name length");
+    return -1;
+  }
+
+  char name[MAX_GROUP_NAME_LEN];
+  memcpy(name, &payload[1], name_len);
+  name[name_len] = '\0';
+  if (strlen(name) != name_len) {
+    send_error(client, ERR_INVALID_FORMAT, "Invalid group name");
+    return -1;
+  }
+
+  uint8_t count = payload[1 + name_len];
+  int members[MAX_GROUP_MEMBERS];
+  uint32_t offset = 2u + name_len;
+  for (int i = 0; i < count; i++) {
+    user_record_t *member =
+        parse_group_member(client, payload, payload_len, &offset);
+    if (!member) {
+      return -1;
+    }
+    members[i] = (int)(member - server.users);
+  }
+
+  // [1 byte: status][4 bytes: group id]
+  uint8_t response[5] = {0};
+  uint32_t group_id;
+  if (create_group(name, client->user_index, members, count, &group_id) ==
+      0) {
+    response[0] = 1;
+    put_u32(&response[1], group_id);
+    log_info("Group %u (%s) created by %s", group_id, name, client->username);
+  }
+
+  return send_client_message(client, MSG_GROUP_RESPONSE, response,
+                             sizeof(response));
+}
+
+// [4 bytes: group id][1 byte: operation][1 byte: length][username]
+int handle_update_group(client_connection_t *client, const uint8_t *payload,
+                        uint32_t payload_len) {
+  if (!payload || payload_len < 6) {
+    send_error(client, ERR_INVALID_FORMAT, "Invalid group update");
+    return -1;
+  }
+
+  uint32_t group_id = get_u32(payload);
+  uint8_t op = payload[4];
+  uint32_t offset = 5;
+  user_record_t *user =
+      parse_group_member(client, payload, payload_len, &offset);
+  if (!user) {
+    return -1;
+  }
+
+  uint8_t response[5] = {0};
+  put_u32(&response[1], group_id);
+  if (update_group(group_id, client->user_index, op,
+                   (int)(user - server.users)) == 0) {
+    response[0] = 1;
+    log_info("Group %u: %s %s %s", group_id, client->username,
+             op == GROUP_ADD_MEMBER ? "added" : "removed", user->username);
+  }
+
+  return send_client_message(client, MSG_GROUP_RESPONSE, response,
+                             sizeof(response));
+}
+
+// [4 bytes: group id][2 bytes: first member], for members only. Members are
+// listed owner first, GROUP_PAGE_MAX_ENTRIES per response.
+int handle_get_group(client_connection_t *client, const uint8_t *payload,
+                     uint32_t payload_len) {
+  if (!payload || payload_len < 6) {
+    send_error(client, ERR_INVALID_FORMAT, "Invalid group request");
+    return -1;
+  }
+
+  uint32_t group_id = get_u32(payload);
+  int start = ((int)payload[4] << 8) | payload[5];
+
+  uint16_t members[MAX_GROUP_MEMBERS];
+  char name[MAX_GROUP_NAME_LEN];
+  int count = get_group_members(group_id, client->user_index, members, name);
+  if (count < 0) {
+    uint8_t status = 0;
+    return send_client_message(client, MSG_GROUP_INFO, &status, 1);
+  }
+
+  // [1 byte: status][4 bytes: group id][1 byte: name length][name]
+  // [2 bytes: member count][2 bytes: first member][1 byte: entries]
+  // [entries x ([1 byte: length][username])]
+  uint8_t response[1 + 4 + 1 + MAX_GROUP_NAME_LEN + 2 + 2 + 1 +
+                   GROUP_PAGE_MAX_ENTRIES * (1 + MAX_USERNAME_LEN)];
+  size_t name_len = strlen(name);
+  response[0] = 1;
+  put_u32(&response[1], group_id);
+  response[5] = (uint8_t)name_len;
+  memcpy(&response[6], name, name_len);
+
+  size_t offset = 6 + name_len;
+  response[offset] = (uint8_t)(count >> 8);
+  response[offset + 1] = (uint8_t)count;
+  response[offset + 2] = (uint8_t)(start >> 8);
+  response[offset + 3] = (uint8_t)start;
+  size_t entries_at = offset + 4;
+  offset += 5;
+
+  int entries = 0;
+  for (int i = start; i < count && entries < GROUP_PAGE_MAX_ENTRIES; i++) {
+    const char *username = server.users[members[i]].username;
+    size_t username_len = strlen(username);
+    response[offset] = (uint8_t)username_len;
+    memcpy(&response[offset + 1], username, username_len);
+    offset += 1 + username_len;
+    entries++;
+  }
+  response[entries_at] = (uint8_t)entries;
+
+  return send_client_message(client, MSG_GROUP_INFO, response,
+                             (uint32_t)offset);
+}
+
+// [4 bytes: group id][2 bytes: length][ciphertext under the group key]
+// One upload reaches every other member. The GROUP_MESSAGE frame is encoded
+// once for all online members; everyone else gets the message in their
+// inbox, all referencing one stored copy of the ciphertext. The ACK status
+// is 1 if every member got it directly, 2 if it was stored for some, and 0
+// if no member could be reached.
+int handle_send_group_message(client_connection_t *client,
+                              const uint8_t *payload, uint32_t payload_len) {
+  if (!payload || payload_len < 6) {
+    send_error(client, ERR_INVALID_FORMAT, "Invalid group message");
+    return -1;
+  }
+
+  uint32_t group_id = get_u32(payload);
+  uint16_t message_len = ((uint16_t)payload[4] << 8) | payload[5];
+  if (message_len == 0 || payload_len < 6u + message_len) {
+    send_error(client, ERR_INVALID_FORMAT, "Invalid message length");
+    return -1;
+  }
+  const unsigned char *encrypted_message = &payload[6];
+
+  uint16_t members[MAX_GROUP_MEMBERS];
+  int count = get_group_members(group_id, client->user_index, members, NULL);
+  if (count < 0) {
+    send_error(client, ERR_USER_NOT_FOUND, "Group not found");
+    return -1;
+  }
+
+  uint32_t message_id;
+  pthread_mutex_lock(&server.message_id_mutex);
+  message_id = server.next_message_id++;
+  pthread_mutex_unlock(&server.message_id_mutex);
+
+  uint8_t ack_response[5];
+  ack_response[0] = (message_id >> 24) & 0xFF;
+  ack_response[1] = (message_id >> 16) & 0xFF;
+  ack_response[2] = (message_id >> 8) & 0xFF;
+  ack_response[3] = message_id & 0xFF;
+
+  // [4 bytes: group id] + INCOMING_MESSAGE
+  size_t frame_len =
+      4 + incoming_message_size(strlen(client->username), message_len);
+  // Every member's lane and socket shares this one buffer
+  frame_buffer_t *frame = frame_buffer_create(NULL, (uint32_t)frame_len);
+  if (!frame) {
+    ack_response[4] = 0;
+    send_client_message(client, MSG_MESSAGE_ACK, ack_response,
+                        sizeof(ack_response));
+    return -1;
+  }
+  put_u32(frame->data, group_id);
+  encode_incoming_message(frame->data + 4, message_id, client->username,
+                          (uint32_t)time(NULL), encrypted_message,
+                          message_len);
+
+  client_connection_t *routes[MAX_GROUP_MEMBERS];
+  find_member_clients(members, count, routes);
+
+  message_body_t *body = NULL;
+  int delivered = 0, queued = 0, failed = 0;
+  for (int i = 0; i < count; i++) {
+    if (members[i] == client->user_index) {
+      continue;
+    }
+
+    user_record_t *member = &server.users[members[i]];
+    if (routes[i] && !delivers_via_inbox(routes[i], member)) {
+      int sent = send_client_buffer(routes[i], MSG_GROUP_MESSAGE, frame);
+      if (sent == 0) {
+        delivered++;
+        continue;
+      }
+      if (sent > 0) {
+        // Behind the member's writer; back to its inbox if never written
+        queued++;
+        continue;
+      }
+    }
+
+    // Offline, reading from its inbox, or not accepting more frames
+    if (!body) {
+      body = message_body_create(encrypted_message, message_len);
+    }
+    if (body && queue_group_message(member, client->username, group_id,
+                                    message_id, body) == 0) {
+      queued++;
+    } else {
+      failed++;
+    }
+  }
+
+  // Inboxes hold their own references
+  message_body_release(body);
+  frame_buffer_release(frame);
+
+  if (delivered + queued == 0 && failed > 0) {
+    ack_response[4] = 0;
+  } else {
+    ack_response[4] = queued + failed > 0 ? 2 : 1;
+  }
+  log_info("Group message %u from %s to group %u: %d delivered, %d queued, "
+           "%d failed",
+           message_id, client->username, group_id, delivered, queued, failed);
+
+  return send_client_message(client, MSG_MESSAGE_ACK, ack_response,
+                             sizeof(ack_response));
+}
+
+static uint64_t get_u64(const uint8_t *in) {
+  return ((uint64_t)get_u32(in) << 32) | get_u32(in + 4);
+}
+
+// [1 byte: status][4 bytes: transfer id][8 bytes: offset]
+static int send_file_response(client_connection_t *client, int status,
+                              uint32_t transfer_id, uint64_t offset) {
+  uint8_t response[13];
+  response[0] = (uint8_t)status;
+  put_u32(&response[1], transfer_id);
+  put_u32(&response[5], (uint32_t)(offset >> 32));
+  put_u32(&response[9], (uint32_t)offset);
+  return send_client_message(client, MSG_FILE_RESPONSE, response,
+                             sizeof(response));
+}
+
+// [4 bytes: transfer id, 0 for a new transfer]
+// New transfers continue with [1 byte: recipient length][recipient]
+// [8 bytes: size][2 bytes: envelope length][envelope]
+// Answered with the transfer ID and the offset to upload from, which is 0
+// for a new transfer and what the server already holds for a resumed one.
+int handle_file_offer(client_connection_t *client, const uint8_t *payload,
+                      uint32_t payload_len) {
+  if (!payload || payload_len < 4) {
+    send_error(client, ERR_INVALID_FORMAT, "Invalid file offer");
+    return -1;
+  }
+
+  uint32_t transfer_id = get_u32(payload);
+  if (transfer_id != 0) {
+    uint64_t stored = 0;
+    int status = file_transfer_resume(transfer_id, client->user_index, &stored);
+    return send_file_response(client, status, transfer_id, stored);
+  }
+
+  uint8_t recipient_len = payload_len > 4 ? payload[4] : 0;
+  if (recipient_len == 0 || recipient_len >= MAX_USERNAME_LEN ||
+      payload_len < 5u + recipient_len + 10u) {
+    send_error(client, ERR_INVALID_FORMAT, "Invalid recipient length");
+    return -1;
+  }
+
+  char recipient[MAX_USERNAME_LEN];
+  memcpy(recipient, &payload[5], recipient_len);
+  recipient[recipient_len] = '\0';
+
+  uint32_t offset = 5u + recipient_len;
+  uint64_t size = get_u64(&payload[offset]);
+  uint16_t envelope_len =
+      ((uint16_t)payload[offset + 8] << 8) | payload[offset + 9];
+  offset += 10;
+  if (payload_len < offset + envelope_len) {
+    send_error(client, ERR_INVALID_FORMAT, "Invalid envelope length");
+    return -1;
+  }
+
+  // The spooled file stays on this node, so its recipient must log in here
+  user_record_t *recipient_user = find_user(recipient);
+  if (!recipient_user || !cluster_is_local(recipient_user)) {
+    send_error(client, ERR_USER_NOT_FOUND, "Recipient not found");
+    return -1;
+  }
+
+  int status = file_transfer_create(
+      client->user_index, (int)(recipient_user - server.users), size,
+      &payload[offset], envelope_len, &transfer_id);
+  if (status == FILE_STATUS_OK) {
+    log_info("File transfer %u from %s to %s started (%llu bytes)",
+             transfer_id, client->username, recipient,
+             (unsigned long long)size);
+  }
+  return send_file_response(client, status, transfer_id, 0);
+}
+
+// [4 bytes: transfer id][8 bytes: offset][data]
+// Every chunk is answered with the bytes stored so far; a chunk that does
+// not start there is refused, and the sender resumes from that offset.
+int handle_file_chunk(client_connection_t *client, const uint8_t *payload,
+                      uint32_t payload_len) {
+  if (!payload || payload_len <= 12) {
+    send_error(client, ERR_INVALID_FORMAT, "Invalid file chunk");
+    return -1;
+  }
+
+  uint32_t transfer_id = get_u32(payload);
+  uint64_t stored;
+  int status = file_transfer_write(transfer_id, client->user_index,
+                                   get_u64(&payload[4]), &payload[12],
+                                   payload_len - 12, &stored);
+  return send_file_response(client, status, transfer_id, stored);
+}
+
+// [4 bytes: transfer id][8 bytes: offset][4 bytes: most bytes to send]
+// Answered with FILE_DATA frames up to what has been uploaded, then a
+// FILE_RESPONSE with the offset to fetch from next. Fetching at the end of
+// the file ends the transfer.
+int handle_file_fetch(client_connection_t *client, const uint8_t *payload,
+                      uint32_t payload_len) {
+  if (!payload || payload_len < 16) {
+    send_error(client, ERR_INVALID_FORMAT, "Invalid file fetch");
+    return -1;
+  }
+
+  uint32_t transfer_id = get_u32(payload);
+  uint64_t next;
+  int status = file_transfer_fetch(client, transfer_id,
+                                   get_u64(&payload[4]),
+                                   get_u32(&payload[12]), &next);
+  return send_file_response(client, status, transfer_id, next);
 }
\ No newline at end of file
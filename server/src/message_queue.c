@@ -1,144 +1,591 @@
 #include "../include/c-chat-server.h"
 
-int queue_message(const char *recipient, const char *sender,
-                  const unsigned char *encrypted_data, size_t encrypted_len) {
-  if (!recipient || !sender || !encrypted_data || encrypted_len == 0) {
-    return -1;
+// Per-recipient inboxes
+//
+// Every stored message gets the next sequence number of its recipient's
+// inbox and stays there until the recipient acknowledges it, whether or not
+// a connection is open. Legacy GET_MESSAGES drains the inbox and counts each
+// sent message as acknowledged. SYNC_MESSAGES sends everything after a
+// client-held sequence number without trimming, and storage is released by
+// the cumulative ACK_MESSAGES that follows (or by the next sync's cursor), so
+// a client that drops mid-drain resumes exactly where it stopped.
+
+static uint32_t get_u32(const uint8_t *in) {
+  return ((uint32_t)in[0] << 24) | ((uint32_t)in[1] << 16) |
+         ((uint32_t)in[2] << 8) | (uint32_t)in[3];
+}
+
+int init_inbox(user_inbox_t *inbox) {
+  // Long-poll deadlines must not move with the wall clock
+  pthread_condattr_t ready_attr;
+  pthread_condattr_init(&ready_attr);
+  pthread_condattr_setclock(&ready_attr, CLOCK_MONOTONIC);
+
+  int result = 0;
+  if (pthread_mutex_init(&inbox->mutex, NULL) != 0 ||
+      pthread_mutex_init(&inbox->spool_mutex, NULL) != 0 ||
+      pthread_cond_init(&inbox->ready, &ready_attr) != 0) {
+    result = -1;
   }
+  pthread_condattr_destroy(&ready_attr);
 
-  client_connection_t *recipient_client = find_client_by_username(recipient);
-  if (!recipient_client) {
-    log_error("Cannot queue message: recipient %s not found", recipient);
-    return -1;
+  inbox->next_seq = 1;
+  inbox->spool_fd = -1;
+  return result;
+}
+
+message_body_t *message_body_create(const unsigned char *data, size_t len) {
+  message_body_t *body = malloc(sizeof(*body) + len);
+  if (!body) {
+    return NULL;
+  }
+  atomic_init(&body->refs, 1);
+  body->len = len;
+  memcpy(body->data, data, len);
+  return body;
+}
+
+void message_body_release(message_body_t *body) {
+  if (body && atomic_fetch_sub(&body->refs, 1) == 1) {
+    sodium_memzero(body->data, body->len);
+    free(body);
+  }
+}
+
+static void free_stored_message(stored_message_t *msg) {
+  message_body_release(msg->body);
+  msg->body = NULL;
+  msg->encrypted_data = NULL;
+}
+
+void destroy_inbox(user_inbox_t *inbox) {
+  for (int i = 0; i < inbox->count; i++) {
+    free_stored_message(
+        &inbox->messages[(inbox->head + i) % MESSAGE_QUEUE_SIZE]);
+  }
+  inbox->count = 0;
+  inbox->bucket_count = 0;
+  spool_close(inbox);
+  pthread_cond_destroy(&inbox->ready);
+  pthread_mutex_destroy(&inbox->spool_mutex);
+  pthread_mutex_destroy(&inbox->mutex);
+}
+
+// Sequence numbers and message IDs wrap, so order is decided by serial
+// number arithmetic
+static bool sequence_after(uint32_t id, uint32_t reference) {
+  return (int32_t)(id - reference) > 0;
+}
+
+static stored_message_t *inbox_at(user_inbox_t *inbox, int position) {
+  return &inbox->messages[(inbox->head + position) % MESSAGE_QUEUE_SIZE];
+}
+
+static size_t drop_oldest_locked(user_inbox_t *inbox) {
+  size_t bytes = inbox_at(inbox, 0)->encrypted_len;
+  free_stored_message(inbox_at(inbox, 0));
+  inbox->head = (inbox->head + 1) % MESSAGE_QUEUE_SIZE;
+  inbox->count--;
+  return bytes;
+}
+
+// Release every message up to and including seq; caller holds inbox->mutex.
+// Spooled messages up to seq are dropped as spool_refill() reads them back,
+// which callers do once they have let go of the inbox.
+static void trim_inbox_locked(user_inbox_t *inbox, uint32_t seq) {
+  while (inbox->count > 0 && !sequence_after(inbox_at(inbox, 0)->seq, seq)) {
+    drop_oldest_locked(inbox);
+    retention_untrack_locked(inbox, 1);
+  }
+  if (sequence_after(seq, inbox->acked_seq)) {
+    inbox->acked_seq = seq;
+  }
+}
+
+// Read back from the spool if the ring has room for it. Caller holds
+// inbox->mutex, which is released during the read.
+static void refill_locked(user_inbox_t *inbox) {
+  if (inbox->spool_count > 0 && inbox->count < MESSAGE_QUEUE_SIZE) {
+    pthread_mutex_unlock(&inbox->mutex);
+    spool_refill(inbox);
+    pthread_mutex_lock(&inbox->mutex);
+  }
+}
+
+// Drop every message stored in a retention bucket at or before cutoff, whole
+// buckets at a time: ring entries are freed and spooled ones skipped over
+// without being read. Expired messages count as acknowledged. Returns the
+// oldest bucket still stored, or -1 if the inbox is empty.
+int64_t expire_inbox(user_record_t *user, int64_t cutoff,
+                     retention_stats_t *stats) {
+  user_inbox_t *inbox = &user->inbox;
+  pthread_mutex_lock(&inbox->mutex);
+
+  while (inbox->bucket_count > 0 &&
+         inbox->buckets[inbox->bucket_head].bucket <= cutoff) {
+    retention_bucket_t *oldest = &inbox->buckets[inbox->bucket_head];
+
+    // A bucket's messages are the oldest stored: the ring first, then the
+    // front of the spool up to spool_end
+    uint32_t in_ring = oldest->count;
+    if (in_ring > (uint32_t)inbox->count) {
+      in_ring = (uint32_t)inbox->count;
+    }
+    for (uint32_t i = 0; i < in_ring; i++) {
+      stats->reclaimed_memory_bytes += drop_oldest_locked(inbox);
+    }
+    stats->reclaimed_spool_bytes += (uint64_t)spool_discard(
+        inbox, oldest->count - in_ring, oldest->spool_end);
+
+    stats->expired_messages += oldest->count;
+    inbox->acked_seq += oldest->count;
+    retention_untrack_locked(inbox, oldest->count);
+  }
+
+  int64_t next = inbox->bucket_count > 0
+                     ? inbox->buckets[inbox->bucket_head].bucket
+                     : -1;
+  pthread_mutex_unlock(&inbox->mutex);
+
+  spool_refill(inbox);
+  return next;
+}
+
+// Store one message for user; caller holds the inbox mutex. The ciphertext
+// is body's if given (another reference is taken), else a copy of
+// encrypted_data. A message that overflows to the spool is only reserved
+// there: the caller writes it with spool_flush() after unlocking.
+static int store_message_locked(user_record_t *user, const char *sender,
+                                uint32_t message_id, uint32_t group_id,
+                                const unsigned char *encrypted_data,
+                                size_t encrypted_len, message_body_t *body) {
+  user_inbox_t *inbox = &user->inbox;
+
+  stored_message_t msg = {0};
+  msg.message_id = message_id;
+  msg.seq = inbox->next_seq;
+  msg.group_id = group_id;
+  strncpy(msg.sender, sender, MAX_USERNAME_LEN - 1);
+  msg.sender[MAX_USERNAME_LEN - 1] = '\0';
+  msg.timestamp = time(NULL);
+  msg.encrypted_len = encrypted_len;
+
+  if (inbox->count >= MESSAGE_QUEUE_SIZE || inbox->spool_count > 0) {
+    // Ring full, or already overflowing (order must hold): spill to disk
+    msg.encrypted_data = (unsigned char *)encrypted_data;
+    if (spool_reserve(inbox, &msg) < 0) {
+      log_error("Message queue full for user %s", user->username);
+      return -1;
+    }
+    retention_track_locked(user, msg.timestamp, true);
+  } else {
+    if (body) {
+      atomic_fetch_add(&body->refs, 1);
+    } else {
+      body = message_body_create(encrypted_data, encrypted_len);
+      if (!body) {
+        log_error("Failed to allocate memory for queued message");
+        return -1;
+      }
+    }
+    msg.body = body;
+    msg.encrypted_data = body->data;
+    *inbox_at(inbox, inbox->count) = msg;
+    inbox->count++;
+    retention_track_locked(user, msg.timestamp, false);
   }
+  inbox->next_seq++;
 
-  pthread_mutex_lock(&recipient_client->queue_mutex);
+  // Wake any long poll or sync parked on this inbox
+  pthread_cond_broadcast(&inbox->ready);
 
-  if (recipient_client->queue_count >= MESSAGE_QUEUE_SIZE) {
-    pthread_mutex_unlock(&recipient_client->queue_mutex);
-    log_error("Message queue full for user %s", recipient);
+  log_debug("Message %u (seq %u) queued for %s from %s", msg.message_id,
+            msg.seq, user->username, sender);
+  return 0;
+}
+
+int queue_message(user_record_t *recipient_user, const char *sender,
+                  const unsigned char *encrypted_data, size_t encrypted_len) {
+  if (!recipient_user || !sender || !encrypted_data || encrypted_len == 0) {
     return -1;
   }
 
-  stored_message_t *msg =
-      &recipient_client->message_queue[recipient_client->queue_tail];
+  user_inbox_t *inbox = &recipient_user->inbox;
+  pthread_mutex_lock(&inbox->mutex);
 
   pthread_mutex_lock(&server.message_id_mutex);
-  msg->message_id = server.next_message_id++;
+  uint32_t message_id = server.next_message_id++;
   pthread_mutex_unlock(&server.message_id_mutex);
 
-  strncpy(msg->sender, sender, MAX_USERNAME_LEN - 1);
-  msg->sender[MAX_USERNAME_LEN - 1] = '\0';
+  int result = store_message_locked(recipient_user, sender, message_id, 0,
+                                    encrypted_data, encrypted_len, NULL);
+  bool spooled = inbox->spool_pending != NULL;
+  pthread_mutex_unlock(&inbox->mutex);
 
-  strncpy(msg->recipient, recipient, MAX_USERNAME_LEN - 1);
-  msg->recipient[MAX_USERNAME_LEN - 1] = '\0';
+  if (result == 0 && spooled) {
+    result = spool_flush(inbox, recipient_user->username);
+  }
+  return result;
+}
 
-  msg->timestamp = time(NULL);
-  msg->encrypted_len = encrypted_len;
-  msg->delivered = false;
+// Store a message another cluster node accepted, keeping the ID it gave
+int queue_forwarded_message(user_record_t *recipient_user, const char *sender,
+                            uint32_t message_id,
+                            const unsigned char *encrypted_data,
+                            size_t encrypted_len) {
+  if (!recipient_user || !sender || !encrypted_data || encrypted_len == 0) {
+    return -1;
+  }
 
-  msg->encrypted_data = malloc(encrypted_len);
-  if (!msg->encrypted_data) {
-    pthread_mutex_unlock(&recipient_client->queue_mutex);
-    log_error("Failed to allocate memory for queued message");
+  user_inbox_t *inbox = &recipient_user->inbox;
+  pthread_mutex_lock(&inbox->mutex);
+  int result = store_message_locked(recipient_user, sender, message_id, 0,
+                                    encrypted_data, encrypted_len, NULL);
+  bool spooled = inbox->spool_pending != NULL;
+  pthread_mutex_unlock(&inbox->mutex);
+
+  if (result == 0 && spooled) {
+    result = spool_flush(inbox, recipient_user->username);
+  }
+  return result;
+}
+
+// Store a group send for one member, sharing body with the other members'
+// inboxes
+int queue_group_message(user_record_t *member, const char *sender,
+                        uint32_t group_id, uint32_t message_id,
+                        message_body_t *body) {
+  if (!member || !sender || !body) {
     return -1;
   }
 
-  memcpy(msg->encrypted_data, encrypted_data, encrypted_len);
+  user_inbox_t *inbox = &member->inbox;
+  pthread_mutex_lock(&inbox->mutex);
+  int result = store_message_locked(member, sender, message_id, group_id,
+                                    body->data, body->len, body);
+  bool spooled = inbox->spool_pending != NULL;
+  pthread_mutex_unlock(&inbox->mutex);
 
-  recipient_client->queue_tail =
-      (recipient_client->queue_tail + 1) % MESSAGE_QUEUE_SIZE;
-  recipient_client->queue_count++;
+  if (result == 0 && spooled) {
+    result = spool_flush(inbox, member->username);
+  }
+  return result;
+}
 
-  pthread_mutex_unlock(&recipient_client->queue_mutex);
+// Store again an INCOMING_MESSAGE or GROUP_MESSAGE frame that was queued
+// for the user's connection but never written (see outbound_close()),
+// keeping its message ID
+int requeue_pushed_message(user_record_t *user, message_type_t type,
+                           const uint8_t *frame, uint32_t frame_len) {
+  uint32_t group_id = 0;
+  if (type == MSG_GROUP_MESSAGE) {
+    if (frame_len < 4) {
+      return -1;
+    }
+    group_id = get_u32(frame);
+    frame += 4;
+    frame_len -= 4;
+  }
 
-  log_debug("Message %u queued for %s from %s", msg->message_id, recipient,
-            sender);
-  return 0;
+  // [4 bytes: message id][1 byte: sender length][sender]
+  // [4 bytes: timestamp][2 bytes: length][ciphertext]
+  if (frame_len < 5 || frame[4] == 0 || frame[4] >= MAX_USERNAME_LEN ||
+      frame_len < 5u + frame[4] + 6) {
+    return -1;
+  }
+  uint32_t message_id = get_u32(frame);
+  char sender[MAX_USERNAME_LEN];
+  memcpy(sender, &frame[5], frame[4]);
+  sender[frame[4]] = '\0';
+  const uint8_t *length = &frame[5 + frame[4] + 4];
+  size_t encrypted_len = ((size_t)length[0] << 8) | length[1];
+  if (encrypted_len == 0 || frame_len < 5u + frame[4] + 6 + encrypted_len) {
+    return -1;
+  }
+
+  user_inbox_t *inbox = &user->inbox;
+  pthread_mutex_lock(&inbox->mutex);
+  int result = store_message_locked(user, sender, message_id, group_id,
+                                    length + 2, encrypted_len, NULL);
+  bool spooled = inbox->spool_pending != NULL;
+  pthread_mutex_unlock(&inbox->mutex);
+
+  if (result == 0 && spooled) {
+    result = spool_flush(inbox, user->username);
+  }
+  return result;
 }
 
-int deliver_queued_messages(client_connection_t *client) {
-  if (!client || !client->authenticated) {
+// Bytes before the INCOMING_MESSAGE layout in a stored message's frame:
+// [4 bytes: seq] for a sync, then [4 bytes: group id] for a group send
+static size_t stored_frame_prefix(const stored_message_t *msg,
+                                  bool with_seq) {
+  return (with_seq ? 4 : 0) + (msg->group_id != 0 ? 4 : 0);
+}
+
+// Frame one stored message as INCOMING_MESSAGE, or for a sync as
+// SYNC_MESSAGE; group sends become GROUP_MESSAGE and GROUP_SYNC_MESSAGE
+static int send_stored_message(client_connection_t *client,
+                               const stored_message_t *msg, bool with_seq) {
+  size_t prefix = stored_frame_prefix(msg, with_seq);
+  size_t total_size =
+      prefix + incoming_message_size(strlen(msg->sender), msg->encrypted_len);
+
+  // Shared with the outbound lane and a zerocopy send, not copied
+  frame_buffer_t *buffer = frame_buffer_create(NULL, (uint32_t)total_size);
+  if (!buffer) {
+    log_error("Failed to allocate memory for message delivery");
     return -1;
   }
+  uint8_t *payload = buffer->data;
 
-  pthread_mutex_lock(&client->queue_mutex);
+  if (with_seq) {
+    payload[0] = (uint8_t)(msg->seq >> 24);
+    payload[1] = (uint8_t)(msg->seq >> 16);
+    payload[2] = (uint8_t)(msg->seq >> 8);
+    payload[3] = (uint8_t)msg->seq;
+  }
+  if (msg->group_id != 0) {
+    uint8_t *group = payload + prefix - 4;
+    group[0] = (uint8_t)(msg->group_id >> 24);
+    group[1] = (uint8_t)(msg->group_id >> 16);
+    group[2] = (uint8_t)(msg->group_id >> 8);
+    group[3] = (uint8_t)msg->group_id;
+  }
+  encode_incoming_message(payload + prefix, msg->message_id, msg->sender,
+                          (uint32_t)msg->timestamp, msg->encrypted_data,
+                          (uint16_t)msg->encrypted_len);
+
+  message_type_t type;
+  if (msg->group_id != 0) {
+    type = with_seq ? MSG_GROUP_SYNC_MESSAGE : MSG_GROUP_MESSAGE;
+  } else {
+    type = with_seq ? MSG_SYNC_MESSAGE : MSG_INCOMING_MESSAGE;
+  }
+  int result = send_client_buffer(client, type, buffer);
+  if (result < 0) {
+    log_error("Failed to deliver queued message %u to %s", msg->message_id,
+              client->username);
+  }
 
-  int delivered_count = 0;
+  frame_buffer_release(buffer);
+  return result;
+}
 
-  while (client->queue_count > 0) {
-    stored_message_t *msg = &client->message_queue[client->queue_head];
+// Send every stored message and count it as received, reading the spool
+// back as the ring empties; caller holds inbox->mutex. last_id receives the
+// ID of the last message sent (unchanged if none).
+static int deliver_pending_locked(client_connection_t *client,
+                                  user_inbox_t *inbox, uint32_t *last_id) {
+  int delivered_count = 0;
 
-    if (msg->delivered) {
-      client->queue_head = (client->queue_head + 1) % MESSAGE_QUEUE_SIZE;
-      client->queue_count--;
-      continue;
+  for (;;) {
+    if (inbox->count == 0) {
+      refill_locked(inbox);
+      if (inbox->count == 0) {
+        break;
+      }
     }
 
-    size_t sender_len = strlen(msg->sender);
-    size_t total_size = 4 + 1 + sender_len + 4 + 2 + msg->encrypted_len;
-
-    uint8_t *payload = malloc(total_size);
-    if (!payload) {
-      log_error("Failed to allocate memory for message delivery");
+    stored_message_t *msg = inbox_at(inbox, 0);
+    if (send_stored_message(client, msg, false) < 0) {
       break;
     }
 
-    payload[0] = (msg->message_id >> 24) & 0xFF;
-    payload[1] = (msg->message_id >> 16) & 0xFF;
-    payload[2] = (msg->message_id >> 8) & 0xFF;
-    payload[3] = msg->message_id & 0xFF;
+    delivered_count++;
+    *last_id = msg->message_id;
+    log_debug("Delivered queued message %u to %s from %s", msg->message_id,
+              client->username, msg->sender);
 
-    payload[4] = (uint8_t)sender_len;
-    memcpy(&payload[5], msg->sender, sender_len);
+    trim_inbox_locked(inbox, msg->seq);
+  }
 
-    uint32_t timestamp = (uint32_t)msg->timestamp;
-    payload[5 + sender_len] = (timestamp >> 24) & 0xFF;
-    payload[5 + sender_len + 1] = (timestamp >> 16) & 0xFF;
-    payload[5 + sender_len + 2] = (timestamp >> 8) & 0xFF;
-    payload[5 + sender_len + 3] = timestamp & 0xFF;
+  if (delivered_count > 0) {
+    log_info("Delivered %d queued messages to %s", delivered_count,
+             client->username);
+  }
 
-    uint16_t msg_len = (uint16_t)msg->encrypted_len;
-    payload[5 + sender_len + 4] = (msg_len >> 8) & 0xFF;
-    payload[5 + sender_len + 5] = msg_len & 0xFF;
+  return delivered_count;
+}
 
-    memcpy(&payload[5 + sender_len + 6], msg->encrypted_data,
-           msg->encrypted_len);
+static user_inbox_t *client_inbox(client_connection_t *client) {
+  if (!client || !client->authenticated) {
+    return NULL;
+  }
 
-    if (send_network_message(client->socket_fd, MSG_INCOMING_MESSAGE, payload,
-                             total_size) == 0) {
-      msg->delivered = true;
-      delivered_count++;
+  user_record_t *user = find_user(client->username);
+  return user ? &user->inbox : NULL;
+}
 
-      log_debug("Delivered queued message %u to %s from %s", msg->message_id,
-                client->username, msg->sender);
-    } else {
-      log_error("Failed to deliver queued message %u to %s", msg->message_id,
-                client->username);
-      sodium_memzero(payload, total_size);
-      free(payload);
+int deliver_queued_messages(client_connection_t *client) {
+  user_inbox_t *inbox = client_inbox(client);
+  if (!inbox) {
+    return -1;
+  }
+
+  uint32_t last_id = 0;
+  pthread_mutex_lock(&inbox->mutex);
+  int delivered_count = deliver_pending_locked(client, inbox, &last_id);
+  pthread_mutex_unlock(&inbox->mutex);
+
+  return delivered_count;
+}
+
+static void poll_deadline(uint32_t timeout_ms, struct timespec *deadline) {
+  if (timeout_ms > LONG_POLL_MAX_MS) {
+    timeout_ms = LONG_POLL_MAX_MS;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, deadline);
+  deadline->tv_sec += timeout_ms / 1000;
+  deadline->tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+  if (deadline->tv_nsec >= 1000000000L) {
+    deadline->tv_sec++;
+    deadline->tv_nsec -= 1000000000L;
+  }
+}
+
+// Park the calling connection's thread until the newest stored seq is after
+// `after`, the deadline passes, or the connection/server stops. Caller holds
+// inbox->mutex.
+static void wait_for_seq_locked(client_connection_t *client,
+                                user_inbox_t *inbox, uint32_t after,
+                                const struct timespec *deadline) {
+  inbox->waiters++;
+  while (!sequence_after(inbox->next_seq - 1, after) && client->connected &&
+         server.running) {
+    if (pthread_cond_timedwait(&inbox->ready, &inbox->mutex, deadline) ==
+        ETIMEDOUT) {
       break;
     }
+  }
+  inbox->waiters--;
+}
 
-    sodium_memzero(payload, total_size);
-    free(payload);
+// Long-poll form of deliver_queued_messages(). Messages up to last_seen_id
+// (0 for none) already reached the client, e.g. as a push, and are dropped.
+// If nothing newer is queued the calling connection's thread parks on the
+// inbox until queue_message() adds something or timeout_ms passes, instead
+// of the client re-polling in a loop.
+int wait_for_messages(client_connection_t *client, uint32_t timeout_ms,
+                      uint32_t last_seen_id, uint32_t *last_id) {
+  user_inbox_t *inbox = client_inbox(client);
+  if (!inbox || !last_id) {
+    return -1;
+  }
+
+  struct timespec deadline;
+  poll_deadline(timeout_ms, &deadline);
+
+  pthread_mutex_lock(&inbox->mutex);
+
+  while (last_seen_id != 0 && inbox->count > 0 &&
+         !sequence_after(inbox_at(inbox, 0)->message_id, last_seen_id)) {
+    trim_inbox_locked(inbox, inbox_at(inbox, 0)->seq);
+  }
 
-    if (msg->encrypted_data) {
-      sodium_memzero(msg->encrypted_data, msg->encrypted_len);
-      free(msg->encrypted_data);
-      msg->encrypted_data = NULL;
+  refill_locked(inbox);
+  if (inbox->count == 0) {
+    wait_for_seq_locked(client, inbox, inbox->next_seq - 1, &deadline);
+  }
+
+  *last_id = last_seen_id;
+  int delivered_count = deliver_pending_locked(client, inbox, last_id);
+
+  pthread_mutex_unlock(&inbox->mutex);
+  return delivered_count;
+}
+
+// Send the messages stored after after_seq, oldest first, as SYNC_MESSAGE
+// frames totalling at most max_bytes (always at least one message, so a
+// large message cannot stall the sync). Asking for "after N" acknowledges
+// 1..N, which are trimmed. With timeout_ms > 0 and nothing newer stored, the
+// call waits for new mail like a long poll. Messages stay stored until
+// acknowledged.
+int sync_messages(client_connection_t *client, uint32_t after_seq,
+                  uint32_t max_bytes, uint32_t timeout_ms,
+                  sync_result_t *result) {
+  user_inbox_t *inbox = client_inbox(client);
+  if (!inbox || !result) {
+    return -1;
+  }
+
+  struct timespec deadline;
+  poll_deadline(timeout_ms, &deadline);
+
+  pthread_mutex_lock(&inbox->mutex);
+
+  // A cursor from before this inbox's numbering (e.g. ahead of next_seq
+  // after a server restart) is treated as "from the start"
+  if (sequence_after(after_seq, inbox->next_seq - 1)) {
+    after_seq = 0;
+  }
+  trim_inbox_locked(inbox, after_seq);
+  refill_locked(inbox);
+
+  if (timeout_ms > 0) {
+    wait_for_seq_locked(client, inbox, after_seq, &deadline);
+    refill_locked(inbox);
+  }
+
+  memset(result, 0, sizeof(*result));
+  result->last_seq = after_seq;
+
+  size_t sent_bytes = 0;
+  for (int i = 0; i < inbox->count; i++) {
+    stored_message_t *msg = inbox_at(inbox, i);
+    if (!sequence_after(msg->seq, after_seq)) {
+      continue;
+    }
+
+    size_t frame_bytes =
+        stored_frame_prefix(msg, true) +
+        incoming_message_size(strlen(msg->sender), msg->encrypted_len);
+    if (result->count > 0 && sent_bytes + frame_bytes > max_bytes) {
+      break;
+    }
+    if (send_stored_message(client, msg, true) < 0) {
+      break;
     }
 
-    client->queue_head = (client->queue_head + 1) % MESSAGE_QUEUE_SIZE;
-    client->queue_count--;
+    sent_bytes += frame_bytes;
+    result->count++;
+    result->last_seq = msg->seq;
   }
 
-  pthread_mutex_unlock(&client->queue_mutex);
+  result->newest_seq = inbox->next_seq - 1;
+  result->acked_seq = inbox->acked_seq;
 
-  if (delivered_count > 0) {
-    log_info("Delivered %d queued messages to %s", delivered_count,
-             client->username);
+  pthread_mutex_unlock(&inbox->mutex);
+
+  log_debug("Synced %u messages (seq %u..%u of %u) to %s", result->count,
+            after_seq + 1, result->last_seq, result->newest_seq,
+            client->username);
+  return result->count;
+}
+
+// Cumulative acknowledgement: the recipient holds every message up to seq
+int ack_messages(user_record_t *user, uint32_t seq) {
+  if (!user) {
+    return -1;
   }
 
-  return delivered_count;
+  user_inbox_t *inbox = &user->inbox;
+  pthread_mutex_lock(&inbox->mutex);
+  if (sequence_after(seq, inbox->next_seq - 1)) {
+    pthread_mutex_unlock(&inbox->mutex);
+    return -1;
+  }
+  trim_inbox_locked(inbox, seq);
+  pthread_mutex_unlock(&inbox->mutex);
+
+  spool_refill(inbox);
+  return 0;
+}
+
+bool inbox_has_waiters(user_record_t *user) {
+  pthread_mutex_lock(&user->inbox.mutex);
+  bool waiting = user->inbox.waiters > 0;
+  pthread_mutex_unlock(&user->inbox.mutex);
+  return waiting;
 }
\ No newline at end of file
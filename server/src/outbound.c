@@ -0,0 +1,420 @@
+#include "../include/c-chat-server.h"
+
+// Outbound frame priority
+//
+// Frames for one connection come from many threads: its own handler, senders
+// relaying to it, presence broadcasts and the timer thread. Only one thread
+// writes to the socket at a time, and there is no dedicated writer: the
+// thread that finds the socket free becomes the writer. It writes its own
+// frame, then keeps flushing whatever others queued meanwhile until the
+// lanes are empty, and only then returns to its own work. A thread that
+// finds the socket busy leaves a copy on the frame's lane and returns
+// without waiting; send_client_message() returns 1 for such a frame, which
+// has been accepted but not yet written.
+//
+// There are two lanes. The control lane carries small frames somebody is
+// waiting on (acknowledgements, presence, errors, pings, login, key, group
+// and file transfer replies); the bulk lane carries message bodies and
+// listings. The writer always empties the control lane before taking the
+// next bulk frame, so a backlog drain delays an ACK by at most one frame
+// instead of the whole backlog. Order is kept within a lane, never across
+// lanes, so every frame of a multi-frame response shares one lane. A bulk
+// lane holding OUTBOUND_BULK_MAX_BYTES refuses further bulk frames; control
+// frames may fill the rest of OUTBOUND_MAX_BYTES.
+//
+// A refused frame, or one whose own write fails, returns -1 to its sender,
+// and a relayed message falls back to the recipient's inbox. A failed write
+// also shuts the connection down, since the peer can no longer find the next
+// frame boundary. Frames still queued then stay on their lanes until
+// outbound_close(), which puts pushed message bodies back in the user's
+// inbox so that a message reported as accepted is never lost.
+//
+// A frame queued from send_client_message() is copied onto its lane; one
+// sent with send_client_buffer() is queued by reference, and its buffer also
+// lets a large frame go out without the kernel copying it (see transport.c).
+//
+// File data is not copied onto a lane: send_client_file() waits to become
+// the writer and sends straight from the spool file, so one such frame
+// delays queued control frames like any other bulk frame.
+
+struct outbound_frame {
+  outbound_frame_t *next;
+  message_type_t type;
+  frame_buffer_t *buffer;
+};
+
+frame_buffer_t *frame_buffer_create(const uint8_t *data, uint32_t len) {
+  frame_buffer_t *buffer = malloc(sizeof(*buffer) + len);
+  if (!buffer) {
+    return NULL;
+  }
+  atomic_init(&buffer->refs, 1);
+  buffer->len = len;
+  if (data && len > 0) {
+    memcpy(buffer->data, data, len);
+  }
+  return buffer;
+}
+
+frame_buffer_t *frame_buffer_hold(frame_buffer_t *buffer) {
+  atomic_fetch_add(&buffer->refs, 1);
+  return buffer;
+}
+
+void frame_buffer_release(frame_buffer_t *buffer) {
+  if (buffer && atomic_fetch_sub(&buffer->refs, 1) == 1) {
+    sodium_memzero(buffer->data, buffer->len);
+    free(buffer);
+  }
+}
+
+static outbound_lane_t outbound_lane(message_type_t type) {
+  switch (type) {
+  case MSG_MESSAGE_ACK:
+  case MSG_STATUS_UPDATE:
+  case MSG_ERROR:
+  case MSG_PING:
+  case MSG_REGISTER_RESPONSE:
+  case MSG_LOGIN_RESPONSE:
+  case MSG_PUBLIC_KEY_RESPONSE:
+  case MSG_GROUP_RESPONSE:
+  case MSG_MULTI_ACK:
+  case MSG_FILE_RESPONSE:
+    return LANE_CONTROL;
+  default:
+    return LANE_BULK;
+  }
+}
+
+static void free_frame(outbound_frame_t *frame) {
+  frame_buffer_release(frame->buffer);
+  free(frame);
+}
+
+// Take every queued frame off the lanes as one list; caller holds
+// send_mutex
+static outbound_frame_t *detach_queued_locked(client_connection_t *client) {
+  outbound_frame_t *list = NULL;
+  outbound_frame_t **end = &list;
+  for (int lane = 0; lane < OUTBOUND_LANES; lane++) {
+    *end = client->lane_head[lane];
+    if (client->lane_tail[lane]) {
+      end = &client->lane_tail[lane]->next;
+    }
+    client->lane_head[lane] = NULL;
+    client->lane_tail[lane] = NULL;
+    client->lane_bytes[lane] = 0;
+  }
+  return list;
+}
+
+// Put a frame that could not be written back at the head of its lane;
+// caller holds send_mutex
+static void requeue_front_locked(client_connection_t *client,
+                                 outbound_frame_t *frame) {
+  outbound_lane_t lane = outbound_lane(frame->type);
+  frame->next = client->lane_head[lane];
+  client->lane_head[lane] = frame;
+  if (!client->lane_tail[lane]) {
+    client->lane_tail[lane] = frame;
+  }
+  client->lane_bytes[lane] += frame->buffer->len;
+}
+
+// Mark the connection broken after a failed write; queued frames stay for
+// outbound_close(). Caller holds send_mutex.
+static void close_broken_locked(client_connection_t *client) {
+  if (!client->send_closed) {
+    log_error("Write to connection %u failed, closing it",
+              client->connection_id);
+  }
+  client->send_closed = true;
+}
+
+// Next frame to write, control lane first; caller holds send_mutex
+static outbound_frame_t *next_frame_locked(client_connection_t *client) {
+  for (int lane = 0; lane < OUTBOUND_LANES; lane++) {
+    outbound_frame_t *frame = client->lane_head[lane];
+    if (frame) {
+      client->lane_head[lane] = frame->next;
+      if (!frame->next) {
+        client->lane_tail[lane] = NULL;
+      }
+      client->lane_bytes[lane] -= frame->buffer->len;
+      return frame;
+    }
+  }
+  return NULL;
+}
+
+// Queue a reference to buffer, or else a copy of payload; caller holds
+// send_mutex and has checked the lane budget
+static int enqueue_locked(client_connection_t *client, outbound_lane_t lane,
+                          message_type_t type, const uint8_t *payload,
+                          uint32_t payload_len, frame_buffer_t *buffer) {
+  outbound_frame_t *frame = malloc(sizeof(*frame));
+  frame_buffer_t *queued = NULL;
+  if (frame) {
+    queued = buffer ? frame_buffer_hold(buffer)
+                    : frame_buffer_create(payload, payload_len);
+  }
+  if (!queued) {
+    log_error("Failed to allocate outbound frame");
+    free(frame);
+    return -1;
+  }
+
+  frame->next = NULL;
+  frame->type = type;
+  frame->buffer = queued;
+
+  if (client->lane_tail[lane]) {
+    client->lane_tail[lane]->next = frame;
+  } else {
+    client->lane_head[lane] = frame;
+  }
+  client->lane_tail[lane] = frame;
+  client->lane_bytes[lane] += payload_len;
+  return 0;
+}
+
+// Whether lane can take payload_len more bytes; caller holds send_mutex
+static bool lane_has_room_locked(const client_connection_t *client,
+                                 outbound_lane_t lane, uint32_t payload_len) {
+  size_t total = 0;
+  for (int i = 0; i < OUTBOUND_LANES; i++) {
+    total += client->lane_bytes[i];
+  }
+  if (total + payload_len > OUTBOUND_MAX_BYTES) {
+    return false;
+  }
+  return lane != LANE_BULK ||
+         client->lane_bytes[LANE_BULK] + payload_len <=
+             OUTBOUND_BULK_MAX_BYTES;
+}
+
+// Write one frame as the connection's writer; send_mutex is not held
+static int write_frame(client_connection_t *client, int socket_fd,
+                       message_type_t type, const uint8_t *payload,
+                       uint32_t payload_len, frame_buffer_t *buffer) {
+  if (send_network_message(socket_fd, type, payload, payload_len, buffer) ==
+      0) {
+    return 0;
+  }
+
+  pthread_mutex_lock(&client->send_mutex);
+  close_broken_locked(client);
+  pthread_mutex_unlock(&client->send_mutex);
+
+  get_transport()->shutdown(socket_fd);
+  return -1;
+}
+
+// Flush what other threads queued while this one was writing, then give up
+// the socket. After a failed write the rest stays queued for
+// outbound_close().
+static void finish_writing(client_connection_t *client, int socket_fd) {
+  pthread_mutex_lock(&client->send_mutex);
+  outbound_frame_t *frame;
+  while (!client->send_closed &&
+         (frame = next_frame_locked(client)) != NULL) {
+    pthread_mutex_unlock(&client->send_mutex);
+    int result = write_frame(client, socket_fd, frame->type,
+                             frame->buffer->data, frame->buffer->len,
+                             frame->buffer);
+    pthread_mutex_lock(&client->send_mutex);
+    if (result < 0) {
+      requeue_front_locked(client, frame);
+    } else {
+      free_frame(frame);
+    }
+  }
+  client->sending = false;
+  pthread_cond_broadcast(&client->send_idle);
+  pthread_mutex_unlock(&client->send_mutex);
+}
+
+// Send one frame, held in buffer if that is not NULL, else in payload
+static int send_frame(client_connection_t *client, message_type_t type,
+                      const uint8_t *payload, uint32_t payload_len,
+                      frame_buffer_t *buffer) {
+  outbound_lane_t lane = outbound_lane(type);
+
+  pthread_mutex_lock(&client->send_mutex);
+  if (client->send_closed) {
+    pthread_mutex_unlock(&client->send_mutex);
+    return -1;
+  }
+
+  if (client->sending) {
+    int result = -1;
+    if (lane_has_room_locked(client, lane, payload_len)) {
+      if (enqueue_locked(client, lane, type, payload, payload_len, buffer) ==
+          0) {
+        result = 1;
+      }
+    } else {
+      log_debug("Outbound queue full for connection %u, refusing type "
+                "0x%02X",
+                client->connection_id, type);
+    }
+    pthread_mutex_unlock(&client->send_mutex);
+    return result;
+  }
+
+  // Nothing is queued while nobody is writing, so this frame goes first
+  client->sending = true;
+  int socket_fd = client->socket_fd;
+  pthread_mutex_unlock(&client->send_mutex);
+
+  int result =
+      write_frame(client, socket_fd, type, payload, payload_len, buffer);
+  finish_writing(client, socket_fd);
+  return result;
+}
+
+// Send one frame to a connection, or queue a copy of it behind the thread
+// already writing to it. 0 means written, 1 queued and -1 refused or failed.
+int send_client_message(client_connection_t *client, message_type_t type,
+                        const uint8_t *payload, uint32_t payload_len) {
+  if (!payload) {
+    payload_len = 0;
+  }
+  return send_frame(client, type, payload, payload_len, NULL);
+}
+
+// As send_client_message(), but a queued frame shares buffer instead of
+// copying it, and a large one may be sent without copying at all. The caller
+// keeps its own reference.
+int send_client_buffer(client_connection_t *client, message_type_t type,
+                       frame_buffer_t *buffer) {
+  return send_frame(client, type, buffer->data, buffer->len, buffer);
+}
+
+// Send a control frame without ever waiting on the socket: behind the
+// current writer if there is one, else with a non-blocking write under
+// send_mutex. A socket that cannot take the frame at once is shut down, as
+// for a failed write. 0 means written, 1 queued and -1 refused or failed.
+int send_client_message_nowait(client_connection_t *client,
+                               message_type_t type, const uint8_t *payload,
+                               uint32_t payload_len) {
+  if (!payload) {
+    payload_len = 0;
+  }
+
+  pthread_mutex_lock(&client->send_mutex);
+  if (client->send_closed) {
+    pthread_mutex_unlock(&client->send_mutex);
+    return -1;
+  }
+
+  int result = -1;
+  if (client->sending) {
+    if (lane_has_room_locked(client, LANE_CONTROL, payload_len) &&
+        enqueue_locked(client, LANE_CONTROL, type, payload, payload_len,
+                       NULL) == 0) {
+      result = 1;
+    }
+    pthread_mutex_unlock(&client->send_mutex);
+    return result;
+  }
+
+  uint8_t header[MESSAGE_HEADER_SIZE];
+  encode_message_header(header, type, payload_len);
+  int socket_fd = client->socket_fd;
+  result = get_transport()->try_send_frame(socket_fd, header, sizeof(header),
+                                           payload, payload_len);
+  if (result < 0) {
+    close_broken_locked(client);
+  }
+  pthread_mutex_unlock(&client->send_mutex);
+
+  if (result < 0) {
+    get_transport()->shutdown(socket_fd);
+  }
+  return result;
+}
+
+// Send a frame made of prefix followed by len bytes of file_fd from offset,
+// waiting until the socket is free. 0 means written.
+int send_client_file(client_connection_t *client, message_type_t type,
+                     const uint8_t *prefix, uint32_t prefix_len, int file_fd,
+                     off_t offset, uint32_t len) {
+  uint8_t header[MESSAGE_HEADER_SIZE + 64];
+  if (prefix_len > sizeof(header) - MESSAGE_HEADER_SIZE) {
+    return -1;
+  }
+  encode_message_header(header, type, prefix_len + len);
+  memcpy(header + MESSAGE_HEADER_SIZE, prefix, prefix_len);
+
+  pthread_mutex_lock(&client->send_mutex);
+  while (client->sending && !client->send_closed) {
+    pthread_cond_wait(&client->send_idle, &client->send_mutex);
+  }
+  if (client->send_closed) {
+    pthread_mutex_unlock(&client->send_mutex);
+    return -1;
+  }
+  client->sending = true;
+  int socket_fd = client->socket_fd;
+  pthread_mutex_unlock(&client->send_mutex);
+
+  int result = 0;
+  if (get_transport()->send_file(socket_fd, header,
+                                 MESSAGE_HEADER_SIZE + prefix_len, file_fd,
+                                 offset, len) < 0) {
+    pthread_mutex_lock(&client->send_mutex);
+    close_broken_locked(client);
+    pthread_mutex_unlock(&client->send_mutex);
+
+    get_transport()->shutdown(socket_fd);
+    result = -1;
+  }
+
+  finish_writing(client, socket_fd);
+  return result;
+}
+
+// Called by accept_client() for every new connection
+void outbound_open(client_connection_t *client) {
+  pthread_mutex_lock(&client->send_mutex);
+  client->send_closed = false;
+  pthread_mutex_unlock(&client->send_mutex);
+}
+
+// Refuse further frames and wait for a writer still using the socket, so
+// the caller may close it. A writer blocked on a slow peer is interrupted by
+// shutting the socket down rather than waited out. Message bodies that were
+// queued but never written go back to user's inbox; other queued frames are
+// dropped. Called without any inbox lock held.
+void outbound_close(client_connection_t *client, user_record_t *user) {
+  pthread_mutex_lock(&client->send_mutex);
+  client->send_closed = true;
+  if (client->sending) {
+    get_transport()->shutdown(client->socket_fd);
+  }
+  while (client->sending) {
+    pthread_cond_wait(&client->send_idle, &client->send_mutex);
+  }
+  outbound_frame_t *frame = detach_queued_locked(client);
+  pthread_mutex_unlock(&client->send_mutex);
+
+  int restored = 0;
+  while (frame) {
+    outbound_frame_t *next = frame->next;
+    if (user && (frame->type == MSG_INCOMING_MESSAGE ||
+                 frame->type == MSG_GROUP_MESSAGE)) {
+      if (requeue_pushed_message(user, frame->type, frame->buffer->data,
+                                 frame->buffer->len) == 0) {
+        restored++;
+      }
+    }
+    free_frame(frame);
+    frame = next;
+  }
+
+  if (restored > 0) {
+    log_info("Returned %d unsent messages to %s's inbox", restored,
+             user->username);
+  }
+}
\ No newline at end of file
@@ -0,0 +1,133 @@
+#include "../include/c-chat-server.h"
+
+// Overload control
+//
+// Each connection has its own handler thread, so under overload work does
+// not queue in the server but in front of it: frames sit in socket buffers
+// while runnable threads wait for a CPU. That wait is measured directly, per
+// frame, as the time from the kernel receiving the header to its dispatch
+// (the transport's arrival_ns()). A frame that arrived while its own
+// connection was still busy with the previous request (a long poll, or a
+// send to a slow peer) waited on that request rather than on the server, so
+// it is timed from when its thread went back to reading instead.
+//
+// Following CoDel, a short burst of delay is fine; a standing queue is not.
+// Time is cut into OVERLOAD_INTERVAL_MS intervals and only the smallest
+// delay seen in each one counts: while any frame gets through quickly there
+// is no standing queue. An interval whose minimum is above
+// OVERLOAD_TARGET_MS makes the server overloaded, and it stays so until an
+// interval's minimum is below target again. While overloaded, low-priority
+// frames are refused with ERR_RATE_LIMIT before their payload is allocated,
+// which leaves the CPU to relay and delivery for sessions already logged in.
+
+#define NS_PER_MS 1000000LL
+
+// Monotonic start of the current interval, and the least delay seen in it
+static _Atomic int64_t interval_start;
+static _Atomic int64_t interval_min;
+static atomic_bool overloaded;
+static _Atomic uint64_t shed_frames;
+
+static int64_t monotonic_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static int64_t realtime_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Work that can wait or be retried without hurting established sessions:
+// directory reads, presence, group management, new file transfers and new
+// sessions
+static bool low_priority(uint8_t type) {
+  switch (type) {
+  case MSG_FILE_OFFER:
+  case MSG_LIST_USERS:
+  case MSG_SEARCH_USERS:
+  case MSG_CREATE_GROUP:
+  case MSG_UPDATE_GROUP:
+  case MSG_GET_GROUP:
+  case MSG_SET_STATUS:
+  case MSG_REGISTER_USER:
+  case MSG_LOGIN_USER:
+    return true;
+  default:
+    return false;
+  }
+}
+
+static void lower_interval_min(int64_t sojourn_ns) {
+  int64_t least = atomic_load_explicit(&interval_min, memory_order_relaxed);
+  while (sojourn_ns < least &&
+         !atomic_compare_exchange_weak(&interval_min, &least, sojourn_ns)) {
+  }
+}
+
+static void set_overloaded(bool state, int64_t least_ns) {
+  if (atomic_exchange(&overloaded, state) == state) {
+    return;
+  }
+  if (state) {
+    log_error("Overloaded: frames waiting at least %lld ms, shedding "
+              "low-priority requests",
+              (long long)(least_ns / NS_PER_MS));
+  } else {
+    log_info("Overload cleared after shedding %llu frames",
+             (unsigned long long)atomic_load(&shed_frames));
+  }
+}
+
+void overload_record(int64_t sojourn_ns) {
+  int64_t now = monotonic_ns();
+  int64_t start = atomic_load_explicit(&interval_start, memory_order_relaxed);
+  if (start != 0 && now - start < OVERLOAD_INTERVAL_MS * NS_PER_MS) {
+    lower_interval_min(sojourn_ns);
+    return;
+  }
+
+  // The interval is over; the one thread that starts the next judges it
+  if (!atomic_compare_exchange_strong(&interval_start, &start, now)) {
+    lower_interval_min(sojourn_ns);
+    return;
+  }
+  int64_t least = atomic_exchange(&interval_min, sojourn_ns);
+  if (start == 0) {
+    return;
+  }
+
+  // No frame at all for a whole interval means nothing was queued
+  bool idle = now - start >= 2 * OVERLOAD_INTERVAL_MS * NS_PER_MS;
+  set_overloaded(!idle && least >= OVERLOAD_TARGET_MS * NS_PER_MS, least);
+}
+
+// Record the frame's queueing delay and decide whether to refuse it.
+// ready_ns is when the connection's thread last went back to reading.
+bool overload_shed(uint8_t type, int64_t arrival_ns, int64_t ready_ns) {
+  if (arrival_ns > 0) {
+    int64_t queued_since = arrival_ns > ready_ns ? arrival_ns : ready_ns;
+    int64_t sojourn = realtime_ns() - queued_since;
+    // A wall clock step makes the sample meaningless
+    if (sojourn >= 0 && sojourn < 60 * 1000 * NS_PER_MS) {
+      overload_record(sojourn);
+    }
+  }
+
+  if (!atomic_load_explicit(&overloaded, memory_order_relaxed) ||
+      !low_priority(type)) {
+    return false;
+  }
+
+  atomic_fetch_add_explicit(&shed_frames, 1, memory_order_relaxed);
+  return true;
+}
+
+// CLOCK_REALTIME now, for the ready_ns argument of overload_shed()
+int64_t overload_clock(void) { return realtime_ns(); }
+
+bool overload_active(void) { return atomic_load(&overloaded); }
+
+uint64_t overload_shed_count(void) { return atomic_load(&shed_frames); }
\ No newline at end of file
@@ -1,26 +1,92 @@
 #include "../include/c-chat-server.h"
 
-int send_network_message(int socket_fd, message_type_t type,
-                         const uint8_t *payload, uint32_t payload_len) {
-  uint8_t header[5];
-
+void encode_message_header(uint8_t *header, message_type_t type,
+                           uint32_t payload_len) {
   header[0] = (payload_len >> 24) & 0xFF;
   header[1] = (payload_len >> 16) & 0xFF;
   header[2] = (payload_len >> 8) & 0xFF;
   header[3] = payload_len & 0xFF;
   header[4] = (uint8_t)type;
+}
+
+void decode_message_header(const uint8_t *header, network_message_t *msg) {
+  msg->length = ((uint32_t)header[0] << 24) | ((uint32_t)header[1] << 16) |
+                ((uint32_t)header[2] << 8) | ((uint32_t)header[3]);
+  msg->type = header[4];
+}
+
+size_t incoming_message_size(size_t sender_len, size_t encrypted_len) {
+  return 4 + 1 + sender_len + 4 + 2 + encrypted_len;
+}
+
+size_t encode_incoming_message(uint8_t *payload, uint32_t message_id,
+                               const char *sender, uint32_t timestamp,
+                               const unsigned char *encrypted_data,
+                               uint16_t encrypted_len) {
+  size_t sender_len = strlen(sender);
+
+  payload[0] = (message_id >> 24) & 0xFF;
+  payload[1] = (message_id >> 16) & 0xFF;
+  payload[2] = (message_id >> 8) & 0xFF;
+  payload[3] = message_id & 0xFF;
+
+  payload[4] = (uint8_t)sender_len;
+  memcpy(&payload[5], sender, sender_len);
+
+  payload[5 + sender_len] = (timestamp >> 24) & 0xFF;
+  payload[5 + sender_len + 1] = (timestamp >> 16) & 0xFF;
+  payload[5 + sender_len + 2] = (timestamp >> 8) & 0xFF;
+  payload[5 + sender_len + 3] = timestamp & 0xFF;
+
+  payload[5 + sender_len + 4] = (encrypted_len >> 8) & 0xFF;
+  payload[5 + sender_len + 5] = encrypted_len & 0xFF;
 
-  if (send(socket_fd, header, sizeof(header), MSG_NOSIGNAL) != sizeof(header)) {
-    log_error("Failed to send message header: %s", strerror(errno));
+  memcpy(&payload[5 + sender_len + 6], encrypted_data, encrypted_len);
+
+  return incoming_message_size(sender_len, encrypted_len);
+}
+
+int parse_send_message(const uint8_t *payload, uint32_t payload_len,
+                       char *recipient, const unsigned char **encrypted_data,
+                       uint16_t *encrypted_len) {
+  if (!payload || payload_len < 3) {
     return -1;
   }
 
-  if (payload_len > 0 && payload) {
-    if (send(socket_fd, payload, payload_len, MSG_NOSIGNAL) !=
-        (ssize_t)payload_len) {
-      log_error("Failed to send message payload: %s", strerror(errno));
-      return -1;
-    }
+  uint8_t recipient_len = payload[0];
+  if (recipient_len == 0 || recipient_len >= MAX_USERNAME_LEN ||
+      payload_len < 1u + recipient_len + 2u) {
+    return -1;
+  }
+
+  memcpy(recipient, &payload[1], recipient_len);
+  recipient[recipient_len] = '\0';
+
+  uint16_t message_len = ((uint16_t)payload[1 + recipient_len] << 8) |
+                         payload[1 + recipient_len + 1];
+
+  if (message_len == 0 ||
+      payload_len < 1u + recipient_len + 2u + message_len) {
+    return -2;
+  }
+
+  *encrypted_data = &payload[1 + recipient_len + 2];
+  *encrypted_len = message_len;
+  return 0;
+}
+
+// owner, if not NULL, holds payload (see transport_ops_t.send_frame)
+int send_network_message(int socket_fd, message_type_t type,
+                         const uint8_t *payload, uint32_t payload_len,
+                         frame_buffer_t *owner) {
+  uint8_t header[MESSAGE_HEADER_SIZE];
+  encode_message_header(header, type, payload_len);
+
+  if (get_transport()->send_frame(socket_fd, header, sizeof(header), payload,
+                                  payload ? payload_len : 0, owner) < 0) {
+    log_error("Failed to send message type 0x%02X: %s", type,
+              strerror(errno));
+    return -1;
   }
 
   log_debug("Sent message type 0x%02X with %u bytes payload", type,
@@ -28,13 +94,16 @@ int send_network_message(int socket_fd, message_type_t type,
   return 0;
 }
 
-int receive_network_message(int socket_fd, network_message_t *msg) {
+// Read and check a frame header only, so the caller can decide whether the
+// payload is worth allocating. Returns -2 when the peer closed cleanly.
+int receive_message_header(int socket_fd, network_message_t *msg) {
   if (!msg) {
     return -1;
   }
 
-  uint8_t header[5];
-  ssize_t received = recv(socket_fd, header, sizeof(header), MSG_WAITALL);
+  uint8_t header[MESSAGE_HEADER_SIZE];
+  ssize_t received =
+      get_transport()->recv_exact(socket_fd, header, sizeof(header));
 
   if (received == 0) {
     log_debug("Client disconnected");
@@ -48,15 +117,24 @@ int receive_network_message(int socket_fd, network_message_t *msg) {
     return -1;
   }
 
-  msg->length = ((uint32_t)header[0] << 24) | ((uint32_t)header[1] << 16) |
-                ((uint32_t)header[2] << 8) | ((uint32_t)header[3]);
-  msg->type = header[4];
+  decode_message_header(header, msg);
+  msg->payload = NULL;
 
-  if (msg->length > MAX_MESSAGE_LEN * 2) {
+  uint32_t max_length = MAX_MESSAGE_LEN * 2;
+  if (msg->type == MSG_SEND_MULTI) {
+    max_length = SEND_MULTI_MAX_PAYLOAD;
+  } else if (msg->type == MSG_FILE_CHUNK) {
+    max_length = 12 + FILE_CHUNK_MAX_BYTES;
+  }
+  if (msg->length > max_length) {
     log_error("Message too large: %u bytes", msg->length);
     return -1;
   }
 
+  return 0;
+}
+
+int receive_message_payload(int socket_fd, network_message_t *msg) {
   if (msg->length > 0) {
     msg->payload = malloc(msg->length);
     if (!msg->payload) {
@@ -64,7 +142,8 @@ int receive_network_message(int socket_fd, network_message_t *msg) {
       return -1;
     }
 
-    received = recv(socket_fd, msg->payload, msg->length, MSG_WAITALL);
+    ssize_t received =
+        get_transport()->recv_exact(socket_fd, msg->payload, msg->length);
     if (received != (ssize_t)msg->length) {
       log_error(
           "Failed to receive message payload: received %zd bytes, expected %u",
@@ -82,6 +161,30 @@ int receive_network_message(int socket_fd, network_message_t *msg) {
   return 0;
 }
 
+// Consume a frame's payload without keeping it, to refuse the frame but keep
+// the connection in step
+int discard_message_payload(int socket_fd, const network_message_t *msg) {
+  uint8_t scratch[512];
+  uint32_t remaining = msg->length;
+  while (remaining > 0) {
+    size_t chunk = remaining < sizeof(scratch) ? remaining : sizeof(scratch);
+    if (get_transport()->recv_exact(socket_fd, scratch, chunk) !=
+        (ssize_t)chunk) {
+      return -1;
+    }
+    remaining -= (uint32_t)chunk;
+  }
+  return 0;
+}
+
+int receive_network_message(int socket_fd, network_message_t *msg) {
+  int result = receive_message_header(socket_fd, msg);
+  if (result < 0) {
+    return result;
+  }
+  return receive_message_payload(socket_fd, msg);
+}
+
 void free_network_message(network_message_t *msg) {
   if (msg && msg->payload) {
     if (msg->length > 0) {
@@ -92,7 +195,7 @@ void free_network_message(network_message_t *msg) {
   }
 }
 
-int send_error(int socket_fd, error_code_t error_code,
+int send_error(client_connection_t *client, error_code_t error_code,
                const char *error_message) {
   size_t msg_len = error_message ? strlen(error_message) : 0;
   uint8_t *payload = malloc(3 + msg_len);
@@ -108,7 +211,7 @@ int send_error(int socket_fd, error_code_t error_code,
     memcpy(&payload[3], error_message, msg_len);
   }
 
-  int result = send_network_message(socket_fd, MSG_ERROR, payload, 3 + msg_len);
+  int result = send_client_message(client, MSG_ERROR, payload, 3 + msg_len);
 
   sodium_memzero(payload, 3 + msg_len);
   free(payload);
@@ -135,19 +238,4 @@ int validate_username_server(const char *username) {
   }
 
   return 0;
-}
-
-bool check_rate_limit(client_connection_t *client) {
-  time_t now = time(NULL);
-
-  if (now - client->rate_limit.window_start >= RATE_LIMIT_WINDOW) {
-    client->rate_limit.window_start = now;
-    client->rate_limit.request_count = 0;
-  }
-
-  return client->rate_limit.request_count < RATE_LIMIT_MAX_REQUESTS;
-}
-
-void update_rate_limit(client_connection_t *client) {
-  client->rate_limit.request_count++;
 }
\ No newline at end of file
@@ -0,0 +1,247 @@
+#include "../include/c-chat-server.h"
+
+// Message retention
+//
+// Stored messages expire MESSAGE_RETENTION_HOURS after they were queued
+// (configurable with --retention / -r), whether they sit in the ring or in
+// the spool. Expiry never scans messages to find old ones:
+//
+// - Time is cut into buckets of retention_period / RETENTION_BUCKETS seconds.
+//   Each inbox keeps, oldest first, how many of its messages fall in each
+//   bucket and where its spooled ones end (retention_bucket_t). Since an
+//   inbox stores messages in arrival order, a bucket is always a run at the
+//   front, so expiring it frees that many ring entries and skips the spool
+//   to spool_end (see expire_inbox()).
+// - A wheel of RETENTION_TRACKED_BUCKETS slots holds, per bucket, a bitmap of
+//   the users that stored something in it. The sweep visits only the users
+//   marked in the buckets that just passed out of retention.
+//
+// A message is removed between one retention period and one bucket after
+// it was queued. An inbox whose oldest bucket is still live is marked again
+// under that bucket, so a sweep that runs late still reaches everybody.
+//
+// The sweeper thread also drops idle file transfers, at least every
+// FILE_TRANSFER_SWEEP_SECONDS whatever the bucket width. It runs even with
+// retention off, when it only does that.
+
+#define USER_BITMAP_WORDS ((MAX_CLIENTS + 63) / 64)
+
+static time_t retention_period = (time_t)MESSAGE_RETENTION_HOURS * 3600;
+
+static _Atomic uint64_t wheel[RETENTION_TRACKED_BUCKETS][USER_BITMAP_WORDS];
+
+// Newest bucket already swept; only the sweeping thread touches it
+static int64_t swept_bucket = -1;
+
+static _Atomic uint64_t expired_messages;
+static _Atomic uint64_t reclaimed_memory_bytes;
+static _Atomic uint64_t reclaimed_spool_bytes;
+
+static pthread_t sweeper_thread;
+static pthread_mutex_t sweeper_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sweeper_wake;
+static bool sweeper_running;
+
+// 0 keeps messages until they are acknowledged
+void retention_set_period(time_t seconds) {
+  retention_period = seconds > 0 ? seconds : 0;
+}
+
+time_t retention_bucket_width(void) {
+  time_t period =
+      retention_period > 0 ? retention_period : MESSAGE_RETENTION_HOURS * 3600;
+  time_t width = period / RETENTION_BUCKETS;
+  return width > 0 ? width : 1;
+}
+
+static int64_t bucket_of(time_t timestamp) {
+  return timestamp > 0 ? (int64_t)(timestamp / retention_bucket_width()) : 0;
+}
+
+static void mark_user(int64_t bucket, int user_index) {
+  _Atomic uint64_t *slot = wheel[bucket % RETENTION_TRACKED_BUCKETS];
+  atomic_fetch_or(&slot[user_index / 64], (uint64_t)1 << (user_index % 64));
+}
+
+// Count one newly stored message; caller holds the inbox mutex
+void retention_track_locked(user_record_t *user, time_t timestamp,
+                            bool spooled) {
+  user_inbox_t *inbox = &user->inbox;
+  int64_t bucket = bucket_of(timestamp);
+
+  retention_bucket_t *newest = NULL;
+  if (inbox->bucket_count > 0) {
+    newest = &inbox->buckets[(inbox->bucket_head + inbox->bucket_count - 1) %
+                             RETENTION_TRACKED_BUCKETS];
+  }
+
+  if (!newest || (bucket > newest->bucket &&
+                  inbox->bucket_count < RETENTION_TRACKED_BUCKETS)) {
+    newest = &inbox->buckets[(inbox->bucket_head + inbox->bucket_count) %
+                             RETENTION_TRACKED_BUCKETS];
+    newest->bucket = bucket;
+    newest->count = 0;
+    newest->spool_end = 0;
+    inbox->bucket_count++;
+    mark_user(bucket, (int)(user - server.users));
+  } else if (bucket > newest->bucket) {
+    // Sweep far behind: fold into the newest bucket, which then expires
+    // late rather than early
+    newest->bucket = bucket;
+    mark_user(bucket, (int)(user - server.users));
+  }
+  // A timestamp older than the newest bucket (clock stepped back) joins it
+
+  newest->count++;
+  if (spooled) {
+    newest->spool_end = inbox->spool_bytes;
+  }
+}
+
+// Forget the count oldest stored messages; caller holds the inbox mutex
+void retention_untrack_locked(user_inbox_t *inbox, uint32_t count) {
+  while (count > 0 && inbox->bucket_count > 0) {
+    retention_bucket_t *oldest = &inbox->buckets[inbox->bucket_head];
+    uint32_t taken = count < oldest->count ? count : oldest->count;
+    oldest->count -= taken;
+    count -= taken;
+    if (oldest->count == 0) {
+      inbox->bucket_head = (inbox->bucket_head + 1) % RETENTION_TRACKED_BUCKETS;
+      inbox->bucket_count--;
+    }
+  }
+}
+
+static void sweep_slot(int64_t cutoff, int slot, retention_stats_t *stats) {
+  for (int word = 0; word < USER_BITMAP_WORDS; word++) {
+    uint64_t users = atomic_exchange(&wheel[slot][word], 0);
+    while (users) {
+      int user_index = word * 64 + __builtin_ctzll(users);
+      users &= users - 1;
+
+      int64_t next = expire_inbox(&server.users[user_index], cutoff, stats);
+      if (next >= 0) {
+        mark_user(next, user_index);
+      }
+    }
+  }
+}
+
+// Expire every bucket that is a full retention period older than now.
+// Returns the number of messages removed.
+int expire_messages(time_t now) {
+  if (retention_period == 0) {
+    return 0;
+  }
+
+  int64_t cutoff = bucket_of(now - retention_period) - 1;
+  if (cutoff <= swept_bucket) {
+    return 0;
+  }
+
+  // One pass over the wheel covers any backlog; slots wrap onto live buckets
+  // only after that
+  int64_t first = cutoff - RETENTION_TRACKED_BUCKETS + 1;
+  if (first <= swept_bucket) {
+    first = swept_bucket + 1;
+  }
+  if (first < 0) {
+    first = 0;
+  }
+
+  retention_stats_t stats = {0};
+  for (int64_t bucket = first; bucket <= cutoff; bucket++) {
+    sweep_slot(cutoff, (int)(bucket % RETENTION_TRACKED_BUCKETS), &stats);
+  }
+  swept_bucket = cutoff;
+
+  if (stats.expired_messages > 0) {
+    atomic_fetch_add(&expired_messages, stats.expired_messages);
+    atomic_fetch_add(&reclaimed_memory_bytes, stats.reclaimed_memory_bytes);
+    atomic_fetch_add(&reclaimed_spool_bytes, stats.reclaimed_spool_bytes);
+    log_info("Expired %llu messages (%llu bytes in memory, %llu bytes "
+             "spooled)",
+             (unsigned long long)stats.expired_messages,
+             (unsigned long long)stats.reclaimed_memory_bytes,
+             (unsigned long long)stats.reclaimed_spool_bytes);
+  }
+
+  return (int)stats.expired_messages;
+}
+
+void retention_get_stats(retention_stats_t *stats) {
+  stats->expired_messages = atomic_load(&expired_messages);
+  stats->reclaimed_memory_bytes = atomic_load(&reclaimed_memory_bytes);
+  stats->reclaimed_spool_bytes = atomic_load(&reclaimed_spool_bytes);
+}
+
+static void *sweeper(void *arg) {
+  (void)arg;
+
+  pthread_mutex_lock(&sweeper_mutex);
+  while (sweeper_running) {
+    pthread_mutex_unlock(&sweeper_mutex);
+    time_t now = time(NULL);
+    expire_messages(now);
+    expire_file_transfers(now);
+    pthread_mutex_lock(&sweeper_mutex);
+
+    // Wake just after the next bucket boundary, or sooner for transfers
+    time_t wait = FILE_TRANSFER_SWEEP_SECONDS;
+    if (retention_period > 0) {
+      time_t width = retention_bucket_width();
+      if (width - now % width + 1 < wait) {
+        wait = width - now % width + 1;
+      }
+    }
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += wait;
+    while (sweeper_running &&
+           pthread_cond_timedwait(&sweeper_wake, &sweeper_mutex, &deadline) !=
+               ETIMEDOUT) {
+    }
+  }
+  pthread_mutex_unlock(&sweeper_mutex);
+  return NULL;
+}
+
+int retention_start(void) {
+  pthread_condattr_t wake_attr;
+  pthread_condattr_init(&wake_attr);
+  pthread_condattr_setclock(&wake_attr, CLOCK_MONOTONIC);
+  int result = pthread_cond_init(&sweeper_wake, &wake_attr);
+  pthread_condattr_destroy(&wake_attr);
+  if (result != 0) {
+    return -1;
+  }
+
+  sweeper_running = true;
+  if (pthread_create(&sweeper_thread, NULL, sweeper, NULL) != 0) {
+    log_error("Failed to start retention thread: %s", strerror(errno));
+    sweeper_running = false;
+    pthread_cond_destroy(&sweeper_wake);
+    return -1;
+  }
+
+  if (retention_period == 0) {
+    log_info("Message retention disabled");
+  } else {
+    log_info("Messages expire after %ld hours",
+             (long)(retention_period / 3600));
+  }
+  return 0;
+}
+
+void retention_stop(void) {
+  pthread_mutex_lock(&sweeper_mutex);
+  bool was_running = sweeper_running;
+  sweeper_running = false;
+  pthread_cond_signal(&sweeper_wake);
+  pthread_mutex_unlock(&sweeper_mutex);
+
+  if (was_running) {
+    pthread_join(sweeper_thread, NULL);
+    pthread_cond_destroy(&sweeper_wake);
+  }
+}
\ No newline at end of file
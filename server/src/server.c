@@ -1,9 +1,18 @@
 #include "../include/c-chat-server.h"
+#include <netinet/tcp.h>
 #include <stdarg.h>
 
 server_state_t server = {0};
 
+static bool log_verbose = true;
+
+void log_set_verbose(bool verbose) { log_verbose = verbose; }
+
 void log_info(const char *format, ...) {
+  if (!log_verbose) {
+    return;
+  }
+
   time_t now;
   struct tm *tm_info;
   char timestamp[64];
@@ -24,6 +33,10 @@ void log_info(const char *format, ...) {
 }
 
 void log_error(const char *format, ...) {
+  if (!log_verbose) {
+    return;
+  }
+
   time_t now;
   struct tm *tm_info;
   char timestamp[64];
@@ -79,9 +92,7 @@ void signal_handler(int sig) {
   }
 }
 
-int init_server(void) {
-  log_info("Initializing C-Chat Server");
-
+int init_server_state(void) {
   if (sodium_init() < 0) {
     log_error("Failed to initialize libsodium");
     return -1;
@@ -91,10 +102,14 @@ int init_server(void) {
   server.server_socket = -1;
   server.running = true;
   server.next_message_id = 1;
+  server.next_connection_id = 1;
+  // Random start so key versions from different server runs do not repeat
+  server.next_key_version = randombytes_random() | 1;
 
   if (pthread_mutex_init(&server.users_mutex, NULL) != 0 ||
       pthread_mutex_init(&server.clients_mutex, NULL) != 0 ||
       pthread_mutex_init(&server.message_id_mutex, NULL) != 0 ||
+      pthread_mutex_init(&server.registry_version_mutex, NULL) != 0 ||
       pthread_mutex_init(&server.running_mutex, NULL) != 0) {
     log_error("Failed to initialize mutexes");
     return -1;
@@ -102,14 +117,26 @@ int init_server(void) {
 
   for (int i = 0; i < MAX_CLIENTS; i++) {
     if (pthread_mutex_init(&server.users[i].mutex, NULL) != 0 ||
+        init_inbox(&server.users[i].inbox) != 0 ||
         pthread_mutex_init(&server.clients[i].mutex, NULL) != 0 ||
-        pthread_mutex_init(&server.clients[i].queue_mutex, NULL) != 0) {
+        pthread_mutex_init(&server.clients[i].send_mutex, NULL) != 0 ||
+        pthread_cond_init(&server.clients[i].send_idle, NULL) != 0) {
       log_error("Failed to initialize client mutex %d", i);
       return -1;
     }
     server.clients[i].socket_fd = -1;
+    server.clients[i].timer_slot = -1;
   }
 
+  if (directory_init() < 0) {
+    log_error("Failed to initialize user directory");
+    return -1;
+  }
+
+  return 0;
+}
+
+int open_listen_socket(void) {
   server.server_socket = socket(AF_INET, SOCK_STREAM, 0);
   if (server.server_socket < 0) {
     log_error("Failed to create server socket: %s", strerror(errno));
@@ -127,7 +154,7 @@ int init_server(void) {
   struct sockaddr_in server_addr = {0};
   server_addr.sin_family = AF_INET;
   server_addr.sin_addr.s_addr = INADDR_ANY;
-  server_addr.sin_port = htons(SERVER_PORT);
+  server_addr.sin_port = htons(cluster_client_port());
 
   if (bind(server.server_socket, (struct sockaddr *)&server_addr,
            sizeof(server_addr)) < 0) {
@@ -146,10 +173,111 @@ int init_server(void) {
   signal(SIGTERM, signal_handler);
   signal(SIGPIPE, SIG_IGN);
 
-  log_info("Server initialized successfully on port %d", SERVER_PORT);
   return 0;
 }
 
+int init_server(void) {
+  log_info("Initializing C-Chat Server");
+
+  if (init_server_state() < 0 || open_listen_socket() < 0 ||
+      retention_start() < 0 || timer_wheel_start() < 0 ||
+      cluster_start() < 0) {
+    return -1;
+  }
+
+  log_info("Server initialized successfully on port %d",
+           cluster_client_port());
+  return 0;
+}
+
+// Let the kernel notice dead peers too, keep a send to a peer that has
+// stopped reading from blocking its sender indefinitely, and timestamp
+// arriving data
+void configure_client_socket(int socket_fd) {
+  int enable = 1;
+  int idle = KEEPALIVE_INTERVAL;
+  int interval = 10;
+  int probes = 3;
+  setsockopt(socket_fd, SOL_SOCKET, SO_KEEPALIVE, &enable, sizeof(enable));
+#ifdef TCP_KEEPIDLE
+  setsockopt(socket_fd, IPPROTO_TCP, TCP_KEEPIDLE, &idle, sizeof(idle));
+  setsockopt(socket_fd, IPPROTO_TCP, TCP_KEEPINTVL, &interval,
+             sizeof(interval));
+  setsockopt(socket_fd, IPPROTO_TCP, TCP_KEEPCNT, &probes, sizeof(probes));
+#else
+  (void)idle;
+  (void)interval;
+  (void)probes;
+#endif
+
+  struct timeval send_timeout = {10, 0};
+  setsockopt(socket_fd, SOL_SOCKET, SO_SNDTIMEO, &send_timeout,
+             sizeof(send_timeout));
+
+#ifdef SO_TIMESTAMPNS
+  // Receive times for overload control (see overload.c)
+  setsockopt(socket_fd, SOL_SOCKET, SO_TIMESTAMPNS, &enable, sizeof(enable));
+#endif
+
+#ifdef SO_ZEROCOPY
+  // Lets large frames go out with MSG_ZEROCOPY (see transport.c)
+  if (transport_zerocopy_threshold() > 0) {
+    setsockopt(socket_fd, SOL_SOCKET, SO_ZEROCOPY, &enable, sizeof(enable));
+  }
+#endif
+}
+
+client_connection_t *accept_client(int socket_fd,
+                                   const struct sockaddr_in *address) {
+  pthread_mutex_lock(&server.clients_mutex);
+
+  int client_index = -1;
+  for (int i = 0; i < MAX_CLIENTS; i++) {
+    if (!server.clients[i].in_use) {
+      client_index = i;
+      break;
+    }
+  }
+
+  if (client_index == -1) {
+    pthread_mutex_unlock(&server.clients_mutex);
+    return NULL;
+  }
+
+  client_connection_t *client = &server.clients[client_index];
+
+  // Only the connection fields are reset; the slot mutexes are reused
+  client->socket_fd = socket_fd;
+  client->connection_id = server.next_connection_id++;
+  client->address = *address;
+  memset(client->username, 0, sizeof(client->username));
+  client->connected = true;
+  client->in_use = true;
+  client->authenticated = false;
+  client->status = STATUS_ONLINE;
+  client->connected_time = time(NULL);
+  client->sync_mode = false;
+  memset(client->admit_full_at, 0, sizeof(client->admit_full_at));
+
+  auth_new_challenge(client->challenge);
+
+  if (client_index >= server.client_count) {
+    server.client_count = client_index + 1;
+  }
+
+  pthread_mutex_unlock(&server.clients_mutex);
+
+  outbound_open(client);
+  connection_timer_start(client);
+
+  char client_ip[INET_ADDRSTRLEN];
+  inet_ntop(AF_INET, &address->sin_addr, client_ip, INET_ADDRSTRLEN);
+  log_info("New client connected from %s:%d (slot %d)", client_ip,
+           ntohs(address->sin_port), client_index);
+
+  return client;
+}
+
 void cleanup_server(void) {
   log_info("Cleaning up server resources");
 
@@ -164,110 +292,33 @@ void cleanup_server(void) {
   pthread_mutex_lock(&server.clients_mutex);
   for (int i = 0; i < server.client_count; i++) {
     if (server.clients[i].connected && server.clients[i].socket_fd >= 0) {
-      close(server.clients[i].socket_fd);
+      get_transport()->close(server.clients[i].socket_fd);
       server.clients[i].connected = false;
     }
-
-    for (int j = 0; j < server.clients[i].queue_count; j++) {
-      if (server.clients[i].message_queue[j].encrypted_data) {
-        sodium_memzero(server.clients[i].message_queue[j].encrypted_data,
-                       server.clients[i].message_queue[j].encrypted_len);
-        free(server.clients[i].message_queue[j].encrypted_data);
-      }
-    }
   }
   pthread_mutex_unlock(&server.clients_mutex);
 
+  cluster_stop();
+  timer_wheel_stop();
+  retention_stop();
+  file_transfers_cleanup();
+
   for (int i = 0; i < MAX_CLIENTS; i++) {
     pthread_mutex_destroy(&server.users[i].mutex);
+    destroy_inbox(&server.users[i].inbox);
     pthread_mutex_destroy(&server.clients[i].mutex);
-    pthread_mutex_destroy(&server.clients[i].queue_mutex);
+    pthread_mutex_destroy(&server.clients[i].send_mutex);
+    pthread_cond_destroy(&server.clients[i].send_idle);
   }
 
+  directory_cleanup();
   pthread_mutex_destroy(&server.users_mutex);
   pthread_mutex_destroy(&server.clients_mutex);
   pthread_mutex_destroy(&server.message_id_mutex);
+  pthread_mutex_destroy(&server.registry_version_mutex);
   pthread_mutex_destroy(&server.running_mutex);
 
-  log_info("Server cleanup completed");
-}
-
-int main(void) {
-  log_info("Starting C-Chat Server v1.0.0");
+  capture_close();
 
-  if (init_server() < 0) {
-    log_error("Failed to initialize server");
-    return EXIT_FAILURE;
-  }
-
-  log_info("Server listening on port %d", SERVER_PORT);
-
-  while (server.running) {
-    struct sockaddr_in client_addr;
-    socklen_t client_len = sizeof(client_addr);
-
-    int client_socket = accept(server.server_socket,
-                               (struct sockaddr *)&client_addr, &client_len);
-    if (client_socket < 0) {
-      if (errno == EINTR && !server.running) {
-        break;
-      }
-      if (errno != EAGAIN && errno != EWOULDBLOCK) {
-        log_error("Failed to accept client connection: %s", strerror(errno));
-      }
-      continue;
-    }
-
-    pthread_mutex_lock(&server.clients_mutex);
-
-    int client_index = -1;
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-      if (!server.clients[i].connected) {
-        client_index = i;
-        break;
-      }
-    }
-
-    if (client_index == -1) {
-      pthread_mutex_unlock(&server.clients_mutex);
-      log_error("Maximum client connections reached, rejecting client");
-      close(client_socket);
-      continue;
-    }
-
-    memset(&server.clients[client_index], 0, sizeof(client_connection_t));
-    server.clients[client_index].socket_fd = client_socket;
-    server.clients[client_index].address = client_addr;
-    server.clients[client_index].connected = true;
-    server.clients[client_index].authenticated = false;
-    server.clients[client_index].status = STATUS_ONLINE;
-    server.clients[client_index].connected_time = time(NULL);
-    server.clients[client_index].queue_head = 0;
-    server.clients[client_index].queue_tail = 0;
-    server.clients[client_index].queue_count = 0;
-
-    randombytes_buf(server.clients[client_index].challenge, CHALLENGE_SIZE);
-
-    if (client_index >= server.client_count) {
-      server.client_count = client_index + 1;
-    }
-
-    pthread_mutex_unlock(&server.clients_mutex);
-
-    char client_ip[INET_ADDRSTRLEN];
-    inet_ntop(AF_INET, &client_addr.sin_addr, client_ip, INET_ADDRSTRLEN);
-    log_info("New client connected from %s:%d (slot %d)", client_ip,
-             ntohs(client_addr.sin_port), client_index);
-
-    if (pthread_create(&server.clients[client_index].thread_id, NULL,
-                       client_handler, &server.clients[client_index]) != 0) {
-      log_error("Failed to create client thread: %s", strerror(errno));
-      close(client_socket);
-      server.clients[client_index].connected = false;
-    }
-  }
-
-  log_info("Server shutting down");
-  cleanup_server();
-  return EXIT_SUCCESS;
+  log_info("Server cleanup completed");
 }
\ No newline at end of file
@@ -0,0 +1,434 @@
+#include "../include/c-chat-server.h"
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+// Inbox overflow spool
+//
+// When a recipient's in-memory ring is full, further messages are appended
+// to a per-user spool file instead of being refused, and read back in order
+// as the ring drains (see queue_message() and spool_refill()). Every
+// spilled message is newer than every message in the ring, so delivery
+// order is unchanged.
+//
+// Like the ring, a spool lives only as long as the server process: the file
+// is unlinked as soon as it is created, so nothing is left behind after a
+// crash and the descriptor is the only handle. It is not fsync()ed; it bounds
+// memory, it is not a durability layer. Each user's spool is capped, and so
+// are all of them together, by the bytes not yet read back or skipped:
+// spool_bytes and spool_read_offset are offsets into an ever-growing file,
+// and what lies between them is what counts.
+//
+// No disk I/O happens under inbox->mutex, which readers hold while they
+// send. Storing a message only reserves its place in the file and queues
+// the encoded record (spool_reserve()); the storing thread writes it once it
+// has let go of the inbox (spool_flush()). Reading back works the same way
+// round: spool_refill() reads with only spool_mutex held and takes the inbox
+// lock just to move what it read into the ring. spool_mutex serializes all
+// use of the file and is never taken while holding inbox->mutex.
+//
+// Record layout, all integers big-endian:
+//   [4 bytes: seq][4 bytes: message id][8 bytes: timestamp]
+//   [4 bytes: group id, 0 for a direct message]
+//   [1 byte: sender length][4 bytes: data length][sender][data]
+
+#define SPOOL_RECORD_HEADER_SIZE 25
+#define SPOOL_READ_CHUNK (64 * 1024)
+#define SPOOL_REFILL_BATCH 64
+
+struct spool_write {
+  spool_write_t *next;
+  size_t len;
+  uint8_t record[];
+};
+
+static char spool_dir[PATH_MAX] = INBOX_SPOOL_DIR;
+
+// Bytes reserved by every open spool and not yet read back or skipped
+static _Atomic uint64_t total_spool_bytes;
+
+static void put_u32(uint8_t *out, uint32_t value) {
+  out[0] = (value >> 24) & 0xFF;
+  out[1] = (value >> 16) & 0xFF;
+  out[2] = (value >> 8) & 0xFF;
+  out[3] = value & 0xFF;
+}
+
+static uint32_t get_u32(const uint8_t *in) {
+  return ((uint32_t)in[0] << 24) | ((uint32_t)in[1] << 16) |
+         ((uint32_t)in[2] << 8) | (uint32_t)in[3];
+}
+
+int spool_set_directory(const char *dir) {
+  if (!dir || strlen(dir) >= sizeof(spool_dir)) {
+    return -1;
+  }
+  strcpy(spool_dir, dir);
+  return 0;
+}
+
+// Create and unlink a file in the spool directory; the descriptor is the
+// only handle to it
+int spool_open(const char *file_name) {
+  if (mkdir(spool_dir, 0700) < 0 && errno != EEXIST) {
+    log_error("Failed to create spool directory %s: %s", spool_dir,
+              strerror(errno));
+    return -1;
+  }
+
+  char path[PATH_MAX];
+  int path_len = snprintf(path, sizeof(path), "%s/%s", spool_dir, file_name);
+  if (path_len < 0 || path_len >= (int)sizeof(path)) {
+    return -1;
+  }
+
+  int fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_APPEND | O_CLOEXEC, 0600);
+  if (fd < 0 && errno == EEXIST) {
+    // Left by a process that died between open() and unlink()
+    unlink(path);
+    fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_APPEND | O_CLOEXEC, 0600);
+  }
+  if (fd < 0) {
+    log_error("Failed to open spool %s: %s", path, strerror(errno));
+    return -1;
+  }
+
+  unlink(path);
+  return fd;
+}
+
+// Reserve room for msg at the end of the user's spool and queue its record
+// for spool_flush(). Caller holds inbox->mutex.
+int spool_reserve(user_inbox_t *inbox, const stored_message_t *msg) {
+  size_t sender_len = strlen(msg->sender);
+  size_t record_len =
+      SPOOL_RECORD_HEADER_SIZE + sender_len + msg->encrypted_len;
+  if (inbox->spool_bytes - inbox->spool_read_offset + (off_t)record_len >
+      INBOX_SPOOL_MAX_BYTES) {
+    return -1;
+  }
+  if (atomic_fetch_add(&total_spool_bytes, record_len) + record_len >
+      INBOX_SPOOL_TOTAL_MAX_BYTES) {
+    atomic_fetch_sub(&total_spool_bytes, record_len);
+    log_error("Spool limit of %llu bytes reached",
+              (unsigned long long)INBOX_SPOOL_TOTAL_MAX_BYTES);
+    return -1;
+  }
+
+  spool_write_t *pending = malloc(sizeof(*pending) + record_len);
+  if (!pending) {
+    atomic_fetch_sub(&total_spool_bytes, record_len);
+    return -1;
+  }
+  pending->next = NULL;
+  pending->len = record_len;
+
+  uint8_t *header = pending->record;
+  put_u32(header, msg->seq);
+  put_u32(header + 4, msg->message_id);
+  put_u32(header + 8, (uint32_t)((uint64_t)msg->timestamp >> 32));
+  put_u32(header + 12, (uint32_t)msg->timestamp);
+  put_u32(header + 16, msg->group_id);
+  header[20] = (uint8_t)sender_len;
+  put_u32(header + 21, (uint32_t)msg->encrypted_len);
+  memcpy(header + SPOOL_RECORD_HEADER_SIZE, msg->sender, sender_len);
+  memcpy(header + SPOOL_RECORD_HEADER_SIZE + sender_len, msg->encrypted_data,
+         msg->encrypted_len);
+
+  if (inbox->spool_pending_tail) {
+    inbox->spool_pending_tail->next = pending;
+  } else {
+    inbox->spool_pending = pending;
+  }
+  inbox->spool_pending_tail = pending;
+  inbox->spool_bytes += (off_t)record_len;
+  inbox->spool_count++;
+  return 0;
+}
+
+static void free_writes(spool_write_t *pending) {
+  while (pending) {
+    spool_write_t *next = pending->next;
+    sodium_memzero(pending->record, pending->len);
+    free(pending);
+    pending = next;
+  }
+}
+
+// Forget everything spooled, e.g. after a failed write or a corrupt record.
+// Caller holds spool_mutex and inbox->mutex; returns the descriptor for the
+// caller to close once it has let go of the inbox.
+static int spool_reset_locked(user_inbox_t *inbox) {
+  int fd = inbox->spool_fd;
+  atomic_fetch_sub(&total_spool_bytes,
+                   (uint64_t)(inbox->spool_bytes - inbox->spool_read_offset));
+  free_writes(inbox->spool_pending);
+  inbox->spool_pending = NULL;
+  inbox->spool_pending_tail = NULL;
+  inbox->spool_fd = -1;
+  inbox->spool_count = 0;
+  inbox->spool_bytes = 0;
+  inbox->spool_written = 0;
+  inbox->spool_read_offset = 0;
+  inbox->spool_punched = 0;
+  inbox->spool_generation++;
+  return fd;
+}
+
+// Write the records reserved so far, in order, opening the spool on first
+// use, then read back into the ring whatever fits. Caller holds no lock.
+int spool_flush(user_inbox_t *inbox, const char *username) {
+  pthread_mutex_lock(&inbox->spool_mutex);
+
+  pthread_mutex_lock(&inbox->mutex);
+  spool_write_t *writes = inbox->spool_pending;
+  inbox->spool_pending = NULL;
+  inbox->spool_pending_tail = NULL;
+  int fd = inbox->spool_fd;
+  pthread_mutex_unlock(&inbox->mutex);
+
+  if (!writes) {
+    pthread_mutex_unlock(&inbox->spool_mutex);
+    return 0;
+  }
+
+  if (fd < 0) {
+    char file_name[MAX_USERNAME_LEN + 8];
+    snprintf(file_name, sizeof(file_name), "%s.spool", username);
+    fd = spool_open(file_name);
+  }
+
+  size_t written_bytes = 0;
+  bool failed = fd < 0;
+  for (spool_write_t *pending = writes; pending && !failed;
+       pending = pending->next) {
+    ssize_t written;
+    do {
+      written = write(fd, pending->record, pending->len);
+    } while (written < 0 && errno == EINTR);
+
+    if (written != (ssize_t)pending->len) {
+      log_error("Failed to spool message for %s: %s", username,
+                written < 0 ? strerror(errno) : "short write");
+      failed = true;
+    } else {
+      written_bytes += pending->len;
+    }
+  }
+  free_writes(writes);
+
+  pthread_mutex_lock(&inbox->mutex);
+  if (failed) {
+    // Records after a torn one can no longer be found: drop the lot
+    inbox->spool_fd = fd;
+    fd = spool_reset_locked(inbox);
+  } else {
+    inbox->spool_fd = fd;
+    inbox->spool_written += (off_t)written_bytes;
+    fd = -1;
+  }
+  pthread_mutex_unlock(&inbox->mutex);
+
+  if (fd >= 0) {
+    close(fd);
+  }
+  pthread_mutex_unlock(&inbox->spool_mutex);
+
+  if (!failed) {
+    spool_refill(inbox);
+  }
+  return failed ? -1 : 0;
+}
+
+// Parse up to max records from buf; *consumed receives the bytes they
+// take. -1 if the first record is not one spool_reserve() wrote.
+static int parse_records(const uint8_t *buf, size_t len, stored_message_t *out,
+                         int max, size_t *consumed) {
+  size_t offset = 0;
+  int parsed = 0;
+  while (parsed < max && offset + SPOOL_RECORD_HEADER_SIZE <= len) {
+    const uint8_t *header = buf + offset;
+    size_t sender_len = header[20];
+    size_t data_len = get_u32(header + 21);
+    size_t record_len = SPOOL_RECORD_HEADER_SIZE + sender_len + data_len;
+    if (sender_len >= MAX_USERNAME_LEN || data_len > SPOOL_READ_CHUNK / 2) {
+      // Stop before reading past it
+      if (parsed == 0) {
+        return -1;
+      }
+      break;
+    }
+    if (offset + record_len > len) {
+      break;
+    }
+
+    stored_message_t *msg = &out[parsed];
+    msg->body = message_body_create(
+        header + SPOOL_RECORD_HEADER_SIZE + sender_len, data_len);
+    if (!msg->body) {
+      break;
+    }
+
+    msg->seq = get_u32(header);
+    msg->message_id = get_u32(header + 4);
+    msg->timestamp = (time_t)(((uint64_t)get_u32(header + 8) << 32) |
+                              get_u32(header + 12));
+    msg->group_id = get_u32(header + 16);
+    memcpy(msg->sender, header + SPOOL_RECORD_HEADER_SIZE, sender_len);
+    msg->sender[sender_len] = '\0';
+    msg->encrypted_data = msg->body->data;
+    msg->encrypted_len = data_len;
+
+    parsed++;
+    offset += record_len;
+  }
+
+  *consumed = offset;
+  return parsed;
+}
+
+// Move written records into free ring slots, oldest first, one sequential
+// read per chunk. Records already acknowledged (an ACK may reach past the
+// ring) are dropped instead. Once nothing is left the spool is closed and
+// its space given back. Caller holds no lock; returns the number of
+// messages added to the ring.
+int spool_refill(user_inbox_t *inbox) {
+  static _Thread_local uint8_t chunk[SPOOL_READ_CHUNK];
+  stored_message_t batch[SPOOL_REFILL_BATCH];
+  int added = 0;
+
+  pthread_mutex_lock(&inbox->spool_mutex);
+  for (;;) {
+    pthread_mutex_lock(&inbox->mutex);
+    int room = MESSAGE_QUEUE_SIZE - inbox->count;
+    off_t offset = inbox->spool_read_offset;
+    off_t readable = inbox->spool_written - offset;
+    uint32_t generation = inbox->spool_generation;
+    uint32_t spooled = inbox->spool_count;
+    int fd = inbox->spool_fd;
+    bool idle = spooled == 0 && !inbox->spool_pending &&
+                inbox->spool_written == inbox->spool_bytes;
+    if (idle && fd >= 0) {
+      fd = spool_reset_locked(inbox);
+    } else if (idle) {
+      fd = -1;
+    }
+    pthread_mutex_unlock(&inbox->mutex);
+
+    if (idle) {
+      if (fd >= 0) {
+        close(fd);
+      }
+      break;
+    }
+    if (room <= 0 || readable <= 0 || spooled == 0) {
+      break;
+    }
+
+    size_t want = readable < SPOOL_READ_CHUNK ? (size_t)readable
+                                               : SPOOL_READ_CHUNK;
+    ssize_t got = pread(fd, chunk, want, offset);
+    int max = room < SPOOL_REFILL_BATCH ? room : SPOOL_REFILL_BATCH;
+    size_t consumed = 0;
+    int parsed = got > 0 ? parse_records(chunk, (size_t)got, batch, max,
+                                         &consumed)
+                         : -1;
+    if (got > 0) {
+      sodium_memzero(chunk, (size_t)got);
+    }
+
+    pthread_mutex_lock(&inbox->mutex);
+    if (generation != inbox->spool_generation ||
+        offset != inbox->spool_read_offset) {
+      // Expiry skipped past what was read meanwhile
+      for (int i = 0; i < parsed; i++) {
+        message_body_release(batch[i].body);
+      }
+      pthread_mutex_unlock(&inbox->mutex);
+      continue;
+    }
+    if (parsed <= 0) {
+      if (parsed < 0) {
+        log_error("Corrupt spool record at offset %lld: %s",
+                  (long long)offset,
+                  got < 0 ? strerror(errno) : "unreadable");
+        fd = spool_reset_locked(inbox);
+      } else {
+        // Out of memory; the rest stays spooled until the next refill
+        fd = -1;
+      }
+      pthread_mutex_unlock(&inbox->mutex);
+      if (fd >= 0) {
+        close(fd);
+      }
+      break;
+    }
+
+    for (int i = 0; i < parsed; i++) {
+      if ((int32_t)(batch[i].seq - inbox->acked_seq) <= 0) {
+        message_body_release(batch[i].body);
+        retention_untrack_locked(inbox, 1);
+        continue;
+      }
+      inbox->messages[(inbox->head + inbox->count) % MESSAGE_QUEUE_SIZE] =
+          batch[i];
+      inbox->count++;
+      added++;
+    }
+    inbox->spool_count -= (uint32_t)parsed;
+    inbox->spool_read_offset += (off_t)consumed;
+    atomic_fetch_sub(&total_spool_bytes, consumed);
+    pthread_cond_broadcast(&inbox->ready);
+    pthread_mutex_unlock(&inbox->mutex);
+  }
+
+#ifdef FALLOC_FL_PUNCH_HOLE
+  // Give back the space of everything read or skipped so far
+  pthread_mutex_lock(&inbox->mutex);
+  int fd = inbox->spool_fd;
+  off_t punched = inbox->spool_punched;
+  off_t read_offset = inbox->spool_read_offset;
+  inbox->spool_punched = read_offset;
+  pthread_mutex_unlock(&inbox->mutex);
+  if (fd >= 0 && read_offset > punched) {
+    fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, punched,
+              read_offset - punched);
+  }
+#endif
+
+  pthread_mutex_unlock(&inbox->spool_mutex);
+  return added;
+}
+
+// Drop the next count spooled messages, which end at end_offset, without
+// reading them; the next spool_refill() gives their disk space back.
+// Returns the number of spool bytes discarded. Caller holds inbox->mutex.
+off_t spool_discard(user_inbox_t *inbox, uint32_t count, off_t end_offset) {
+  if (inbox->spool_count == 0 || count == 0) {
+    return 0;
+  }
+  if (count >= inbox->spool_count) {
+    count = inbox->spool_count;
+    end_offset = inbox->spool_bytes;
+  }
+
+  off_t discarded = 0;
+  if (end_offset > inbox->spool_read_offset) {
+    discarded = end_offset - inbox->spool_read_offset;
+    inbox->spool_read_offset = end_offset;
+    inbox->spool_generation++;
+    atomic_fetch_sub(&total_spool_bytes, (uint64_t)discarded);
+  }
+
+  inbox->spool_count -= count;
+  return discarded;
+}
+
+// Release the spool of an inbox nobody else can reach any more
+void spool_close(user_inbox_t *inbox) {
+  int fd = spool_reset_locked(inbox);
+  if (fd >= 0) {
+    close(fd);
+  }
+}
\ No newline at end of file
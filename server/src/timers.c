@@ -0,0 +1,285 @@
+#include "../include/c-chat-server.h"
+
+// Idle connection timers
+//
+// A connection that sends nothing for KEEPALIVE_INTERVAL seconds gets a PING;
+// one silent for CONNECTION_TIMEOUT seconds is shut down, which ends its
+// handler thread and frees the slot. Any inbound frame counts as activity.
+//
+// Timers live in a hashed wheel of TIMER_WHEEL_SLOTS one-second slots, each a
+// doubly linked list threaded through clients[] by index, so scheduling and
+// cancelling are O(1) and a tick only looks at the connections due in it.
+// Every delay is shorter than the wheel, so a slot never holds a timer for a
+// later lap.
+//
+// Activity does not move the timer: connection_timer_touch() only records
+// the tick. When the timer fires it compares against that tick and, if the
+// connection was active meanwhile, files itself again at the real deadline.
+// Busy connections therefore cost one atomic store per frame and one wheel
+// visit per KEEPALIVE_INTERVAL.
+
+typedef enum { TIMER_NONE, TIMER_PING, TIMER_SHUTDOWN } timer_action_t;
+
+typedef struct {
+  int index;
+  uint32_t connection_id;
+  timer_action_t action;
+} timer_due_t;
+
+static int wheel_heads[TIMER_WHEEL_SLOTS];
+static uint32_t wheel_tick; // newest tick already expired
+static pthread_mutex_t wheel_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static struct timespec wheel_epoch;
+static pthread_once_t wheel_epoch_once = PTHREAD_ONCE_INIT;
+
+static pthread_t wheel_thread;
+static pthread_cond_t wheel_wake;
+static bool wheel_running;
+
+static void init_wheel_epoch(void) {
+  clock_gettime(CLOCK_MONOTONIC, &wheel_epoch);
+  for (int i = 0; i < TIMER_WHEEL_SLOTS; i++) {
+    wheel_heads[i] = -1;
+  }
+}
+
+// Seconds since the wheel was first used, starting at 1
+uint32_t timer_now(void) {
+  pthread_once(&wheel_epoch_once, init_wheel_epoch);
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint32_t)(now.tv_sec - wheel_epoch.tv_sec) + 1;
+}
+
+static void unlink_locked(client_connection_t *client) {
+  if (client->timer_slot < 0) {
+    return;
+  }
+
+  if (client->timer_prev >= 0) {
+    server.clients[client->timer_prev].timer_next = client->timer_next;
+  } else {
+    wheel_heads[client->timer_slot] = client->timer_next;
+  }
+  if (client->timer_next >= 0) {
+    server.clients[client->timer_next].timer_prev = client->timer_prev;
+  }
+  client->timer_slot = -1;
+}
+
+static void schedule_locked(client_connection_t *client, uint32_t deadline) {
+  // A deadline already passed fires on the next tick
+  if ((int32_t)(deadline - wheel_tick) <= 0) {
+    deadline = wheel_tick + 1;
+  }
+
+  int index = (int)(client - server.clients);
+  int slot = (int)(deadline % TIMER_WHEEL_SLOTS);
+  client->timer_slot = slot;
+  client->timer_prev = -1;
+  client->timer_next = wheel_heads[slot];
+  if (client->timer_next >= 0) {
+    server.clients[client->timer_next].timer_prev = index;
+  }
+  wheel_heads[slot] = index;
+}
+
+// Called by accept_client() for every new connection
+void connection_timer_start(client_connection_t *client) {
+  uint32_t now = timer_now();
+  atomic_store(&client->last_activity, now);
+  client->pinged_activity = 0;
+
+  pthread_mutex_lock(&wheel_mutex);
+  if (wheel_tick == 0) {
+    wheel_tick = now - 1;
+  }
+  unlink_locked(client);
+  schedule_locked(client, now + KEEPALIVE_INTERVAL);
+  pthread_mutex_unlock(&wheel_mutex);
+}
+
+void connection_timer_touch(client_connection_t *client) {
+  atomic_store_explicit(&client->last_activity, timer_now(),
+                        memory_order_relaxed);
+}
+
+void connection_timer_stop(client_connection_t *client) {
+  pthread_mutex_lock(&wheel_mutex);
+  unlink_locked(client);
+  pthread_mutex_unlock(&wheel_mutex);
+}
+
+// Decide what a fired timer means and file it again if the connection stays;
+// caller holds wheel_mutex
+static timer_action_t fire_locked(client_connection_t *client, uint32_t now) {
+  uint32_t last_activity = atomic_load_explicit(&client->last_activity,
+                                                memory_order_relaxed);
+  uint32_t idle = now - last_activity;
+
+  if (idle >= CONNECTION_TIMEOUT) {
+    return TIMER_SHUTDOWN;
+  }
+
+  timer_action_t action = TIMER_NONE;
+  if (idle >= KEEPALIVE_INTERVAL) {
+    if (client->pinged_activity != last_activity) {
+      client->pinged_activity = last_activity;
+      action = TIMER_PING;
+    }
+    schedule_locked(client, last_activity + CONNECTION_TIMEOUT);
+  } else {
+    schedule_locked(client, last_activity + KEEPALIVE_INTERVAL);
+  }
+  return action;
+}
+
+// The connection's mutex was busy, for instance through a disconnect
+// waiting on its writer: fire again on the next tick instead of waiting, so
+// one connection never holds up the others' timers
+static void rearm_due(const timer_due_t *due) {
+  client_connection_t *client = &server.clients[due->index];
+
+  pthread_mutex_lock(&wheel_mutex);
+  if (client->connection_id == due->connection_id) {
+    if (due->action == TIMER_PING) {
+      client->pinged_activity = 0; // activity ticks start at 1
+    }
+    unlink_locked(client);
+    schedule_locked(client, wheel_tick + 1);
+  }
+  pthread_mutex_unlock(&wheel_mutex);
+}
+
+// Returns -1 if the connection was busy and the timer was filed again
+static int run_due(const timer_due_t *due) {
+  client_connection_t *client = &server.clients[due->index];
+
+  if (pthread_mutex_trylock(&client->mutex) != 0) {
+    rearm_due(due);
+    return -1;
+  }
+
+  // The slot may have been handed to a new connection since the timer fired
+  if (client->connection_id != due->connection_id || !client->connected ||
+      client->socket_fd < 0) {
+    pthread_mutex_unlock(&client->mutex);
+    return 0;
+  }
+
+  if (due->action == TIMER_PING) {
+    // Never waits: a peer whose socket buffer is full is as good as dead
+    log_debug("Pinging idle connection %u", due->connection_id);
+    if (send_client_message_nowait(client, MSG_PING, NULL, 0) < 0) {
+      log_info("Closing connection %u: ping could not be sent",
+               due->connection_id);
+    }
+  } else {
+    log_info("Closing connection %u after %d seconds idle",
+             due->connection_id, CONNECTION_TIMEOUT);
+    get_transport()->shutdown(client->socket_fd);
+  }
+  pthread_mutex_unlock(&client->mutex);
+  return 0;
+}
+
+// Fire every timer due up to now. Pings and shutdowns are sent after the
+// wheel is unlocked and never wait on the socket or on a busy connection,
+// so a slow peer never holds up scheduling. Called from one thread at a
+// time; returns the number of connections shut down.
+int timer_wheel_advance(uint32_t now) {
+  static timer_due_t due[MAX_CLIENTS];
+  int due_count = 0;
+
+  pthread_mutex_lock(&wheel_mutex);
+  if (wheel_tick == 0) {
+    wheel_tick = now - 1;
+  }
+  if (now - wheel_tick > TIMER_WHEEL_SLOTS) {
+    // Far behind: one lap visits every slot, and fired timers re-check
+    wheel_tick = now - TIMER_WHEEL_SLOTS;
+  }
+  while ((int32_t)(now - wheel_tick) > 0) {
+    wheel_tick++;
+    int slot = (int)(wheel_tick % TIMER_WHEEL_SLOTS);
+
+    int index = wheel_heads[slot];
+    wheel_heads[slot] = -1;
+    while (index >= 0) {
+      client_connection_t *client = &server.clients[index];
+      int next = client->timer_next;
+      client->timer_slot = -1;
+
+      timer_action_t action = fire_locked(client, wheel_tick);
+      if (action != TIMER_NONE) {
+        due[due_count++] =
+            (timer_due_t){index, client->connection_id, action};
+      }
+      index = next;
+    }
+  }
+  pthread_mutex_unlock(&wheel_mutex);
+
+  int closed = 0;
+  for (int i = 0; i < due_count; i++) {
+    if (run_due(&due[i]) == 0) {
+      closed += due[i].action == TIMER_SHUTDOWN;
+    }
+  }
+  return closed;
+}
+
+static void *wheel_loop(void *arg) {
+  (void)arg;
+
+  pthread_mutex_lock(&wheel_mutex);
+  while (wheel_running) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += 1;
+    pthread_cond_timedwait(&wheel_wake, &wheel_mutex, &deadline);
+    if (!wheel_running) {
+      break;
+    }
+
+    pthread_mutex_unlock(&wheel_mutex);
+    timer_wheel_advance(timer_now());
+    pthread_mutex_lock(&wheel_mutex);
+  }
+  pthread_mutex_unlock(&wheel_mutex);
+  return NULL;
+}
+
+int timer_wheel_start(void) {
+  pthread_condattr_t wake_attr;
+  pthread_condattr_init(&wake_attr);
+  pthread_condattr_setclock(&wake_attr, CLOCK_MONOTONIC);
+  int result = pthread_cond_init(&wheel_wake, &wake_attr);
+  pthread_condattr_destroy(&wake_attr);
+  if (result != 0) {
+    return -1;
+  }
+
+  wheel_running = true;
+  if (pthread_create(&wheel_thread, NULL, wheel_loop, NULL) != 0) {
+    log_error("Failed to start timer thread: %s", strerror(errno));
+    wheel_running = false;
+    pthread_cond_destroy(&wheel_wake);
+    return -1;
+  }
+  return 0;
+}
+
+void timer_wheel_stop(void) {
+  pthread_mutex_lock(&wheel_mutex);
+  bool was_running = wheel_running;
+  wheel_running = false;
+  pthread_cond_signal(&wheel_wake);
+  pthread_mutex_unlock(&wheel_mutex);
+
+  if (was_running) {
+    pthread_join(wheel_thread, NULL);
+    pthread_cond_destroy(&wheel_wake);
+  }
+}
\ No newline at end of file
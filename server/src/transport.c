@@ -0,0 +1,713 @@
+#include "../include/c-chat-server.h"
+#include <sys/uio.h>
+#ifdef __linux__
+#include <linux/errqueue.h>
+#include <sys/sendfile.h>
+#endif
+
+// Byte transports underneath send_network_message()/receive_network_message()
+//
+// socket_transport talks to real sockets. memory_transport keeps each
+// simulated connection as a pair of in-process byte rings so handlers and
+// routing can be driven without the kernel TCP stack (see tools/sim.c).
+
+// Copy len bytes of file_fd from offset into a new buffer, for transports
+// that cannot send straight from the file
+static uint8_t *read_file_range(int file_fd, off_t offset, size_t len) {
+  uint8_t *data = malloc(len > 0 ? len : 1);
+  if (!data) {
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  size_t done = 0;
+  while (done < len) {
+    ssize_t got = pread(file_fd, data + done, len - done,
+                        offset + (off_t)done);
+    if (got < 0 && errno == EINTR) {
+      continue;
+    }
+    if (got <= 0) {
+      int error = got < 0 ? errno : EIO;
+      free(data);
+      errno = error;
+      return NULL;
+    }
+    done += (size_t)got;
+  }
+  return data;
+}
+
+// ---------------------------------------------------------------------------
+// Socket transport
+// ---------------------------------------------------------------------------
+
+// Write all of message; calls counts the sendmsg() calls that sent something
+static int socket_sendmsg_all(int fd, struct msghdr *message, int flags,
+                              int *calls) {
+  size_t remaining = 0;
+  for (size_t i = 0; i < message->msg_iovlen; i++) {
+    remaining += message->msg_iov[i].iov_len;
+  }
+
+  while (remaining > 0) {
+    ssize_t sent = sendmsg(fd, message, flags);
+    if (sent < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    (*calls)++;
+    remaining -= (size_t)sent;
+
+    size_t skip = (size_t)sent;
+    while (message->msg_iovlen > 0 && skip >= message->msg_iov[0].iov_len) {
+      skip -= message->msg_iov[0].iov_len;
+      message->msg_iov++;
+      message->msg_iovlen--;
+    }
+    if (message->msg_iovlen > 0) {
+      message->msg_iov[0].iov_base =
+          (uint8_t *)message->msg_iov[0].iov_base + skip;
+      message->msg_iov[0].iov_len -= skip;
+    }
+  }
+
+  return 0;
+}
+
+// Zerocopy sends
+//
+// Above the threshold a frame whose payload sits in a frame_buffer_t has that
+// payload sent with MSG_ZEROCOPY (the header is copied as usual): the kernel
+// pins the buffer's pages instead of copying them into the socket buffer,
+// and reports on the socket's error queue once it no longer needs them,
+// which for TCP is when the peer has acknowledged the data. The send does
+// not wait for that. It keeps a reference to the buffer, filed under the
+// kernel's sequence numbers for its sendmsg() calls, and later sends on the
+// socket read whatever completions have arrived and drop the references
+// they cover. socket_close() drops the rest: the kernel
+// keeps its own hold on pages it has pinned. The pinning only pays off for
+// large frames; below the threshold the copy is cheaper.
+//
+// A connection opts in when accepted (configure_client_socket()); its
+// SO_ZEROCOPY setting is read once, at its first large send. If the kernel
+// reports that it copied the data after all (loopback, or a device without
+// scatter-gather), zerocopy is switched off for that socket.
+//
+// Per-socket state is touched only by the thread writing to the socket and
+// by socket_close(), which runs once no thread writes to it any more.
+
+static _Atomic size_t zerocopy_threshold = ZEROCOPY_THRESHOLD_BYTES;
+
+// 0 disables zerocopy sends for connections accepted afterwards
+void transport_set_zerocopy_threshold(size_t bytes) {
+  atomic_store(&zerocopy_threshold, bytes);
+}
+
+size_t transport_zerocopy_threshold(void) {
+  return atomic_load(&zerocopy_threshold);
+}
+
+#ifdef SO_ZEROCOPY
+// One frame the kernel may still be reading
+typedef struct zerocopy_send {
+  struct zerocopy_send *next;
+  frame_buffer_t *buffer;
+  uint32_t first_seq; // kernel number of its first sendmsg() call
+  uint32_t calls;     // how many there were
+  uint32_t pending;   // how many are not yet reported complete
+} zerocopy_send_t;
+
+typedef struct {
+  bool enabled;      // SO_ZEROCOPY as read at the first large send
+  uint32_t next_seq; // kernel number of the next zerocopy sendmsg() call
+  zerocopy_send_t *sends;
+} zerocopy_socket_t;
+
+static zerocopy_socket_t *_Atomic zerocopy_sockets[ZEROCOPY_MAX_FD];
+
+static zerocopy_socket_t *zerocopy_socket(int fd) {
+  if (fd < 0 || fd >= ZEROCOPY_MAX_FD) {
+    return NULL;
+  }
+
+  zerocopy_socket_t *state = atomic_load(&zerocopy_sockets[fd]);
+  if (state) {
+    return state;
+  }
+
+  state = calloc(1, sizeof(*state));
+  if (!state) {
+    return NULL;
+  }
+  int enabled = 0;
+  socklen_t len = sizeof(enabled);
+  state->enabled =
+      getsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &enabled, &len) == 0 &&
+      enabled;
+  atomic_store(&zerocopy_sockets[fd], state);
+  return state;
+}
+
+static void zerocopy_complete(zerocopy_socket_t *state, uint32_t low,
+                              uint32_t high) {
+  zerocopy_send_t **link = &state->sends;
+  while (*link) {
+    zerocopy_send_t *send = *link;
+    for (uint32_t i = 0; i < send->calls; i++) {
+      if (send->first_seq + i - low <= high - low) {
+        send->pending--;
+      }
+    }
+    if (send->pending == 0) {
+      *link = send->next;
+      frame_buffer_release(send->buffer);
+      free(send);
+    } else {
+      link = &send->next;
+    }
+  }
+}
+
+// Read the completions that have arrived, without waiting for more
+static void socket_reap_zerocopy(int fd, zerocopy_socket_t *state) {
+  bool copied = false;
+
+  while (state->sends) {
+    union {
+      struct cmsghdr align;
+      uint8_t data[CMSG_SPACE(sizeof(struct sock_extended_err) +
+                              sizeof(struct sockaddr_in6))];
+    } control;
+    struct msghdr message = {0};
+    message.msg_control = control.data;
+    message.msg_controllen = sizeof(control.data);
+
+    if (recvmsg(fd, &message, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message); cmsg;
+         cmsg = CMSG_NXTHDR(&message, cmsg)) {
+      if (!((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) ||
+            (cmsg->cmsg_level == SOL_IPV6 &&
+             cmsg->cmsg_type == IPV6_RECVERR))) {
+        continue;
+      }
+      struct sock_extended_err error;
+      memcpy(&error, CMSG_DATA(cmsg), sizeof(error));
+      if (error.ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+        continue;
+      }
+      // ee_info..ee_data is the range of sends completed
+      zerocopy_complete(state, error.ee_info, error.ee_data);
+      if (error.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+        copied = true;
+      }
+    }
+  }
+
+  if (copied && state->enabled) {
+    int disable = 0;
+    setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &disable, sizeof(disable));
+    state->enabled = false;
+    log_debug("Zerocopy sends copied on fd %d, falling back to copying", fd);
+  }
+}
+
+// Keep owner until the kernel reports the calls just made as complete
+static void zerocopy_track(zerocopy_socket_t *state, frame_buffer_t *owner,
+                           int calls) {
+  uint32_t first_seq = state->next_seq;
+  state->next_seq += (uint32_t)calls;
+  if (calls == 0) {
+    return;
+  }
+
+  zerocopy_send_t *send = malloc(sizeof(*send));
+  if (!send) {
+    // Cannot happen often enough to matter; the peer sees the bytes the
+    // kernel had read by the time the buffer is reused
+    log_error("Failed to track zerocopy send, buffer released early");
+    return;
+  }
+  send->buffer = frame_buffer_hold(owner);
+  send->first_seq = first_seq;
+  send->calls = (uint32_t)calls;
+  send->pending = (uint32_t)calls;
+  send->next = state->sends;
+  state->sends = send;
+}
+
+// Drop every reference the socket holds; called when it is closed
+static void zerocopy_forget(int fd) {
+  if (fd < 0 || fd >= ZEROCOPY_MAX_FD) {
+    return;
+  }
+  zerocopy_socket_t *state = atomic_exchange(&zerocopy_sockets[fd], NULL);
+  if (!state) {
+    return;
+  }
+  while (state->sends) {
+    zerocopy_send_t *send = state->sends;
+    state->sends = send->next;
+    frame_buffer_release(send->buffer);
+    free(send);
+  }
+  free(state);
+}
+#endif
+
+static int socket_send_frame(int fd, const uint8_t *header, size_t header_len,
+                             const uint8_t *payload, size_t payload_len,
+                             frame_buffer_t *owner) {
+  // Header and payload go out in one sendmsg so small frames are not split
+  // across segments and stalled by Nagle/delayed ACK
+  struct iovec iov[2] = {{(void *)header, header_len},
+                         {(void *)payload, payload_len}};
+  struct msghdr message = {0};
+  message.msg_iov = iov;
+  message.msg_iovlen = payload && payload_len > 0 ? 2 : 1;
+
+  int calls = 0;
+#ifdef SO_ZEROCOPY
+  size_t threshold = atomic_load_explicit(&zerocopy_threshold,
+                                          memory_order_relaxed);
+  zerocopy_socket_t *state = NULL;
+  if (owner && message.msg_iovlen == 2 && threshold > 0 &&
+      payload_len >= threshold) {
+    state = zerocopy_socket(fd);
+  } else if (fd >= 0 && fd < ZEROCOPY_MAX_FD) {
+    state = atomic_load(&zerocopy_sockets[fd]);
+  }
+  if (state) {
+    socket_reap_zerocopy(fd, state);
+  }
+
+  if (state && state->enabled && owner && message.msg_iovlen == 2 &&
+      threshold > 0 && payload_len >= threshold) {
+    // The kernel pins every page it is handed, and only the payload is held
+    // by owner: the header is usually the caller's stack. It is copied,
+    // with MSG_MORE so that it still shares a segment with the payload.
+    struct msghdr header_message = {0};
+    header_message.msg_iov = &iov[0];
+    header_message.msg_iovlen = 1;
+    if (socket_sendmsg_all(fd, &header_message, MSG_NOSIGNAL | MSG_MORE,
+                           &calls) < 0) {
+      return -1;
+    }
+
+    message.msg_iov = &iov[1];
+    message.msg_iovlen = 1;
+    calls = 0;
+    int result =
+        socket_sendmsg_all(fd, &message, MSG_NOSIGNAL | MSG_ZEROCOPY, &calls);
+    // Track after a failure too: earlier calls may have pinned the payload
+    int send_errno = errno;
+    zerocopy_track(state, owner, calls);
+    if (result == 0) {
+      return 0;
+    }
+    // ENOBUFS: the pages could not be pinned and that call sent nothing, so
+    // the rest of the payload can still be copied
+    if (send_errno != ENOBUFS) {
+      errno = send_errno;
+      return -1;
+    }
+  }
+#else
+  (void)owner;
+#endif
+
+  return socket_sendmsg_all(fd, &message, MSG_NOSIGNAL, &calls);
+}
+
+static int socket_try_send_frame(int fd, const uint8_t *header,
+                                 size_t header_len, const uint8_t *payload,
+                                 size_t payload_len) {
+  struct iovec iov[2] = {{(void *)header, header_len},
+                         {(void *)payload, payload_len}};
+  struct msghdr message = {0};
+  message.msg_iov = iov;
+  message.msg_iovlen = payload && payload_len > 0 ? 2 : 1;
+
+  ssize_t sent;
+  do {
+    sent = sendmsg(fd, &message, MSG_NOSIGNAL | MSG_DONTWAIT);
+  } while (sent < 0 && errno == EINTR);
+
+  size_t frame_len = header_len + (message.msg_iovlen == 2 ? payload_len : 0);
+  return sent == (ssize_t)frame_len ? 0 : -1;
+}
+
+// Kernel receive time of the last read on this thread (SO_TIMESTAMPNS, see
+// configure_client_socket()); one handler thread serves one connection
+static _Thread_local int64_t socket_arrival_ns;
+
+static ssize_t socket_recv_exact(int fd, void *buffer, size_t len) {
+  struct iovec iov = {buffer, len};
+  union {
+    struct cmsghdr align;
+    uint8_t data[CMSG_SPACE(sizeof(struct timespec))];
+  } control;
+  struct msghdr message = {0};
+  message.msg_iov = &iov;
+  message.msg_iovlen = 1;
+  message.msg_control = control.data;
+  message.msg_controllen = sizeof(control.data);
+
+  ssize_t received = recvmsg(fd, &message, MSG_WAITALL);
+
+  socket_arrival_ns = 0;
+#ifdef SCM_TIMESTAMPNS
+  for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message); cmsg;
+       cmsg = CMSG_NXTHDR(&message, cmsg)) {
+    if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+      struct timespec stamp;
+      memcpy(&stamp, CMSG_DATA(cmsg), sizeof(stamp));
+      socket_arrival_ns = (int64_t)stamp.tv_sec * 1000000000 + stamp.tv_nsec;
+    }
+  }
+#endif
+  return received;
+}
+
+static int64_t socket_arrival(int fd) {
+  (void)fd;
+  return socket_arrival_ns;
+}
+
+static void socket_shutdown(int fd) { shutdown(fd, SHUT_RDWR); }
+
+static void socket_close(int fd) {
+#ifdef SO_ZEROCOPY
+  zerocopy_forget(fd);
+#endif
+  close(fd);
+}
+
+// The file data goes from the page cache to the socket with sendfile(), never
+// through user space; MSG_MORE holds the header back to share its segment.
+// Elsewhere it is read into a buffer and sent like any other frame.
+static int socket_send_file(int fd, const uint8_t *header, size_t header_len,
+                            int file_fd, off_t offset, size_t len) {
+#ifdef __linux__
+  size_t header_sent = 0;
+  while (header_sent < header_len) {
+    ssize_t sent = send(fd, header + header_sent, header_len - header_sent,
+                        MSG_NOSIGNAL | MSG_MORE);
+    if (sent < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    header_sent += (size_t)sent;
+  }
+
+  while (len > 0) {
+    ssize_t sent = sendfile(fd, file_fd, &offset, len);
+    if (sent < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    if (sent == 0) {
+      // The file is shorter than the frame header promised
+      errno = EIO;
+      return -1;
+    }
+    len -= (size_t)sent;
+  }
+
+  return 0;
+#else
+  uint8_t *payload = read_file_range(file_fd, offset, len);
+  if (!payload) {
+    return -1;
+  }
+
+  int result = socket_send_frame(fd, header, header_len, payload, len, NULL);
+  free(payload);
+  return result;
+#endif
+}
+
+const transport_ops_t socket_transport = {
+    "socket",       socket_send_frame, socket_try_send_frame,
+    socket_recv_exact, socket_shutdown, socket_arrival,
+    socket_close,   socket_send_file};
+
+// ---------------------------------------------------------------------------
+// Memory transport
+// ---------------------------------------------------------------------------
+
+typedef struct {
+  uint8_t *data;
+  size_t capacity;
+  size_t head;
+  size_t count;
+} byte_ring_t;
+
+typedef struct {
+  bool initialized;
+  bool open;
+  bool shut_down;
+  bool discard_output;
+  uint64_t output_bytes;
+  byte_ring_t inbound;  // simulated client -> server
+  byte_ring_t outbound; // server -> simulated client
+  pthread_mutex_t mutex;
+  pthread_cond_t readable;
+} memory_channel_t;
+
+static memory_channel_t memory_channels[MEMORY_TRANSPORT_MAX_CHANNELS];
+static pthread_mutex_t memory_channels_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static memory_channel_t *channel_for_fd(int fd) {
+  int index = fd - MEMORY_TRANSPORT_FD_BASE;
+  if (index < 0 || index >= MEMORY_TRANSPORT_MAX_CHANNELS) {
+    return NULL;
+  }
+  return &memory_channels[index];
+}
+
+static int ring_write(byte_ring_t *ring, const uint8_t *data, size_t len) {
+  if (ring->capacity - ring->count < len) {
+    size_t capacity = ring->capacity ? ring->capacity : 4096;
+    while (capacity - ring->count < len) {
+      capacity *= 2;
+    }
+
+    uint8_t *grown = malloc(capacity);
+    if (!grown) {
+      return -1;
+    }
+    for (size_t i = 0; i < ring->count; i++) {
+      grown[i] = ring->data[(ring->head + i) % ring->capacity];
+    }
+    free(ring->data);
+    ring->data = grown;
+    ring->capacity = capacity;
+    ring->head = 0;
+  }
+
+  size_t tail = (ring->head + ring->count) % ring->capacity;
+  size_t first = ring->capacity - tail < len ? ring->capacity - tail : len;
+  memcpy(ring->data + tail, data, first);
+  memcpy(ring->data, data + first, len - first);
+  ring->count += len;
+  return 0;
+}
+
+static size_t ring_read(byte_ring_t *ring, uint8_t *out, size_t len) {
+  if (len > ring->count) {
+    len = ring->count;
+  }
+
+  size_t first = ring->capacity - ring->head < len ? ring->capacity - ring->head
+                                                   : len;
+  memcpy(out, ring->data + ring->head, first);
+  memcpy(out + first, ring->data, len - first);
+  ring->head = ring->count == len ? 0 : (ring->head + len) % ring->capacity;
+  ring->count -= len;
+  return len;
+}
+
+static int memory_send_frame(int fd, const uint8_t *header, size_t header_len,
+                             const uint8_t *payload, size_t payload_len,
+                             frame_buffer_t *owner) {
+  (void)owner;
+  memory_channel_t *channel = channel_for_fd(fd);
+  if (!channel) {
+    errno = EBADF;
+    return -1;
+  }
+
+  pthread_mutex_lock(&channel->mutex);
+  if (!channel->open || channel->shut_down) {
+    pthread_mutex_unlock(&channel->mutex);
+    errno = EPIPE;
+    return -1;
+  }
+
+  int result = 0;
+  channel->output_bytes += header_len + (payload ? payload_len : 0);
+  if (!channel->discard_output) {
+    if (ring_write(&channel->outbound, header, header_len) < 0 ||
+        (payload && payload_len > 0 &&
+         ring_write(&channel->outbound, payload, payload_len) < 0)) {
+      errno = ENOMEM;
+      result = -1;
+    }
+  }
+  pthread_mutex_unlock(&channel->mutex);
+  return result;
+}
+
+static ssize_t memory_recv_exact(int fd, void *buffer, size_t len) {
+  memory_channel_t *channel = channel_for_fd(fd);
+  if (!channel) {
+    errno = EBADF;
+    return -1;
+  }
+
+  pthread_mutex_lock(&channel->mutex);
+  while (channel->open && !channel->shut_down &&
+         channel->inbound.count < len) {
+    pthread_cond_wait(&channel->readable, &channel->mutex);
+  }
+
+  // Like recv(MSG_WAITALL): a closed channel returns what is left
+  size_t received = ring_read(&channel->inbound, buffer, len);
+  pthread_mutex_unlock(&channel->mutex);
+  return (ssize_t)received;
+}
+
+// Unlike close, keeps the channel from being handed to another connection
+static void memory_shutdown(int fd) {
+  memory_channel_t *channel = channel_for_fd(fd);
+  if (!channel) {
+    return;
+  }
+
+  pthread_mutex_lock(&channel->mutex);
+  channel->shut_down = true;
+  pthread_cond_broadcast(&channel->readable);
+  pthread_mutex_unlock(&channel->mutex);
+}
+
+// Simulated clients are not timed: their frames wait on the simulator, not
+// on the server
+static int64_t memory_arrival(int fd) {
+  (void)fd;
+  return 0;
+}
+
+static void memory_close(int fd) {
+  memory_channel_t *channel = channel_for_fd(fd);
+  if (!channel) {
+    return;
+  }
+
+  pthread_mutex_lock(&channel->mutex);
+  channel->open = false;
+  channel->inbound.head = channel->inbound.count = 0;
+  channel->outbound.head = channel->outbound.count = 0;
+  pthread_cond_broadcast(&channel->readable);
+  pthread_mutex_unlock(&channel->mutex);
+}
+
+static int memory_send_file(int fd, const uint8_t *header, size_t header_len,
+                            int file_fd, off_t offset, size_t len) {
+  uint8_t *payload = read_file_range(file_fd, offset, len);
+  if (!payload) {
+    return -1;
+  }
+
+  int result = memory_send_frame(fd, header, header_len, payload, len, NULL);
+  free(payload);
+  return result;
+}
+
+// Memory channels grow instead of filling up, so every send is immediate
+static int memory_try_send_frame(int fd, const uint8_t *header,
+                                 size_t header_len, const uint8_t *payload,
+                                 size_t payload_len) {
+  return memory_send_frame(fd, header, header_len, payload, payload_len,
+                           NULL);
+}
+
+const transport_ops_t memory_transport = {
+    "memory",       memory_send_frame, memory_try_send_frame,
+    memory_recv_exact, memory_shutdown, memory_arrival,
+    memory_close,   memory_send_file};
+
+int memory_transport_open(bool discard_output) {
+  pthread_mutex_lock(&memory_channels_mutex);
+
+  for (int i = 0; i < MEMORY_TRANSPORT_MAX_CHANNELS; i++) {
+    memory_channel_t *channel = &memory_channels[i];
+    if (channel->open) {
+      continue;
+    }
+
+    if (!channel->initialized) {
+      pthread_mutex_init(&channel->mutex, NULL);
+      pthread_cond_init(&channel->readable, NULL);
+      channel->initialized = true;
+    }
+
+    pthread_mutex_lock(&channel->mutex);
+    channel->open = true;
+    channel->shut_down = false;
+    channel->discard_output = discard_output;
+    channel->output_bytes = 0;
+    channel->inbound.head = channel->inbound.count = 0;
+    channel->outbound.head = channel->outbound.count = 0;
+    pthread_mutex_unlock(&channel->mutex);
+
+    // Ring buffers stay allocated so the next session on this slot reuses them
+    pthread_mutex_unlock(&memory_channels_mutex);
+    return MEMORY_TRANSPORT_FD_BASE + i;
+  }
+
+  pthread_mutex_unlock(&memory_channels_mutex);
+  return -1;
+}
+
+int memory_transport_write(int fd, const void *data, size_t len) {
+  memory_channel_t *channel = channel_for_fd(fd);
+  if (!channel) {
+    return -1;
+  }
+
+  pthread_mutex_lock(&channel->mutex);
+  int result = channel->open ? ring_write(&channel->inbound, data, len) : -1;
+  pthread_cond_broadcast(&channel->readable);
+  pthread_mutex_unlock(&channel->mutex);
+  return result;
+}
+
+size_t memory_transport_read(int fd, void *buffer, size_t len) {
+  memory_channel_t *channel = channel_for_fd(fd);
+  if (!channel) {
+    return 0;
+  }
+
+  pthread_mutex_lock(&channel->mutex);
+  size_t received = ring_read(&channel->outbound, buffer, len);
+  pthread_mutex_unlock(&channel->mutex);
+  return received;
+}
+
+uint64_t memory_transport_output_bytes(int fd) {
+  memory_channel_t *channel = channel_for_fd(fd);
+  if (!channel) {
+    return 0;
+  }
+
+  pthread_mutex_lock(&channel->mutex);
+  uint64_t bytes = channel->output_bytes;
+  pthread_mutex_unlock(&channel->mutex);
+  return bytes;
+}
+
+// ---------------------------------------------------------------------------
+// Active transport
+// ---------------------------------------------------------------------------
+
+static const transport_ops_t *active_transport = &socket_transport;
+
+void set_transport(const transport_ops_t *ops) {
+  active_transport = ops ? ops : &socket_transport;
+  log_info("Using %s transport", active_transport->name);
+}
+
+const transport_ops_t *get_transport(void) { return active_transport; }
\ No newline at end of file
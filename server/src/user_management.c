@@ -5,18 +5,23 @@ user_record_t *find_user(const char *username) {
     return NULL;
   }
 
-  pthread_mutex_lock(&server.users_mutex);
+  // Lock-free binary search of the published directory
+  const user_directory_t *directory = directory_acquire();
+  user_record_t *user = directory_find(directory, username);
+  directory_release();
+  return user;
+}
 
-  for (int i = 0; i < server.user_count; i++) {
-    if (server.users[i].is_registered &&
-        strcmp(server.users[i].username, username) == 0) {
-      pthread_mutex_unlock(&server.users_mutex);
-      return &server.users[i];
-    }
+// Resolve many names under one directory snapshot: users[i] receives the
+// record for usernames[i], or NULL if there is none
+void find_users(const char *const *usernames, int count,
+                user_record_t **users) {
+  const user_directory_t *directory = directory_acquire();
+  for (int i = 0; i < count; i++) {
+    users[i] =
+        usernames[i] ? directory_find(directory, usernames[i]) : NULL;
   }
-
-  pthread_mutex_unlock(&server.users_mutex);
-  return NULL;
+  directory_release();
 }
 
 client_connection_t *find_client_by_username(const char *username) {
@@ -38,6 +43,33 @@ client_connection_t *find_client_by_username(const char *username) {
   return NULL;
 }
 
+// Connections of many users in one pass over clients[]: routes[i] receives
+// the connection of users[members[i]], or NULL if that user is offline
+void find_member_clients(const uint16_t *members, int count,
+                         client_connection_t **routes) {
+  // users[] index -> position in members + 1
+  static _Thread_local uint16_t position[MAX_CLIENTS];
+
+  for (int i = 0; i < count; i++) {
+    routes[i] = NULL;
+    position[members[i]] = (uint16_t)(i + 1);
+  }
+
+  pthread_mutex_lock(&server.clients_mutex);
+  for (int i = 0; i < server.client_count; i++) {
+    client_connection_t *client = &server.clients[i];
+    if (client->connected && client->authenticated &&
+        position[client->user_index] != 0) {
+      routes[position[client->user_index] - 1] = client;
+    }
+  }
+  pthread_mutex_unlock(&server.clients_mutex);
+
+  for (int i = 0; i < count; i++) {
+    position[members[i]] = 0;
+  }
+}
+
 int add_user(const char *username, const unsigned char *public_key) {
   if (!username || !public_key) {
     return -1;
@@ -54,24 +86,37 @@ int add_user(const char *username, const unsigned char *public_key) {
     return -1;
   }
 
-  for (int i = 0; i < server.user_count; i++) {
-    if (server.users[i].is_registered &&
-        strcmp(server.users[i].username, username) == 0) {
-      pthread_mutex_unlock(&server.users_mutex);
-      return -2;
-    }
+  // Writers are serialized by users_mutex, so the current snapshot is
+  // stable here and gives both the duplicate check and the insert position
+  const user_directory_t *directory = atomic_load(&server.directory);
+  int position = directory_lower_bound(directory, username);
+  if (position < directory->count &&
+      strcmp(server.users[directory->by_name[position]].username, username) ==
+          0) {
+    pthread_mutex_unlock(&server.users_mutex);
+    return -2;
   }
 
   int user_index = server.user_count;
+
   strncpy(server.users[user_index].username, username, MAX_USERNAME_LEN - 1);
   server.users[user_index].username[MAX_USERNAME_LEN - 1] = '\0';
 
   memcpy(server.users[user_index].public_key, public_key, PUBLIC_KEY_SIZE);
+  server.users[user_index].key_version = server.next_key_version++;
 
   server.users[user_index].status = STATUS_OFFLINE;
   server.users[user_index].last_seen = time(NULL);
   server.users[user_index].is_registered = true;
+  server.users[user_index].node = (uint8_t)cluster_owner(username);
+  touch_user_record(&server.users[user_index]);
 
+  // Readers see the record only once the new snapshot is published
+  if (directory_insert(position, user_index) < 0) {
+    server.users[user_index].is_registered = false;
+    pthread_mutex_unlock(&server.users_mutex);
+    return -1;
+  }
   server.user_count++;
 
   pthread_mutex_unlock(&server.users_mutex);
@@ -80,6 +125,66 @@ int add_user(const char *username, const unsigned char *public_key) {
   return 0;
 }
 
+// Stamp a change to user with the next registry version, so paged
+// LIST_USERS requests can return only records changed since a version.
+// Callers hold user->mutex (or users_mutex for a new record).
+void touch_user_record(user_record_t *user) {
+  pthread_mutex_lock(&server.registry_version_mutex);
+  user->changed_version = ++server.registry_version;
+  pthread_mutex_unlock(&server.registry_version_mutex);
+}
+
+// Registered users whose name starts with prefix, in name order. Returns the
+// number of matches stored in matches (at most max_results). Records are
+// never removed and names never change, so the pointers stay valid.
+int search_users(const char *prefix, int max_results,
+                 user_record_t **matches) {
+  if (!prefix || !matches || max_results <= 0) {
+    return 0;
+  }
+
+  size_t prefix_len = strlen(prefix);
+  int count = 0;
+
+  const user_directory_t *directory = directory_acquire();
+
+  // Every name with the prefix follows the first name >= prefix
+  for (int i = directory_lower_bound(directory, prefix);
+       i < directory->count && count < max_results; i++) {
+    user_record_t *user = &server.users[directory->by_name[i]];
+    if (strncmp(user->username, prefix, prefix_len) != 0) {
+      break;
+    }
+    matches[count++] = user;
+  }
+
+  directory_release();
+  return count;
+}
+
+// Login challenges are random per connection, so a captured LOGIN_USER
+// frame cannot log in again. For capture and replay (see tools/replay.c)
+// both servers may instead derive every challenge from a shared seed, which
+// makes any captured signature valid forever: testing only.
+static bool replay_challenge_set = false;
+static unsigned char replay_challenge[CHALLENGE_SIZE];
+
+void auth_set_replay_seed(const char *seed) {
+  crypto_generichash(replay_challenge, sizeof(replay_challenge),
+                     (const unsigned char *)seed, strlen(seed), NULL, 0);
+  replay_challenge_set = true;
+  log_error("Login challenges are fixed by --replay-auth; logins can be "
+            "replayed, never run this in production");
+}
+
+void auth_new_challenge(unsigned char *challenge) {
+  if (replay_challenge_set) {
+    memcpy(challenge, replay_challenge, CHALLENGE_SIZE);
+  } else {
+    randombytes_buf(challenge, CHALLENGE_SIZE);
+  }
+}
+
 int authenticate_user(client_connection_t *client, const char *username,
                       const unsigned char *signature) {
   if (!client || !username || !signature) {
@@ -99,6 +204,7 @@ int authenticate_user(client_connection_t *client, const char *username,
 
   pthread_mutex_lock(&client->mutex);
   client->authenticated = true;
+  client->user_index = (int)(user - server.users);
   strncpy(client->username, username, MAX_USERNAME_LEN - 1);
   client->username[MAX_USERNAME_LEN - 1] = '\0';
   pthread_mutex_unlock(&client->mutex);
@@ -106,6 +212,7 @@ int authenticate_user(client_connection_t *client, const char *username,
   pthread_mutex_lock(&user->mutex);
   user->status = STATUS_ONLINE;
   user->last_seen = time(NULL);
+  touch_user_record(user);
   pthread_mutex_unlock(&user->mutex);
 
   broadcast_status_update(username, STATUS_ONLINE);
@@ -135,8 +242,8 @@ void broadcast_status_update(const char *username, user_status_t status) {
     if (server.clients[i].connected && server.clients[i].authenticated &&
         strcmp(server.clients[i].username, username) != 0) {
 
-      send_network_message(server.clients[i].socket_fd, MSG_STATUS_UPDATE,
-                           payload, 1 + username_len + 1);
+      send_client_message(&server.clients[i], MSG_STATUS_UPDATE, payload,
+                          1 + username_len + 1);
     }
   }
 
@@ -145,5 +252,8 @@ void broadcast_status_update(const char *username, user_status_t status) {
   sodium_memzero(payload, 1 + username_len + 1);
   free(payload);
 
+  // Other cluster nodes learn of it from the user's owner
+  cluster_announce_status(username, status);
+
   log_debug("Broadcasted status update for %s: %d", username, status);
 }
\ No newline at end of file
@@ -0,0 +1,95 @@
+#include "../include/c-chat-server.h"
+
+// Closing a connection whose writer is blocked on a peer that reads nothing
+// must interrupt the writer instead of waiting it out.
+
+#define PAYLOAD_LEN (4 * 1024 * 1024)
+
+typedef struct {
+  client_connection_t *client;
+  int result;
+  volatile bool done;
+} call_t;
+
+static void *write_thread(void *arg) {
+  call_t *call = arg;
+  static uint8_t payload[PAYLOAD_LEN];
+  call->result =
+      send_client_message(call->client, MSG_PING, payload, sizeof(payload));
+  call->done = true;
+  return NULL;
+}
+
+static void *close_thread(void *arg) {
+  call_t *call = arg;
+  outbound_close(call->client, NULL);
+  call->done = true;
+  return NULL;
+}
+
+static bool wait_done(call_t *call) {
+  for (int i = 0; i < 100 && !call->done; i++) {
+    usleep(10 * 1000);
+  }
+  return call->done;
+}
+
+int main(void) {
+  if (init_server_state() < 0) {
+    fprintf(stderr, "FAIL: server state\n");
+    return 1;
+  }
+
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+    fprintf(stderr, "FAIL: socketpair\n");
+    return 1;
+  }
+  struct sockaddr_in address = {0};
+  address.sin_family = AF_INET;
+  client_connection_t *client = accept_client(fds[0], &address);
+  if (!client) {
+    fprintf(stderr, "FAIL: connect\n");
+    return 1;
+  }
+
+  // The peer never reads, so the frame fills the socket and the writer
+  // blocks in the middle of it
+  call_t writer = {.client = client};
+  pthread_t writer_thread;
+  pthread_create(&writer_thread, NULL, write_thread, &writer);
+  bool sending = false;
+  for (int i = 0; i < 100 && !sending; i++) {
+    usleep(10 * 1000);
+    pthread_mutex_lock(&client->send_mutex);
+    sending = client->sending;
+    pthread_mutex_unlock(&client->send_mutex);
+  }
+  if (!sending || writer.done) {
+    fprintf(stderr, "FAIL: writer did not block\n");
+    return 1;
+  }
+
+  call_t closer = {.client = client};
+  pthread_t closer_thread;
+  pthread_create(&closer_thread, NULL, close_thread, &closer);
+  if (!wait_done(&closer)) {
+    fprintf(stderr, "FAIL: outbound_close() waited on a blocked writer\n");
+    return 1;
+  }
+  pthread_join(closer_thread, NULL);
+
+  int failures = 0;
+  if (!wait_done(&writer) || writer.result >= 0) {
+    fprintf(stderr, "FAIL: interrupted write reported success\n");
+    failures++;
+  }
+  pthread_join(writer_thread, NULL);
+
+  close(fds[0]);
+  close(fds[1]);
+  if (failures == 0) {
+    printf("PASS: outbound close interrupts the writer\n");
+  }
+  return failures == 0 ? 0 : 1;
+}
\ No newline at end of file
@@ -0,0 +1,83 @@
+#include "../include/c-chat-server.h"
+
+// Messages read back from the spool must stop counting against the user's
+// spool limit: spill until the limit refuses a message, have part of the
+// spool read back by acknowledging what the ring holds, and the inbox must
+// take as many new messages as were read back.
+
+#define MESSAGE_BYTES (30 * 1024)
+
+static unsigned char message[MESSAGE_BYTES];
+
+// Queue messages until one is refused; returns how many were stored
+static int fill(user_record_t *user) {
+  int stored = 0;
+  while (queue_message(user, "bob", message, sizeof(message)) == 0) {
+    stored++;
+  }
+  return stored;
+}
+
+int main(void) {
+  char spool_dir[] = "/tmp/c-chat-spool-XXXXXX";
+  if (init_server_state() < 0 || !mkdtemp(spool_dir) ||
+      spool_set_directory(spool_dir) < 0) {
+    fprintf(stderr, "FAIL: setup\n");
+    return 1;
+  }
+  user_record_t *user = &server.users[0];
+  strcpy(user->username, "alice");
+  memset(message, 0x5A, sizeof(message));
+
+  int failures = 0;
+  int first = fill(user);
+  uint32_t spooled = user->inbox.spool_count;
+  if (first <= MESSAGE_QUEUE_SIZE || spooled == 0) {
+    fprintf(stderr, "FAIL: nothing spilled (%d stored)\n", first);
+    return 1;
+  }
+
+  // Each acknowledgement frees the ring, which is refilled from the spool
+  uint32_t acked = 0;
+  for (int round = 0; round < 3; round++) {
+    acked += MESSAGE_QUEUE_SIZE;
+    ack_messages(user, acked);
+  }
+  uint32_t read_back = spooled - user->inbox.spool_count;
+  if (read_back != 3 * MESSAGE_QUEUE_SIZE) {
+    fprintf(stderr, "FAIL: %u spooled messages read back\n", read_back);
+    failures++;
+  }
+
+  int second = fill(user);
+  if (second != (int)read_back) {
+    fprintf(stderr,
+            "FAIL: %d messages stored after %u were read back from the "
+            "spool\n",
+            second, read_back);
+    failures++;
+  }
+
+  // Everything left still comes back, in order
+  uint32_t total = (uint32_t)(first + second);
+  while (acked < total) {
+    uint32_t before = user->inbox.count;
+    acked += before;
+    ack_messages(user, acked);
+    if (before == 0) {
+      break;
+    }
+  }
+  if (acked != total || user->inbox.count != 0 ||
+      user->inbox.spool_count != 0 || user->inbox.spool_fd >= 0) {
+    fprintf(stderr, "FAIL: %u of %u messages drained\n", acked, total);
+    failures++;
+  }
+
+  rmdir(spool_dir);
+  if (failures == 0) {
+    printf("PASS: spool refill frees its limit (%d spilled, %u read back)\n",
+           first - MESSAGE_QUEUE_SIZE, read_back);
+  }
+  return failures == 0 ? 0 : 1;
+}
\ No newline at end of file
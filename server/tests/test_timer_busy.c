@@ -0,0 +1,112 @@
+#include "../include/c-chat-server.h"
+
+// A connection whose mutex is held, as by a disconnect waiting on its
+// writer, must not stall the timer wheel: the tick returns at once and the
+// PING or shutdown goes out on the first tick after the mutex is free.
+
+typedef struct {
+  uint32_t now;
+  int closed;
+  volatile bool done;
+} advance_t;
+
+static void *advance_thread(void *arg) {
+  advance_t *advance = arg;
+  advance->closed = timer_wheel_advance(advance->now);
+  advance->done = true;
+  return NULL;
+}
+
+// Advance the wheel from another thread; fails if it blocks for a second
+static int advance_within(uint32_t now, int *closed) {
+  static advance_t advance;
+  advance = (advance_t){.now = now};
+  pthread_t thread;
+  if (pthread_create(&thread, NULL, advance_thread, &advance) != 0) {
+    return -1;
+  }
+  for (int i = 0; i < 100 && !advance.done; i++) {
+    usleep(10 * 1000);
+  }
+  if (!advance.done) {
+    return -1; // the thread stays blocked; the test exits anyway
+  }
+  pthread_join(thread, NULL);
+  *closed = advance.closed;
+  return 0;
+}
+
+static int connect_client(client_connection_t **client, int *peer) {
+  int fds[2];
+  if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+    return -1;
+  }
+
+  struct sockaddr_in address = {0};
+  address.sin_family = AF_INET;
+  *client = accept_client(fds[0], &address);
+  *peer = fds[1];
+  return *client ? 0 : -1;
+}
+
+int main(void) {
+  if (init_server_state() < 0) {
+    fprintf(stderr, "FAIL: server state\n");
+    return 1;
+  }
+
+  int failures = 0;
+  client_connection_t *client;
+  int peer;
+  if (connect_client(&client, &peer) < 0) {
+    fprintf(stderr, "FAIL: connect\n");
+    return 1;
+  }
+  uint32_t start = timer_now();
+  uint8_t frame[MESSAGE_HEADER_SIZE];
+  int closed;
+
+  // Idle long enough for a PING while the connection is busy
+  pthread_mutex_lock(&client->mutex);
+  if (advance_within(start + KEEPALIVE_INTERVAL, &closed) < 0) {
+    fprintf(stderr, "FAIL: tick blocked on a busy connection\n");
+    return 1;
+  }
+  if (recv(peer, frame, sizeof(frame), MSG_DONTWAIT) >= 0) {
+    fprintf(stderr, "FAIL: ping sent while the connection was busy\n");
+    failures++;
+  }
+  pthread_mutex_unlock(&client->mutex);
+
+  if (advance_within(start + KEEPALIVE_INTERVAL + 1, &closed) < 0 ||
+      recv(peer, frame, sizeof(frame), MSG_DONTWAIT) != sizeof(frame) ||
+      frame[4] != MSG_PING) {
+    fprintf(stderr, "FAIL: no ping on the tick after the mutex was free\n");
+    failures++;
+  }
+
+  // Past the timeout: the shutdown waits for the mutex the same way
+  pthread_mutex_lock(&client->mutex);
+  if (advance_within(start + CONNECTION_TIMEOUT + 1, &closed) < 0) {
+    fprintf(stderr, "FAIL: tick blocked on a busy connection\n");
+    return 1;
+  }
+  if (closed != 0) {
+    fprintf(stderr, "FAIL: busy connection counted as closed\n");
+    failures++;
+  }
+  pthread_mutex_unlock(&client->mutex);
+
+  uint8_t byte;
+  if (advance_within(start + CONNECTION_TIMEOUT + 2, &closed) < 0 ||
+      closed != 1 || recv(peer, &byte, 1, MSG_DONTWAIT) != 0) {
+    fprintf(stderr, "FAIL: no shutdown on the tick after the mutex was free\n");
+    failures++;
+  }
+
+  close(peer);
+  if (failures == 0) {
+    printf("PASS: timers skip busy connections\n");
+  }
+  return failures == 0 ? 0 : 1;
+}
\ No newline at end of file
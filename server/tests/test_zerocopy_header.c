@@ -0,0 +1,133 @@
+#include "../include/c-chat-server.h"
+
+// A zerocopy send must not depend on the caller's header buffer after it
+// returns: the frame's header is overwritten straight away, while the whole
+// frame is still queued behind a full receive window, and the peer must
+// still read the original header.
+
+#define FILLER_SNDBUF (16 * 1024)
+#define FRAME_SNDBUF (512 * 1024)
+#define PAYLOAD_LEN (64 * 1024)
+
+static int connect_pair(int *sender, int *receiver) {
+  int listener = socket(AF_INET, SOCK_STREAM, 0);
+  struct sockaddr_in address = {0};
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t address_len = sizeof(address);
+
+  // A small receive window, inherited by the accepted socket
+  int rcvbuf = 4096;
+  setsockopt(listener, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+  if (listener < 0 ||
+      bind(listener, (struct sockaddr *)&address, sizeof(address)) < 0 ||
+      listen(listener, 1) < 0 ||
+      getsockname(listener, (struct sockaddr *)&address, &address_len) < 0) {
+    return -1;
+  }
+
+  *sender = socket(AF_INET, SOCK_STREAM, 0);
+  if (*sender < 0 ||
+      connect(*sender, (struct sockaddr *)&address, sizeof(address)) < 0) {
+    return -1;
+  }
+  *receiver = accept(listener, NULL, NULL);
+  close(listener);
+  return *receiver < 0 ? -1 : 0;
+}
+
+static int read_exact(int fd, uint8_t *buffer, size_t len) {
+  size_t done = 0;
+  while (done < len) {
+    ssize_t got = recv(fd, buffer + done, len - done, 0);
+    if (got <= 0) {
+      return -1;
+    }
+    done += (size_t)got;
+  }
+  return 0;
+}
+
+int main(void) {
+  int sender, receiver;
+  if (connect_pair(&sender, &receiver) < 0) {
+    perror("connect_pair");
+    return 1;
+  }
+
+  int on = 1;
+  if (setsockopt(sender, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) < 0) {
+    printf("SKIP: SO_ZEROCOPY not supported\n");
+    return 0;
+  }
+
+  // Fill the peer's window and a small send buffer, then make room for the
+  // frame only on the sending side, so none of it can leave yet
+  int sndbuf = FILLER_SNDBUF;
+  setsockopt(sender, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+  uint8_t filler[4096];
+  memset(filler, 0x5A, sizeof(filler));
+  size_t filler_len = 0;
+  for (;;) {
+    ssize_t sent = send(sender, filler, sizeof(filler), MSG_DONTWAIT);
+    if (sent <= 0) {
+      break;
+    }
+    filler_len += (size_t)sent;
+  }
+  sndbuf = FRAME_SNDBUF;
+  setsockopt(sender, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+
+  frame_buffer_t *buffer = frame_buffer_create(NULL, PAYLOAD_LEN);
+  for (uint32_t i = 0; i < PAYLOAD_LEN; i++) {
+    buffer->data[i] = (uint8_t)(i * 7);
+  }
+
+  uint8_t expected[MESSAGE_HEADER_SIZE];
+  encode_message_header(expected, MSG_INCOMING_MESSAGE, PAYLOAD_LEN);
+  uint8_t header[MESSAGE_HEADER_SIZE];
+  memcpy(header, expected, sizeof(header));
+
+  if (socket_transport.send_frame(sender, header, sizeof(header),
+                                  buffer->data, PAYLOAD_LEN, buffer) < 0) {
+    perror("send_frame");
+    return 1;
+  }
+  memset(header, 0xEE, sizeof(header));
+  frame_buffer_release(buffer);
+
+  uint8_t *skipped = malloc(filler_len);
+  uint8_t received[MESSAGE_HEADER_SIZE];
+  uint8_t *payload = malloc(PAYLOAD_LEN);
+  if (read_exact(receiver, skipped, filler_len) < 0 ||
+      read_exact(receiver, received, sizeof(received)) < 0 ||
+      read_exact(receiver, payload, PAYLOAD_LEN) < 0) {
+    fprintf(stderr, "FAIL: short read\n");
+    return 1;
+  }
+
+  int failures = 0;
+  if (memcmp(received, expected, sizeof(expected)) != 0) {
+    fprintf(stderr, "FAIL: header %02x %02x %02x %02x %02x on the wire\n",
+            received[0], received[1], received[2], received[3], received[4]);
+    failures++;
+  }
+  for (uint32_t i = 0; i < PAYLOAD_LEN; i++) {
+    if (payload[i] != (uint8_t)(i * 7)) {
+      fprintf(stderr, "FAIL: payload byte %u\n", i);
+      failures++;
+      break;
+    }
+  }
+
+  free(skipped);
+  free(payload);
+  socket_transport.close(sender);
+  close(receiver);
+
+  if (failures == 0) {
+    printf("PASS: zerocopy frame header (%zu bytes queued ahead)\n",
+           filler_len);
+  }
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,878 @@
+#include "../include/c-chat-server.h"
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+// c-chat-replay: re-drive a capture written by `c-chat-server --capture`
+// against a server, at the original pacing (optionally scaled) or as fast as
+// possible, and report per-frame response latency and throughput.
+//
+// Latency is measured from the moment a request frame is written until the
+// matching response (or MSG_ERROR) arrives on the same connection. Frames
+// without a response (GET_MESSAGES, SET_STATUS, LOGOUT) are replayed but not
+// timed. Per-frame results can be saved with --output and compared against a
+// previous run with --compare, so two builds can be measured on an identical
+// workload.
+//
+// LOGIN_USER signs a per-connection random challenge, so a replayed login
+// only succeeds when the capturing server and the one replayed against were
+// both started with the same `--replay-auth <seed>`, which fixes the
+// challenge. Without it replayed logins fail and every later authenticated
+// frame measures the MSG_ERROR path; the summary reports how many did.
+
+#define REPLAY_DRAIN_TIMEOUT_MS 5000
+#define REPLAY_RECV_CHUNK 65536
+#define REPLAY_FAST_POLL_INTERVAL 32
+
+typedef struct {
+  capture_kind_t kind;
+  uint32_t connection_id;
+  uint64_t offset_ns;
+  uint8_t type;
+  uint32_t payload_len;
+  const uint8_t *payload;
+  size_t index;
+
+  uint64_t sent_ns;
+  int64_t latency_ns;
+} replay_record_t;
+
+typedef struct {
+  uint32_t connection_id;
+  int fd;
+  uint8_t *buffer;
+  size_t buffered;
+  size_t capacity;
+
+  size_t *pending;
+  size_t pending_head;
+  size_t pending_count;
+  size_t pending_capacity;
+} replay_conn_t;
+
+typedef struct {
+  replay_conn_t *conns;
+  size_t conn_count;
+  size_t *slots;
+  size_t slot_mask;
+} conn_table_t;
+
+static const char *host = "127.0.0.1";
+static int port = SERVER_PORT;
+static uint64_t replay_start;
+
+// Responses that show the replay is not exercising the captured path
+static size_t error_responses;
+static size_t refused_logins;
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static uint32_t get_u32(const uint8_t *in) {
+  return ((uint32_t)in[0] << 24) | ((uint32_t)in[1] << 16) |
+         ((uint32_t)in[2] << 8) | (uint32_t)in[3];
+}
+
+static uint64_t get_u64(const uint8_t *in) {
+  return ((uint64_t)get_u32(in) << 32) | get_u32(in + 4);
+}
+
+static uint8_t expected_response(uint8_t type) {
+  switch (type) {
+  case MSG_REGISTER_USER:
+    return MSG_REGISTER_RESPONSE;
+  case MSG_LOGIN_USER:
+    return MSG_LOGIN_RESPONSE;
+  case MSG_GET_PUBLIC_KEY:
+    return MSG_PUBLIC_KEY_RESPONSE;
+  case MSG_GET_PUBLIC_KEYS:
+    return MSG_PUBLIC_KEYS_RESPONSE;
+  case MSG_SEND_MESSAGE:
+    return MSG_MESSAGE_ACK;
+  case MSG_LIST_USERS:
+    return MSG_USER_LIST_RESPONSE;
+  case MSG_SEARCH_USERS:
+    return MSG_SEARCH_RESPONSE;
+  case MSG_SYNC_MESSAGES:
+    return MSG_SYNC_RESPONSE;
+  case MSG_CREATE_GROUP:
+  case MSG_UPDATE_GROUP:
+    return MSG_GROUP_RESPONSE;
+  case MSG_GET_GROUP:
+    return MSG_GROUP_INFO;
+  case MSG_SEND_GROUP_MESSAGE:
+    return MSG_MESSAGE_ACK;
+  case MSG_SEND_MULTI:
+    return MSG_MULTI_ACK;
+  case MSG_FILE_OFFER:
+  case MSG_FILE_CHUNK:
+  case MSG_FILE_FETCH:
+    return MSG_FILE_RESPONSE;
+  default:
+    return 0;
+  }
+}
+
+static bool is_response_to(uint8_t request_type, uint8_t response_type) {
+  // LIST_USERS with a payload is answered page by page
+  if (request_type == MSG_LIST_USERS &&
+      response_type == MSG_USER_PAGE_RESPONSE) {
+    return true;
+  }
+  return response_type == expected_response(request_type);
+}
+
+static int compare_records(const void *a, const void *b) {
+  const replay_record_t *x = a;
+  const replay_record_t *y = b;
+  if (x->offset_ns != y->offset_ns) {
+    return x->offset_ns < y->offset_ns ? -1 : 1;
+  }
+  return (x->index > y->index) - (x->index < y->index);
+}
+
+static int compare_int64(const void *a, const void *b) {
+  int64_t x = *(const int64_t *)a;
+  int64_t y = *(const int64_t *)b;
+  return (x > y) - (x < y);
+}
+
+static replay_record_t *load_capture(const uint8_t *data, size_t size,
+                                     size_t *record_count) {
+  if (size < CAPTURE_HEADER_SIZE || memcmp(data, CAPTURE_MAGIC, 4) != 0) {
+    fprintf(stderr, "Not a c-chat capture file\n");
+    return NULL;
+  }
+  if (((data[4] << 8) | data[5]) != CAPTURE_VERSION) {
+    fprintf(stderr, "Unsupported capture version %d\n",
+            (data[4] << 8) | data[5]);
+    return NULL;
+  }
+
+  size_t capacity = 1024;
+  size_t count = 0;
+  replay_record_t *records = malloc(capacity * sizeof(*records));
+  if (!records) {
+    return NULL;
+  }
+
+  size_t offset = CAPTURE_HEADER_SIZE;
+  while (offset + CAPTURE_RECORD_HEADER_SIZE <= size) {
+    const uint8_t *header = data + offset;
+    uint32_t payload_len = get_u32(&header[14]);
+    if (offset + CAPTURE_RECORD_HEADER_SIZE + payload_len > size) {
+      fprintf(stderr, "Truncated capture record at offset %zu, stopping\n",
+              offset);
+      break;
+    }
+
+    if (count == capacity) {
+      capacity *= 2;
+      replay_record_t *grown = realloc(records, capacity * sizeof(*records));
+      if (!grown) {
+        free(records);
+        return NULL;
+      }
+      records = grown;
+    }
+
+    replay_record_t *record = &records[count];
+    record->kind = (capture_kind_t)header[0];
+    record->connection_id = get_u32(&header[1]);
+    record->offset_ns = get_u64(&header[5]);
+    record->type = header[13];
+    record->payload_len = payload_len;
+    record->payload = header + CAPTURE_RECORD_HEADER_SIZE;
+    record->index = count;
+    record->sent_ns = 0;
+    record->latency_ns = -1;
+    count++;
+
+    offset += CAPTURE_RECORD_HEADER_SIZE + payload_len;
+  }
+
+  qsort(records, count, sizeof(*records), compare_records);
+  for (size_t i = 0; i < count; i++) {
+    records[i].index = i;
+  }
+
+  *record_count = count;
+  return records;
+}
+
+static int build_conn_table(conn_table_t *table,
+                            const replay_record_t *records, size_t count) {
+  size_t slot_count = 64;
+  while (slot_count < count * 2) {
+    slot_count *= 2;
+  }
+
+  table->slots = malloc(slot_count * sizeof(size_t));
+  table->conns = calloc(count > 0 ? count : 1, sizeof(replay_conn_t));
+  if (!table->slots || !table->conns) {
+    return -1;
+  }
+  memset(table->slots, 0xFF, slot_count * sizeof(size_t));
+  table->slot_mask = slot_count - 1;
+  table->conn_count = 0;
+
+  for (size_t i = 0; i < count; i++) {
+    uint32_t id = records[i].connection_id;
+    size_t slot = (id * 2654435761u) & table->slot_mask;
+    while (table->slots[slot] != SIZE_MAX &&
+           table->conns[table->slots[slot]].connection_id != id) {
+      slot = (slot + 1) & table->slot_mask;
+    }
+    if (table->slots[slot] == SIZE_MAX) {
+      replay_conn_t *conn = &table->conns[table->conn_count];
+      conn->connection_id = id;
+      conn->fd = -1;
+      table->slots[slot] = table->conn_count++;
+    }
+  }
+
+  return 0;
+}
+
+static replay_conn_t *lookup_conn(conn_table_t *table, uint32_t id) {
+  size_t slot = (id * 2654435761u) & table->slot_mask;
+  while (table->slots[slot] != SIZE_MAX) {
+    replay_conn_t *conn = &table->conns[table->slots[slot]];
+    if (conn->connection_id == id) {
+      return conn;
+    }
+    slot = (slot + 1) & table->slot_mask;
+  }
+  return NULL;
+}
+
+static int open_connection(replay_conn_t *conn) {
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return -1;
+  }
+
+  struct sockaddr_in addr = {0};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(port);
+  if (inet_pton(AF_INET, host, &addr.sin_addr) <= 0 ||
+      connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    close(fd);
+    return -1;
+  }
+
+  conn->fd = fd;
+  conn->buffered = 0;
+  return 0;
+}
+
+static void close_connection(replay_conn_t *conn) {
+  if (conn->fd >= 0) {
+    close(conn->fd);
+    conn->fd = -1;
+  }
+  // Requests still waiting for a response stay unanswered (latency -1)
+  conn->pending_head = 0;
+  conn->pending_count = 0;
+  conn->buffered = 0;
+}
+
+static int push_pending(replay_conn_t *conn, size_t record_index) {
+  if (conn->pending_count == conn->pending_capacity) {
+    size_t capacity = conn->pending_capacity ? conn->pending_capacity * 2 : 16;
+    size_t *grown = malloc(capacity * sizeof(size_t));
+    if (!grown) {
+      return -1;
+    }
+    for (size_t i = 0; i < conn->pending_count; i++) {
+      grown[i] =
+          conn->pending[(conn->pending_head + i) % conn->pending_capacity];
+    }
+    free(conn->pending);
+    conn->pending = grown;
+    conn->pending_capacity = capacity;
+    conn->pending_head = 0;
+  }
+
+  conn->pending[(conn->pending_head + conn->pending_count) %
+                conn->pending_capacity] = record_index;
+  conn->pending_count++;
+  return 0;
+}
+
+static int send_record(replay_conn_t *conn, const replay_record_t *record) {
+  uint8_t header[MESSAGE_HEADER_SIZE];
+  encode_message_header(header, (message_type_t)record->type,
+                        record->payload_len);
+
+  // One sendmsg per frame so header and payload leave in the same segment
+  struct iovec iov[2] = {{header, sizeof(header)},
+                         {(void *)record->payload, record->payload_len}};
+  struct msghdr message = {0};
+  message.msg_iov = iov;
+  message.msg_iovlen = record->payload_len > 0 ? 2 : 1;
+
+  size_t total = sizeof(header) + record->payload_len;
+  size_t sent = 0;
+  while (sent < total) {
+    ssize_t result = sendmsg(conn->fd, &message, MSG_NOSIGNAL);
+    if (result < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    sent += (size_t)result;
+
+    // Advance past whatever the kernel accepted on a short write
+    size_t skip = (size_t)result;
+    while (message.msg_iovlen > 0 && skip >= message.msg_iov[0].iov_len) {
+      skip -= message.msg_iov[0].iov_len;
+      message.msg_iov++;
+      message.msg_iovlen--;
+    }
+    if (message.msg_iovlen > 0) {
+      message.msg_iov[0].iov_base =
+          (uint8_t *)message.msg_iov[0].iov_base + skip;
+      message.msg_iov[0].iov_len -= skip;
+    }
+  }
+  return 0;
+}
+
+// Read whatever is available and match complete response frames to the
+// oldest outstanding request on this connection
+static void drain_connection(replay_conn_t *conn, replay_record_t *records,
+                             size_t *outstanding) {
+  bool closed = false;
+
+  for (;;) {
+    if (conn->capacity - conn->buffered < REPLAY_RECV_CHUNK) {
+      size_t capacity =
+          conn->capacity ? conn->capacity * 2 : 4 * REPLAY_RECV_CHUNK;
+      uint8_t *grown = realloc(conn->buffer, capacity);
+      if (!grown) {
+        close_connection(conn);
+        return;
+      }
+      conn->buffer = grown;
+      conn->capacity = capacity;
+    }
+
+    ssize_t received = recv(conn->fd, conn->buffer + conn->buffered,
+                            conn->capacity - conn->buffered, MSG_DONTWAIT);
+    if (received == 0 || (received < 0 && errno != EAGAIN &&
+                          errno != EWOULDBLOCK && errno != EINTR)) {
+      // Match what already arrived before giving up on the connection
+      closed = true;
+      break;
+    }
+    if (received < 0) {
+      break;
+    }
+    conn->buffered += (size_t)received;
+  }
+
+  uint64_t now = now_ns();
+  size_t consumed = 0;
+  while (conn->buffered - consumed >= MESSAGE_HEADER_SIZE) {
+    network_message_t frame;
+    decode_message_header(conn->buffer + consumed, &frame);
+    if (conn->buffered - consumed < MESSAGE_HEADER_SIZE + frame.length) {
+      break;
+    }
+    const uint8_t *payload = conn->buffer + consumed + MESSAGE_HEADER_SIZE;
+    consumed += MESSAGE_HEADER_SIZE + frame.length;
+
+    if (frame.type == MSG_ERROR) {
+      error_responses++;
+    } else if (frame.type == MSG_LOGIN_RESPONSE &&
+               (frame.length == 0 || payload[0] == 0)) {
+      refused_logins++;
+    }
+
+    if (frame.type == MSG_INCOMING_MESSAGE || frame.type == MSG_STATUS_UPDATE ||
+        frame.type == MSG_GROUP_MESSAGE || frame.type == MSG_FILE_AVAILABLE ||
+        frame.type == MSG_FILE_DATA || conn->pending_count == 0) {
+      continue;
+    }
+
+    replay_record_t *request = &records[conn->pending[conn->pending_head]];
+    if (frame.type == MSG_ERROR || is_response_to(request->type, frame.type)) {
+      request->latency_ns = (int64_t)(now - replay_start - request->sent_ns);
+      conn->pending_head = (conn->pending_head + 1) % conn->pending_capacity;
+      conn->pending_count--;
+      (*outstanding)--;
+    }
+  }
+
+  memmove(conn->buffer, conn->buffer + consumed, conn->buffered - consumed);
+  conn->buffered -= consumed;
+
+  if (closed) {
+    *outstanding -= conn->pending_count;
+    close_connection(conn);
+  }
+}
+
+static void poll_connections(conn_table_t *table, replay_record_t *records,
+                             size_t *outstanding, int timeout_ms) {
+  static struct pollfd *fds = NULL;
+  static replay_conn_t **owners = NULL;
+  static size_t fds_capacity = 0;
+
+  if (fds_capacity < table->conn_count) {
+    free(fds);
+    free(owners);
+    fds_capacity = table->conn_count;
+    fds = malloc(fds_capacity * sizeof(*fds));
+    owners = malloc(fds_capacity * sizeof(*owners));
+    if (!fds || !owners) {
+      fds_capacity = 0;
+      return;
+    }
+  }
+
+  nfds_t nfds = 0;
+  for (size_t i = 0; i < table->conn_count; i++) {
+    if (table->conns[i].fd >= 0) {
+      fds[nfds].fd = table->conns[i].fd;
+      fds[nfds].events = POLLIN;
+      owners[nfds] = &table->conns[i];
+      nfds++;
+    }
+  }
+
+  if (nfds == 0) {
+    if (timeout_ms > 0) {
+      usleep((useconds_t)timeout_ms * 1000);
+    }
+    return;
+  }
+
+  if (poll(fds, nfds, timeout_ms) <= 0) {
+    return;
+  }
+
+  for (nfds_t i = 0; i < nfds; i++) {
+    if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+      drain_connection(owners[i], records, outstanding);
+    }
+  }
+}
+
+typedef struct {
+  size_t frames;
+  size_t timed;
+  double duration_s;
+  int64_t p50, p90, p99, p999, max;
+} replay_summary_t;
+
+static int64_t percentile(const int64_t *sorted, size_t count, double p) {
+  if (count == 0) {
+    return -1;
+  }
+  size_t rank = (size_t)(p * (double)(count - 1) + 0.5);
+  return sorted[rank];
+}
+
+static void summarize(const int64_t *latencies, size_t timed, size_t frames,
+                      double duration_s, replay_summary_t *summary) {
+  int64_t *sorted = malloc((timed ? timed : 1) * sizeof(int64_t));
+  if (!sorted) {
+    memset(summary, 0, sizeof(*summary));
+    return;
+  }
+  memcpy(sorted, latencies, timed * sizeof(int64_t));
+  qsort(sorted, timed, sizeof(int64_t), compare_int64);
+
+  summary->frames = frames;
+  summary->timed = timed;
+  summary->duration_s = duration_s;
+  summary->p50 = percentile(sorted, timed, 0.50);
+  summary->p90 = percentile(sorted, timed, 0.90);
+  summary->p99 = percentile(sorted, timed, 0.99);
+  summary->p999 = percentile(sorted, timed, 0.999);
+  summary->max = timed ? sorted[timed - 1] : -1;
+  free(sorted);
+}
+
+static void print_summary(const char *label, const replay_summary_t *s) {
+  printf("%-10s frames=%zu timed=%zu duration=%.3fs throughput=%.1f frames/s\n",
+         label, s->frames, s->timed, s->duration_s,
+         s->duration_s > 0 ? (double)s->frames / s->duration_s : 0.0);
+  printf("%-10s latency us: p50=%.1f p90=%.1f p99=%.1f p99.9=%.1f max=%.1f\n",
+         label, s->p50 / 1e3, s->p90 / 1e3, s->p99 / 1e3, s->p999 / 1e3,
+         s->max / 1e3);
+}
+
+static int write_results(const char *path, const replay_record_t *records,
+                         size_t count) {
+  FILE *file = fopen(path, "w");
+  if (!file) {
+    perror("Failed to open output file");
+    return -1;
+  }
+
+  fprintf(file, "index,connection_id,type,offset_ns,sent_ns,latency_ns\n");
+  for (size_t i = 0; i < count; i++) {
+    if (records[i].kind != CAPTURE_FRAME) {
+      continue;
+    }
+    fprintf(file, "%zu,%u,%u,%llu,%llu,%lld\n", records[i].index,
+            records[i].connection_id, records[i].type,
+            (unsigned long long)records[i].offset_ns,
+            (unsigned long long)records[i].sent_ns,
+            (long long)records[i].latency_ns);
+  }
+
+  fclose(file);
+  return 0;
+}
+
+// Summarize a previous --output file and print per-frame-type deltas
+static int compare_results(const char *path, const replay_record_t *records,
+                           size_t count, const replay_summary_t *current) {
+  FILE *file = fopen(path, "r");
+  if (!file) {
+    perror("Failed to open baseline results");
+    return -1;
+  }
+
+  size_t capacity = 1024;
+  size_t timed = 0;
+  size_t frames = 0;
+  uint64_t last_ns = 0;
+  int64_t *latencies = malloc(capacity * sizeof(int64_t));
+  int64_t *by_type[256] = {0};
+  size_t type_count[256] = {0};
+  size_t type_capacity[256] = {0};
+  if (!latencies) {
+    fclose(file);
+    return -1;
+  }
+
+  char line[256];
+  if (!fgets(line, sizeof(line), file)) {
+    fclose(file);
+    free(latencies);
+    return -1;
+  }
+
+  while (fgets(line, sizeof(line), file)) {
+    size_t index;
+    unsigned connection_id, type;
+    unsigned long long offset_ns, sent_ns;
+    long long latency_ns;
+    if (sscanf(line, "%zu,%u,%u,%llu,%llu,%lld", &index, &connection_id,
+               &type, &offset_ns, &sent_ns, &latency_ns) != 6 ||
+        type > 255) {
+      continue;
+    }
+    frames++;
+    if (latency_ns < 0) {
+      continue;
+    }
+    if (sent_ns + (uint64_t)latency_ns > last_ns) {
+      last_ns = sent_ns + (uint64_t)latency_ns;
+    }
+
+    if (timed == capacity) {
+      capacity *= 2;
+      int64_t *grown = realloc(latencies, capacity * sizeof(int64_t));
+      if (!grown) {
+        break;
+      }
+      latencies = grown;
+    }
+    latencies[timed++] = latency_ns;
+
+    if (type_count[type] == type_capacity[type]) {
+      size_t grown_capacity =
+          type_capacity[type] ? type_capacity[type] * 2 : 64;
+      int64_t *grown = realloc(by_type[type], grown_capacity * sizeof(int64_t));
+      if (!grown) {
+        continue;
+      }
+      by_type[type] = grown;
+      type_capacity[type] = grown_capacity;
+    }
+    by_type[type][type_count[type]++] = latency_ns;
+  }
+  fclose(file);
+
+  replay_summary_t baseline;
+  summarize(latencies, timed, frames, last_ns / 1e9, &baseline);
+  free(latencies);
+
+  printf("\n");
+  print_summary("baseline", &baseline);
+  print_summary("candidate", current);
+
+  printf("\n%-6s %8s %12s %12s %8s %12s %12s %8s\n", "type", "frames",
+         "base p50us", "new p50us", "delta", "base p99us", "new p99us",
+         "delta");
+
+  for (int type = 0; type < 256; type++) {
+    if (type_count[type] == 0) {
+      continue;
+    }
+
+    size_t current_count = 0;
+    int64_t *current_latencies = malloc(count * sizeof(int64_t));
+    if (!current_latencies) {
+      break;
+    }
+    for (size_t i = 0; i < count; i++) {
+      if (records[i].kind == CAPTURE_FRAME && records[i].type == type &&
+          records[i].latency_ns >= 0) {
+        current_latencies[current_count++] = records[i].latency_ns;
+      }
+    }
+
+    replay_summary_t base_type, current_type;
+    summarize(by_type[type], type_count[type], type_count[type], 0,
+              &base_type);
+    summarize(current_latencies, current_count, current_count, 0,
+              &current_type);
+    free(current_latencies);
+
+    printf("0x%02X   %8zu %12.1f %12.1f %+7.1f%% %12.1f %12.1f %+7.1f%%\n",
+           type, type_count[type], base_type.p50 / 1e3, current_type.p50 / 1e3,
+           base_type.p50 > 0
+               ? (current_type.p50 - base_type.p50) * 100.0 / base_type.p50
+               : 0.0,
+           base_type.p99 / 1e3, current_type.p99 / 1e3,
+           base_type.p99 > 0
+               ? (current_type.p99 - base_type.p99) * 100.0 / base_type.p99
+               : 0.0);
+    free(by_type[type]);
+  }
+
+  return 0;
+}
+
+static void print_usage(const char *program_name) {
+  printf("C-Chat Traffic Replay\n\n");
+  printf("Usage: %s [OPTIONS] <capture-file>\n\n", program_name);
+  printf("Options:\n");
+  printf("  -H, --host <addr>       Server IPv4 address (default 127.0.0.1)\n");
+  printf("  -p, --port <port>       Server port (default %d)\n", SERVER_PORT);
+  printf("  -s, --speed <factor>    Pacing relative to capture (default 1.0, "
+         "0 = fast)\n");
+  printf("  -f, --fast              Replay as fast as possible\n");
+  printf("  -o, --output <file>     Write per-frame latencies as CSV\n");
+  printf("  -c, --compare <file>    Compare against a previous --output\n");
+  printf("  -h, --help              Show this help message\n");
+}
+
+int main(int argc, char *argv[]) {
+  double speed = 1.0;
+  const char *output_path = NULL;
+  const char *compare_path = NULL;
+
+  static struct option long_options[] = {
+      {"host", required_argument, 0, 'H'},
+      {"port", required_argument, 0, 'p'},
+      {"speed", required_argument, 0, 's'},
+      {"fast", no_argument, 0, 'f'},
+      {"output", required_argument, 0, 'o'},
+      {"compare", required_argument, 0, 'c'},
+      {"help", no_argument, 0, 'h'},
+      {0, 0, 0, 0}};
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "H:p:s:fo:c:h", long_options, NULL)) !=
+         -1) {
+    switch (opt) {
+    case 'H':
+      host = optarg;
+      break;
+    case 'p':
+      port = atoi(optarg);
+      break;
+    case 's':
+      speed = atof(optarg);
+      break;
+    case 'f':
+      speed = 0.0;
+      break;
+    case 'o':
+      output_path = optarg;
+      break;
+    case 'c':
+      compare_path = optarg;
+      break;
+    case 'h':
+      print_usage(argv[0]);
+      return EXIT_SUCCESS;
+    default:
+      print_usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (optind >= argc || speed < 0.0) {
+    print_usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  int capture_fd = open(argv[optind], O_RDONLY);
+  if (capture_fd < 0) {
+    perror("Failed to open capture file");
+    return EXIT_FAILURE;
+  }
+
+  struct stat st;
+  if (fstat(capture_fd, &st) < 0 || st.st_size == 0) {
+    fprintf(stderr, "Empty or unreadable capture file\n");
+    close(capture_fd);
+    return EXIT_FAILURE;
+  }
+
+  uint8_t *data =
+      mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, capture_fd, 0);
+  close(capture_fd);
+  if (data == MAP_FAILED) {
+    perror("Failed to map capture file");
+    return EXIT_FAILURE;
+  }
+
+  size_t count = 0;
+  replay_record_t *records = load_capture(data, (size_t)st.st_size, &count);
+  conn_table_t table = {0};
+  if (!records || build_conn_table(&table, records, count) < 0) {
+    munmap(data, (size_t)st.st_size);
+    return EXIT_FAILURE;
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+
+  printf("Replaying %zu records over %zu connections to %s:%d (%s)\n", count,
+         table.conn_count, host, port, speed > 0.0 ? "paced" : "fast");
+
+  size_t outstanding = 0;
+  size_t frames_sent = 0;
+  size_t send_failures = 0;
+  uint64_t start = now_ns();
+  uint64_t last_activity = start;
+  replay_start = start;
+
+  for (size_t i = 0; i < count; i++) {
+    replay_record_t *record = &records[i];
+
+    if (speed > 0.0) {
+      uint64_t due = start + (uint64_t)((double)record->offset_ns / speed);
+      for (uint64_t now = now_ns(); now < due; now = now_ns()) {
+        uint64_t wait_ms = (due - now) / 1000000ULL;
+        poll_connections(&table, records, &outstanding,
+                         wait_ms > 0 ? (int)wait_ms : 0);
+      }
+    } else if (i % REPLAY_FAST_POLL_INTERVAL == 0) {
+      poll_connections(&table, records, &outstanding, 0);
+    }
+
+    replay_conn_t *conn = lookup_conn(&table, record->connection_id);
+    switch (record->kind) {
+    case CAPTURE_CONNECT:
+      if (open_connection(conn) < 0) {
+        fprintf(stderr, "Failed to connect for connection %u: %s\n",
+                record->connection_id, strerror(errno));
+      }
+      break;
+
+    case CAPTURE_FRAME:
+      if (conn->fd < 0) {
+        send_failures++;
+        break;
+      }
+      record->sent_ns = now_ns() - start;
+      if (send_record(conn, record) < 0) {
+        send_failures++;
+        outstanding -= conn->pending_count;
+        close_connection(conn);
+        break;
+      }
+      frames_sent++;
+      if (expected_response(record->type) &&
+          push_pending(conn, record->index) == 0) {
+        outstanding++;
+      }
+      break;
+
+    case CAPTURE_DISCONNECT:
+      // Give in-flight responses on this connection a chance to arrive
+      for (uint64_t deadline = now_ns() + REPLAY_DRAIN_TIMEOUT_MS * 1000000ULL;
+           conn->fd >= 0 && conn->pending_count > 0 && now_ns() < deadline;) {
+        poll_connections(&table, records, &outstanding, 1);
+      }
+      outstanding -= conn->pending_count;
+      close_connection(conn);
+      break;
+    }
+  }
+
+  uint64_t deadline = now_ns() + REPLAY_DRAIN_TIMEOUT_MS * 1000000ULL;
+  while (outstanding > 0 && now_ns() < deadline) {
+    poll_connections(&table, records, &outstanding, 10);
+  }
+
+  int64_t *latencies = malloc((count ? count : 1) * sizeof(int64_t));
+  size_t timed = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (records[i].kind == CAPTURE_FRAME && records[i].latency_ns >= 0) {
+      latencies[timed++] = records[i].latency_ns;
+      uint64_t done = start + records[i].sent_ns + records[i].latency_ns;
+      if (done > last_activity) {
+        last_activity = done;
+      }
+    } else if (records[i].kind == CAPTURE_FRAME &&
+               start + records[i].sent_ns > last_activity) {
+      last_activity = start + records[i].sent_ns;
+    }
+  }
+
+  replay_summary_t summary;
+  summarize(latencies, timed, frames_sent, (last_activity - start) / 1e9,
+            &summary);
+  free(latencies);
+
+  print_summary("replay", &summary);
+  if (send_failures > 0 || outstanding > 0) {
+    printf("%zu frame(s) could not be sent, %zu response(s) never arrived\n",
+           send_failures, outstanding);
+  }
+  if (error_responses > 0 || refused_logins > 0) {
+    printf("%zu MSG_ERROR response(s), %zu login(s) refused%s\n",
+           error_responses, refused_logins,
+           refused_logins > 0 ? " (capture and replay with the same "
+                                "--replay-auth on both servers)"
+                              : "");
+  }
+
+  int status = EXIT_SUCCESS;
+  if (output_path && write_results(output_path, records, count) < 0) {
+    status = EXIT_FAILURE;
+  }
+  if (compare_path &&
+      compare_results(compare_path, records, count, &summary) < 0) {
+    status = EXIT_FAILURE;
+  }
+
+  for (size_t i = 0; i < table.conn_count; i++) {
+    close_connection(&table.conns[i]);
+    free(table.conns[i].buffer);
+    free(table.conns[i].pending);
+  }
+  free(table.conns);
+  free(table.slots);
+  free(records);
+  munmap(data, (size_t)st.st_size);
+  return status;
+}
\ No newline at end of file
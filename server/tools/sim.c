@@ -0,0 +1,464 @@
+#include "../include/c-chat-server.h"
+#include <getopt.h>
+
+// c-chat-sim: drive the server's handlers and routing with simulated clients
+// over the in-process memory transport, without sockets or client threads.
+//
+// A fixed pool of users is registered up front (Ed25519 keys generated
+// in-process so logins sign the real challenge). Each worker thread then
+// keeps --concurrency/--threads sessions open at once and steps them round
+// robin: LOGIN, --messages SEND_MESSAGEs to random users, LOGOUT, after which
+// the slot is recycled for the next session. Running millions of short
+// sessions exercises accept/disconnect, presence broadcasts and delivery to
+// online recipients while measuring only application-level cost.
+
+#define SIM_SCRATCH_SIZE 65536
+
+typedef struct {
+  char username[MAX_USERNAME_LEN];
+  unsigned char public_key[crypto_sign_PUBLICKEYBYTES];
+  unsigned char secret_key[crypto_sign_SECRETKEYBYTES];
+} sim_user_t;
+
+typedef struct {
+  int fd;
+  client_connection_t *client;
+  const sim_user_t *user;
+  int sends_left;
+} sim_session_t;
+
+typedef struct {
+  pthread_t thread;
+  uint32_t rng;
+  int lane_count;
+  uint64_t session_quota;
+
+  uint64_t sessions;
+  uint64_t frames;
+  uint64_t bytes_out;
+  uint64_t rejected;
+  uint64_t errors;
+  uint64_t request_count[256];
+  uint64_t request_ns[256];
+  uint64_t response_count[256];
+} sim_worker_t;
+
+static sim_user_t *users;
+static int user_count = 500;
+static int messages_per_session = 8;
+static size_t message_size = 128;
+
+static uint64_t now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static uint32_t next_random(uint32_t *state) {
+  // xorshift32: cheap and good enough for picking recipients
+  uint32_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  *state = x;
+  return x;
+}
+
+static const char *type_name(uint8_t type) {
+  switch (type) {
+  case MSG_REGISTER_USER:
+    return "REGISTER_USER";
+  case MSG_LOGIN_USER:
+    return "LOGIN_USER";
+  case MSG_SEND_MESSAGE:
+    return "SEND_MESSAGE";
+  case MSG_LOGOUT:
+    return "LOGOUT";
+  case MSG_REGISTER_RESPONSE:
+    return "REGISTER_RESPONSE";
+  case MSG_LOGIN_RESPONSE:
+    return "LOGIN_RESPONSE";
+  case MSG_MESSAGE_ACK:
+    return "MESSAGE_ACK";
+  case MSG_INCOMING_MESSAGE:
+    return "INCOMING_MESSAGE";
+  case MSG_STATUS_UPDATE:
+    return "STATUS_UPDATE";
+  case MSG_ERROR:
+    return "ERROR";
+  default:
+    return "OTHER";
+  }
+}
+
+static int write_frame(int fd, message_type_t type, const uint8_t *payload,
+                       size_t payload_len) {
+  uint8_t frame[MESSAGE_HEADER_SIZE + 1 + MAX_USERNAME_LEN + 2 +
+                MAX_MESSAGE_LEN * 2];
+  if (payload_len > sizeof(frame) - MESSAGE_HEADER_SIZE) {
+    return -1;
+  }
+
+  encode_message_header(frame, type, (uint32_t)payload_len);
+  if (payload_len > 0) {
+    memcpy(frame + MESSAGE_HEADER_SIZE, payload, payload_len);
+  }
+  return memory_transport_write(fd, frame, MESSAGE_HEADER_SIZE + payload_len);
+}
+
+// Run one request through the server and account for it
+static int serve(sim_worker_t *worker, sim_session_t *session, uint8_t type) {
+  uint64_t start = now_ns();
+  int result = serve_client_message(session->client);
+  worker->request_ns[type] += now_ns() - start;
+  worker->request_count[type]++;
+  worker->frames++;
+  return result;
+}
+
+// Consume everything the server wrote to this session
+static void drain(sim_worker_t *worker, sim_session_t *session) {
+  static _Thread_local uint8_t scratch[SIM_SCRATCH_SIZE];
+  uint8_t header[MESSAGE_HEADER_SIZE];
+
+  while (memory_transport_read(session->fd, header, sizeof(header)) ==
+         sizeof(header)) {
+    network_message_t msg;
+    decode_message_header(header, &msg);
+
+    // Frames are written atomically, so the payload is already buffered
+    bool accepted = false;
+    for (size_t left = msg.length; left > 0;) {
+      size_t chunk = left < sizeof(scratch) ? left : sizeof(scratch);
+      size_t got = memory_transport_read(session->fd, scratch, chunk);
+      if (got == 0) {
+        break;
+      }
+      if (left == msg.length) {
+        accepted = scratch[0] == 1;
+      }
+      left -= got;
+    }
+
+    worker->response_count[msg.type]++;
+    if (msg.type == MSG_ERROR) {
+      worker->errors++;
+    } else if ((msg.type == MSG_REGISTER_RESPONSE ||
+                msg.type == MSG_LOGIN_RESPONSE) &&
+               !accepted) {
+      worker->rejected++;
+    }
+  }
+}
+
+static int open_session(sim_session_t *session, const sim_user_t *user,
+                        int lane) {
+  session->fd = memory_transport_open(false);
+  if (session->fd < 0) {
+    return -1;
+  }
+
+  struct sockaddr_in address = {0};
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  address.sin_port = htons((uint16_t)(10000 + lane));
+
+  session->client = accept_client(session->fd, &address);
+  if (!session->client) {
+    memory_transport.close(session->fd);
+    return -1;
+  }
+
+  session->user = user;
+  return 0;
+}
+
+static void close_session(sim_session_t *session) {
+  disconnect_client(session->client);
+  session->client = NULL;
+  session->fd = -1;
+}
+
+static int register_users(void) {
+  sim_worker_t setup = {0};
+
+  for (int i = 0; i < user_count; i++) {
+    sim_user_t *user = &users[i];
+    snprintf(user->username, sizeof(user->username), "sim%05d", i);
+    crypto_sign_keypair(user->public_key, user->secret_key);
+
+    sim_session_t session;
+    if (open_session(&session, user, 0) < 0) {
+      fprintf(stderr, "No free connection slot for registration\n");
+      return -1;
+    }
+
+    size_t name_len = strlen(user->username);
+    uint8_t payload[1 + MAX_USERNAME_LEN + PUBLIC_KEY_SIZE];
+    payload[0] = (uint8_t)name_len;
+    memcpy(&payload[1], user->username, name_len);
+    memcpy(&payload[1 + name_len], user->public_key, PUBLIC_KEY_SIZE);
+
+    write_frame(session.fd, MSG_REGISTER_USER, payload,
+                1 + name_len + PUBLIC_KEY_SIZE);
+    serve(&setup, &session, MSG_REGISTER_USER);
+    drain(&setup, &session);
+    close_session(&session);
+
+    if (setup.errors > 0 || setup.rejected > 0) {
+      fprintf(stderr, "Registration of %s failed\n", user->username);
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+static void start_session(sim_worker_t *worker, sim_session_t *session,
+                          int lane) {
+  const sim_user_t *user = &users[next_random(&worker->rng) % user_count];
+  if (open_session(session, user, lane) < 0) {
+    worker->errors++;
+    return;
+  }
+
+  size_t name_len = strlen(user->username);
+  uint8_t payload[1 + MAX_USERNAME_LEN + SIGNATURE_SIZE];
+  payload[0] = (uint8_t)name_len;
+  memcpy(&payload[1], user->username, name_len);
+  crypto_sign_detached(&payload[1 + name_len], NULL, session->client->challenge,
+                       CHALLENGE_SIZE, user->secret_key);
+
+  write_frame(session->fd, MSG_LOGIN_USER, payload,
+              1 + name_len + SIGNATURE_SIZE);
+  serve(worker, session, MSG_LOGIN_USER);
+  session->sends_left = messages_per_session;
+  worker->sessions++;
+}
+
+static void step_session(sim_worker_t *worker, sim_session_t *session) {
+  if (session->sends_left > 0) {
+    const sim_user_t *recipient =
+        &users[next_random(&worker->rng) % user_count];
+    size_t name_len = strlen(recipient->username);
+    size_t encrypted_len = message_size + crypto_box_SEALBYTES;
+
+    uint8_t payload[1 + MAX_USERNAME_LEN + 2 + MAX_MESSAGE_LEN +
+                    crypto_box_SEALBYTES];
+    payload[0] = (uint8_t)name_len;
+    memcpy(&payload[1], recipient->username, name_len);
+    payload[1 + name_len] = (encrypted_len >> 8) & 0xFF;
+    payload[1 + name_len + 1] = encrypted_len & 0xFF;
+    // Ciphertext is opaque to the server, so any bytes will do
+    memset(&payload[1 + name_len + 2], 0xA5, encrypted_len);
+
+    write_frame(session->fd, MSG_SEND_MESSAGE, payload,
+                1 + name_len + 2 + encrypted_len);
+    serve(worker, session, MSG_SEND_MESSAGE);
+    session->sends_left--;
+    return;
+  }
+
+  write_frame(session->fd, MSG_LOGOUT, NULL, 0);
+  serve(worker, session, MSG_LOGOUT);
+  drain(worker, session);
+  worker->bytes_out += memory_transport_output_bytes(session->fd);
+  close_session(session);
+}
+
+static void *worker_main(void *arg) {
+  sim_worker_t *worker = arg;
+
+  sim_session_t *lanes = calloc((size_t)worker->lane_count, sizeof(*lanes));
+  if (!lanes) {
+    return NULL;
+  }
+
+  uint64_t started = 0;
+  int active = 0;
+
+  do {
+    for (int i = 0; i < worker->lane_count; i++) {
+      sim_session_t *session = &lanes[i];
+      if (!session->client) {
+        if (started < worker->session_quota) {
+          started++;
+          start_session(worker, session, i);
+          active += session->client ? 1 : 0;
+        }
+        continue;
+      }
+
+      drain(worker, session);
+      step_session(worker, session);
+      if (!session->client) {
+        active--;
+      }
+    }
+  } while (active > 0 || started < worker->session_quota);
+
+  free(lanes);
+  return NULL;
+}
+
+static void print_usage(const char *program_name) {
+  printf("Usage: %s [OPTIONS]\n\n", program_name);
+  printf("Options:\n");
+  printf("  -u, --users <n>         Registered users (default 500, max %d)\n",
+         MAX_CLIENTS);
+  printf("  -s, --sessions <n>      Total login sessions (default 100000)\n");
+  printf("  -c, --concurrency <n>   Sessions open at once (default 256)\n");
+  printf("  -m, --messages <n>      Messages per session (default 8)\n");
+  printf("  -b, --size <bytes>      Plaintext message size (default 128)\n");
+  printf("  -t, --threads <n>       Worker threads (default 1)\n");
+  printf("  -v, --verbose           Keep server INFO logging\n");
+  printf("  -h, --help              Show this help message\n");
+}
+
+int main(int argc, char *argv[]) {
+  uint64_t total_sessions = 100000;
+  int concurrency = 256;
+  int thread_count = 1;
+  bool verbose = false;
+
+  static struct option long_options[] = {
+      {"users", required_argument, 0, 'u'},
+      {"sessions", required_argument, 0, 's'},
+      {"concurrency", required_argument, 0, 'c'},
+      {"messages", required_argument, 0, 'm'},
+      {"size", required_argument, 0, 'b'},
+      {"threads", required_argument, 0, 't'},
+      {"verbose", no_argument, 0, 'v'},
+      {"help", no_argument, 0, 'h'},
+      {0, 0, 0, 0}};
+
+  int opt;
+  while ((opt = getopt_long(argc, argv, "u:s:c:m:b:t:vh", long_options,
+                            NULL)) != -1) {
+    switch (opt) {
+    case 'u':
+      user_count = atoi(optarg);
+      break;
+    case 's':
+      total_sessions = strtoull(optarg, NULL, 10);
+      break;
+    case 'c':
+      concurrency = atoi(optarg);
+      break;
+    case 'm':
+      messages_per_session = atoi(optarg);
+      break;
+    case 'b':
+      message_size = (size_t)atol(optarg);
+      break;
+    case 't':
+      thread_count = atoi(optarg);
+      break;
+    case 'v':
+      verbose = true;
+      break;
+    case 'h':
+      print_usage(argv[0]);
+      return EXIT_SUCCESS;
+    default:
+      print_usage(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (user_count < 1 || user_count > MAX_CLIENTS || concurrency < 1 ||
+      concurrency > MAX_CLIENTS || thread_count < 1 ||
+      thread_count > concurrency || messages_per_session < 0 ||
+      message_size < 1 || message_size > MAX_MESSAGE_LEN) {
+    print_usage(argv[0]);
+    return EXIT_FAILURE;
+  }
+
+  log_set_verbose(verbose);
+  set_transport(&memory_transport);
+  // Every simulated session comes from the same loopback address
+  admission_set_enabled(false);
+
+  if (init_server_state() < 0) {
+    return EXIT_FAILURE;
+  }
+
+  users = calloc((size_t)user_count, sizeof(*users));
+  if (!users || register_users() < 0) {
+    free(users);
+    return EXIT_FAILURE;
+  }
+
+  sim_worker_t *workers = calloc((size_t)thread_count, sizeof(*workers));
+  if (!workers) {
+    free(users);
+    return EXIT_FAILURE;
+  }
+
+  printf("Simulating %llu sessions of %d messages (%zu bytes) for %d users, "
+         "%d concurrent on %d thread(s)\n",
+         (unsigned long long)total_sessions, messages_per_session, message_size,
+         user_count, concurrency, thread_count);
+
+  uint64_t start = now_ns();
+  for (int i = 0; i < thread_count; i++) {
+    sim_worker_t *worker = &workers[i];
+    worker->rng = 0x9E3779B9u * (uint32_t)(i + 1);
+    worker->lane_count = concurrency / thread_count +
+                         (i < concurrency % thread_count ? 1 : 0);
+    worker->session_quota = total_sessions / (uint64_t)thread_count +
+                            ((uint64_t)i < total_sessions % thread_count);
+    pthread_create(&worker->thread, NULL, worker_main, worker);
+  }
+
+  sim_worker_t total = {0};
+  for (int i = 0; i < thread_count; i++) {
+    pthread_join(workers[i].thread, NULL);
+    total.sessions += workers[i].sessions;
+    total.frames += workers[i].frames;
+    total.bytes_out += workers[i].bytes_out;
+    total.rejected += workers[i].rejected;
+    total.errors += workers[i].errors;
+    for (int t = 0; t < 256; t++) {
+      total.request_count[t] += workers[i].request_count[t];
+      total.request_ns[t] += workers[i].request_ns[t];
+      total.response_count[t] += workers[i].response_count[t];
+    }
+  }
+  double elapsed = (double)(now_ns() - start) / 1e9;
+
+  printf("\nSessions:        %llu in %.2f s (%.0f sessions/s)\n",
+         (unsigned long long)total.sessions, elapsed,
+         elapsed > 0 ? (double)total.sessions / elapsed : 0.0);
+  printf("Requests:        %llu (%.0f requests/s)\n",
+         (unsigned long long)total.frames,
+         elapsed > 0 ? (double)total.frames / elapsed : 0.0);
+  printf("Bytes written:   %llu\n", (unsigned long long)total.bytes_out);
+  printf("Rejected logins: %llu\n", (unsigned long long)total.rejected);
+  printf("Error frames:    %llu\n", (unsigned long long)total.errors);
+
+  printf("\n%-20s %12s %12s\n", "request", "count", "mean_ns");
+  for (int t = 0; t < 256; t++) {
+    if (total.request_count[t] > 0) {
+      printf("%-20s %12llu %12.0f\n", type_name((uint8_t)t),
+             (unsigned long long)total.request_count[t],
+             (double)total.request_ns[t] / (double)total.request_count[t]);
+    }
+  }
+
+  printf("\n%-20s %12s\n", "response", "count");
+  for (int t = 0; t < 256; t++) {
+    if (total.response_count[t] > 0) {
+      printf("%-20s %12llu\n", type_name((uint8_t)t),
+             (unsigned long long)total.response_count[t]);
+    }
+  }
+
+  cleanup_server();
+  sodium_memzero(users, (size_t)user_count * sizeof(*users));
+  free(users);
+  free(workers);
+
+  return total.rejected == 0 && total.errors == 0 ? EXIT_SUCCESS
+                                                        : EXIT_FAILURE;
+}
\ No newline at end of file
@@ -0,0 +1,511 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // SO_PEERCRED / struct ucred
+#endif
+#include "c-chat.h"
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+
+// Key agent: a long-running local process that holds unlocked private keys so
+// that chats and logins skip Argon2id after the first unlock, in the spirit
+// of ssh-agent. Keys live in sodium_malloc() memory (guarded and mlocked),
+// are kept PROT_NONE between requests and are wiped after an idle timeout.
+//
+// The agent listens on ~/.c-chat/agent.sock (or $CCHAT_AGENT_SOCK), created
+// with 0600 permissions, and serves only peers running as the same uid.
+// Private keys never leave the agent once added: clients ask it for session
+// keys (crypto_box_beforenm) and to open sealed boxes.
+//
+// Request:  [1 byte: op][1 byte: username length][N bytes: username]
+//           [2 bytes: data length][N bytes: data]
+// Response: [1 byte: status][2 bytes: data length][N bytes: data]
+
+#define AGENT_MAX_KEYS 16
+#define AGENT_MAX_DATA (PUBLIC_KEY_SIZE + ENCRYPTED_MSG_SIZE)
+
+typedef enum {
+  AGENT_OP_ADD = 0x01,         // data: [public key][private key]
+  AGENT_OP_PUBLIC_KEY = 0x02,  // data: none -> public key
+  AGENT_OP_SESSION_KEY = 0x03, // data: partner public key -> session key
+  AGENT_OP_OPEN = 0x04,        // data: sealed box -> plaintext
+  AGENT_OP_LOCK = 0x05         // forget all keys
+} agent_op_t;
+
+typedef enum {
+  AGENT_STATUS_OK = 0,
+  AGENT_STATUS_NO_KEY = 1,
+  AGENT_STATUS_FAILED = 2
+} agent_status_t;
+
+typedef struct {
+  char username[MAX_USERNAME_LEN];
+  unsigned char *keys; // sodium_malloc: [public key][private key]
+} agent_key_t;
+
+static agent_key_t agent_keys[AGENT_MAX_KEYS];
+static volatile sig_atomic_t agent_running = 1;
+
+static cchat_error_t agent_socket_path(char *path, size_t path_size) {
+  const char *override = getenv("CCHAT_AGENT_SOCK");
+  if (override && override[0] != '\0') {
+    if (strlen(override) >= path_size) {
+      return CCHAT_ERROR_FILE_IO;
+    }
+    safe_strncpy(path, override, path_size);
+    return CCHAT_SUCCESS;
+  }
+
+  char *home_dir = get_home_directory();
+  if (!home_dir) {
+    return CCHAT_ERROR_FILE_IO;
+  }
+
+  int path_len = snprintf(path, path_size, "%s/%s/%s", home_dir, KEYS_DIR,
+                          AGENT_SOCKET_FILE);
+  free(home_dir);
+
+  if (path_len >= (int)path_size || path_len < 0) {
+    return CCHAT_ERROR_FILE_IO;
+  }
+  return CCHAT_SUCCESS;
+}
+
+static int write_all(int fd, const void *buffer, size_t len) {
+  const uint8_t *bytes = buffer;
+  while (len > 0) {
+    ssize_t written = send(fd, bytes, len, MSG_NOSIGNAL);
+    if (written < 0 && errno == EINTR) {
+      continue;
+    }
+    if (written <= 0) {
+      return -1;
+    }
+    bytes += written;
+    len -= (size_t)written;
+  }
+  return 0;
+}
+
+static int read_all(int fd, void *buffer, size_t len) {
+  uint8_t *bytes = buffer;
+  while (len > 0) {
+    ssize_t got = recv(fd, bytes, len, 0);
+    if (got < 0 && errno == EINTR) {
+      continue;
+    }
+    if (got <= 0) {
+      return -1;
+    }
+    bytes += got;
+    len -= (size_t)got;
+  }
+  return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Agent side
+// ---------------------------------------------------------------------------
+
+static void agent_signal_handler(int sig) {
+  (void)sig;
+  agent_running = 0;
+}
+
+static agent_key_t *find_agent_key(const char *username) {
+  for (int i = 0; i < AGENT_MAX_KEYS; i++) {
+    if (agent_keys[i].keys && strcmp(agent_keys[i].username, username) == 0) {
+      return &agent_keys[i];
+    }
+  }
+  return NULL;
+}
+
+static void forget_agent_keys(void) {
+  for (int i = 0; i < AGENT_MAX_KEYS; i++) {
+    if (agent_keys[i].keys) {
+      // sodium_free() wipes the region before unmapping it
+      sodium_mprotect_readwrite(agent_keys[i].keys);
+      sodium_free(agent_keys[i].keys);
+      agent_keys[i].keys = NULL;
+      memset(agent_keys[i].username, 0, sizeof(agent_keys[i].username));
+    }
+  }
+}
+
+static agent_status_t add_agent_key(const char *username,
+                                    const uint8_t *data, size_t data_len) {
+  if (data_len != PUBLIC_KEY_SIZE + PRIVATE_KEY_SIZE) {
+    return AGENT_STATUS_FAILED;
+  }
+
+  agent_key_t *slot = find_agent_key(username);
+  for (int i = 0; !slot && i < AGENT_MAX_KEYS; i++) {
+    if (!agent_keys[i].keys) {
+      slot = &agent_keys[i];
+      slot->keys = sodium_malloc(PUBLIC_KEY_SIZE + PRIVATE_KEY_SIZE);
+      if (!slot->keys) {
+        return AGENT_STATUS_FAILED;
+      }
+      safe_strncpy(slot->username, username, sizeof(slot->username));
+    }
+  }
+
+  if (!slot) {
+    return AGENT_STATUS_FAILED;
+  }
+
+  sodium_mprotect_readwrite(slot->keys);
+  memcpy(slot->keys, data, data_len);
+  sodium_mprotect_noaccess(slot->keys);
+  return AGENT_STATUS_OK;
+}
+
+static agent_status_t handle_agent_request(uint8_t op, const char *username,
+                                           const uint8_t *data,
+                                           size_t data_len, uint8_t *out,
+                                           size_t *out_len) {
+  *out_len = 0;
+
+  if (op == AGENT_OP_LOCK) {
+    forget_agent_keys();
+    return AGENT_STATUS_OK;
+  }
+
+  if (username[0] == '\0') {
+    return AGENT_STATUS_NO_KEY;
+  }
+
+  if (op == AGENT_OP_ADD) {
+    return add_agent_key(username, data, data_len);
+  }
+
+  agent_key_t *key = find_agent_key(username);
+  if (!key) {
+    return AGENT_STATUS_NO_KEY;
+  }
+
+  const unsigned char *public_key = key->keys;
+  const unsigned char *private_key = key->keys + PUBLIC_KEY_SIZE;
+  agent_status_t status = AGENT_STATUS_FAILED;
+
+  sodium_mprotect_readonly(key->keys);
+
+  switch (op) {
+  case AGENT_OP_PUBLIC_KEY:
+    memcpy(out, public_key, PUBLIC_KEY_SIZE);
+    *out_len = PUBLIC_KEY_SIZE;
+    status = AGENT_STATUS_OK;
+    break;
+
+  case AGENT_OP_SESSION_KEY:
+    if (data_len == PUBLIC_KEY_SIZE &&
+        crypto_box_beforenm(out, data, private_key) == 0) {
+      *out_len = SESSION_KEY_SIZE;
+      status = AGENT_STATUS_OK;
+    }
+    break;
+
+  case AGENT_OP_OPEN:
+    if (data_len > crypto_box_SEALBYTES && data_len <= ENCRYPTED_MSG_SIZE &&
+        crypto_box_seal_open(out, data, data_len, public_key, private_key) ==
+            0) {
+      *out_len = data_len - crypto_box_SEALBYTES;
+      status = AGENT_STATUS_OK;
+    }
+    break;
+
+  default:
+    break;
+  }
+
+  sodium_mprotect_noaccess(key->keys);
+  return status;
+}
+
+static bool peer_is_owner(int fd) {
+#if defined(SO_PEERCRED)
+  struct ucred cred;
+  socklen_t len = sizeof(cred);
+  if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0) {
+    return false;
+  }
+  return cred.uid == getuid();
+#else
+  uid_t uid;
+  gid_t gid;
+  if (getpeereid(fd, &uid, &gid) != 0) {
+    return false;
+  }
+  return uid == getuid();
+#endif
+}
+
+static void serve_agent_client(int fd) {
+  uint8_t request[2 + MAX_USERNAME_LEN + 2 + AGENT_MAX_DATA];
+  uint8_t response[3 + AGENT_MAX_DATA];
+
+  // One connection may carry several requests, e.g. public key + session key
+  while (read_all(fd, request, 2) == 0) {
+    uint8_t op = request[0];
+    uint8_t username_len = request[1];
+    if (username_len >= MAX_USERNAME_LEN ||
+        read_all(fd, request + 2, username_len + 2u) < 0) {
+      break;
+    }
+
+    char username[MAX_USERNAME_LEN];
+    memcpy(username, request + 2, username_len);
+    username[username_len] = '\0';
+
+    size_t data_len = ((size_t)request[2 + username_len] << 8) |
+                      request[2 + username_len + 1];
+    uint8_t *data = request + 2 + username_len + 2;
+    if (data_len > AGENT_MAX_DATA || read_all(fd, data, data_len) < 0) {
+      break;
+    }
+
+    size_t out_len = 0;
+    response[0] = handle_agent_request(op, username, data, data_len,
+                                       response + 3, &out_len);
+    response[1] = (out_len >> 8) & 0xFF;
+    response[2] = out_len & 0xFF;
+
+    int sent = write_all(fd, response, 3 + out_len);
+    secure_zero_memory(request, sizeof(request));
+    secure_zero_memory(response, sizeof(response));
+    if (sent < 0) {
+      break;
+    }
+  }
+
+  secure_zero_memory(request, sizeof(request));
+}
+
+cchat_error_t run_key_agent(unsigned int idle_timeout) {
+  if (create_keys_directory() != CCHAT_SUCCESS) {
+    return CCHAT_ERROR_FILE_IO;
+  }
+
+  struct sockaddr_un addr = {0};
+  addr.sun_family = AF_UNIX;
+  if (agent_socket_path(addr.sun_path, sizeof(addr.sun_path)) !=
+      CCHAT_SUCCESS) {
+    fprintf(stderr, "Agent socket path too long\n");
+    return CCHAT_ERROR_FILE_IO;
+  }
+
+  // Refuse to replace a live agent; clear a stale socket file
+  unsigned char probe[PUBLIC_KEY_SIZE];
+  if (agent_get_public_key("", probe) != CCHAT_ERROR_NETWORK) {
+    fprintf(stderr, "A key agent is already running on %s\n", addr.sun_path);
+    return CCHAT_ERROR_INVALID_ARGS;
+  }
+  unlink(addr.sun_path);
+
+  int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listen_fd < 0) {
+    perror("Failed to create agent socket");
+    return CCHAT_ERROR_NETWORK;
+  }
+
+  mode_t old_mask = umask(0177);
+  int bound = bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr));
+  umask(old_mask);
+
+  if (bound < 0 || secure_file_permissions(addr.sun_path) != CCHAT_SUCCESS ||
+      listen(listen_fd, 16) < 0) {
+    perror("Failed to listen on agent socket");
+    close(listen_fd);
+    unlink(addr.sun_path);
+    return CCHAT_ERROR_NETWORK;
+  }
+
+  signal(SIGINT, agent_signal_handler);
+  signal(SIGTERM, agent_signal_handler);
+  signal(SIGPIPE, SIG_IGN);
+
+  printf("Key agent listening on %s (idle timeout %us)\n", addr.sun_path,
+         idle_timeout);
+  fflush(stdout);
+
+  time_t last_activity = time(NULL);
+  while (agent_running) {
+    int timeout_ms = -1;
+    bool holding_keys = false;
+    for (int i = 0; i < AGENT_MAX_KEYS; i++) {
+      holding_keys |= agent_keys[i].keys != NULL;
+    }
+
+    if (holding_keys && idle_timeout > 0) {
+      time_t idle = time(NULL) - last_activity;
+      if (idle >= (time_t)idle_timeout) {
+        forget_agent_keys();
+        printf("Idle timeout reached, keys locked\n");
+        fflush(stdout);
+        continue;
+      }
+      timeout_ms = (int)((time_t)idle_timeout - idle) * 1000;
+    }
+
+    struct pollfd pfd = {listen_fd, POLLIN, 0};
+    int ready = poll(&pfd, 1, timeout_ms);
+    if (ready <= 0) {
+      continue;
+    }
+
+    int client_fd = accept(listen_fd, NULL, NULL);
+    if (client_fd < 0) {
+      continue;
+    }
+
+    if (peer_is_owner(client_fd)) {
+      // A stalled client must not hold the agent forever
+      struct timeval tv = {5, 0};
+      setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+      serve_agent_client(client_fd);
+      last_activity = time(NULL);
+    }
+    close(client_fd);
+  }
+
+  forget_agent_keys();
+  close(listen_fd);
+  unlink(addr.sun_path);
+  printf("Key agent stopped\n");
+  return CCHAT_SUCCESS;
+}
+
+// ---------------------------------------------------------------------------
+// Client side
+// ---------------------------------------------------------------------------
+
+// Send one request on a fresh connection and read the reply. Returns
+// CCHAT_ERROR_NETWORK when no agent is running so callers can fall back to
+// the key file.
+static cchat_error_t agent_request(uint8_t op, const char *username,
+                                   const uint8_t *data, size_t data_len,
+                                   uint8_t *out, size_t out_size,
+                                   size_t *out_len) {
+  struct sockaddr_un addr = {0};
+  addr.sun_family = AF_UNIX;
+  if (agent_socket_path(addr.sun_path, sizeof(addr.sun_path)) !=
+      CCHAT_SUCCESS) {
+    return CCHAT_ERROR_NETWORK;
+  }
+
+  size_t username_len = username ? strlen(username) : 0;
+  if (username_len >= MAX_USERNAME_LEN || data_len > AGENT_MAX_DATA) {
+    return CCHAT_ERROR_INVALID_ARGS;
+  }
+
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return CCHAT_ERROR_NETWORK;
+  }
+
+  if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    close(fd);
+    return CCHAT_ERROR_NETWORK;
+  }
+
+  uint8_t request[2 + MAX_USERNAME_LEN + 2 + AGENT_MAX_DATA];
+  request[0] = op;
+  request[1] = (uint8_t)username_len;
+  if (username_len > 0) {
+    memcpy(request + 2, username, username_len);
+  }
+  request[2 + username_len] = (data_len >> 8) & 0xFF;
+  request[2 + username_len + 1] = data_len & 0xFF;
+  if (data_len > 0) {
+    memcpy(request + 2 + username_len + 2, data, data_len);
+  }
+
+  uint8_t header[3];
+  cchat_error_t result = CCHAT_ERROR_NETWORK;
+  if (write_all(fd, request, 2 + username_len + 2 + data_len) == 0 &&
+      read_all(fd, header, sizeof(header)) == 0) {
+    size_t len = ((size_t)header[1] << 8) | header[2];
+    if (len > out_size || (len > 0 && read_all(fd, out, len) < 0)) {
+      result = CCHAT_ERROR_NETWORK;
+    } else if (header[0] == AGENT_STATUS_OK) {
+      if (out_len) {
+        *out_len = len;
+      }
+      result = CCHAT_SUCCESS;
+    } else if (header[0] == AGENT_STATUS_NO_KEY) {
+      result = CCHAT_ERROR_AUTH;
+    } else {
+      result = CCHAT_ERROR_CRYPTO;
+    }
+  }
+
+  secure_zero_memory(request, sizeof(request));
+  close(fd);
+  return result;
+}
+
+cchat_error_t agent_add_key(const char *username,
+                            const unsigned char *public_key,
+                            const unsigned char *private_key) {
+  uint8_t data[PUBLIC_KEY_SIZE + PRIVATE_KEY_SIZE];
+  memcpy(data, public_key, PUBLIC_KEY_SIZE);
+  memcpy(data + PUBLIC_KEY_SIZE, private_key, PRIVATE_KEY_SIZE);
+
+  cchat_error_t result = agent_request(AGENT_OP_ADD, username, data,
+                                       sizeof(data), NULL, 0, NULL);
+  secure_zero_memory(data, sizeof(data));
+  return result;
+}
+
+cchat_error_t agent_get_public_key(const char *username,
+                                   unsigned char *public_key) {
+  size_t len = 0;
+  cchat_error_t result = agent_request(AGENT_OP_PUBLIC_KEY, username, NULL, 0,
+                                       public_key, PUBLIC_KEY_SIZE, &len);
+  if (result == CCHAT_SUCCESS && len != PUBLIC_KEY_SIZE) {
+    return CCHAT_ERROR_CRYPTO;
+  }
+  return result;
+}
+
+cchat_error_t agent_session_key(const char *username,
+                                const unsigned char *partner_public_key,
+                                unsigned char *session_key) {
+  size_t len = 0;
+  cchat_error_t result =
+      agent_request(AGENT_OP_SESSION_KEY, username, partner_public_key,
+                    PUBLIC_KEY_SIZE, session_key, SESSION_KEY_SIZE, &len);
+  if (result == CCHAT_SUCCESS && len != SESSION_KEY_SIZE) {
+    return CCHAT_ERROR_CRYPTO;
+  }
+  return result;
+}
+
+cchat_error_t agent_open_message(const char *username,
+                                 const unsigned char *encrypted,
+                                 size_t encrypted_len, char *message,
+                                 size_t *message_len) {
+  if (!encrypted || !message || !message_len ||
+      encrypted_len <= crypto_box_SEALBYTES ||
+      encrypted_len > ENCRYPTED_MSG_SIZE) {
+    return CCHAT_ERROR_INVALID_ARGS;
+  }
+
+  size_t len = 0;
+  cchat_error_t result =
+      agent_request(AGENT_OP_OPEN, username, encrypted, encrypted_len,
+                    (uint8_t *)message, MAX_MESSAGE_LEN, &len);
+  if (result != CCHAT_SUCCESS) {
+    return result == CCHAT_ERROR_CRYPTO ? CCHAT_ERROR_DECRYPTION : result;
+  }
+
+  message[len] = '\0';
+  *message_len = len;
+  return CCHAT_SUCCESS;
+}
+
+cchat_error_t agent_lock(void) {
+  return agent_request(AGENT_OP_LOCK, NULL, NULL, 0, NULL, 0, NULL);
+}
\ No newline at end of file
@@ -1,58 +1,307 @@
 #include "c-chat.h"
+#include <pthread.h>
+#include <time.h>
 
 chat_session_t current_session = {0};
 
+// Background unlock of the user's key file. Argon2id in load_keys_from_file()
+// takes ~100 ms, so it runs on a worker thread while start_chat() connects
+// and fetches the partner's public key; the result is joined only when the
+// first message needs encrypting.
+typedef struct {
+  pthread_t thread;
+  bool running;
+  char username[MAX_USERNAME_LEN];
+  char password[MAX_PASSWORD_LEN];
+  secure_session_keys_t *keys;
+  cchat_error_t result;
+} key_unlock_t;
+
+static void *key_unlock_worker(void *arg) {
+  key_unlock_t *unlock = arg;
+  unlock->result =
+      load_keys_from_file(unlock->username, unlock->keys->public_key,
+                          unlock->keys->private_key, unlock->password);
+  secure_zero_memory(unlock->password, sizeof(unlock->password));
+  return NULL;
+}
+
+static cchat_error_t begin_key_unlock(const char *username,
+                                      secure_session_keys_t *keys,
+                                      key_unlock_t *unlock) {
+  memset(unlock, 0, sizeof(*unlock));
+  unlock->keys = keys;
+  unlock->result = CCHAT_SUCCESS;
+  safe_strncpy(unlock->username, username, sizeof(unlock->username));
+
+  // A running key agent already holds the unlocked key: no password prompt
+  // and no Argon2id derivation
+  if (agent_get_public_key(username, keys->public_key) == CCHAT_SUCCESS) {
+    keys->agent_backed = true;
+    keys->keys_loaded = true;
+    return CCHAT_SUCCESS;
+  }
+
+  get_password_input("Enter your password to start secure chat: ",
+                     unlock->password, sizeof(unlock->password));
+
+  if (pthread_create(&unlock->thread, NULL, key_unlock_worker, unlock) == 0) {
+    unlock->running = true;
+  } else {
+    key_unlock_worker(unlock);
+  }
+
+  return CCHAT_SUCCESS;
+}
+
+static cchat_error_t finish_key_unlock(key_unlock_t *unlock) {
+  if (unlock->running) {
+    pthread_join(unlock->thread, NULL);
+    unlock->running = false;
+  }
+
+  secure_zero_memory(unlock->password, sizeof(unlock->password));
+
+  secure_session_keys_t *keys = unlock->keys;
+  if (keys->keys_loaded || unlock->result != CCHAT_SUCCESS) {
+    return unlock->result;
+  }
+
+  // Hand the key to the agent, if one is running, for later chats
+  if (agent_add_key(unlock->username, keys->public_key, keys->private_key) ==
+      CCHAT_SUCCESS) {
+    printf("[Key added to agent]\n");
+  }
+
+  keys->keys_loaded = true;
+  return CCHAT_SUCCESS;
+}
+
+// Join the key unlock and set up the per-chat session key
+static cchat_error_t ensure_session_ready(key_unlock_t *unlock) {
+  secure_session_keys_t *keys = unlock->keys;
+  if (keys->session_ready) {
+    return CCHAT_SUCCESS;
+  }
+
+  cchat_error_t result = finish_key_unlock(unlock);
+  if (result != CCHAT_SUCCESS) {
+    if (result == CCHAT_ERROR_DECRYPTION) {
+      fprintf(stderr, "Invalid password or corrupted key file.\n");
+    } else {
+      fprintf(stderr, "Failed to load your keys for secure messaging\n");
+    }
+    return result;
+  }
+
+  // One key exchange for the whole chat instead of one per message
+  if (keys->agent_backed) {
+    result = agent_session_key(unlock->username, keys->partner_public_key,
+                               keys->session_key);
+    if (result == CCHAT_SUCCESS) {
+      init_session_nonce(keys);
+    }
+  } else {
+    result = derive_session_key(keys);
+  }
+
+  return result == CCHAT_SUCCESS ? CCHAT_SUCCESS : CCHAT_ERROR_CRYPTO;
+}
+
+// Apply a server answer to the known keys file. pinned holds the existing
+// pin when have_pin is set. A key that differs from the pin is refused
+// rather than trusted.
+static cchat_error_t pin_server_key(const char *username, known_key_t *pinned,
+                                    bool have_pin, const unsigned char *fetched,
+                                    uint32_t key_version, bool unchanged) {
+  char fingerprint[KEY_FINGERPRINT_LEN];
+  if (have_pin && !unchanged &&
+      sodium_memcmp(fetched, pinned->public_key, PUBLIC_KEY_SIZE) != 0) {
+    format_key_fingerprint(pinned->public_key, fingerprint,
+                           sizeof(fingerprint));
+    fprintf(stderr, "\nWARNING: %s's public key has changed!\n", username);
+    fprintf(stderr, "  Pinned: %s\n", fingerprint);
+    format_key_fingerprint(fetched, fingerprint, sizeof(fingerprint));
+    fprintf(stderr, "  Server: %s\n", fingerprint);
+    fprintf(stderr, "Verify the new key with %s, then run "
+                    "'c-chat --forget-key %s' to accept it.\n",
+            username, username);
+    return CCHAT_ERROR_AUTH;
+  }
+
+  if (!have_pin) {
+    memset(pinned, 0, sizeof(*pinned));
+    safe_strncpy(pinned->username, username, sizeof(pinned->username));
+    memcpy(pinned->public_key, fetched, PUBLIC_KEY_SIZE);
+
+    format_key_fingerprint(fetched, fingerprint, sizeof(fingerprint));
+    printf("Pinned %s's key on first use: %s\n", username, fingerprint);
+  }
+
+  pinned->key_version = key_version;
+  pinned->verified_at = (uint64_t)time(NULL);
+  if (keycache_store(pinned) != CCHAT_SUCCESS) {
+    fprintf(stderr, "Warning: Could not update known keys file\n");
+  }
+
+  return CCHAT_SUCCESS;
+}
+
+// Resolve the partner's public key through the known keys file. A pin that
+// the server confirmed recently is used as-is, with no round trip; an older
+// one is revalidated by key version.
+static cchat_error_t resolve_partner_key(const char *username,
+                                         unsigned char *public_key) {
+  known_key_t pinned;
+  bool have_pin = keycache_lookup(username, &pinned) == CCHAT_SUCCESS;
+  uint64_t now = (uint64_t)time(NULL);
+
+  if (have_pin && pinned.key_version != 0 && now >= pinned.verified_at &&
+      now - pinned.verified_at < KEY_CACHE_REVALIDATE_SECS) {
+    memcpy(public_key, pinned.public_key, PUBLIC_KEY_SIZE);
+    return CCHAT_SUCCESS;
+  }
+
+  if (have_pin) {
+    printf("Revalidating %s's public key with server...\n", username);
+  } else {
+    printf("Retrieving %s's public key from server...\n", username);
+  }
+
+  unsigned char fetched[PUBLIC_KEY_SIZE];
+  uint32_t key_version = 0;
+  bool unchanged = false;
+  cchat_error_t result =
+      fetch_user_public_key(username, have_pin ? pinned.key_version : 0,
+                            fetched, &key_version, &unchanged);
+  if (result != CCHAT_SUCCESS) {
+    return result;
+  }
+
+  result = pin_server_key(username, &pinned, have_pin, fetched, key_version,
+                          unchanged);
+  if (result != CCHAT_SUCCESS) {
+    return result;
+  }
+
+  memcpy(public_key, pinned.public_key, PUBLIC_KEY_SIZE);
+  return CCHAT_SUCCESS;
+}
+
+cchat_error_t sync_known_keys(const char **usernames, size_t count) {
+  if (!usernames || count == 0) {
+    return CCHAT_ERROR_INVALID_ARGS;
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    if (validate_username(usernames[i]) != CCHAT_SUCCESS) {
+      fprintf(stderr, "Invalid username: %s\n", usernames[i]);
+      return CCHAT_ERROR_INVALID_ARGS;
+    }
+  }
+
+  cchat_error_t result = connect_to_server();
+  if (result != CCHAT_SUCCESS) {
+    fprintf(stderr, "Failed to connect to server\n");
+    return CCHAT_ERROR_NETWORK;
+  }
+
+  // One GET_PUBLIC_KEYS round trip per MAX_KEY_BATCH names; pinned keys
+  // carry their version so unchanged ones come back without the key
+  size_t pinned_count = 0, unchanged_count = 0, missing_count = 0;
+  size_t changed_count = 0;
+  for (size_t start = 0; start < count && result == CCHAT_SUCCESS;
+       start += MAX_KEY_BATCH) {
+    size_t batch = count - start < MAX_KEY_BATCH ? count - start
+                                                 : MAX_KEY_BATCH;
+    known_key_t pins[MAX_KEY_BATCH];
+    known_key_t fetched[MAX_KEY_BATCH];
+    bool have_pin[MAX_KEY_BATCH];
+    key_lookup_status_t statuses[MAX_KEY_BATCH];
+
+    for (size_t i = 0; i < batch; i++) {
+      const char *username = usernames[start + i];
+      have_pin[i] = keycache_lookup(username, &pins[i]) == CCHAT_SUCCESS;
+
+      memset(&fetched[i], 0, sizeof(fetched[i]));
+      safe_strncpy(fetched[i].username, username,
+                   sizeof(fetched[i].username));
+      fetched[i].key_version = have_pin[i] ? pins[i].key_version : 0;
+    }
+
+    result = fetch_user_public_keys(fetched, statuses, batch);
+    if (result != CCHAT_SUCCESS) {
+      fprintf(stderr, "Failed to retrieve public keys\n");
+      break;
+    }
+
+    for (size_t i = 0; i < batch; i++) {
+      if (statuses[i] == KEY_LOOKUP_NOT_FOUND) {
+        printf("  %s: not found on server\n", fetched[i].username);
+        missing_count++;
+        continue;
+      }
+
+      bool unchanged = statuses[i] == KEY_LOOKUP_UNCHANGED;
+      if (pin_server_key(fetched[i].username, &pins[i], have_pin[i],
+                         fetched[i].public_key, fetched[i].key_version,
+                         unchanged) != CCHAT_SUCCESS) {
+        changed_count++;
+      } else if (have_pin[i]) {
+        unchanged_count++;
+      } else {
+        pinned_count++;
+      }
+    }
+  }
+
+  disconnect_from_server();
+
+  if (result == CCHAT_SUCCESS) {
+    printf("Key sync: %zu newly pinned, %zu confirmed, %zu changed, "
+           "%zu not found\n",
+           pinned_count, unchanged_count, changed_count, missing_count);
+  }
+  return result != CCHAT_SUCCESS  ? result
+         : changed_count > 0 ? CCHAT_ERROR_AUTH
+                             : CCHAT_SUCCESS;
+}
+
 cchat_error_t start_chat(const char *username) {
   printf("Initiating secure chat with %s...\n", username);
 
   // Use stack-allocated keys for better security
   secure_session_keys_t session_keys = {0};
+  key_unlock_t unlock;
 
   if (validate_username(username) != CCHAT_SUCCESS) {
     printf("Error: Invalid username\n");
     return CCHAT_ERROR_INVALID_ARGS;
   }
 
-  // Load current user's private key for decryption
-  if (!session_keys.keys_loaded) {
-    char password[MAX_PASSWORD_LEN];
-    get_password_input("Enter your password to start secure chat: ", password,
-                       sizeof(password));
-
-    unsigned char public_key_temp[PUBLIC_KEY_SIZE];
-    cchat_error_t result = load_keys_from_file(
-        current_session.current_user.username, public_key_temp,
-        session_keys.private_key, password);
-    if (result != CCHAT_SUCCESS) {
-      fprintf(stderr, "Failed to load your keys for secure messaging\n");
-      secure_zero_memory(password, sizeof(password));
-      secure_zero_memory(&session_keys, sizeof(session_keys));
-      return result;
-    }
-
-    secure_zero_memory(password, sizeof(password));
-    secure_zero_memory(public_key_temp, sizeof(public_key_temp));
-    session_keys.keys_loaded = true;
-  }
+  // Start unlocking our private key; it is joined at the first message
+  begin_key_unlock(current_session.current_user.username, &session_keys,
+                   &unlock);
 
   // Connect to server and retrieve target user's public key
   cchat_error_t server_result = connect_to_server();
   if (server_result != CCHAT_SUCCESS) {
     fprintf(stderr, "Failed to connect to server\n");
+    finish_key_unlock(&unlock);
     secure_zero_memory(&session_keys, sizeof(session_keys));
     return CCHAT_ERROR_NETWORK;
   }
 
-  printf("Retrieving %s's public key from server...\n", username);
   server_result =
-      get_user_public_key(username, session_keys.partner_public_key);
+      resolve_partner_key(username, session_keys.partner_public_key);
   if (server_result != CCHAT_SUCCESS) {
     if (server_result == CCHAT_ERROR_USER_NOT_FOUND) {
       fprintf(stderr, "User %s not found on server\n", username);
-    } else {
+    } else if (server_result != CCHAT_ERROR_AUTH) {
       fprintf(stderr, "Failed to retrieve public key for %s\n", username);
     }
     disconnect_from_server();
+    finish_key_unlock(&unlock);
     secure_zero_memory(&session_keys, sizeof(session_keys));
     return server_result;
   }
@@ -64,10 +313,12 @@ cchat_error_t start_chat(const char *username) {
   current_session.is_in_chat = true;
 
   printf("\nSecure chat established with %s\n", username);
-  printf("End-to-end encryption active (ChaCha20-Poly1305)\n");
+  printf("End-to-end encryption active (X25519 session key, "
+         "XSalsa20-Poly1305)\n");
   printf("Type your messages (or /exit to leave chat):\n\n");
 
   // Chat loop
+  cchat_error_t chat_result = CCHAT_SUCCESS;
   char message[MAX_MESSAGE_LEN];
   while (current_session.is_in_chat) {
     printf("%s> ", current_session.chat_partner.username);
@@ -83,13 +334,16 @@ cchat_error_t start_chat(const char *username) {
     if (strcmp(message, "/exit") == 0) {
       current_session.is_in_chat = false;
       printf("Chat session ended.\n");
-      // Disconnect from server and securely clear all session keys before exit
-      disconnect_from_server();
-      secure_zero_memory(&session_keys, sizeof(session_keys));
       break;
     }
 
     if (strlen(message) > 0) {
+      chat_result = ensure_session_ready(&unlock);
+      if (chat_result != CCHAT_SUCCESS) {
+        current_session.is_in_chat = false;
+        break;
+      }
+
       cchat_error_t result = send_message_secure(message, &session_keys);
       if (result != CCHAT_SUCCESS) {
         printf("Failed to send message\n");
@@ -97,10 +351,11 @@ cchat_error_t start_chat(const char *username) {
     }
   }
 
-  // Ensure keys are cleared and server disconnected even on normal exit
+  // Disconnect from server and securely clear all session keys before exit
   disconnect_from_server();
+  finish_key_unlock(&unlock);
   secure_zero_memory(&session_keys, sizeof(session_keys));
-  return CCHAT_SUCCESS;
+  return chat_result;
 }
 
 cchat_error_t send_message_secure(const char *message,
@@ -114,12 +369,16 @@ cchat_error_t send_message_secure(const char *message,
     return CCHAT_ERROR_CRYPTO;
   }
 
-  // Encrypt message with recipient's public key
+  // Encrypt with the precomputed session key, or seal to the recipient's
+  // public key when no session has been established
   unsigned char encrypted[ENCRYPTED_MSG_SIZE];
   size_t encrypted_len;
 
-  cchat_error_t result = encrypt_message(message, keys->partner_public_key,
-                                         encrypted, &encrypted_len);
+  cchat_error_t result =
+      keys->session_ready
+          ? encrypt_message_session(message, keys, encrypted, &encrypted_len)
+          : encrypt_message(message, keys->partner_public_key, encrypted,
+                            &encrypted_len);
   if (result != CCHAT_SUCCESS) {
     fprintf(stderr, "Failed to encrypt message\n");
     return result;
@@ -145,6 +404,28 @@ cchat_error_t send_message_secure(const char *message,
   return CCHAT_SUCCESS;
 }
 
+// Session envelopes start with SESSION_ENVELOPE_VERSION; anything else, or
+// an envelope that fails to authenticate, is treated as a sealed box
+static cchat_error_t open_chat_message(const secure_session_keys_t *keys,
+                                       const unsigned char *encrypted,
+                                       size_t encrypted_len, char *message,
+                                       size_t *message_len) {
+  if (keys->session_ready && encrypted_len > 0 &&
+      encrypted[0] == SESSION_ENVELOPE_VERSION &&
+      decrypt_message_session(encrypted, encrypted_len, keys, message,
+                              message_len) == CCHAT_SUCCESS) {
+    return CCHAT_SUCCESS;
+  }
+
+  if (keys->agent_backed) {
+    return agent_open_message(current_session.current_user.username,
+                              encrypted, encrypted_len, message, message_len);
+  }
+
+  return decrypt_sealed_message(encrypted, encrypted_len, keys->public_key,
+                                keys->private_key, message, message_len);
+}
+
 cchat_error_t receive_messages_secure(secure_session_keys_t *keys) {
   if (!keys || !keys->keys_loaded) {
     return CCHAT_ERROR_CRYPTO;
@@ -158,26 +439,25 @@ cchat_error_t receive_messages_secure(secure_session_keys_t *keys) {
   unsigned char encrypted[ENCRYPTED_MSG_SIZE];
   size_t encrypted_len;
 
-  // Encrypt with our own public key for demo (in reality, this would come from
-  // server)
-  unsigned char our_public[PUBLIC_KEY_SIZE];
-  crypto_scalarmult_base(our_public, keys->private_key);
-
-  if (encrypt_message(demo_message, our_public, encrypted, &encrypted_len) !=
-      CCHAT_SUCCESS) {
-    secure_zero_memory(our_public, sizeof(our_public));
+  // Encrypt to ourselves for demo (in reality, this would come from server)
+  cchat_error_t result =
+      keys->session_ready
+          ? encrypt_message_session(demo_message, keys, encrypted,
+                                    &encrypted_len)
+          : encrypt_message(demo_message, keys->public_key, encrypted,
+                            &encrypted_len);
+  if (result != CCHAT_SUCCESS) {
     return CCHAT_ERROR_ENCRYPTION;
   }
 
   // Decrypt the received message
-  char decrypted[MAX_MESSAGE_LEN];
+  char decrypted[MAX_MESSAGE_LEN + 1];
   size_t decrypted_len;
 
-  cchat_error_t result = decrypt_message(
-      encrypted, encrypted_len, keys->private_key, decrypted, &decrypted_len);
+  result = open_chat_message(keys, encrypted, encrypted_len, decrypted,
+                             &decrypted_len);
   if (result != CCHAT_SUCCESS) {
     fprintf(stderr, "Failed to decrypt received message\n");
-    secure_zero_memory(our_public, sizeof(our_public));
     secure_zero_memory(encrypted, sizeof(encrypted));
     return result;
   }
@@ -186,7 +466,6 @@ cchat_error_t receive_messages_secure(secure_session_keys_t *keys) {
   printf("[Message decrypted and verified]\n");
 
   // Clear sensitive data
-  secure_zero_memory(our_public, sizeof(our_public));
   secure_zero_memory(encrypted, sizeof(encrypted));
   secure_zero_memory(decrypted, sizeof(decrypted));
 
@@ -1,3 +1,6 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // fdopen / fileno
+#endif
 #include "c-chat.h"
 #include <fcntl.h>
 #include <sys/stat.h>
@@ -79,8 +82,7 @@ cchat_error_t decrypt_message(const unsigned char *encrypted,
                               size_t encrypted_len,
                               const unsigned char *private_key, char *message,
                               size_t *message_len) {
-  if (!encrypted || !private_key || !message || !message_len ||
-      encrypted_len == 0) {
+  if (!private_key) {
     return CCHAT_ERROR_INVALID_ARGS;
   }
 
@@ -90,10 +92,34 @@ cchat_error_t decrypt_message(const unsigned char *encrypted,
   }
 
   // Generate public key from private key using Curve25519 scalar multiplication
-  // Required because crypto_box_seal_open needs both keys to decrypt
+  // Callers decrypting repeatedly should cache it and use
+  // decrypt_sealed_message() directly
   unsigned char public_key[PUBLIC_KEY_SIZE];
   crypto_scalarmult_base(public_key, private_key);
 
+  result = decrypt_sealed_message(encrypted, encrypted_len, public_key,
+                                  private_key, message, message_len);
+
+  secure_zero_memory(public_key, sizeof(public_key));
+  return result;
+}
+
+cchat_error_t decrypt_sealed_message(const unsigned char *encrypted,
+                                     size_t encrypted_len,
+                                     const unsigned char *public_key,
+                                     const unsigned char *private_key,
+                                     char *message, size_t *message_len) {
+  if (!encrypted || !public_key || !private_key || !message || !message_len ||
+      encrypted_len <= crypto_box_SEALBYTES ||
+      encrypted_len > ENCRYPTED_MSG_SIZE) {
+    return CCHAT_ERROR_INVALID_ARGS;
+  }
+
+  cchat_error_t result = init_crypto_library();
+  if (result != CCHAT_SUCCESS) {
+    return result;
+  }
+
   // Decrypt the message using anonymous encryption (crypto_box_seal)
   // This requires both the recipient's public and private keys
   unsigned char decrypted_buffer[MAX_MESSAGE_LEN + 1];
@@ -111,99 +137,245 @@ cchat_error_t decrypt_message(const unsigned char *encrypted,
 
   // Clear sensitive data
   secure_zero_memory(decrypted_buffer, sizeof(decrypted_buffer));
-  secure_zero_memory(public_key, sizeof(public_key));
 
   return CCHAT_SUCCESS;
 }
 
-cchat_error_t save_keys_to_file(const char *username,
-                                const unsigned char *public_key,
-                                const unsigned char *private_key,
-                                const char *password) {
-  if (!username || !public_key || !private_key || !password) {
+cchat_error_t derive_session_key(secure_session_keys_t *keys) {
+  if (!keys || !keys->keys_loaded) {
     return CCHAT_ERROR_INVALID_ARGS;
   }
 
-  if (create_keys_directory() != CCHAT_SUCCESS) {
-    return CCHAT_ERROR_FILE_IO;
+  cchat_error_t result = init_crypto_library();
+  if (result != CCHAT_SUCCESS) {
+    return result;
+  }
+
+  // Both peers arrive at the same key: DH(our_sk, their_pk) hashed with
+  // HSalsa20. The random nonce prefix keeps the two directions apart.
+  if (crypto_box_beforenm(keys->session_key, keys->partner_public_key,
+                          keys->private_key) != 0) {
+    fprintf(stderr, "Failed to derive session key\n");
+    return CCHAT_ERROR_CRYPTO;
   }
 
+  init_session_nonce(keys);
+  return CCHAT_SUCCESS;
+}
+
+void init_session_nonce(secure_session_keys_t *keys) {
+  randombytes_buf(keys->nonce_prefix, sizeof(keys->nonce_prefix));
+  keys->nonce_counter = 0;
+  keys->session_ready = true;
+}
+
+cchat_error_t encrypt_message_session(const char *message,
+                                      secure_session_keys_t *keys,
+                                      unsigned char *encrypted,
+                                      size_t *encrypted_len) {
+  if (!message || !keys || !keys->session_ready || !encrypted ||
+      !encrypted_len) {
+    return CCHAT_ERROR_INVALID_ARGS;
+  }
+
+  size_t message_len = strlen(message);
+  if (message_len == 0 || message_len > MAX_MESSAGE_LEN) {
+    return CCHAT_ERROR_INVALID_ARGS;
+  }
+
+  if (keys->nonce_counter == UINT64_MAX) {
+    // Never reuse a nonce under the same key; start a new chat instead
+    return CCHAT_ERROR_ENCRYPTION;
+  }
+
+  unsigned char *nonce = &encrypted[1];
+  memcpy(nonce, keys->nonce_prefix, SESSION_NONCE_PREFIX_SIZE);
+  uint64_t counter = keys->nonce_counter++;
+  for (int i = 0; i < 8; i++) {
+    nonce[SESSION_NONCE_PREFIX_SIZE + i] = (counter >> (56 - 8 * i)) & 0xFF;
+  }
+
+  encrypted[0] = SESSION_ENVELOPE_VERSION;
+  if (crypto_box_easy_afternm(&encrypted[1 + crypto_box_NONCEBYTES],
+                              (const unsigned char *)message, message_len,
+                              nonce, keys->session_key) != 0) {
+    fprintf(stderr, "Failed to encrypt message\n");
+    return CCHAT_ERROR_ENCRYPTION;
+  }
+
+  *encrypted_len = message_len + SESSION_OVERHEAD;
+  return CCHAT_SUCCESS;
+}
+
+cchat_error_t decrypt_message_session(const unsigned char *encrypted,
+                                      size_t encrypted_len,
+                                      const secure_session_keys_t *keys,
+                                      char *message, size_t *message_len) {
+  if (!encrypted || !keys || !keys->session_ready || !message ||
+      !message_len || encrypted_len <= SESSION_OVERHEAD ||
+      encrypted_len > MAX_MESSAGE_LEN + SESSION_OVERHEAD ||
+      encrypted[0] != SESSION_ENVELOPE_VERSION) {
+    return CCHAT_ERROR_INVALID_ARGS;
+  }
+
+  size_t plain_len = encrypted_len - SESSION_OVERHEAD;
+  if (crypto_box_open_easy_afternm((unsigned char *)message,
+                                   &encrypted[1 + crypto_box_NONCEBYTES],
+                                   encrypted_len - 1 - crypto_box_NONCEBYTES,
+                                   &encrypted[1], keys->session_key) != 0) {
+    return CCHAT_ERROR_DECRYPTION;
+  }
+
+  message[plain_len] = '\0';
+  *message_len = plain_len;
+  return CCHAT_SUCCESS;
+}
+
+static cchat_error_t key_file_path(const char *username, char *path,
+                                   size_t size) {
   char *home_dir = get_home_directory();
   if (!home_dir) {
     return CCHAT_ERROR_FILE_IO;
   }
 
   // Construct path safely to prevent buffer overflow
-  char keys_path[PATH_MAX];
-  int path_len = snprintf(keys_path, sizeof(keys_path), "%s/%s/%s.keys",
-                          home_dir, KEYS_DIR, username);
-  if (path_len >= (int)sizeof(keys_path) || path_len < 0) {
+  int path_len =
+      snprintf(path, size, "%s/%s/%s.keys", home_dir, KEYS_DIR, username);
+  free(home_dir);
+  if (path_len >= (int)size || path_len < 0) {
     fprintf(stderr, "Path too long for key file\n");
-    free(home_dir);
     return CCHAT_ERROR_FILE_IO;
   }
 
+  return CCHAT_SUCCESS;
+}
+
+static void write_be32(unsigned char *out, uint32_t value) {
+  out[0] = (unsigned char)(value >> 24);
+  out[1] = (unsigned char)(value >> 16);
+  out[2] = (unsigned char)(value >> 8);
+  out[3] = (unsigned char)value;
+}
+
+static uint32_t read_be32(const unsigned char *in) {
+  return ((uint32_t)in[0] << 24) | ((uint32_t)in[1] << 16) |
+         ((uint32_t)in[2] << 8) | (uint32_t)in[3];
+}
+
+static cchat_error_t seal_keys_to_file(const char *username,
+                                       const unsigned char *public_key,
+                                       const unsigned char *private_key,
+                                       const char *password,
+                                       const kdf_params_t *params) {
+  if (create_keys_directory() != CCHAT_SUCCESS) {
+    return CCHAT_ERROR_FILE_IO;
+  }
+
+  char keys_path[PATH_MAX];
+  char temp_path[PATH_MAX + 8];
+  if (key_file_path(username, keys_path, sizeof(keys_path)) != CCHAT_SUCCESS) {
+    return CCHAT_ERROR_FILE_IO;
+  }
+  snprintf(temp_path, sizeof(temp_path), "%s.tmp", keys_path);
+
+  // Key file in secure format: [header][salt][nonce][public_key]
+  // [encrypted_private_key]. The header records the Argon2id limits so they
+  // can change per machine without breaking existing files.
+  unsigned char file_data[KEY_FILE_HEADER_SIZE + KEY_FILE_BODY_SIZE] = {0};
+  unsigned char *header = file_data;
+  unsigned char *salt = header + KEY_FILE_HEADER_SIZE;
+  unsigned char *nonce = salt + KEY_DERIVATION_SALT_SIZE;
+  unsigned char *stored_public = nonce + crypto_secretbox_NONCEBYTES;
+  unsigned char *encrypted_private = stored_public + PUBLIC_KEY_SIZE;
+
+  memcpy(header, KEY_FILE_MAGIC, 4);
+  header[4] = KEY_FILE_VERSION;
+  header[5] = crypto_pwhash_ALG_ARGON2ID13;
+  write_be32(header + 8, (uint32_t)params->opslimit);
+  write_be32(header + 12, (uint32_t)(params->memlimit / 1024));
+
   // Generate cryptographically secure random salt for Argon2 key derivation
   // Each user gets a unique salt to prevent rainbow table attacks
-  unsigned char salt[KEY_DERIVATION_SALT_SIZE];
-  randombytes_buf(salt, sizeof(salt));
+  randombytes_buf(salt, KEY_DERIVATION_SALT_SIZE);
+  randombytes_buf(nonce, crypto_secretbox_NONCEBYTES);
+  memcpy(stored_public, public_key, PUBLIC_KEY_SIZE);
 
   // Derive encryption key from password
   unsigned char derived_key[DERIVED_KEY_SIZE];
-  if (derive_key_from_password(password, salt, derived_key) != CCHAT_SUCCESS) {
-    free(home_dir);
+  if (derive_key_from_password_with_limits(password, salt, params->opslimit,
+                                           params->memlimit,
+                                           derived_key) != CCHAT_SUCCESS) {
     secure_zero_memory(derived_key, sizeof(derived_key));
     return CCHAT_ERROR_KEY_DERIVATION;
   }
 
   // Encrypt private key
-  unsigned char encrypted_private[PRIVATE_KEY_SIZE + crypto_secretbox_MACBYTES];
-  unsigned char nonce[crypto_secretbox_NONCEBYTES];
-  randombytes_buf(nonce, sizeof(nonce));
-
   if (crypto_secretbox_easy(encrypted_private, private_key, PRIVATE_KEY_SIZE,
                             nonce, derived_key) != 0) {
-    free(home_dir);
     secure_zero_memory(derived_key, sizeof(derived_key));
     return CCHAT_ERROR_ENCRYPTION;
   }
+  secure_zero_memory(derived_key, sizeof(derived_key));
 
-  // Save key file in secure format:
-  // [salt][nonce][public_key][encrypted_private_key] This layout allows safe
-  // key loading without exposing private key structure
-  FILE *file = fopen(keys_path, "wb");
-  if (!file) {
+  // Write a temporary file and rename it over the old one, so an upgrade
+  // interrupted halfway never leaves the user without a readable key file
+  int fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR);
+  if (fd < 0) {
     perror("Failed to create key file");
-    free(home_dir);
-    secure_zero_memory(derived_key, sizeof(derived_key));
     return CCHAT_ERROR_FILE_IO;
   }
 
-  // Write components
-  if (fwrite(salt, 1, sizeof(salt), file) != sizeof(salt) ||
-      fwrite(nonce, 1, sizeof(nonce), file) != sizeof(nonce) ||
-      fwrite(public_key, 1, PUBLIC_KEY_SIZE, file) != PUBLIC_KEY_SIZE ||
-      fwrite(encrypted_private, 1, sizeof(encrypted_private), file) !=
-          sizeof(encrypted_private)) {
-    fclose(file);
-    unlink(keys_path);
-    free(home_dir);
-    secure_zero_memory(derived_key, sizeof(derived_key));
+  FILE *file = fdopen(fd, "wb");
+  if (!file) {
+    close(fd);
+    unlink(temp_path);
     return CCHAT_ERROR_FILE_IO;
   }
 
+  if (fwrite(file_data, 1, sizeof(file_data), file) != sizeof(file_data) ||
+      fflush(file) != 0 || fsync(fileno(file)) != 0) {
+    fclose(file);
+    unlink(temp_path);
+    return CCHAT_ERROR_FILE_IO;
+  }
   fclose(file);
 
+  if (rename(temp_path, keys_path) != 0) {
+    perror("Failed to replace key file");
+    unlink(temp_path);
+    return CCHAT_ERROR_FILE_IO;
+  }
+
   // Set secure file permissions (owner read/write only)
   if (secure_file_permissions(keys_path) != CCHAT_SUCCESS) {
     fprintf(stderr, "Warning: Could not set secure file permissions\n");
   }
 
-  free(home_dir);
-  secure_zero_memory(derived_key, sizeof(derived_key));
-  secure_zero_memory(encrypted_private, sizeof(encrypted_private));
+  return CCHAT_SUCCESS;
+}
+
+cchat_error_t save_keys_to_file(const char *username,
+                                const unsigned char *public_key,
+                                const unsigned char *private_key,
+                                const char *password) {
+  if (!username || !public_key || !private_key || !password) {
+    return CCHAT_ERROR_INVALID_ARGS;
+  }
+
+  // New files use this machine's calibrated limits (see kdf.c)
+  kdf_params_t params;
+  load_kdf_params(&params);
+
+  cchat_error_t result =
+      seal_keys_to_file(username, public_key, private_key, password, &params);
+  if (result != CCHAT_SUCCESS) {
+    return result;
+  }
 
-  printf("Keys saved securely to: %s\n", keys_path);
+  char keys_path[PATH_MAX];
+  if (key_file_path(username, keys_path, sizeof(keys_path)) == CCHAT_SUCCESS) {
+    printf("Keys saved securely to: %s\n", keys_path);
+  }
   return CCHAT_SUCCESS;
 }
 
@@ -215,61 +387,89 @@ cchat_error_t load_keys_from_file(const char *username,
     return CCHAT_ERROR_INVALID_ARGS;
   }
 
-  char *home_dir = get_home_directory();
-  if (!home_dir) {
-    return CCHAT_ERROR_FILE_IO;
-  }
-
   char keys_path[PATH_MAX];
-  int path_len = snprintf(keys_path, sizeof(keys_path), "%s/%s/%s.keys",
-                          home_dir, KEYS_DIR, username);
-  if (path_len >= (int)sizeof(keys_path) || path_len < 0) {
-    fprintf(stderr, "Path too long for key file\n");
-    free(home_dir);
+  if (key_file_path(username, keys_path, sizeof(keys_path)) != CCHAT_SUCCESS) {
     return CCHAT_ERROR_FILE_IO;
   }
 
   FILE *file = fopen(keys_path, "rb");
   if (!file) {
-    free(home_dir);
     return CCHAT_ERROR_FILE_IO;
   }
 
-  // Read components
-  unsigned char salt[KEY_DERIVATION_SALT_SIZE];
-  unsigned char nonce[crypto_secretbox_NONCEBYTES];
-  unsigned char encrypted_private[PRIVATE_KEY_SIZE + crypto_secretbox_MACBYTES];
+  // Read one byte past the largest valid file to reject trailing data
+  unsigned char file_data[KEY_FILE_HEADER_SIZE + KEY_FILE_BODY_SIZE + 1];
+  size_t file_len = fread(file_data, 1, sizeof(file_data), file);
+  fclose(file);
 
-  if (fread(salt, 1, sizeof(salt), file) != sizeof(salt) ||
-      fread(nonce, 1, sizeof(nonce), file) != sizeof(nonce) ||
-      fread(public_key, 1, PUBLIC_KEY_SIZE, file) != PUBLIC_KEY_SIZE ||
-      fread(encrypted_private, 1, sizeof(encrypted_private), file) !=
-          sizeof(encrypted_private)) {
-    fclose(file);
-    free(home_dir);
+  kdf_params_t stored;
+  const unsigned char *body;
+  bool legacy = false;
+
+  if (file_len == KEY_FILE_HEADER_SIZE + KEY_FILE_BODY_SIZE &&
+      memcmp(file_data, KEY_FILE_MAGIC, 4) == 0) {
+    if (file_data[4] != KEY_FILE_VERSION ||
+        file_data[5] != crypto_pwhash_ALG_ARGON2ID13) {
+      fprintf(stderr, "Unsupported key file version\n");
+      return CCHAT_ERROR_FILE_IO;
+    }
+    stored.opslimit = read_be32(file_data + 8);
+    stored.memlimit = (size_t)read_be32(file_data + 12) * 1024;
+    if (!kdf_params_valid(&stored)) {
+      fprintf(stderr, "Key file has invalid KDF parameters\n");
+      return CCHAT_ERROR_FILE_IO;
+    }
+    body = file_data + KEY_FILE_HEADER_SIZE;
+  } else if (file_len == KEY_FILE_BODY_SIZE) {
+    // Original headerless format
+    kdf_default_params(&stored);
+    body = file_data;
+    legacy = true;
+  } else {
     return CCHAT_ERROR_FILE_IO;
   }
 
-  fclose(file);
-  free(home_dir);
+  const unsigned char *salt = body;
+  const unsigned char *nonce = salt + KEY_DERIVATION_SALT_SIZE;
+  const unsigned char *stored_public = nonce + crypto_secretbox_NONCEBYTES;
+  const unsigned char *encrypted_private = stored_public + PUBLIC_KEY_SIZE;
+
+  memcpy(public_key, stored_public, PUBLIC_KEY_SIZE);
 
   // Derive decryption key from password
   unsigned char derived_key[DERIVED_KEY_SIZE];
-  if (derive_key_from_password(password, salt, derived_key) != CCHAT_SUCCESS) {
+  if (derive_key_from_password_with_limits(password, salt, stored.opslimit,
+                                           stored.memlimit,
+                                           derived_key) != CCHAT_SUCCESS) {
     secure_zero_memory(derived_key, sizeof(derived_key));
     return CCHAT_ERROR_KEY_DERIVATION;
   }
 
   // Decrypt private key
-  if (crypto_secretbox_open_easy(private_key, encrypted_private,
-                                 sizeof(encrypted_private), nonce,
-                                 derived_key) != 0) {
+  if (crypto_secretbox_open_easy(
+          private_key, encrypted_private,
+          PRIVATE_KEY_SIZE + crypto_secretbox_MACBYTES, nonce,
+          derived_key) != 0) {
     secure_zero_memory(derived_key, sizeof(derived_key));
     return CCHAT_ERROR_DECRYPTION;
   }
 
   secure_zero_memory(derived_key, sizeof(derived_key));
-  secure_zero_memory(encrypted_private, sizeof(encrypted_private));
+
+  // Transparent upgrade: re-seal under the configured limits while the
+  // password is at hand. Failure leaves the old file in place.
+  kdf_params_t configured;
+  load_kdf_params(&configured);
+  if (legacy || stored.opslimit != configured.opslimit ||
+      stored.memlimit != configured.memlimit) {
+    if (seal_keys_to_file(username, public_key, private_key, password,
+                          &configured) == CCHAT_SUCCESS) {
+      printf("Upgraded key file to opslimit=%llu memlimit=%zu MiB\n",
+             configured.opslimit, configured.memlimit / (1024 * 1024));
+    } else {
+      fprintf(stderr, "Warning: Could not upgrade key file\n");
+    }
+  }
 
   return CCHAT_SUCCESS;
 }
@@ -306,16 +506,24 @@ cchat_error_t create_keys_directory(void) {
 cchat_error_t derive_key_from_password(const char *password,
                                        const unsigned char *salt,
                                        unsigned char *derived_key) {
+  // INTERACTIVE settings balance security with user experience (~100ms)
+  return derive_key_from_password_with_limits(
+      password, salt, crypto_pwhash_OPSLIMIT_INTERACTIVE,
+      crypto_pwhash_MEMLIMIT_INTERACTIVE, derived_key);
+}
+
+cchat_error_t derive_key_from_password_with_limits(const char *password,
+                                                   const unsigned char *salt,
+                                                   unsigned long long opslimit,
+                                                   size_t memlimit,
+                                                   unsigned char *derived_key) {
   if (!password || !salt || !derived_key) {
     return CCHAT_ERROR_INVALID_ARGS;
   }
 
   // Use Argon2id key derivation function (memory-hard, side-channel resistant)
-  // INTERACTIVE settings balance security with user experience (~100ms)
   if (crypto_pwhash(derived_key, DERIVED_KEY_SIZE, password, strlen(password),
-                    salt, crypto_pwhash_OPSLIMIT_INTERACTIVE,
-                    crypto_pwhash_MEMLIMIT_INTERACTIVE,
-                    crypto_pwhash_ALG_DEFAULT) != 0) {
+                    salt, opslimit, memlimit, crypto_pwhash_ALG_DEFAULT) != 0) {
     fprintf(stderr, "Key derivation failed - out of memory\n");
     return CCHAT_ERROR_KEY_DERIVATION;
   }
@@ -327,4 +535,249 @@ void secure_zero_memory(void *ptr, size_t size) {
   if (ptr && size > 0) {
     sodium_memzero(ptr, size);
   }
+}
+
+void generate_group_key(unsigned char *group_key) {
+  randombytes_buf(group_key, GROUP_KEY_SIZE);
+}
+
+// wrapped receives WRAPPED_GROUP_KEY_SIZE bytes that only the member can
+// open; the group's creator sends one to each member
+cchat_error_t wrap_group_key(const unsigned char *group_key,
+                             const unsigned char *member_public_key,
+                             unsigned char *wrapped) {
+  if (!group_key || !member_public_key || !wrapped) {
+    return CCHAT_ERROR_INVALID_ARGS;
+  }
+
+  cchat_error_t result = init_crypto_library();
+  if (result != CCHAT_SUCCESS) {
+    return result;
+  }
+
+  if (crypto_box_seal(wrapped, group_key, GROUP_KEY_SIZE,
+                      member_public_key) != 0) {
+    return CCHAT_ERROR_ENCRYPTION;
+  }
+  return CCHAT_SUCCESS;
+}
+
+cchat_error_t unwrap_group_key(const unsigned char *wrapped,
+                               size_t wrapped_len,
+                               const unsigned char *public_key,
+                               const unsigned char *private_key,
+                               unsigned char *group_key) {
+  if (!wrapped || wrapped_len != WRAPPED_GROUP_KEY_SIZE || !public_key ||
+      !private_key || !group_key) {
+    return CCHAT_ERROR_INVALID_ARGS;
+  }
+
+  if (crypto_box_seal_open(group_key, wrapped, wrapped_len, public_key,
+                           private_key) != 0) {
+    return CCHAT_ERROR_DECRYPTION;
+  }
+  return CCHAT_SUCCESS;
+}
+
+cchat_error_t encrypt_group_message(const char *message,
+                                    const unsigned char *group_key,
+                                    unsigned char *encrypted,
+                                    size_t *encrypted_len) {
+  if (!message || !group_key || !encrypted || !encrypted_len) {
+    return CCHAT_ERROR_INVALID_ARGS;
+  }
+
+  size_t message_len = strlen(message);
+  if (message_len == 0 || message_len > MAX_MESSAGE_LEN) {
+    return CCHAT_ERROR_INVALID_ARGS;
+  }
+
+  cchat_error_t result = init_crypto_library();
+  if (result != CCHAT_SUCCESS) {
+    return result;
+  }
+
+  // Every member encrypts under the same key, so nonces cannot be counters;
+  // 24 random bytes make a collision negligible
+  unsigned char *nonce = &encrypted[1];
+  randombytes_buf(nonce, crypto_secretbox_NONCEBYTES);
+
+  encrypted[0] = GROUP_ENVELOPE_VERSION;
+  if (crypto_secretbox_easy(&encrypted[1 + crypto_secretbox_NONCEBYTES],
+                            (const unsigned char *)message, message_len, nonce,
+                            group_key) != 0) {
+    fprintf(stderr, "Failed to encrypt message\n");
+    return CCHAT_ERROR_ENCRYPTION;
+  }
+
+  *encrypted_len = message_len + GROUP_OVERHEAD;
+  return CCHAT_SUCCESS;
+}
+
+// message needs room for MAX_MESSAGE_LEN bytes and the terminator
+cchat_error_t decrypt_group_message(const unsigned char *encrypted,
+                                    size_t encrypted_len,
+                                    const unsigned char *group_key,
+                                    char *message, size_t *message_len) {
+  if (!encrypted || !group_key || !message || !message_len ||
+      encrypted_len <= GROUP_OVERHEAD ||
+      encrypted_len > MAX_MESSAGE_LEN + GROUP_OVERHEAD ||
+      encrypted[0] != GROUP_ENVELOPE_VERSION) {
+    return CCHAT_ERROR_INVALID_ARGS;
+  }
+
+  size_t plain_len = encrypted_len - GROUP_OVERHEAD;
+  if (crypto_secretbox_open_easy(
+          (unsigned char *)message, &encrypted[1 + crypto_secretbox_NONCEBYTES],
+          encrypted_len - 1 - crypto_secretbox_NONCEBYTES, &encrypted[1],
+          group_key) != 0) {
+    return CCHAT_ERROR_DECRYPTION;
+  }
+
+  message[plain_len] = '\0';
+  *message_len = plain_len;
+  return CCHAT_SUCCESS;
+}
+
+// envelope receives FILE_ENVELOPE_SIZE bytes: [key][header] sealed to the
+// recipient, so only it can open the stream
+cchat_error_t seal_file_envelope(
+    const unsigned char *key, const unsigned char *header,
+    const unsigned char *recipient_public_key, unsigned char *envelope) {
+  if (!key || !header || !recipient_public_key || !envelope) {
+    return CCHAT_ERROR_INVALID_ARGS;
+  }
+
+  unsigned char plain[FILE_KEY_SIZE + FILE_HEADER_SIZE];
+  memcpy(plain, key, FILE_KEY_SIZE);
+  memcpy(&plain[FILE_KEY_SIZE], header, FILE_HEADER_SIZE);
+
+  int result =
+      crypto_box_seal(envelope, plain, sizeof(plain), recipient_public_key);
+  sodium_memzero(plain, sizeof(plain));
+  return result == 0 ? CCHAT_SUCCESS : CCHAT_ERROR_ENCRYPTION;
+}
+
+cchat_error_t open_file_envelope(const unsigned char *envelope,
+                                 size_t envelope_len,
+                                 const unsigned char *public_key,
+                                 const unsigned char *private_key,
+                                 unsigned char *key, unsigned char *header) {
+  if (!envelope || envelope_len != FILE_ENVELOPE_SIZE || !public_key ||
+      !private_key || !key || !header) {
+    return CCHAT_ERROR_INVALID_ARGS;
+  }
+
+  unsigned char plain[FILE_KEY_SIZE + FILE_HEADER_SIZE];
+  if (crypto_box_seal_open(plain, envelope, envelope_len, public_key,
+                           private_key) != 0) {
+    return CCHAT_ERROR_DECRYPTION;
+  }
+
+  memcpy(key, plain, FILE_KEY_SIZE);
+  memcpy(header, &plain[FILE_KEY_SIZE], FILE_HEADER_SIZE);
+  sodium_memzero(plain, sizeof(plain));
+  return CCHAT_SUCCESS;
+}
+
+// header receives FILE_HEADER_SIZE bytes for the recipient's envelope
+cchat_error_t file_stream_init_push(file_stream_t *stream,
+                                    const unsigned char *key,
+                                    unsigned char *header) {
+  if (!stream || !key || !header) {
+    return CCHAT_ERROR_INVALID_ARGS;
+  }
+
+  memset(stream, 0, sizeof(*stream));
+  if (crypto_secretstream_xchacha20poly1305_init_push(&stream->state, header,
+                                                      key) != 0) {
+    return CCHAT_ERROR_ENCRYPTION;
+  }
+  return CCHAT_SUCCESS;
+}
+
+// chunk receives plain_len + crypto_secretstream_xchacha20poly1305_ABYTES
+// bytes, at most FILE_CHUNK_SIZE. Only the last chunk may be short.
+cchat_error_t file_stream_push(file_stream_t *stream,
+                               const unsigned char *plain, size_t plain_len,
+                               bool last, unsigned char *chunk,
+                               size_t *chunk_len) {
+  if (!stream || (!plain && plain_len > 0) || !chunk || !chunk_len ||
+      plain_len > FILE_PLAIN_CHUNK_SIZE ||
+      (!last && plain_len != FILE_PLAIN_CHUNK_SIZE) || stream->finished) {
+    return CCHAT_ERROR_INVALID_ARGS;
+  }
+
+  unsigned char tag = last ? crypto_secretstream_xchacha20poly1305_TAG_FINAL
+                           : crypto_secretstream_xchacha20poly1305_TAG_MESSAGE;
+  unsigned long long out_len;
+  if (crypto_secretstream_xchacha20poly1305_push(
+          &stream->state, chunk, &out_len, plain, plain_len, NULL, 0, tag) !=
+      0) {
+    return CCHAT_ERROR_ENCRYPTION;
+  }
+
+  stream->finished = last;
+  *chunk_len = (size_t)out_len;
+  return CCHAT_SUCCESS;
+}
+
+cchat_error_t file_stream_init_pull(file_stream_t *stream,
+                                    const unsigned char *key,
+                                    const unsigned char *header) {
+  if (!stream || !key || !header) {
+    return CCHAT_ERROR_INVALID_ARGS;
+  }
+
+  memset(stream, 0, sizeof(*stream));
+  if (crypto_secretstream_xchacha20poly1305_init_pull(&stream->state, header,
+                                                      key) != 0) {
+    return CCHAT_ERROR_DECRYPTION;
+  }
+  return CCHAT_SUCCESS;
+}
+
+// Decrypt one whole ciphertext chunk; plain receives up to
+// FILE_PLAIN_CHUNK_SIZE bytes
+cchat_error_t file_stream_pull(file_stream_t *stream,
+                               const unsigned char *chunk, size_t chunk_len,
+                               unsigned char *plain, size_t *plain_len) {
+  if (!stream || !chunk || !plain || !plain_len ||
+      chunk_len > FILE_CHUNK_SIZE) {
+    return CCHAT_ERROR_INVALID_ARGS;
+  }
+
+  // Nothing may follow the final chunk
+  if (stream->finished ||
+      chunk_len < crypto_secretstream_xchacha20poly1305_ABYTES) {
+    return CCHAT_ERROR_DECRYPTION;
+  }
+
+  unsigned long long out_len;
+  unsigned char tag;
+  if (crypto_secretstream_xchacha20poly1305_pull(&stream->state, plain,
+                                                 &out_len, &tag, chunk,
+                                                 chunk_len, NULL, 0) != 0) {
+    return CCHAT_ERROR_DECRYPTION;
+  }
+
+  if (tag == crypto_secretstream_xchacha20poly1305_TAG_FINAL) {
+    stream->finished = true;
+  } else if (tag != crypto_secretstream_xchacha20poly1305_TAG_MESSAGE ||
+             chunk_len != FILE_CHUNK_SIZE) {
+    sodium_memzero(plain, (size_t)out_len);
+    return CCHAT_ERROR_DECRYPTION;
+  }
+
+  *plain_len = (size_t)out_len;
+  return CCHAT_SUCCESS;
+}
+
+// Once the ciphertext runs out: a stream that never reached TAG_FINAL was
+// truncated at a chunk boundary
+cchat_error_t file_stream_end(const file_stream_t *stream) {
+  if (!stream) {
+    return CCHAT_ERROR_INVALID_ARGS;
+  }
+  return stream->finished ? CCHAT_SUCCESS : CCHAT_ERROR_DECRYPTION;
 }
\ No newline at end of file
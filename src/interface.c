@@ -1,3 +1,6 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // strtok_r
+#endif
 #include "c-chat.h"
 #ifdef _WIN32
 #include <windows.h>
@@ -10,14 +13,32 @@ void print_usage(const char *program_name) {
   printf("  -r, --register <username>   Register a new user account\n");
   printf("  -l, --login <username>      Login to your account\n");
   printf("  -u, --list-users            List all registered users\n");
+  printf("  -a, --agent                 Run the key agent in the foreground\n");
+  printf("  -t, --agent-timeout <secs>  Agent idle timeout (default %d, 0 = "
+         "never)\n",
+         AGENT_DEFAULT_IDLE_TIMEOUT);
+  printf("  -k, --agent-lock            Make the key agent forget all keys\n");
+  printf("  -F, --forget-key <username> Drop a pinned partner key\n");
+  printf("  -C, --calibrate-kdf         Tune Argon2id cost for this machine\n");
+  printf("  -T, --kdf-target <ms>       Calibration unlock time (default %d)\n",
+         KDF_DEFAULT_TARGET_MS);
+  printf("  -M, --kdf-memory <MiB>      Calibration memory budget (default "
+         "1/4 RAM, max 1024)\n");
   printf("  -h, --help                  Show this help message\n");
   printf("  -v, --version               Show version information\n\n");
   printf("Examples:\n");
   printf("  %s --register alice         Register user 'alice'\n", program_name);
   printf("  %s --login alice            Login as 'alice'\n", program_name);
-  printf("  %s --list-users             List all users\n\n", program_name);
+  printf("  %s --list-users             List all users\n", program_name);
+  printf("  %s --agent &                 Cache unlocked keys for later runs\n",
+         program_name);
+  printf("  %s -C -M 128                 Calibrate within 128 MiB of RAM\n\n",
+         program_name);
   printf("In-Chat Commands:\n");
   printf("  chat <username>             Start encrypted chat with user\n");
+  printf("  users                       List users, then only changes\n");
+  printf("  sync <username>...          Pin or revalidate keys in bulk\n");
+  printf("  find <prefix>               Search users by name prefix\n");
   printf("  /exit                       Exit current chat session\n");
   printf("  /quit                       Quit c-chat application\n\n");
 }
@@ -36,10 +57,11 @@ void run_chat_interface(void) {
   char command[MAX_COMMAND_LEN];
   char target_user[MAX_USERNAME_LEN];
   bool running = true;
+  uint32_t directory_version = 0;
 
   printf(
       "\nWelcome to C-Chat! Type 'chat <username>' to start a conversation.\n");
-  printf("Available commands: chat, /exit, /quit\n\n");
+  printf("Available commands: chat, users, find, sync, /exit, /quit\n\n");
 
   while (running) {
     printf("c-chat> ");
@@ -65,10 +87,40 @@ void run_chat_interface(void) {
         } else {
           printf("Usage: chat <username>\n");
         }
+      } else if (strcmp(command, "users") == 0) {
+        // Full listing the first time, then only what changed since
+        if (list_users_since(&directory_version) != CCHAT_SUCCESS) {
+          printf("Failed to list users\n");
+        }
+      } else if (strcmp(command, "find") == 0) {
+        char prefix[MAX_MESSAGE_LEN];
+        if (sscanf(input, "%*s %s", prefix) == 1) {
+          if (find_users(prefix) != CCHAT_SUCCESS) {
+            printf("Failed to search users\n");
+          }
+        } else {
+          printf("Usage: find <prefix>\n");
+        }
+      } else if (strcmp(command, "sync") == 0) {
+        // Names are the rest of the line, separated by spaces
+        const char *usernames[MAX_MESSAGE_LEN / 2];
+        size_t count = 0;
+        char *save = NULL;
+        for (char *name = strtok_r(input + strlen(command), " \t", &save);
+             name && count < sizeof(usernames) / sizeof(usernames[0]);
+             name = strtok_r(NULL, " \t", &save)) {
+          usernames[count++] = name;
+        }
+        if (count > 0) {
+          sync_known_keys(usernames, count);
+        } else {
+          printf("Usage: sync <username> [username...]\n");
+        }
       } else if (strcmp(command, "/exit") == 0) {
         printf("No active chat session to exit.\n");
       } else {
-        printf("Unknown command. Available commands: chat, /exit, /quit\n");
+        printf("Unknown command. Available commands: chat, users, find, sync, "
+               "/exit, /quit\n");
       }
     }
   }
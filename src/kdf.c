@@ -0,0 +1,256 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // clock_gettime
+#endif
+#include "c-chat.h"
+#include <time.h>
+
+// Argon2id cost parameters for key files
+//
+// Parameters are per machine: `c-chat --calibrate-kdf` times crypto_pwhash()
+// locally and writes the chosen limits to ~/.c-chat/kdf.conf. Key files record
+// the limits they were sealed with (see save_keys_to_file()), and
+// load_keys_from_file() re-seals any file whose limits differ from the
+// configured ones, so a calibration takes effect on each key's next unlock.
+//
+// kdf.conf format, one "name=value" per line:
+//   opslimit=3
+//   memlimit=268435456
+
+void kdf_default_params(kdf_params_t *params) {
+  // INTERACTIVE limits are what every key file used before calibration
+  params->opslimit = crypto_pwhash_OPSLIMIT_INTERACTIVE;
+  params->memlimit = crypto_pwhash_MEMLIMIT_INTERACTIVE;
+}
+
+bool kdf_params_valid(const kdf_params_t *params) {
+  return params->opslimit >= crypto_pwhash_OPSLIMIT_MIN &&
+         params->opslimit <= KDF_MAX_OPSLIMIT &&
+         params->memlimit >= KDF_MIN_MEMLIMIT &&
+         params->memlimit <= KDF_MAX_MEMLIMIT &&
+         params->memlimit % 1024 == 0;
+}
+
+static cchat_error_t kdf_config_path(char *path, size_t size) {
+  char *home_dir = get_home_directory();
+  if (!home_dir) {
+    return CCHAT_ERROR_FILE_IO;
+  }
+
+  int path_len =
+      snprintf(path, size, "%s/%s/%s", home_dir, KEYS_DIR, KDF_CONFIG_FILE);
+  free(home_dir);
+  if (path_len >= (int)size || path_len < 0) {
+    fprintf(stderr, "Path too long for KDF config\n");
+    return CCHAT_ERROR_FILE_IO;
+  }
+
+  return CCHAT_SUCCESS;
+}
+
+cchat_error_t load_kdf_params(kdf_params_t *params) {
+  if (!params) {
+    return CCHAT_ERROR_INVALID_ARGS;
+  }
+
+  kdf_default_params(params);
+
+  char path[PATH_MAX];
+  if (kdf_config_path(path, sizeof(path)) != CCHAT_SUCCESS) {
+    return CCHAT_ERROR_FILE_IO;
+  }
+
+  FILE *file = fopen(path, "r");
+  if (!file) {
+    // Not calibrated yet: defaults
+    return CCHAT_SUCCESS;
+  }
+
+  kdf_params_t loaded = *params;
+  char line[128];
+  while (fgets(line, sizeof(line), file)) {
+    unsigned long long value;
+    if (sscanf(line, "opslimit=%llu", &value) == 1) {
+      loaded.opslimit = value;
+    } else if (sscanf(line, "memlimit=%llu", &value) == 1) {
+      loaded.memlimit = (size_t)value;
+    }
+  }
+  fclose(file);
+
+  if (!kdf_params_valid(&loaded)) {
+    fprintf(stderr, "Ignoring invalid KDF parameters in %s\n", path);
+    return CCHAT_SUCCESS;
+  }
+
+  *params = loaded;
+  return CCHAT_SUCCESS;
+}
+
+cchat_error_t save_kdf_params(const kdf_params_t *params) {
+  if (!params || !kdf_params_valid(params)) {
+    return CCHAT_ERROR_INVALID_ARGS;
+  }
+
+  if (create_keys_directory() != CCHAT_SUCCESS) {
+    return CCHAT_ERROR_FILE_IO;
+  }
+
+  char path[PATH_MAX];
+  if (kdf_config_path(path, sizeof(path)) != CCHAT_SUCCESS) {
+    return CCHAT_ERROR_FILE_IO;
+  }
+
+  FILE *file = fopen(path, "w");
+  if (!file) {
+    perror("Failed to write KDF config");
+    return CCHAT_ERROR_FILE_IO;
+  }
+
+  fprintf(file, "opslimit=%llu\nmemlimit=%zu\n", params->opslimit,
+          params->memlimit);
+  if (fclose(file) != 0) {
+    return CCHAT_ERROR_FILE_IO;
+  }
+
+  return CCHAT_SUCCESS;
+}
+
+static double time_kdf_ms(const kdf_params_t *params) {
+  static const char password[] = "c-chat kdf calibration";
+  unsigned char salt[KEY_DERIVATION_SALT_SIZE] = {0};
+  unsigned char derived_key[DERIVED_KEY_SIZE];
+  struct timespec start, end;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  cchat_error_t result = derive_key_from_password_with_limits(
+      password, salt, params->opslimit, params->memlimit, derived_key);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  secure_zero_memory(derived_key, sizeof(derived_key));
+  if (result != CCHAT_SUCCESS) {
+    return -1.0;
+  }
+
+  return (double)(end.tv_sec - start.tv_sec) * 1000.0 +
+         (double)(end.tv_nsec - start.tv_nsec) / 1e6;
+}
+
+static size_t default_memory_budget(void) {
+  // A quarter of physical memory keeps small containers out of swap
+  long pages = sysconf(_SC_PHYS_PAGES);
+  long page_size = sysconf(_SC_PAGESIZE);
+  size_t budget = KDF_DEFAULT_MEMORY_BUDGET;
+  if (pages > 0 && page_size > 0) {
+    unsigned long long quarter =
+        (unsigned long long)pages * (unsigned long long)page_size / 4;
+    if (quarter < budget) {
+      budget = (size_t)quarter;
+    }
+  }
+  return budget;
+}
+
+cchat_error_t calibrate_kdf(unsigned int target_ms, size_t memory_budget,
+                            kdf_params_t *params) {
+  if (!params || target_ms == 0) {
+    return CCHAT_ERROR_INVALID_ARGS;
+  }
+
+  cchat_error_t result = init_crypto_library();
+  if (result != CCHAT_SUCCESS) {
+    return result;
+  }
+
+  if (memory_budget == 0) {
+    memory_budget = default_memory_budget();
+  }
+  if (memory_budget > KDF_MAX_MEMLIMIT) {
+    memory_budget = KDF_MAX_MEMLIMIT;
+  }
+
+  // Memory hardness first: the largest power-of-two budget that a single pass
+  // can cover within the target
+  kdf_params_t candidate = {crypto_pwhash_OPSLIMIT_MIN, KDF_MIN_MEMLIMIT};
+  while (candidate.memlimit * 2 <= memory_budget) {
+    candidate.memlimit *= 2;
+  }
+
+  double elapsed = time_kdf_ms(&candidate);
+  while ((elapsed < 0 || elapsed > target_ms) &&
+         candidate.memlimit > KDF_MIN_MEMLIMIT) {
+    candidate.memlimit /= 2;
+    elapsed = time_kdf_ms(&candidate);
+  }
+  if (elapsed < 0) {
+    fprintf(stderr, "Key derivation failed at the minimum memory limit\n");
+    return CCHAT_ERROR_KEY_DERIVATION;
+  }
+
+  // Then spend the remaining time on passes. The first pass also pays for
+  // allocating and touching the memory, so fit time = base + passes * cost
+  // from a one-pass and a two-pass run.
+  unsigned long long passes = crypto_pwhash_OPSLIMIT_MIN;
+  kdf_params_t two_pass = {2, candidate.memlimit};
+  double elapsed_two = elapsed <= target_ms / 2.0 ? time_kdf_ms(&two_pass) : -1;
+  if (elapsed_two > elapsed) {
+    double pass_cost = elapsed_two - elapsed;
+    double base = elapsed - pass_cost;
+    passes = (unsigned long long)((target_ms - base) / pass_cost);
+  }
+  if (passes < crypto_pwhash_OPSLIMIT_MIN) {
+    passes = crypto_pwhash_OPSLIMIT_MIN;
+  }
+  if (passes > KDF_MAX_OPSLIMIT) {
+    passes = KDF_MAX_OPSLIMIT;
+  }
+  candidate.opslimit = passes;
+
+  // The fit is rough at small memory sizes; trim passes if it overshoots
+  elapsed = time_kdf_ms(&candidate);
+  while (elapsed > target_ms * 1.1 && candidate.opslimit > 1) {
+    unsigned long long scaled =
+        (unsigned long long)(candidate.opslimit * (target_ms / elapsed));
+    candidate.opslimit = scaled < candidate.opslimit ? scaled : 1;
+    if (candidate.opslimit < crypto_pwhash_OPSLIMIT_MIN) {
+      candidate.opslimit = crypto_pwhash_OPSLIMIT_MIN;
+    }
+    elapsed = time_kdf_ms(&candidate);
+  }
+
+  *params = candidate;
+  return CCHAT_SUCCESS;
+}
+
+cchat_error_t run_kdf_calibration(unsigned int target_ms,
+                                  size_t memory_budget) {
+  kdf_params_t current;
+  load_kdf_params(&current);
+
+  printf("Calibrating Argon2id for ~%u ms per unlock", target_ms);
+  if (memory_budget > 0) {
+    printf(" within %zu MiB", memory_budget / (1024 * 1024));
+  }
+  printf("...\n");
+
+  kdf_params_t params;
+  cchat_error_t result = calibrate_kdf(target_ms, memory_budget, &params);
+  if (result != CCHAT_SUCCESS) {
+    return result;
+  }
+
+  double elapsed = time_kdf_ms(&params);
+  printf("Selected opslimit=%llu memlimit=%zu MiB (measured %.0f ms)\n",
+         params.opslimit, params.memlimit / (1024 * 1024), elapsed);
+  printf("Previous opslimit=%llu memlimit=%zu MiB\n", current.opslimit,
+         current.memlimit / (1024 * 1024));
+
+  result = save_kdf_params(&params);
+  if (result != CCHAT_SUCCESS) {
+    fprintf(stderr, "Failed to save KDF parameters\n");
+    return result;
+  }
+
+  printf("Saved to ~/%s/%s; key files are upgraded on their next unlock\n",
+         KEYS_DIR, KDF_CONFIG_FILE);
+  return CCHAT_SUCCESS;
+}
\ No newline at end of file
@@ -0,0 +1,438 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // pread / pwrite / ftruncate
+#endif
+#include "c-chat.h"
+#include <fcntl.h>
+#include <sys/file.h>
+
+// Known partner keys: ~/.c-chat/known_keys
+//
+// Trust on first use: the first key fetched for a partner is pinned here and
+// used for later chats without asking the server. The pin is revalidated
+// against the server's key version (see fetch_user_public_key()) at most
+// once per KEY_CACHE_REVALIDATE_SECS; a different key is reported to the user
+// instead of silently replacing the pin.
+//
+// Readers take a shared flock() and writers an exclusive one. The file is
+// an open-addressed hash table of fixed-size slots, so a lookup
+// reads one or a few slots with pread() regardless of how many keys are
+// cached:
+//
+//   Header: "CCKK", 1 byte version, 3 reserved, 4 byte slot count,
+//           4 byte used slot count (live + deleted), big-endian
+//   Slot:   1 byte state, 3 reserved, 4 byte key version,
+//           8 byte verified-at time, 32 byte username, 32 byte public key
+
+#define KEYCACHE_MAGIC "CCKK"
+#define KEYCACHE_VERSION 0x01
+#define KEYCACHE_HEADER_SIZE 16
+#define KEYCACHE_SLOT_SIZE (16 + MAX_USERNAME_LEN + PUBLIC_KEY_SIZE)
+#define KEYCACHE_INITIAL_SLOTS 64
+
+typedef enum {
+  SLOT_EMPTY = 0,
+  SLOT_USED = 1,
+  SLOT_DELETED = 2
+} slot_state_t;
+
+typedef struct {
+  int fd;
+  uint32_t slot_count;
+  uint32_t used_count;
+} keycache_t;
+
+static void put_be32(unsigned char *out, uint32_t value) {
+  out[0] = (unsigned char)(value >> 24);
+  out[1] = (unsigned char)(value >> 16);
+  out[2] = (unsigned char)(value >> 8);
+  out[3] = (unsigned char)value;
+}
+
+static uint32_t get_be32(const unsigned char *in) {
+  return ((uint32_t)in[0] << 24) | ((uint32_t)in[1] << 16) |
+         ((uint32_t)in[2] << 8) | (uint32_t)in[3];
+}
+
+static uint32_t username_hash(const char *username) {
+  // FNV-1a
+  uint32_t hash = 2166136261u;
+  for (const unsigned char *p = (const unsigned char *)username; *p; p++) {
+    hash ^= *p;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static cchat_error_t keycache_path(const char *suffix, char *path,
+                                   size_t size) {
+  char *home_dir = get_home_directory();
+  if (!home_dir) {
+    return CCHAT_ERROR_FILE_IO;
+  }
+
+  int path_len = snprintf(path, size, "%s/%s/%s%s", home_dir, KEYS_DIR,
+                          KNOWN_KEYS_FILE, suffix);
+  free(home_dir);
+  if (path_len >= (int)size || path_len < 0) {
+    fprintf(stderr, "Path too long for known keys file\n");
+    return CCHAT_ERROR_FILE_IO;
+  }
+
+  return CCHAT_SUCCESS;
+}
+
+static cchat_error_t write_header(int fd, uint32_t slot_count,
+                                  uint32_t used_count) {
+  unsigned char header[KEYCACHE_HEADER_SIZE] = {0};
+  memcpy(header, KEYCACHE_MAGIC, 4);
+  header[4] = KEYCACHE_VERSION;
+  put_be32(header + 8, slot_count);
+  put_be32(header + 12, used_count);
+
+  if (pwrite(fd, header, sizeof(header), 0) != (ssize_t)sizeof(header)) {
+    return CCHAT_ERROR_FILE_IO;
+  }
+  return CCHAT_SUCCESS;
+}
+
+// Create an empty table with slot_count slots at path, which must not exist
+static cchat_error_t create_table(const char *path, uint32_t slot_count,
+                                  int *out_fd) {
+  int fd = open(path, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+  if (fd < 0) {
+    return CCHAT_ERROR_FILE_IO;
+  }
+
+  off_t size = KEYCACHE_HEADER_SIZE + (off_t)slot_count * KEYCACHE_SLOT_SIZE;
+  if (ftruncate(fd, size) != 0 ||
+      write_header(fd, slot_count, 0) != CCHAT_SUCCESS) {
+    close(fd);
+    unlink(path);
+    return CCHAT_ERROR_FILE_IO;
+  }
+
+  *out_fd = fd;
+  return CCHAT_SUCCESS;
+}
+
+static cchat_error_t keycache_open(keycache_t *cache, bool writable) {
+  char path[PATH_MAX];
+  if (keycache_path("", path, sizeof(path)) != CCHAT_SUCCESS) {
+    return CCHAT_ERROR_FILE_IO;
+  }
+
+  for (;;) {
+    cache->fd = open(path, O_RDWR);
+    if (cache->fd < 0) {
+      if (!writable || errno != ENOENT) {
+        return errno == ENOENT ? CCHAT_ERROR_USER_NOT_FOUND
+                               : CCHAT_ERROR_FILE_IO;
+      }
+      if (create_keys_directory() != CCHAT_SUCCESS) {
+        return CCHAT_ERROR_FILE_IO;
+      }
+      if (create_table(path, KEYCACHE_INITIAL_SLOTS, &cache->fd) !=
+          CCHAT_SUCCESS) {
+        if (errno == EEXIST) {
+          continue; // another process created it first
+        }
+        return CCHAT_ERROR_FILE_IO;
+      }
+    }
+
+    if (flock(cache->fd, writable ? LOCK_EX : LOCK_SH) != 0) {
+      close(cache->fd);
+      return CCHAT_ERROR_FILE_IO;
+    }
+
+    // grow() may have renamed a new table over the one we waited on
+    struct stat opened, current;
+    if (fstat(cache->fd, &opened) == 0 && stat(path, &current) == 0 &&
+        opened.st_ino == current.st_ino && opened.st_dev == current.st_dev) {
+      break;
+    }
+    close(cache->fd);
+  }
+
+  unsigned char header[KEYCACHE_HEADER_SIZE];
+  if (pread(cache->fd, header, sizeof(header), 0) != (ssize_t)sizeof(header) ||
+      memcmp(header, KEYCACHE_MAGIC, 4) != 0 ||
+      header[4] != KEYCACHE_VERSION) {
+    fprintf(stderr, "Ignoring unreadable known keys file %s\n", path);
+    close(cache->fd);
+    return CCHAT_ERROR_FILE_IO;
+  }
+
+  cache->slot_count = get_be32(header + 8);
+  cache->used_count = get_be32(header + 12);
+  if (cache->slot_count == 0 ||
+      (cache->slot_count & (cache->slot_count - 1)) != 0) {
+    close(cache->fd);
+    return CCHAT_ERROR_FILE_IO;
+  }
+
+  return CCHAT_SUCCESS;
+}
+
+static off_t slot_offset(uint32_t index) {
+  return KEYCACHE_HEADER_SIZE + (off_t)index * KEYCACHE_SLOT_SIZE;
+}
+
+static cchat_error_t read_slot(const keycache_t *cache, uint32_t index,
+                               unsigned char *slot) {
+  if (pread(cache->fd, slot, KEYCACHE_SLOT_SIZE, slot_offset(index)) !=
+      KEYCACHE_SLOT_SIZE) {
+    return CCHAT_ERROR_FILE_IO;
+  }
+  return CCHAT_SUCCESS;
+}
+
+static cchat_error_t write_slot(const keycache_t *cache, uint32_t index,
+                                const unsigned char *slot) {
+  if (pwrite(cache->fd, slot, KEYCACHE_SLOT_SIZE, slot_offset(index)) !=
+      KEYCACHE_SLOT_SIZE) {
+    return CCHAT_ERROR_FILE_IO;
+  }
+  return CCHAT_SUCCESS;
+}
+
+static void encode_slot(unsigned char *slot, const known_key_t *entry) {
+  memset(slot, 0, KEYCACHE_SLOT_SIZE);
+  slot[0] = SLOT_USED;
+  put_be32(slot + 4, entry->key_version);
+  put_be32(slot + 8, (uint32_t)(entry->verified_at >> 32));
+  put_be32(slot + 12, (uint32_t)entry->verified_at);
+  size_t username_len = strnlen(entry->username, MAX_USERNAME_LEN - 1);
+  memcpy(slot + 16, entry->username, username_len);
+  memcpy(slot + 16 + MAX_USERNAME_LEN, entry->public_key, PUBLIC_KEY_SIZE);
+}
+
+static void decode_slot(const unsigned char *slot, known_key_t *entry) {
+  entry->key_version = get_be32(slot + 4);
+  entry->verified_at =
+      ((uint64_t)get_be32(slot + 8) << 32) | (uint64_t)get_be32(slot + 12);
+  memcpy(entry->username, slot + 16, MAX_USERNAME_LEN);
+  entry->username[MAX_USERNAME_LEN - 1] = '\0';
+  memcpy(entry->public_key, slot + 16 + MAX_USERNAME_LEN, PUBLIC_KEY_SIZE);
+}
+
+static bool slot_matches(const unsigned char *slot, const char *username) {
+  return slot[0] == SLOT_USED &&
+         strncmp((const char *)slot + 16, username, MAX_USERNAME_LEN) == 0;
+}
+
+// Probe for username. *found is the matching slot, or UINT32_MAX; *free_slot
+// is the first empty or deleted slot on the probe path, or UINT32_MAX.
+static cchat_error_t probe(const keycache_t *cache, const char *username,
+                           uint32_t *found, uint32_t *free_slot) {
+  unsigned char slot[KEYCACHE_SLOT_SIZE];
+  uint32_t mask = cache->slot_count - 1;
+  uint32_t index = username_hash(username) & mask;
+
+  *found = UINT32_MAX;
+  *free_slot = UINT32_MAX;
+  for (uint32_t i = 0; i < cache->slot_count; i++, index = (index + 1) & mask) {
+    if (read_slot(cache, index, slot) != CCHAT_SUCCESS) {
+      return CCHAT_ERROR_FILE_IO;
+    }
+    if (slot[0] == SLOT_EMPTY) {
+      if (*free_slot == UINT32_MAX) {
+        *free_slot = index;
+      }
+      break;
+    }
+    if (slot[0] == SLOT_DELETED) {
+      if (*free_slot == UINT32_MAX) {
+        *free_slot = index;
+      }
+      continue;
+    }
+    if (slot_matches(slot, username)) {
+      *found = index;
+      break;
+    }
+  }
+
+  return CCHAT_SUCCESS;
+}
+
+// Rebuild the table with twice the slots, dropping deleted entries
+static cchat_error_t grow(keycache_t *cache) {
+  char path[PATH_MAX];
+  char temp_path[PATH_MAX];
+  if (keycache_path("", path, sizeof(path)) != CCHAT_SUCCESS ||
+      keycache_path(".tmp", temp_path, sizeof(temp_path)) != CCHAT_SUCCESS) {
+    return CCHAT_ERROR_FILE_IO;
+  }
+
+  // A leftover from an interrupted grow is safe to discard: we hold the lock
+  unlink(temp_path);
+  keycache_t grown = {-1, cache->slot_count * 2, 0};
+  if (create_table(temp_path, grown.slot_count, &grown.fd) != CCHAT_SUCCESS) {
+    return CCHAT_ERROR_FILE_IO;
+  }
+
+  unsigned char slot[KEYCACHE_SLOT_SIZE];
+  uint32_t mask = grown.slot_count - 1;
+  for (uint32_t i = 0; i < cache->slot_count; i++) {
+    if (read_slot(cache, i, slot) != CCHAT_SUCCESS) {
+      goto fail;
+    }
+    if (slot[0] != SLOT_USED) {
+      continue;
+    }
+
+    char username[MAX_USERNAME_LEN];
+    memcpy(username, slot + 16, MAX_USERNAME_LEN);
+    username[MAX_USERNAME_LEN - 1] = '\0';
+
+    uint32_t index = username_hash(username) & mask;
+    unsigned char existing[KEYCACHE_SLOT_SIZE];
+    for (;;) {
+      if (read_slot(&grown, index, existing) != CCHAT_SUCCESS) {
+        goto fail;
+      }
+      if (existing[0] == SLOT_EMPTY) {
+        break;
+      }
+      index = (index + 1) & mask;
+    }
+    if (write_slot(&grown, index, slot) != CCHAT_SUCCESS) {
+      goto fail;
+    }
+    grown.used_count++;
+  }
+
+  if (write_header(grown.fd, grown.slot_count, grown.used_count) !=
+          CCHAT_SUCCESS ||
+      fsync(grown.fd) != 0 || rename(temp_path, path) != 0) {
+    goto fail;
+  }
+
+  close(cache->fd);
+  *cache = grown;
+  return CCHAT_SUCCESS;
+
+fail:
+  close(grown.fd);
+  unlink(temp_path);
+  return CCHAT_ERROR_FILE_IO;
+}
+
+cchat_error_t keycache_lookup(const char *username, known_key_t *entry) {
+  if (!username || !entry) {
+    return CCHAT_ERROR_INVALID_ARGS;
+  }
+
+  keycache_t cache;
+  cchat_error_t result = keycache_open(&cache, false);
+  if (result != CCHAT_SUCCESS) {
+    return result == CCHAT_ERROR_FILE_IO ? result : CCHAT_ERROR_USER_NOT_FOUND;
+  }
+
+  uint32_t found, free_slot;
+  unsigned char slot[KEYCACHE_SLOT_SIZE];
+  result = probe(&cache, username, &found, &free_slot);
+  if (result == CCHAT_SUCCESS) {
+    if (found == UINT32_MAX) {
+      result = CCHAT_ERROR_USER_NOT_FOUND;
+    } else if ((result = read_slot(&cache, found, slot)) == CCHAT_SUCCESS) {
+      decode_slot(slot, entry);
+    }
+  }
+
+  close(cache.fd);
+  return result;
+}
+
+cchat_error_t keycache_store(const known_key_t *entry) {
+  if (!entry || validate_username(entry->username) != CCHAT_SUCCESS) {
+    return CCHAT_ERROR_INVALID_ARGS;
+  }
+
+  keycache_t cache;
+  cchat_error_t result = keycache_open(&cache, true);
+  if (result != CCHAT_SUCCESS) {
+    return result;
+  }
+
+  uint32_t found, free_slot;
+  result = probe(&cache, entry->username, &found, &free_slot);
+  if (result == CCHAT_SUCCESS && found == UINT32_MAX &&
+      (cache.used_count + 1) * 2 > cache.slot_count) {
+    // Keep the load factor at or below 1/2 so probes stay short
+    result = grow(&cache);
+    if (result == CCHAT_SUCCESS) {
+      result = probe(&cache, entry->username, &found, &free_slot);
+    }
+  }
+
+  if (result == CCHAT_SUCCESS) {
+    unsigned char slot[KEYCACHE_SLOT_SIZE];
+    encode_slot(slot, entry);
+
+    if (found != UINT32_MAX) {
+      result = write_slot(&cache, found, slot);
+    } else if (free_slot == UINT32_MAX) {
+      result = CCHAT_ERROR_FILE_IO;
+    } else {
+      unsigned char previous[KEYCACHE_SLOT_SIZE];
+      result = read_slot(&cache, free_slot, previous);
+      if (result == CCHAT_SUCCESS) {
+        result = write_slot(&cache, free_slot, slot);
+      }
+      // Reusing a deleted slot does not change the used count
+      if (result == CCHAT_SUCCESS && previous[0] == SLOT_EMPTY) {
+        cache.used_count++;
+        result = write_header(cache.fd, cache.slot_count, cache.used_count);
+      }
+    }
+  }
+
+  close(cache.fd);
+  return result;
+}
+
+cchat_error_t keycache_forget(const char *username) {
+  if (!username) {
+    return CCHAT_ERROR_INVALID_ARGS;
+  }
+
+  // Writing the tombstone needs the same exclusive lock as keycache_store()
+  keycache_t cache;
+  cchat_error_t result = keycache_open(&cache, true);
+  if (result != CCHAT_SUCCESS) {
+    return result;
+  }
+
+  uint32_t found, free_slot;
+  result = probe(&cache, username, &found, &free_slot);
+  if (result == CCHAT_SUCCESS) {
+    if (found == UINT32_MAX) {
+      result = CCHAT_ERROR_USER_NOT_FOUND;
+    } else {
+      // Tombstone, so probes for keys stored after this one still find them
+      unsigned char slot[KEYCACHE_SLOT_SIZE] = {SLOT_DELETED};
+      result = write_slot(&cache, found, slot);
+    }
+  }
+
+  close(cache.fd);
+  return result;
+}
+
+void format_key_fingerprint(const unsigned char *public_key, char *out,
+                            size_t out_size) {
+  unsigned char digest[KEY_FINGERPRINT_BYTES];
+  crypto_generichash(digest, sizeof(digest), public_key, PUBLIC_KEY_SIZE, NULL,
+                     0);
+
+  size_t pos = 0;
+  if (out_size > 0) {
+    out[0] = '\0';
+  }
+  for (size_t i = 0; i < sizeof(digest) && pos + 3 < out_size; i++) {
+    pos += (size_t)snprintf(out + pos, out_size - pos, i ? ":%02x" : "%02x",
+                            digest[i]);
+  }
+}
\ No newline at end of file
@@ -13,18 +13,33 @@ int main(int argc, char *argv[]) {
   bool register_mode = false;
   bool login_mode = false;
   bool list_mode = false;
+  bool agent_mode = false;
+  bool agent_lock_mode = false;
+  unsigned int agent_timeout = AGENT_DEFAULT_IDLE_TIMEOUT;
+  bool calibrate_mode = false;
+  unsigned int kdf_target_ms = KDF_DEFAULT_TARGET_MS;
+  size_t kdf_memory_budget = 0;
+  bool forget_key_mode = false;
 
   // Command line options
   static struct option long_options[] = {
       {"register", required_argument, 0, 'r'},
       {"login", required_argument, 0, 'l'},
       {"list-users", no_argument, 0, 'u'},
+      {"agent", no_argument, 0, 'a'},
+      {"agent-timeout", required_argument, 0, 't'},
+      {"agent-lock", no_argument, 0, 'k'},
+      {"calibrate-kdf", no_argument, 0, 'C'},
+      {"kdf-target", required_argument, 0, 'T'},
+      {"kdf-memory", required_argument, 0, 'M'},
+      {"forget-key", required_argument, 0, 'F'},
       {"help", no_argument, 0, 'h'},
       {"version", no_argument, 0, 'v'},
       {0, 0, 0, 0}};
 
   // Parse command line arguments
-  while ((opt = getopt_long(argc, argv, "r:l:uhv", long_options, NULL)) != -1) {
+  while ((opt = getopt_long(argc, argv, "r:l:uat:kCT:M:F:hv", long_options,
+                            NULL)) != -1) {
     switch (opt) {
     case 'r':
       register_mode = true;
@@ -37,6 +52,28 @@ int main(int argc, char *argv[]) {
     case 'u':
       list_mode = true;
       break;
+    case 'a':
+      agent_mode = true;
+      break;
+    case 't':
+      agent_timeout = (unsigned int)strtoul(optarg, NULL, 10);
+      break;
+    case 'k':
+      agent_lock_mode = true;
+      break;
+    case 'C':
+      calibrate_mode = true;
+      break;
+    case 'T':
+      kdf_target_ms = (unsigned int)strtoul(optarg, NULL, 10);
+      break;
+    case 'M':
+      kdf_memory_budget = (size_t)strtoul(optarg, NULL, 10) * 1024 * 1024;
+      break;
+    case 'F':
+      forget_key_mode = true;
+      safe_strncpy(username, optarg, sizeof(username));
+      break;
     case 'h':
       print_usage(argv[0]);
       cleanup_crypto_library();
@@ -52,6 +89,50 @@ int main(int argc, char *argv[]) {
   }
 
   // Execute based on mode
+  if (agent_mode) {
+    cchat_error_t result = run_key_agent(agent_timeout);
+    cleanup_crypto_library();
+    return result;
+  }
+
+  if (calibrate_mode) {
+    cchat_error_t result =
+        run_kdf_calibration(kdf_target_ms, kdf_memory_budget);
+    if (result != CCHAT_SUCCESS) {
+      fprintf(stderr, "KDF calibration failed\n");
+      return result;
+    }
+    cleanup_crypto_library();
+    return CCHAT_SUCCESS;
+  }
+
+  if (forget_key_mode) {
+    cchat_error_t result = keycache_forget(username);
+    if (result == CCHAT_ERROR_USER_NOT_FOUND) {
+      fprintf(stderr, "No pinned key for '%s'\n", username);
+      return result;
+    }
+    if (result != CCHAT_SUCCESS) {
+      fprintf(stderr, "Failed to update known keys file\n");
+      return result;
+    }
+    printf("Forgot pinned key for '%s'; it is pinned again on next chat\n",
+           username);
+    cleanup_crypto_library();
+    return CCHAT_SUCCESS;
+  }
+
+  if (agent_lock_mode) {
+    cchat_error_t result = agent_lock();
+    if (result != CCHAT_SUCCESS) {
+      fprintf(stderr, "No key agent running\n");
+      return result;
+    }
+    printf("Key agent locked\n");
+    cleanup_crypto_library();
+    return CCHAT_SUCCESS;
+  }
+
   if (register_mode) {
     if (validate_username(username) != CCHAT_SUCCESS) {
       fprintf(stderr, "Error: Invalid username\n");
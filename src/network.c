@@ -1,11 +1,20 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // getaddrinfo
+#endif
 #include "c-chat.h"
 #include <arpa/inet.h>
+#include <netdb.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
 
 static int server_socket = -1;
 static bool connected_to_server = false;
 
+// Where connect_to_server() dials: SERVER_HOST until a cluster node
+// redirects us to the node that owns our username
+static char server_host[256] = SERVER_HOST;
+static int server_port = SERVER_PORT;
+
 static cchat_error_t reconnect_to_server(void) {
   if (connected_to_server) {
     return CCHAT_SUCCESS;
@@ -21,18 +30,44 @@ static cchat_error_t reconnect_to_server(void) {
   return connect_to_server();
 }
 
+void encode_frame_header(uint8_t *header, uint8_t msg_type,
+                         uint32_t payload_len) {
+  header[0] = (payload_len >> 24) & 0xFF;
+  header[1] = (payload_len >> 16) & 0xFF;
+  header[2] = (payload_len >> 8) & 0xFF;
+  header[3] = payload_len & 0xFF;
+  header[4] = msg_type;
+}
+
+void decode_frame_header(const uint8_t *header, uint8_t *msg_type,
+                         uint32_t *payload_len) {
+  *payload_len = ((uint32_t)header[0] << 24) | ((uint32_t)header[1] << 16) |
+                 ((uint32_t)header[2] << 8) | ((uint32_t)header[3]);
+  *msg_type = header[4];
+}
+
+size_t encode_send_message_payload(uint8_t *payload, const char *recipient,
+                                   const unsigned char *encrypted_message,
+                                   size_t message_len) {
+  size_t recipient_len = strlen(recipient);
+
+  payload[0] = (uint8_t)recipient_len;
+  memcpy(&payload[1], recipient, recipient_len);
+  payload[1 + recipient_len] = (message_len >> 8) & 0xFF;
+  payload[1 + recipient_len + 1] = message_len & 0xFF;
+  memcpy(&payload[1 + recipient_len + 2], encrypted_message, message_len);
+
+  return 1 + recipient_len + 2 + message_len;
+}
+
 static int send_network_message(uint8_t msg_type, const uint8_t *payload,
                                 uint32_t payload_len) {
   if (server_socket < 0 || !connected_to_server) {
     return -1;
   }
 
-  uint8_t header[5];
-  header[0] = (payload_len >> 24) & 0xFF;
-  header[1] = (payload_len >> 16) & 0xFF;
-  header[2] = (payload_len >> 8) & 0xFF;
-  header[3] = payload_len & 0xFF;
-  header[4] = msg_type;
+  uint8_t header[FRAME_HEADER_SIZE];
+  encode_frame_header(header, msg_type, payload_len);
 
   ssize_t sent = send(server_socket, header, sizeof(header), MSG_NOSIGNAL);
   if (sent != sizeof(header)) {
@@ -61,15 +96,22 @@ static int receive_network_message(uint8_t *msg_type, uint8_t **payload,
     return -1;
   }
 
-  uint8_t header[5];
-  if (recv(server_socket, header, sizeof(header), MSG_WAITALL) !=
-      sizeof(header)) {
-    return -1;
-  }
+  uint8_t header[FRAME_HEADER_SIZE];
+  for (;;) {
+    if (recv(server_socket, header, sizeof(header), MSG_WAITALL) !=
+        sizeof(header)) {
+      return -1;
+    }
 
-  *payload_len = ((uint32_t)header[0] << 24) | ((uint32_t)header[1] << 16) |
-                 ((uint32_t)header[2] << 8) | ((uint32_t)header[3]);
-  *msg_type = header[4];
+    decode_frame_header(header, msg_type, payload_len);
+
+    // Keepalive PINGs (0x8F, empty) can arrive ahead of any response: answer
+    // with PONG (0x0D) and keep waiting for the frame the caller wants
+    if (*msg_type != 0x8F || *payload_len != 0) {
+      break;
+    }
+    send_network_message(0x0D, NULL, 0);
+  }
 
   if (*payload_len > 0) {
     *payload = malloc(*payload_len);
@@ -91,26 +133,33 @@ static int receive_network_message(uint8_t *msg_type, uint8_t **payload,
 }
 
 cchat_error_t connect_to_server(void) {
-  printf("Connecting to server at %s:%d...\n", SERVER_HOST, SERVER_PORT);
+  printf("Connecting to server at %s:%d...\n", server_host, server_port);
 
   if (connected_to_server) {
     return CCHAT_SUCCESS;
   }
 
-  server_socket = socket(AF_INET, SOCK_STREAM, 0);
-  if (server_socket < 0) {
-    perror("Failed to create socket");
-    return CCHAT_ERROR_NETWORK;
-  }
-
   struct sockaddr_in server_addr;
+  memset(&server_addr, 0, sizeof(server_addr));
   server_addr.sin_family = AF_INET;
-  server_addr.sin_port = htons(SERVER_PORT);
+  server_addr.sin_port = htons((uint16_t)server_port);
+
+  if (inet_pton(AF_INET, server_host, &server_addr.sin_addr) <= 0) {
+    struct addrinfo hints = {0};
+    struct addrinfo *found = NULL;
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(server_host, NULL, &hints, &found) != 0 || !found) {
+      fprintf(stderr, "Invalid address: %s\n", server_host);
+      return CCHAT_ERROR_NETWORK;
+    }
+    server_addr.sin_addr = ((struct sockaddr_in *)found->ai_addr)->sin_addr;
+    freeaddrinfo(found);
+  }
 
-  if (inet_pton(AF_INET, "127.0.0.1", &server_addr.sin_addr) <= 0) {
-    perror("Invalid address");
-    close(server_socket);
-    server_socket = -1;
+  server_socket = socket(AF_INET, SOCK_STREAM, 0);
+  if (server_socket < 0) {
+    perror("Failed to create socket");
     return CCHAT_ERROR_NETWORK;
   }
 
@@ -141,6 +190,44 @@ cchat_error_t disconnect_from_server(void) {
   return CCHAT_SUCCESS;
 }
 
+// True when response is ERROR 0x09 (wrong node). The message is the owning
+// node's "host:port": reconnect there so the caller can repeat its request.
+static bool follow_redirect(uint8_t response_type, const uint8_t *response,
+                            uint32_t response_len, cchat_error_t *result) {
+  // [1 byte: error code][2 bytes: message length][message]
+  if (response_type != 0x88 || response_len < 3 || response[0] != 0x09) {
+    return false;
+  }
+
+  uint32_t message_len = ((uint32_t)response[1] << 8) | response[2];
+  char owner[sizeof(server_host) + 8];
+  if (message_len == 0 || message_len >= sizeof(owner) ||
+      response_len < 3 + message_len) {
+    *result = CCHAT_ERROR_NETWORK;
+    return true;
+  }
+  memcpy(owner, &response[3], message_len);
+  owner[message_len] = '\0';
+
+  char *colon = strrchr(owner, ':');
+  char *end = NULL;
+  long port = colon ? strtol(colon + 1, &end, 10) : 0;
+  if (!colon || colon == owner || *end != '\0' || port <= 0 ||
+      port > 65535) {
+    fprintf(stderr, "Invalid redirect from server: %s\n", owner);
+    *result = CCHAT_ERROR_NETWORK;
+    return true;
+  }
+  *colon = '\0';
+
+  printf("Username is served by %s:%ld, reconnecting\n", owner, port);
+  disconnect_from_server();
+  safe_strncpy(server_host, owner, sizeof(server_host));
+  server_port = (int)port;
+  *result = connect_to_server();
+  return true;
+}
+
 cchat_error_t register_user_with_server(const char *username,
                                         const unsigned char *public_key) {
   if (!username || !public_key || !connected_to_server) {
@@ -161,23 +248,35 @@ cchat_error_t register_user_with_server(const char *username,
   memcpy(&payload[1], username, username_len);
   memcpy(&payload[1 + username_len], public_key, PUBLIC_KEY_SIZE);
 
-  if (send_network_message(0x01, payload, 1 + username_len + PUBLIC_KEY_SIZE) <
-      0) {
-    free(payload);
-    return CCHAT_ERROR_NETWORK;
-  }
-
-  free(payload);
-
   uint8_t response_type;
   uint8_t *response_payload;
   uint32_t response_len;
 
-  if (receive_network_message(&response_type, &response_payload,
-                              &response_len) < 0) {
-    return CCHAT_ERROR_NETWORK;
+  // A cluster node that does not own the name redirects us to the owner
+  for (int attempt = 0;; attempt++) {
+    if (send_network_message(0x01, payload,
+                             1 + username_len + PUBLIC_KEY_SIZE) < 0 ||
+        receive_network_message(&response_type, &response_payload,
+                                &response_len) < 0) {
+      free(payload);
+      return CCHAT_ERROR_NETWORK;
+    }
+
+    cchat_error_t redirected = CCHAT_SUCCESS;
+    if (attempt >= MAX_SERVER_REDIRECTS ||
+        !follow_redirect(response_type, response_payload, response_len,
+                         &redirected)) {
+      break;
+    }
+    free(response_payload);
+    if (redirected != CCHAT_SUCCESS) {
+      free(payload);
+      return redirected;
+    }
   }
 
+  free(payload);
+
   if (response_type != 0x81 || response_len < 2) {
     if (response_payload)
       free(response_payload);
@@ -205,6 +304,13 @@ cchat_error_t register_user_with_server(const char *username,
 
 cchat_error_t get_user_public_key(const char *username,
                                   unsigned char *public_key) {
+  return fetch_user_public_key(username, 0, public_key, NULL, NULL);
+}
+
+cchat_error_t fetch_user_public_key(const char *username,
+                                    uint32_t known_version,
+                                    unsigned char *public_key,
+                                    uint32_t *key_version, bool *unchanged) {
   if (!username || !public_key || !connected_to_server) {
     return CCHAT_ERROR_NETWORK;
   }
@@ -214,15 +320,24 @@ cchat_error_t get_user_public_key(const char *username,
     return CCHAT_ERROR_INVALID_ARGS;
   }
 
-  uint8_t *payload = malloc(1 + username_len);
+  // A known version lets the server answer "unchanged" without the key
+  size_t payload_len = 1 + username_len + (known_version ? 4 : 0);
+  uint8_t *payload = malloc(payload_len);
   if (!payload) {
     return CCHAT_ERROR_MEMORY;
   }
 
   payload[0] = (uint8_t)username_len;
   memcpy(&payload[1], username, username_len);
+  if (known_version) {
+    uint8_t *version = &payload[1 + username_len];
+    version[0] = (uint8_t)(known_version >> 24);
+    version[1] = (uint8_t)(known_version >> 16);
+    version[2] = (uint8_t)(known_version >> 8);
+    version[3] = (uint8_t)known_version;
+  }
 
-  if (send_network_message(0x03, payload, 1 + username_len) < 0) {
+  if (send_network_message(0x03, payload, payload_len) < 0) {
     free(payload);
     return CCHAT_ERROR_NETWORK;
   }
@@ -249,17 +364,287 @@ cchat_error_t get_user_public_key(const char *username,
     return CCHAT_ERROR_USER_NOT_FOUND;
   }
 
+  if (unchanged) {
+    *unchanged = false;
+  }
+
+  // [2][4 bytes: key version]: the cached key is still current
+  if (response_payload[0] == KEY_LOOKUP_UNCHANGED) {
+    if (!known_version || response_len < 5) {
+      free(response_payload);
+      return CCHAT_ERROR_NETWORK;
+    }
+    if (unchanged) {
+      *unchanged = true;
+    }
+    if (key_version) {
+      *key_version = known_version;
+    }
+    free(response_payload);
+    return CCHAT_SUCCESS;
+  }
+
   if (response_len < 1 + PUBLIC_KEY_SIZE) {
     free(response_payload);
     return CCHAT_ERROR_NETWORK;
   }
 
   memcpy(public_key, &response_payload[1], PUBLIC_KEY_SIZE);
+
+  // Older servers send no version; 0 means "always refetch"
+  if (key_version) {
+    const uint8_t *version = &response_payload[1 + PUBLIC_KEY_SIZE];
+    *key_version = response_len >= 1 + PUBLIC_KEY_SIZE + 4
+                       ? ((uint32_t)version[0] << 24) |
+                             ((uint32_t)version[1] << 16) |
+                             ((uint32_t)version[2] << 8) | (uint32_t)version[3]
+                       : 0;
+  }
   free(response_payload);
 
   return CCHAT_SUCCESS;
 }
 
+cchat_error_t fetch_user_page(uint32_t cursor, uint32_t since,
+                              user_page_t *page) {
+  if (!page || !connected_to_server) {
+    return CCHAT_ERROR_NETWORK;
+  }
+
+  // [4 bytes: cursor][4 bytes: since version][1 byte: max entries]
+  uint8_t payload[9];
+  payload[0] = (uint8_t)(cursor >> 24);
+  payload[1] = (uint8_t)(cursor >> 16);
+  payload[2] = (uint8_t)(cursor >> 8);
+  payload[3] = (uint8_t)cursor;
+  payload[4] = (uint8_t)(since >> 24);
+  payload[5] = (uint8_t)(since >> 16);
+  payload[6] = (uint8_t)(since >> 8);
+  payload[7] = (uint8_t)since;
+  payload[8] = USER_PAGE_MAX_ENTRIES;
+
+  if (send_network_message(0x07, payload, sizeof(payload)) < 0) {
+    return CCHAT_ERROR_NETWORK;
+  }
+
+  uint8_t response_type;
+  uint8_t *response_payload;
+  uint32_t response_len;
+
+  if (receive_network_message(&response_type, &response_payload,
+                              &response_len) < 0) {
+    return CCHAT_ERROR_NETWORK;
+  }
+
+  if (response_type != 0x8A || response_len < 9 ||
+      response_payload[8] > USER_PAGE_MAX_ENTRIES) {
+    if (response_payload)
+      free(response_payload);
+    return CCHAT_ERROR_NETWORK;
+  }
+
+  page->registry_version =
+      ((uint32_t)response_payload[0] << 24) |
+      ((uint32_t)response_payload[1] << 16) |
+      ((uint32_t)response_payload[2] << 8) | (uint32_t)response_payload[3];
+  page->next_cursor =
+      ((uint32_t)response_payload[4] << 24) |
+      ((uint32_t)response_payload[5] << 16) |
+      ((uint32_t)response_payload[6] << 8) | (uint32_t)response_payload[7];
+  page->count = response_payload[8];
+
+  // Per user: [1 byte: length][name][1 byte: status][4 bytes: version]
+  size_t offset = 9;
+  for (size_t i = 0; i < page->count; i++) {
+    uint8_t username_len =
+        offset < response_len ? response_payload[offset] : 0;
+    if (username_len == 0 || username_len >= MAX_USERNAME_LEN ||
+        offset + 1 + username_len + 5 > response_len) {
+      free(response_payload);
+      return CCHAT_ERROR_NETWORK;
+    }
+
+    user_entry_t *entry = &page->entries[i];
+    memcpy(entry->username, &response_payload[offset + 1], username_len);
+    entry->username[username_len] = '\0';
+
+    const uint8_t *data = &response_payload[offset + 1 + username_len];
+    entry->status = data[0];
+    entry->changed_version = ((uint32_t)data[1] << 24) |
+                             ((uint32_t)data[2] << 16) |
+                             ((uint32_t)data[3] << 8) | (uint32_t)data[4];
+    offset += 1 + username_len + 5;
+  }
+
+  free(response_payload);
+  return CCHAT_SUCCESS;
+}
+
+// Prefix search (SEARCH_USERS). entries must hold SEARCH_MAX_RESULTS; the
+// server returns up to that many names in order, with status. changed_version
+// is not part of a search result and is left 0.
+cchat_error_t fetch_user_matches(const char *prefix, user_entry_t *entries,
+                                 size_t *count) {
+  if (!prefix || !entries || !count || !connected_to_server) {
+    return CCHAT_ERROR_INVALID_ARGS;
+  }
+
+  size_t prefix_len = strlen(prefix);
+  if (prefix_len >= MAX_USERNAME_LEN) {
+    return CCHAT_ERROR_INVALID_ARGS;
+  }
+
+  // [1 byte: prefix length][prefix][1 byte: max results]
+  uint8_t payload[1 + MAX_USERNAME_LEN + 1];
+  payload[0] = (uint8_t)prefix_len;
+  memcpy(&payload[1], prefix, prefix_len);
+  payload[1 + prefix_len] = SEARCH_MAX_RESULTS;
+
+  if (send_network_message(0x0A, payload, prefix_len + 2) < 0) {
+    return CCHAT_ERROR_NETWORK;
+  }
+
+  uint8_t response_type;
+  uint8_t *response_payload;
+  uint32_t response_len;
+
+  if (receive_network_message(&response_type, &response_payload,
+                              &response_len) < 0) {
+    return CCHAT_ERROR_NETWORK;
+  }
+
+  if (response_type != 0x8B || response_len < 1 ||
+      response_payload[0] > SEARCH_MAX_RESULTS) {
+    if (response_payload)
+      free(response_payload);
+    return CCHAT_ERROR_NETWORK;
+  }
+
+  // Per match: [1 byte: length][name][1 byte: status]
+  size_t matches = response_payload[0];
+  size_t offset = 1;
+  for (size_t i = 0; i < matches; i++) {
+    uint8_t username_len =
+        offset < response_len ? response_payload[offset] : 0;
+    if (username_len == 0 || username_len >= MAX_USERNAME_LEN ||
+        offset + 1 + username_len + 1 > response_len) {
+      free(response_payload);
+      return CCHAT_ERROR_NETWORK;
+    }
+
+    user_entry_t *entry = &entries[i];
+    memcpy(entry->username, &response_payload[offset + 1], username_len);
+    entry->username[username_len] = '\0';
+    entry->status = response_payload[offset + 1 + username_len];
+    entry->changed_version = 0;
+    offset += 1 + username_len + 1;
+  }
+
+  *count = matches;
+  free(response_payload);
+  return CCHAT_SUCCESS;
+}
+
+cchat_error_t fetch_user_public_keys(known_key_t *keys,
+                                     key_lookup_status_t *statuses,
+                                     size_t count) {
+  if (!keys || !statuses || count == 0 || count > MAX_KEY_BATCH ||
+      !connected_to_server) {
+    return CCHAT_ERROR_INVALID_ARGS;
+  }
+
+  // [1 byte: count] then per name [1 byte: length][name][4 bytes: version]
+  uint8_t payload[1 + MAX_KEY_BATCH * (1 + MAX_USERNAME_LEN + 4)];
+  size_t payload_len = 1;
+  payload[0] = (uint8_t)count;
+
+  for (size_t i = 0; i < count; i++) {
+    size_t username_len = strlen(keys[i].username);
+    if (username_len == 0 || username_len >= MAX_USERNAME_LEN) {
+      return CCHAT_ERROR_INVALID_ARGS;
+    }
+
+    payload[payload_len] = (uint8_t)username_len;
+    memcpy(&payload[payload_len + 1], keys[i].username, username_len);
+    uint8_t *version = &payload[payload_len + 1 + username_len];
+    version[0] = (uint8_t)(keys[i].key_version >> 24);
+    version[1] = (uint8_t)(keys[i].key_version >> 16);
+    version[2] = (uint8_t)(keys[i].key_version >> 8);
+    version[3] = (uint8_t)keys[i].key_version;
+    payload_len += 1 + username_len + 4;
+  }
+
+  if (send_network_message(0x09, payload, payload_len) < 0) {
+    return CCHAT_ERROR_NETWORK;
+  }
+
+  uint8_t response_type;
+  uint8_t *response_payload;
+  uint32_t response_len;
+
+  if (receive_network_message(&response_type, &response_payload,
+                              &response_len) < 0) {
+    return CCHAT_ERROR_NETWORK;
+  }
+
+  if (response_type != 0x89 || response_len < 1 ||
+      response_payload[0] != count) {
+    if (response_payload)
+      free(response_payload);
+    return CCHAT_ERROR_NETWORK;
+  }
+
+  // Entries come back in request order:
+  // [1 byte: status][1 byte: length][name] followed by
+  // [32 bytes: key][4 bytes: version] if found, [4 bytes: version] if
+  // unchanged
+  size_t offset = 1;
+  for (size_t i = 0; i < count; i++) {
+    if (offset + 2 > response_len) {
+      break;
+    }
+
+    uint8_t status = response_payload[offset];
+    uint8_t username_len = response_payload[offset + 1];
+    offset += 2;
+    if (offset + username_len > response_len ||
+        username_len != strlen(keys[i].username) ||
+        memcmp(&response_payload[offset], keys[i].username, username_len) !=
+            0) {
+      break;
+    }
+    offset += username_len;
+
+    size_t data_len = status == KEY_LOOKUP_FOUND       ? PUBLIC_KEY_SIZE + 4
+                      : status == KEY_LOOKUP_UNCHANGED ? 4
+                                                       : 0;
+    if (status > KEY_LOOKUP_UNCHANGED || offset + data_len > response_len) {
+      break;
+    }
+
+    const uint8_t *data = &response_payload[offset];
+    if (status == KEY_LOOKUP_FOUND) {
+      memcpy(keys[i].public_key, data, PUBLIC_KEY_SIZE);
+      data += PUBLIC_KEY_SIZE;
+    }
+    if (data_len > 0) {
+      keys[i].key_version = ((uint32_t)data[0] << 24) |
+                            ((uint32_t)data[1] << 16) |
+                            ((uint32_t)data[2] << 8) | (uint32_t)data[3];
+    }
+    statuses[i] = (key_lookup_status_t)status;
+    offset += data_len;
+
+    if (i + 1 == count) {
+      free(response_payload);
+      return CCHAT_SUCCESS;
+    }
+  }
+
+  free(response_payload);
+  return CCHAT_ERROR_NETWORK;
+}
+
 cchat_error_t send_message_to_server(const char *recipient,
                                      const unsigned char *encrypted_message,
                                      size_t message_len) {
@@ -279,14 +664,10 @@ cchat_error_t send_message_to_server(const char *recipient,
     return CCHAT_ERROR_MEMORY;
   }
 
-  payload[0] = (uint8_t)recipient_len;
-  memcpy(&payload[1], recipient, recipient_len);
-  payload[1 + recipient_len] = (message_len >> 8) & 0xFF;
-  payload[1 + recipient_len + 1] = message_len & 0xFF;
-  memcpy(&payload[1 + recipient_len + 2], encrypted_message, message_len);
+  size_t payload_len = encode_send_message_payload(
+      payload, recipient, encrypted_message, message_len);
 
-  if (send_network_message(0x04, payload, 1 + recipient_len + 2 + message_len) <
-      0) {
+  if (send_network_message(0x04, payload, (uint32_t)payload_len) < 0) {
     free(payload);
     return CCHAT_ERROR_NETWORK;
   }
@@ -95,12 +95,19 @@ cchat_error_t register_user(const char *username) {
 cchat_error_t login_user(const char *username) {
   printf("Logging in user: %s\n", username);
 
+  // Skip the password and key derivation when the agent holds the key
+  unsigned char public_key[PUBLIC_KEY_SIZE];
+  if (agent_get_public_key(username, public_key) == CCHAT_SUCCESS) {
+    printf("\nAuthentication successful (key agent)!\n");
+    secure_zero_memory(public_key, sizeof(public_key));
+    return CCHAT_SUCCESS;
+  }
+
   // Get password to decrypt private key
   char password[MAX_PASSWORD_LEN];
   get_password_input("Enter your password: ", password, sizeof(password));
 
   // Load and decrypt keys from local storage
-  unsigned char public_key[PUBLIC_KEY_SIZE];
   unsigned char private_key[PRIVATE_KEY_SIZE];
 
   cchat_error_t result =
@@ -118,6 +125,11 @@ cchat_error_t login_user(const char *username) {
     return result;
   }
 
+  // Cache the unlocked key in the agent, if one is running
+  if (agent_add_key(username, public_key, private_key) == CCHAT_SUCCESS) {
+    printf("Key added to agent\n");
+  }
+
   // TODO: Authenticate with server using loaded keys
   // TODO: Retrieve and verify server's response
 
@@ -134,13 +146,100 @@ cchat_error_t login_user(const char *username) {
 }
 
 cchat_error_t list_users(void) {
-  printf("Available users:\n");
+  uint32_t registry_version = 0;
+  return list_users_since(&registry_version);
+}
+
+cchat_error_t list_users_since(uint32_t *registry_version) {
+  if (!registry_version) {
+    return CCHAT_ERROR_INVALID_ARGS;
+  }
+
+  static const char *status_names[] = {"offline", "online", "away"};
+
+  cchat_error_t result = connect_to_server();
+  if (result != CCHAT_SUCCESS) {
+    return result;
+  }
+
+  // Page through the directory; after the first listing only users whose
+  // record changed since the last version seen are transferred
+  uint32_t since = *registry_version;
+  uint32_t cursor = 0;
+  uint32_t first_version = 0;
+  size_t shown = 0;
+  user_page_t page;
+
+  printf(since ? "Changed users:\n" : "Available users:\n");
+  do {
+    result = fetch_user_page(cursor, since, &page);
+    if (result != CCHAT_SUCCESS) {
+      break;
+    }
+    if (cursor == 0) {
+      first_version = page.registry_version;
+    }
+
+    for (size_t i = 0; i < page.count; i++) {
+      const user_entry_t *entry = &page.entries[i];
+      printf("  %-20s (%s)\n", entry->username,
+             entry->status < 3 ? status_names[entry->status] : "unknown");
+    }
+    shown += page.count;
+    cursor = page.next_cursor;
+  } while (cursor != 0);
+
+  disconnect_from_server();
 
-  // TODO: Query server for list of registered users
-  // For now, show placeholder data
-  printf("  alice    (online)\n");
-  printf("  bob      (offline)\n");
-  printf("  charlie  (online)\n");
+  if (result != CCHAT_SUCCESS) {
+    return result;
+  }
+
+  if (shown == 0) {
+    printf(since ? "  (no changes)\n" : "  (no users)\n");
+  }
+
+  // The first page's version: changes made while paging are newer than it
+  // and are picked up by the next call
+  *registry_version = first_version;
+  return CCHAT_SUCCESS;
+}
+
+cchat_error_t find_users(const char *prefix) {
+  if (!prefix || strlen(prefix) >= MAX_USERNAME_LEN) {
+    return CCHAT_ERROR_INVALID_ARGS;
+  }
+
+  static const char *status_names[] = {"offline", "online", "away"};
+
+  cchat_error_t result = connect_to_server();
+  if (result != CCHAT_SUCCESS) {
+    return result;
+  }
+
+  // The server answers from its sorted name index, so this stays cheap
+  // enough to run per keystroke for completion
+  user_entry_t matches[SEARCH_MAX_RESULTS];
+  size_t count = 0;
+  result = fetch_user_matches(prefix, matches, &count);
+  disconnect_from_server();
+
+  if (result != CCHAT_SUCCESS) {
+    return result;
+  }
+
+  printf("Users matching '%s':\n", prefix);
+  for (size_t i = 0; i < count; i++) {
+    printf("  %-20s (%s)\n", matches[i].username,
+           matches[i].status < 3 ? status_names[matches[i].status]
+                                 : "unknown");
+  }
+  if (count == 0) {
+    printf("  (no matches)\n");
+  } else if (count == SEARCH_MAX_RESULTS) {
+    printf("  (showing the first %d; type more to narrow)\n",
+           SEARCH_MAX_RESULTS);
+  }
 
   return CCHAT_SUCCESS;
 }
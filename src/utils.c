@@ -1,3 +1,6 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // strdup
+#endif
 #include "c-chat.h"
 #include <pwd.h>
 #include <termios.h>
@@ -0,0 +1,185 @@
+#include "../include/c-chat.h"
+
+// Round trips through the file secretstream: files on either side of a
+// chunk boundary come back whole, only the last chunk carries TAG_FINAL,
+// and a stream cut short or tampered with is rejected.
+
+#define MAX_CHUNKS 4
+
+typedef struct {
+  unsigned char key[FILE_KEY_SIZE];
+  unsigned char header[FILE_HEADER_SIZE];
+  unsigned char *ciphertext; // MAX_CHUNKS * FILE_CHUNK_SIZE
+  size_t chunk_len[MAX_CHUNKS];
+  size_t chunks;
+} sealed_file_t;
+
+static int failures = 0;
+
+static void check(bool ok, const char *what, size_t size) {
+  if (!ok) {
+    fprintf(stderr, "FAIL: %s (%zu bytes)\n", what, size);
+    failures++;
+  }
+}
+
+static cchat_error_t encrypt_file(const unsigned char *plain, size_t size,
+                                  sealed_file_t *sealed) {
+  crypto_secretstream_xchacha20poly1305_keygen(sealed->key);
+  file_stream_t stream;
+  cchat_error_t result =
+      file_stream_init_push(&stream, sealed->key, sealed->header);
+  if (result != CCHAT_SUCCESS) {
+    return result;
+  }
+
+  // An empty file is still one (final) chunk
+  size_t done = 0;
+  sealed->chunks = 0;
+  do {
+    size_t piece = size - done < FILE_PLAIN_CHUNK_SIZE ? size - done
+                                                       : FILE_PLAIN_CHUNK_SIZE;
+    bool last = done + piece == size;
+    unsigned char *chunk =
+        &sealed->ciphertext[sealed->chunks * FILE_CHUNK_SIZE];
+    result = file_stream_push(&stream, &plain[done], piece, last, chunk,
+                              &sealed->chunk_len[sealed->chunks]);
+    if (result != CCHAT_SUCCESS) {
+      return result;
+    }
+    sealed->chunks++;
+    done += piece;
+  } while (done < size);
+  return CCHAT_SUCCESS;
+}
+
+// Decrypt the first `chunks` chunks into plain and finish the stream
+static cchat_error_t decrypt_file(const sealed_file_t *sealed, size_t chunks,
+                                  unsigned char *plain, size_t *size) {
+  file_stream_t stream;
+  cchat_error_t result =
+      file_stream_init_pull(&stream, sealed->key, sealed->header);
+  *size = 0;
+  for (size_t i = 0; result == CCHAT_SUCCESS && i < chunks; i++) {
+    size_t plain_len = 0;
+    result = file_stream_pull(&stream,
+                              &sealed->ciphertext[i * FILE_CHUNK_SIZE],
+                              sealed->chunk_len[i], &plain[*size], &plain_len);
+    *size += plain_len;
+  }
+  return result == CCHAT_SUCCESS ? file_stream_end(&stream) : result;
+}
+
+int main(void) {
+  if (init_crypto_library() != CCHAT_SUCCESS) {
+    fprintf(stderr, "FAIL: libsodium\n");
+    return 1;
+  }
+
+  size_t max_size = (MAX_CHUNKS - 1) * FILE_PLAIN_CHUNK_SIZE + 1;
+  unsigned char *plain = malloc(max_size);
+  unsigned char *decrypted = malloc(max_size);
+  sealed_file_t sealed = {.ciphertext = malloc(MAX_CHUNKS * FILE_CHUNK_SIZE)};
+  if (!plain || !decrypted || !sealed.ciphertext) {
+    fprintf(stderr, "FAIL: out of memory\n");
+    return 1;
+  }
+  randombytes_buf(plain, max_size);
+
+  const size_t sizes[] = {0,
+                          1,
+                          FILE_PLAIN_CHUNK_SIZE - 1,
+                          FILE_PLAIN_CHUNK_SIZE,
+                          FILE_PLAIN_CHUNK_SIZE + 1,
+                          3 * FILE_PLAIN_CHUNK_SIZE,
+                          max_size};
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+    size_t size = sizes[i];
+    if (encrypt_file(plain, size, &sealed) != CCHAT_SUCCESS) {
+      check(false, "encrypt", size);
+      continue;
+    }
+
+    // Full chunks but the last, which alone is final
+    size_t expected_chunks =
+        size == 0 ? 1
+                  : (size + FILE_PLAIN_CHUNK_SIZE - 1) / FILE_PLAIN_CHUNK_SIZE;
+    check(sealed.chunks == expected_chunks, "chunk count", size);
+    for (size_t c = 0; c + 1 < sealed.chunks; c++) {
+      check(sealed.chunk_len[c] == FILE_CHUNK_SIZE, "full chunk", size);
+    }
+
+    size_t decrypted_size;
+    check(decrypt_file(&sealed, sealed.chunks, decrypted, &decrypted_size) ==
+                  CCHAT_SUCCESS &&
+              decrypted_size == size &&
+              memcmp(decrypted, plain, size) == 0,
+          "round trip", size);
+
+    // Dropping the final chunk leaves a stream that never ends
+    if (sealed.chunks > 1) {
+      check(decrypt_file(&sealed, sealed.chunks - 1, decrypted,
+                         &decrypted_size) == CCHAT_ERROR_DECRYPTION,
+            "truncated at a chunk boundary accepted", size);
+    }
+
+    // Cutting into the final chunk breaks its tag
+    size_t last = sealed.chunks - 1;
+    size_t full_len = sealed.chunk_len[last];
+    sealed.chunk_len[last] = full_len - 1;
+    check(decrypt_file(&sealed, sealed.chunks, decrypted, &decrypted_size) ==
+              CCHAT_ERROR_DECRYPTION,
+          "truncated chunk accepted", size);
+    sealed.chunk_len[last] = full_len;
+
+    sealed.ciphertext[last * FILE_CHUNK_SIZE] ^= 0x01;
+    check(decrypt_file(&sealed, sealed.chunks, decrypted, &decrypted_size) ==
+              CCHAT_ERROR_DECRYPTION,
+          "modified chunk accepted", size);
+    sealed.ciphertext[last * FILE_CHUNK_SIZE] ^= 0x01;
+  }
+
+  // A short chunk may only be the last one
+  file_stream_t stream;
+  unsigned char header[FILE_HEADER_SIZE];
+  size_t chunk_len;
+  file_stream_init_push(&stream, sealed.key, header);
+  check(file_stream_push(&stream, plain, 1, false, sealed.ciphertext,
+                         &chunk_len) == CCHAT_ERROR_INVALID_ARGS,
+        "short chunk before the end", 1);
+  check(file_stream_push(&stream, plain, 1, true, sealed.ciphertext,
+                         &chunk_len) == CCHAT_SUCCESS &&
+            file_stream_end(&stream) == CCHAT_SUCCESS,
+        "final chunk", 1);
+  check(file_stream_push(&stream, plain, 1, true, sealed.ciphertext,
+                         &chunk_len) == CCHAT_ERROR_INVALID_ARGS,
+        "chunk after the final one", 1);
+
+  // The envelope hands the key and header to the recipient only
+  unsigned char public_key[PUBLIC_KEY_SIZE], private_key[PRIVATE_KEY_SIZE];
+  unsigned char envelope[FILE_ENVELOPE_SIZE];
+  unsigned char opened_key[FILE_KEY_SIZE], opened_header[FILE_HEADER_SIZE];
+  generate_keypair(public_key, private_key);
+  check(seal_file_envelope(sealed.key, header, public_key, envelope) ==
+                CCHAT_SUCCESS &&
+            open_file_envelope(envelope, sizeof(envelope), public_key,
+                               private_key, opened_key,
+                               opened_header) == CCHAT_SUCCESS &&
+            memcmp(opened_key, sealed.key, FILE_KEY_SIZE) == 0 &&
+            memcmp(opened_header, header, FILE_HEADER_SIZE) == 0,
+        "envelope round trip", sizeof(envelope));
+  envelope[0] ^= 0x01;
+  check(open_file_envelope(envelope, sizeof(envelope), public_key,
+                           private_key, opened_key,
+                           opened_header) == CCHAT_ERROR_DECRYPTION,
+        "modified envelope accepted", sizeof(envelope));
+
+  free(plain);
+  free(decrypted);
+  free(sealed.ciphertext);
+
+  if (failures == 0) {
+    printf("PASS: file stream round trips\n");
+  }
+  return failures == 0 ? 0 : 1;
+}
\ No newline at end of file
@@ -0,0 +1,107 @@
+#include "../include/c-chat.h"
+
+// The group key reaches each member sealed to their own key, and one group
+// envelope then opens for every member and nobody else.
+
+#define MEMBERS 3
+
+static int failures = 0;
+
+static void check(bool ok, const char *what) {
+  if (!ok) {
+    fprintf(stderr, "FAIL: %s\n", what);
+    failures++;
+  }
+}
+
+int main(void) {
+  if (init_crypto_library() != CCHAT_SUCCESS) {
+    fprintf(stderr, "FAIL: libsodium\n");
+    return 1;
+  }
+
+  unsigned char public_keys[MEMBERS][PUBLIC_KEY_SIZE];
+  unsigned char private_keys[MEMBERS][PRIVATE_KEY_SIZE];
+  for (int i = 0; i < MEMBERS; i++) {
+    generate_keypair(public_keys[i], private_keys[i]);
+  }
+  unsigned char outsider_public[PUBLIC_KEY_SIZE];
+  unsigned char outsider_private[PRIVATE_KEY_SIZE];
+  generate_keypair(outsider_public, outsider_private);
+
+  unsigned char group_key[GROUP_KEY_SIZE];
+  generate_group_key(group_key);
+
+  // Every member unwraps the same key; the outsider cannot open a member's
+  unsigned char member_keys[MEMBERS][GROUP_KEY_SIZE];
+  unsigned char wrapped[MEMBERS][WRAPPED_GROUP_KEY_SIZE];
+  for (int i = 0; i < MEMBERS; i++) {
+    check(wrap_group_key(group_key, public_keys[i], wrapped[i]) ==
+                  CCHAT_SUCCESS &&
+              unwrap_group_key(wrapped[i], WRAPPED_GROUP_KEY_SIZE,
+                               public_keys[i], private_keys[i],
+                               member_keys[i]) == CCHAT_SUCCESS &&
+              memcmp(member_keys[i], group_key, GROUP_KEY_SIZE) == 0,
+          "wrapped key round trip");
+  }
+  unsigned char stolen_key[GROUP_KEY_SIZE];
+  check(unwrap_group_key(wrapped[0], WRAPPED_GROUP_KEY_SIZE, outsider_public,
+                         outsider_private,
+                         stolen_key) == CCHAT_ERROR_DECRYPTION,
+        "outsider unwrapped a member's key");
+  check(unwrap_group_key(wrapped[0], WRAPPED_GROUP_KEY_SIZE - 1,
+                         public_keys[0], private_keys[0],
+                         stolen_key) == CCHAT_ERROR_INVALID_ARGS,
+        "short wrapped key accepted");
+
+  // One upload, readable by every member
+  const char *text = "standup moved to 10:30";
+  unsigned char envelope[MAX_MESSAGE_LEN + GROUP_OVERHEAD];
+  size_t envelope_len = 0;
+  check(encrypt_group_message(text, group_key, envelope, &envelope_len) ==
+                CCHAT_SUCCESS &&
+            envelope_len == strlen(text) + GROUP_OVERHEAD &&
+            envelope[0] == GROUP_ENVELOPE_VERSION,
+        "encrypt");
+  for (int i = 0; i < MEMBERS; i++) {
+    char message[MAX_MESSAGE_LEN + 1];
+    size_t message_len = 0;
+    check(decrypt_group_message(envelope, envelope_len, member_keys[i],
+                                message, &message_len) == CCHAT_SUCCESS &&
+              message_len == strlen(text) && strcmp(message, text) == 0,
+          "member decrypt");
+  }
+
+  // Random nonces: the same text never gives the same envelope
+  unsigned char again[MAX_MESSAGE_LEN + GROUP_OVERHEAD];
+  size_t again_len = 0;
+  encrypt_group_message(text, group_key, again, &again_len);
+  check(again_len == envelope_len &&
+            memcmp(again, envelope, envelope_len) != 0,
+        "nonce reused");
+
+  char message[MAX_MESSAGE_LEN + 1];
+  size_t message_len = 0;
+  unsigned char other_key[GROUP_KEY_SIZE];
+  generate_group_key(other_key);
+  check(decrypt_group_message(envelope, envelope_len, other_key, message,
+                              &message_len) == CCHAT_ERROR_DECRYPTION,
+        "wrong group key accepted");
+  envelope[envelope_len - 1] ^= 0x01;
+  check(decrypt_group_message(envelope, envelope_len, group_key, message,
+                              &message_len) == CCHAT_ERROR_DECRYPTION,
+        "modified envelope accepted");
+  envelope[envelope_len - 1] ^= 0x01;
+  check(decrypt_group_message(envelope, envelope_len - 1, group_key, message,
+                              &message_len) == CCHAT_ERROR_DECRYPTION,
+        "truncated envelope accepted");
+  envelope[0] = SESSION_ENVELOPE_VERSION;
+  check(decrypt_group_message(envelope, envelope_len, group_key, message,
+                              &message_len) == CCHAT_ERROR_INVALID_ARGS,
+        "session envelope accepted as a group one");
+
+  if (failures == 0) {
+    printf("PASS: group envelope\n");
+  }
+  return failures == 0 ? 0 : 1;
+}
\ No newline at end of file